@@ -12,12 +12,27 @@ list  (APPEND primary_sources
 list  (APPEND primary_sources 
       "shared/source/logger.c" 
       "shared/source/torCon.c"
+      "shared/source/socksIsol.c"
+      "shared/source/streamPool.c"
+      "shared/source/dnsCache.c"
+      "shared/source/hedgeCon.c"
       "shared/source/security.c"
       "shared/source/tweetNacl.c"
       "shared/source/isolFs.c"
       "shared/source/isolIpc.c"
       "shared/source/isolName.c"
       "shared/source/isolNet.c"
+      "shared/source/redirEpoll.c"
+      "shared/source/redirPool.c"
+      "shared/source/redirUpstream.c"
+      "shared/source/redirUring.c"
+      "shared/source/redirTenant.c"
+      "shared/source/redirFlow.c"
+      "shared/source/redirCapture.c"
+      "shared/source/relayBuff.c"
+      "shared/source/relayPool.c"
+      "shared/source/relayQos.c"
+      "shared/source/timerWheel.c"
       "shared/source/net.c"
       "shared/source/isolProc.c"
       "shared/source/isolGui.c"
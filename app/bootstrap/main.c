@@ -235,8 +235,21 @@ static int isolKern(void)
                            SCMP_CMP( 2 , SCMP_CMP_EQ , 0)
                          );
 
+  /* Only allow recvmsg with MSG_CMSG_CLOEXEC, which is used for receiving the
+   * connected Tor SocksPort sockets passed by the redirector. Received sockets
+   * are already connected stream sockets, such that they cannot be used for 
+   * bypassing the proxy. 
+   */ 
+  ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                           SCMP_SYS(recvmsg), 1,
+                           SCMP_CMP( 2 , SCMP_CMP_EQ , MSG_CMSG_CLOEXEC)
+                         );
+
   /* Poll is used for managing the sockets */
   ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(poll), 0);
+
+  /* torBatchCon times the connects it makes with the monotonic clock */
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(clock_gettime), 0);
   
   /* For now generically whitelisting connect, maybe restrict more later */
   ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, SCMP_SYS(connect), 0);
@@ -18,11 +18,16 @@
 #include "controller.h"
 #include "prng.h" 
 #include "net.h"
+#include "isolNet.h"
 
-enum{ CONTROL_PORT_TOKEN_BC = 32 };
+enum{ CONTROL_PORT_BACKLOG = 20 };
 
 static int authenticateCp(int cpIncoming);
 static int manageControl(int cpIncoming);
+static int sendUpstreamHealth(int cpIncoming);
+static int reloadRedir(int cpIncoming);
+static int sendRedirStatus(int cpIncoming);
+static int sendFlowRecords(int cpIncoming);
 
 static char *allocRandToken(void);
 
@@ -64,7 +69,8 @@ int initializeController(void)
   /* Start listening for incoming control connections (not accepting yet!) */
   
   sListenSocket = udsListen( "sandbox/control_unix_socket", 
-                             strlen("sandbox/control_unix_socket") );
+                             strlen("sandbox/control_unix_socket"),
+                             CONTROL_PORT_BACKLOG );
   if( sListenSocket == -1 ){
     logErr("Failed to open control socket");
     return 0;
@@ -285,13 +291,45 @@ static int manageControl(int cpIncoming)
     }
     
     /* Control switch */ 
-    switch( controlAction ){
-      case 0:{
+    switch( ntohl(controlAction) ){
+      case CONTROL_CLOSE:{
         logMsg("Client requested to close control session");
         close(cpIncoming);
         return 1;
       }
       
+      case CONTROL_UPSTREAM_HEALTH:{
+        if( !sendUpstreamHealth(cpIncoming) ){
+          logWrn("Failed to send the health of the Tor SocksPorts to the client");
+          return 0; 
+        }
+        continue; 
+      }
+      
+      case CONTROL_REDIR_RELOAD:{
+        if( !reloadRedir(cpIncoming) ){
+          logWrn("Failed to reload the redirector for the client");
+          return 0; 
+        }
+        continue; 
+      }
+      
+      case CONTROL_REDIR_STATUS:{
+        if( !sendRedirStatus(cpIncoming) ){
+          logWrn("Failed to send the status of the redirector to the client");
+          return 0; 
+        }
+        continue; 
+      }
+      
+      case CONTROL_FLOW_RECORDS:{
+        if( !sendFlowRecords(cpIncoming) ){
+          logWrn("Failed to send the flow records of the redirector to the client");
+          return 0; 
+        }
+        continue; 
+      }
+      
       default:{
         printf("Muahhahaa\n");
         fflush(stdout); 
@@ -303,6 +341,163 @@ static int manageControl(int cpIncoming)
 
 
 
+/* sendUpstreamHealth sends the health of each of the Tor SocksPorts of the 
+ * redirector over the control session, as CONTROL_UPSTREAM_HEALTH is replied to.
+ * There are no SocksPorts to send if there is no redirector.
+ *
+ * Returns 1 on success, 0 on error.
+ */ 
+static int sendUpstreamHealth(int cpIncoming)
+{
+  struct redirStats     *stats = getRedirStats();
+  struct upstreamHealth *health;
+  uint64_t              nowMs = clockMs();
+  uint32_t              reply[1 + REDIR_MAX_UPSTREAMS * 4];
+  uint32_t              count = 0;
+  uint32_t              i;
+  
+  if( stats != NULL ) count = __atomic_load_n(&stats->upstreams, __ATOMIC_RELAXED);
+  
+  reply[0] = htonl(count);
+  
+  for( i = 0 ; i < count ; i++ ){
+    health = &stats->health[i];
+    
+    reply[1 + i * 4]     = htonl(__atomic_load_n(&health->state, __ATOMIC_RELAXED));
+    reply[1 + i * 4 + 1] = htonl(__atomic_load_n(&health->failures, __ATOMIC_RELAXED));
+    reply[1 + i * 4 + 2] = 0;
+    reply[1 + i * 4 + 3] = htonl(__atomic_load_n(&stats->upstreamConns[i], __ATOMIC_RELAXED));
+    
+    if( __atomic_load_n(&health->state, __ATOMIC_RELAXED) == UPSTREAM_OPEN 
+        && __atomic_load_n(&health->retryMs, __ATOMIC_RELAXED) > nowMs ){
+      reply[1 + i * 4 + 2] = htonl(__atomic_load_n(&health->retryMs, __ATOMIC_RELAXED) - nowMs);
+    }
+  }
+  
+  if( send(cpIncoming, reply, (1 + count * 4) * sizeof(uint32_t), 0) 
+      != (ssize_t)((1 + count * 4) * sizeof(uint32_t)) ){
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/* reloadRedir receives the Tor SocksPorts of CONTROL_REDIR_RELOAD, if any, 
+ * then has the redirector reload with them and replies whether it does. The
+ * SocksPorts are only those of this reload, the redirConf is left with those
+ * the App was started with, such that a later reload without any goes back
+ * to them.
+ *
+ * Returns 1 on success, 0 on error.
+ */ 
+static int reloadRedir(int cpIncoming)
+{
+  char     upstreams[CONTROL_UPSTREAMS_BC];
+  uint32_t bc = 0;
+  uint32_t reply;
+  
+  if( recv(cpIncoming, &bc, sizeof(bc), MSG_WAITALL) != sizeof(bc) ){
+    return 0; 
+  }
+  
+  bc = ntohl(bc);
+  if( bc >= CONTROL_UPSTREAMS_BC ){
+    logWrn("The client sent too many Tor SocksPorts to reload the redirector with");
+    return 0; 
+  }
+  
+  if( bc ){
+    if( recv(cpIncoming, upstreams, bc, MSG_WAITALL) != (ssize_t)bc ){
+      return 0; 
+    }
+    
+    upstreams[bc] = '\0'; 
+  }
+  
+  reply = htonl(reloadRedirector(bc ? upstreams : NULL));
+  
+  if( send(cpIncoming, &reply, sizeof(reply), 0) != sizeof(reply) ){
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+/* sendRedirStatus sends the generations of the redirector that were started, 
+ * those of them draining and the streams relayed by all of them, as 
+ * CONTROL_REDIR_STATUS is replied to. All of them are 0 without a redirector.
+ *
+ * Returns 1 on success, 0 on error.
+ */ 
+static int sendRedirStatus(int cpIncoming)
+{
+  struct redirStats *stats = getRedirStats();
+  uint32_t          reply[3] = { 0, 0, 0 };
+  
+  if( stats != NULL ){
+    reply[0] = htonl(__atomic_load_n(&stats->generation, __ATOMIC_RELAXED));
+    reply[1] = htonl(__atomic_load_n(&stats->draining, __ATOMIC_RELAXED));
+    reply[2] = htonl(__atomic_load_n(&stats->streams, __ATOMIC_RELAXED));
+  }
+  
+  if( send(cpIncoming, reply, sizeof(reply), 0) != sizeof(reply) ){
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
+/* sendFlowRecords takes up to CONTROL_FLOW_BATCH flow records out of the ring
+ * of the redirector and sends them over the control session, as 
+ * CONTROL_FLOW_RECORDS is replied to. The records taken are the client's, a 
+ * client that fails to receive them loses them.
+ *
+ * Returns 1 on success, 0 on error.
+ */ 
+static int sendFlowRecords(int cpIncoming)
+{
+  struct redirStats *stats = getRedirStats();
+  struct flowRecord records[CONTROL_FLOW_BATCH];
+  uint32_t          reply[2 + CONTROL_FLOW_BATCH * 13];
+  uint32_t          *at;
+  int               count;
+  int               i;
+  
+  count = takeFlowRecords(records, CONTROL_FLOW_BATCH);
+  
+  reply[0] = 0;
+  if( stats != NULL ) reply[0] = htonl(__atomic_load_n(&stats->flowsDropped, __ATOMIC_RELAXED));
+  reply[1] = htonl(count);
+  
+  for( i = 0 ; i < count ; i++ ){
+    at = &reply[2 + i * 13];
+    
+    at[0]  = htonl(records[i].openMs >> 32);
+    at[1]  = htonl(records[i].openMs);
+    at[2]  = htonl(records[i].closeMs >> 32);
+    at[3]  = htonl(records[i].closeMs);
+    at[4]  = htonl(records[i].bytesOut >> 32);
+    at[5]  = htonl(records[i].bytesOut);
+    at[6]  = htonl(records[i].bytesIn >> 32);
+    at[7]  = htonl(records[i].bytesIn);
+    at[8]  = htonl(records[i].replyMs);
+    at[9]  = htonl(records[i].firstByteMs);
+    at[10] = htonl(records[i].reason);
+    at[11] = htonl(records[i].upstream);
+    at[12] = htonl(records[i].tenant);
+  }
+  
+  if( send(cpIncoming, reply, (2 + count * 13) * sizeof(uint32_t), 0) 
+      != (ssize_t)((2 + count * 13) * sizeof(uint32_t)) ){
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+
 /* Returns the pointer to the singletons secret token */ 
 char *getCpToken(void)
 {
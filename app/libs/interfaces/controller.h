@@ -1,5 +1,6 @@
 #pragma once
 
+#include "controlProto.h"
 
 int initializeController(void);
 int manageControlPort(void);
@@ -0,0 +1,46 @@
+############################### BENCH CMAKE ####################################
+
+project(RedirBench)
+
+# The redirector the benchmark and the replay measure, and the client side of it 
+list  (APPEND bench_redir_sources 
+      "shared/source/logger.c" 
+      "shared/source/torCon.c"
+      "shared/source/socksIsol.c"
+      "shared/source/security.c"
+      "shared/source/isolNet.c"
+      "shared/source/redirEpoll.c"
+      "shared/source/redirPool.c"
+      "shared/source/redirUpstream.c"
+      "shared/source/redirUring.c"
+      "shared/source/redirTenant.c"
+      "shared/source/redirFlow.c"
+      "shared/source/redirCapture.c"
+      "shared/source/relayBuff.c"
+      "shared/source/relayPool.c"
+      "shared/source/relayQos.c"
+      "shared/source/timerWheel.c"
+      "shared/source/net.c"
+      "shared/source/tweetNacl.c"
+      "shared/source/prng.c"
+      )
+
+
+# The benchmark, and the replay of workloads captured by the redirector 
+add_executable(RedirBench "bench/redirBench.c" ${bench_redir_sources})
+add_executable(RedirReplay "bench/redirReplay.c" ${bench_redir_sources})
+
+# Header files can be found in these directories
+target_include_directories(RedirBench PUBLIC shared/interfaces)
+target_include_directories(RedirReplay PUBLIC shared/interfaces)
+
+
+# We want to make the RedirBench and RedirReplay executables in the parent directory 
+set_target_properties( RedirBench RedirReplay
+    PROPERTIES
+    RUNTIME_OUTPUT_DIRECTORY "${CMAKE_BINARY_DIR}"
+)
+
+# Dynamically linked libraries are required
+target_link_libraries(RedirBench "-lseccomp -lcap -lpthread")
+target_link_libraries(RedirReplay "-lseccomp -lcap -lpthread")
@@ -0,0 +1,680 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "isolNet.h"
+#include "torCon.h"
+#include "logger.h"
+#include "settings.h"
+
+
+/* RedirBench measures the network redirector. It starts a stand-in for the Tor
+ * SocksPort on the loopback interface, which accepts any SOCKS5 connect and
+ * then either echoes the stream back or sinks it, then starts the redirector
+ * with isolNet(REDIRECT) and drives many concurrent clients through the Unix
+ * Domain Socket of the redirector exactly as the App does, with getTorCon
+ * followed by torUrlCon.
+ *
+ * Each client sends its bytes, shuts its socket down for writing, and then
+ * receives until the stand-in closes the stream, which it does once it got the
+ * end of the stream and (when echoing) sent every byte back. The connect
+ * latency is from calling getTorCon to torUrlCon returning, and the stream
+ * throughput is from then to the stream closing.
+ *
+ * Every relay mode runs in its own process, as isolNet moves the calling
+ * process into a new network namespace and the redirector lives for as long
+ * as the process group it was started in, such that "-m all" compares each of
+ * them side by side with the same stand-in on the same machine.
+ *
+ * Like the App, this must run with the CAP_SYS_ADMIN capability.
+ *
+ * Usage: RedirBench [-m mode] [-c clients] [-n streams] [-b bytes] [-k kind]
+ *                   [-t threads] [-p poolSize] [-s socks] [-u upstreams]
+ *                   [-l balance] [-a family]
+ *
+ *   -m  fork, fork-splice, epoll, epoll-splice, uring or all (default all)
+ *   -c  concurrent clients (default 256), the epoll redirector drops
+ *       connections beyond the REDIR_MAX_CONNS of a thread
+ *   -n  streams in total (default 10000)
+ *   -b  bytes sent by each stream (default 65536)
+ *   -k  echo or sink, what the stand-in does with streams (default echo)
+ *   -t  event loop threads of the epoll redirector (default 1)
+ *   -p  pre-established Tor connections of the redirector (default 8)
+ *   -s  pipelined or lockstep, how clients send the SOCKS5 handshake and
+ *       connect request (default pipelined)
+ *   -u  stand-ins the redirector spreads streams over, each standing in for
+ *       a Tor of its own (default 1)
+ *   -l  round-robin, least-conn or dest-hash, how the redirector spreads the
+ *       streams over the stand-ins (default least-conn)
+ *   -a  tcp or unix, if the stand-ins listen on the loopback interface or on
+ *       Unix Domain Sockets, as with Tor's SocksPort unix:PATH (default tcp)
+ *
+ * The splice modes are compared with their recv/send counterparts on a few
+ * bulk streams, as splicing only pays off once the payload dominates, with
+ *
+ *   RedirBench -m all -c 8 -n 8 -b 33554432 -k echo
+ *
+ * which should be run where the redirector has a CPU of its own, as on a
+ * single CPU the copies of the clients and of the stand-in hide its own.
+ */
+
+
+enum{ KIND_ECHO = 0, KIND_SINK = 1 };
+
+enum{ CLIENT_STACK_BC = 65536, STANDIN_BUFF_BC = 65536, UPSTREAM_BC = 128 };
+
+/* benchMode is a relay mode of the redirector that can be benchmarked */
+struct benchMode{
+  const char *name;
+  int        mode;
+  int        splice;
+};
+
+/* benchRun holds the settings and the results of benchmarking a single mode,
+ * connectMs and streamMBs holding the results of each stream by its index.
+ */
+struct benchRun{
+  int      clients;
+  int      streams;
+  long     bytes;
+  int      nextStream;
+  int      failures;
+  uint64_t received;
+  double   *connectMs;
+  double   *streamMBs;
+};
+
+
+static void   usage(void);
+static int    startStandIn(int kind, int onUnix, char *upstream);
+static void   serveStandIn(int listenSock, int kind);
+static void   *standInConn(void *arg);
+static int    standInSocks(int sock);
+static int    recvAll(int sock, void *buff, size_t bc);
+static int    runMode(const struct benchMode *mode, struct benchRun *run,
+                      int threads, int poolSize, const char *upstreams);
+static void   *benchClient(void *arg);
+static int    runStream(struct benchRun *run, int idx, char *buff);
+static void   report(const char *name, struct benchRun *run, double seconds);
+static double percentile(double *sorted, int count, double pct);
+static int    cmpDouble(const void *x, const void *y);
+static double nowSec(void);
+
+
+static const struct benchMode sModes[] = {
+  { "fork",         REDIR_FORK,  0 },
+  { "fork-splice",  REDIR_FORK,  1 },
+  { "epoll",        REDIR_EPOLL, 0 },
+  { "epoll-splice", REDIR_EPOLL, 1 },
+  { "uring",        REDIR_URING, 0 }
+};
+
+static int sKind;
+
+
+int main(int argc, char *argv[])
+{
+  struct benchRun run;
+  const char      *modeName = "all";
+  char            upstream[REDIR_MAX_UPSTREAMS][UPSTREAM_BC];
+  char            upstreams[REDIR_MAX_UPSTREAMS * UPSTREAM_BC] = "";
+  pid_t           standIns[REDIR_MAX_UPSTREAMS];
+  int             standInCount = 1;
+  int             onUnix    = 0;
+  int             threads   = 1;
+  int             poolSize  = 8;
+  int             pipeline  = 1;
+  int             opt;
+  int             status;
+  unsigned        i;
+  pid_t           pid;
+
+  run.clients = 256;
+  run.streams = 10000;
+  run.bytes   = 65536;
+  sKind       = KIND_ECHO;
+
+  while( (opt = getopt(argc, argv, "m:c:n:b:k:t:p:s:u:l:a:")) != -1 ){
+    switch( opt ){
+      case 'm': modeName    = optarg;       break;
+      case 'c': run.clients = atoi(optarg); break;
+      case 'n': run.streams = atoi(optarg); break;
+      case 'b': run.bytes   = atol(optarg); break;
+      case 't': threads     = atoi(optarg); break;
+      case 'p': poolSize    = atoi(optarg); break;
+      case 'u': standInCount = atoi(optarg); break;
+      case 'a': onUnix = !strcmp(optarg, "unix"); break;
+      case 'l':{
+        getRedirConf()->balance = !strcmp(optarg, "round-robin") ? BALANCE_ROUND_ROBIN
+                                : !strcmp(optarg, "dest-hash")   ? BALANCE_DEST_HASH
+                                :                                  BALANCE_LEAST_CONN;
+        break;
+      }
+      case 's':{
+        pipeline = strcmp(optarg, "lockstep") ? 1 : 0;
+        break;
+      }
+      case 'k':{
+        sKind = strcmp(optarg, "sink") ? KIND_ECHO : KIND_SINK;
+        break;
+      }
+      default:{
+        usage();
+        return 1;
+      }
+    }
+  }
+
+  if( run.clients < 1 || run.streams < 1 || run.bytes < 0
+      || standInCount < 1 || standInCount > REDIR_MAX_UPSTREAMS ){
+    usage();
+    return 1;
+  }
+  if( run.clients > run.streams ) run.clients = run.streams;
+
+  setSocksPipeline(pipeline);
+
+  /* The redirector logs to the same file the App does */
+  initLogFile(LOGFILE_NAME);
+
+  /* Streams the clients send to a closed socket must not kill the bench */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* The stand-ins are listed as the upstreams of the redirector */
+  for( i = 0 ; i < (unsigned)standInCount ; i++ ){
+    standIns[i] = startStandIn(sKind, onUnix, upstream[i]);
+    if( standIns[i] == -1 ){
+      printf("Failed to start the SOCKS5 stand-in\n");
+      return 1;
+    }
+
+    snprintf( upstreams + strlen(upstreams), sizeof(upstreams) - strlen(upstreams),
+              "%s%s", i ? "," : "", upstream[i] );
+  }
+
+  printf( "%d streams of %ld bytes, %d concurrent, %d %s stand-in %s, SOCKS5 %s\n\n",
+          run.streams, run.bytes, run.clients, standInCount,
+          onUnix ? "unix" : "tcp", sKind == KIND_ECHO ? "echoing" : "sinking",
+          pipeline ? "pipelined" : "lockstep" );
+  printf( "%-13s %9s %9s %9s %11s %11s %8s\n", "mode", "conn/s", "p50 ms",
+          "p99 ms", "stream MB/s", "total MB/s", "failed" );
+
+  for( i = 0 ; i < sizeof(sModes) / sizeof(sModes[0]) ; i++ ){
+    if( strcmp(modeName, "all") && strcmp(modeName, sModes[i].name) ) continue;
+
+    /* Each mode gets its own process, and with it its own redirector */
+    fflush(stdout);
+    pid = fork();
+    if( pid == -1 ){
+      printf("Failed to fork for benchmarking %s\n", sModes[i].name);
+      break;
+    }
+
+    if( pid == 0 ){
+      _exit( runMode(&sModes[i], &run, threads, poolSize, upstreams) );
+    }
+
+    waitpid(pid, &status, 0);
+  }
+
+  for( i = 0 ; i < (unsigned)standInCount ; i++ ){
+    kill(standIns[i], SIGKILL);
+    waitpid(standIns[i], &status, 0);
+
+    if( onUnix ) unlink(upstream[i] + strlen("unix:"));
+  }
+
+  return 0;
+}
+
+/* usage prints how RedirBench is used */
+static void usage(void)
+{
+  printf( "Usage: RedirBench [-m fork|fork-splice|epoll|epoll-splice|uring|all]\n"
+          "                  [-c clients] [-n streams] [-b bytes] [-k echo|sink]\n"
+          "                  [-t threads] [-p poolSize] [-s pipelined|lockstep]\n"
+          "                  [-u upstreams] [-l round-robin|least-conn|dest-hash]\n"
+          "                  [-a tcp|unix]\n" );
+}
+
+
+/******************************SOCKS5 STAND-IN*********************************/
+
+/* startStandIn starts the stand-in for the Tor SocksPort in a process of its
+ * own, listening on an ephemeral port of the loopback interface, or when
+ * onUnix is 1 on a Unix Domain Socket in /tmp, the upstream of which it
+ * writes into upstream, of UPSTREAM_BC bytes.
+ *
+ * Returns the pid of the stand-in on success, -1 on error.
+ */
+static int startStandIn(int kind, int onUnix, char *upstream)
+{
+  static int         count;
+  struct sockaddr_in addr;
+  struct sockaddr_un unixAddr;
+  socklen_t          addrBc = sizeof(addr);
+  int                listenSock;
+  pid_t              pid;
+
+  listenSock = socket(onUnix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+  if( listenSock == -1 ){
+    return -1;
+  }
+
+  if( onUnix ){
+    memset(&unixAddr, 0, sizeof(unixAddr));
+    unixAddr.sun_family = AF_UNIX;
+    snprintf( unixAddr.sun_path, sizeof(unixAddr.sun_path),
+              "/tmp/RedirBench.%d.%d", (int)getpid(), count++ );
+    unlink(unixAddr.sun_path);
+
+    if( bind(listenSock, (struct sockaddr *)&unixAddr, sizeof(unixAddr))
+        || listen(listenSock, SOMAXCONN) ){
+      close(listenSock);
+      return -1;
+    }
+
+    snprintf(upstream, UPSTREAM_BC, "unix:%s", unixAddr.sun_path);
+  }
+  else{
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = 0;
+
+    if( bind(listenSock, (struct sockaddr *)&addr, sizeof(addr))
+        || listen(listenSock, SOMAXCONN)
+        || getsockname(listenSock, (struct sockaddr *)&addr, &addrBc) ){
+      close(listenSock);
+      return -1;
+    }
+
+    snprintf(upstream, UPSTREAM_BC, "127.0.0.1:%u", ntohs(addr.sin_port));
+  }
+
+  pid = fork();
+  if( pid == 0 ){
+    serveStandIn(listenSock, kind);
+    _exit(1);
+  }
+
+  close(listenSock);
+
+  return pid;
+}
+
+/* serveStandIn accepts connections on listenSock ad infinitum, serving each
+ * of them in a thread of its own
+ */
+static void serveStandIn(int listenSock, int kind)
+{
+  pthread_attr_t attr;
+  pthread_t      thread;
+  long           sock;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, CLIENT_STACK_BC);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  sKind = kind;
+
+  while(1){
+    sock = accept(listenSock, NULL, NULL);
+    if( sock == -1 ) continue;
+
+    if( pthread_create(&thread, &attr, &standInConn, (void *)sock) ){
+      close(sock);
+    }
+  }
+}
+
+/* standInConn serves a single connection to the stand-in, answering its SOCKS5
+ * handshake and connect request and then echoing or sinking its stream until
+ * the client shuts it down for writing, after which it is closed.
+ */
+static void *standInConn(void *arg)
+{
+  int     sock = (long)arg;
+  char    *buff;
+  ssize_t got;
+  ssize_t sent;
+  ssize_t out;
+
+  /* The buffer doesn't fit on the small stacks of the threads */
+  buff = malloc(STANDIN_BUFF_BC);
+  if( buff == NULL || !standInSocks(sock) ){
+    free(buff);
+    close(sock);
+    return NULL;
+  }
+
+  while( (got = recv(sock, buff, STANDIN_BUFF_BC, 0)) > 0 ){
+    if( sKind == KIND_SINK ) continue;
+
+    for( out = 0 ; out < got ; out += sent ){
+      sent = send(sock, buff + out, got - out, MSG_NOSIGNAL);
+      if( sent <= 0 ) break;
+    }
+  }
+
+  free(buff);
+  close(sock);
+
+  return NULL;
+}
+
+/* standInSocks answers the SOCKS5 method selection of the client on sock with
+ * username and password authentication if offered and no authentication
+ * otherwise, accepting any credentials, and its connect request with success.
+ *
+ * Returns 1 on success, 0 if the client misbehaved.
+ */
+static int standInSocks(int sock)
+{
+  unsigned char msg[262];
+  size_t        addrBc;
+  size_t        userBc;
+
+  /* Method selection, VER NMETHODS METHODS */
+  if( !recvAll(sock, msg, 2) || msg[0] != 5 || !recvAll(sock, msg + 2, msg[1]) ){
+    return 0;
+  }
+
+  /* Username and password authentication is selected when offered, as the 
+   * client isolates its streams with it, and accepted as Tor does 
+   */
+  if( memchr(msg + 2, 2, msg[1]) != NULL ){
+    if( send(sock, "\005\002", 2, MSG_NOSIGNAL) != 2 ){
+      return 0;
+    }
+
+    /* VER ULEN, then UNAME PLEN, then PASSWD */
+    if( !recvAll(sock, msg, 2) || msg[0] != 1 ){
+      return 0;
+    }
+
+    userBc = msg[1];
+    if( !recvAll(sock, msg, userBc + 1) || !recvAll(sock, msg, msg[userBc]) ){
+      return 0;
+    }
+
+    if( send(sock, "\001\000", 2, MSG_NOSIGNAL) != 2 ){
+      return 0;
+    }
+  }
+  else if( send(sock, "\005\000", 2, MSG_NOSIGNAL) != 2 ){
+    return 0;
+  }
+
+  /* Connect request, VER CMD RSV ATYP DST.ADDR DST.PORT */
+  if( !recvAll(sock, msg, 4) || msg[0] != 5 || msg[1] != 1 ){
+    return 0;
+  }
+
+  switch( msg[3] ){
+    case 1:  addrBc = 4;  break;
+    case 4:  addrBc = 16; break;
+    case 3:{
+      if( !recvAll(sock, msg, 1) ) return 0;
+      addrBc = msg[0];
+      break;
+    }
+    default: return 0;
+  }
+
+  if( !recvAll(sock, msg, addrBc + 2) ){
+    return 0;
+  }
+
+  /* Succeeded, bound to 0.0.0.0:0 as Tor replies */
+  if( send(sock, "\005\000\000\001\000\000\000\000\000\000", 10, MSG_NOSIGNAL) != 10 ){
+    return 0;
+  }
+
+  return 1;
+}
+
+/* recvAll receives exactly bc bytes from sock into buff.
+ *
+ * Returns 1 on success, 0 on error or disconnect.
+ */
+static int recvAll(int sock, void *buff, size_t bc)
+{
+  ssize_t got;
+  size_t  have = 0;
+
+  while( have < bc ){
+    got = recv(sock, (char *)buff + have, bc - have, 0);
+    if( got <= 0 ) return 0;
+    have += got;
+  }
+
+  return 1;
+}
+
+
+/********************************BENCH CLIENTS*********************************/
+
+/* runMode starts the redirector in mode, relaying to the stand-ins listed in upstreams,
+ * then runs the streams of run through it with run->clients clients and
+ * reports the results. The redirector and this process are then killed.
+ *
+ * Returns 0 on success, 1 on error.
+ */
+static int runMode(const struct benchMode *mode, struct benchRun *run,
+                   int threads, int poolSize, const char *upstreams)
+{
+  struct redirConf *conf = getRedirConf();
+  pthread_attr_t   attr;
+  pthread_t        *clients;
+  double           start;
+  int              started;
+  int              i;
+
+  /* The redirector joins this process group, such that it dies with it */
+  setpgid(0, 0);
+
+  conf->mode         = mode->mode;
+  conf->splice       = mode->splice;
+  conf->threads      = threads;
+  conf->poolSize     = poolSize;
+  conf->torUpstreams = upstreams;
+
+  run->nextStream = 0;
+  run->failures   = 0;
+  run->received   = 0;
+  run->connectMs  = calloc(run->streams, sizeof(double));
+  run->streamMBs  = calloc(run->streams, sizeof(double));
+  clients         = calloc(run->clients, sizeof(pthread_t));
+  if( run->connectMs == NULL || run->streamMBs == NULL || clients == NULL ){
+    printf("%-13s failed to allocate memory\n", mode->name);
+    return 1;
+  }
+
+  if( !isolNet(REDIRECT) ){
+    printf("%-13s failed to start the redirector\n", mode->name);
+    kill(0, SIGKILL);
+    return 1;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, CLIENT_STACK_BC);
+
+  start = nowSec();
+
+  for( started = 0 ; started < run->clients ; started++ ){
+    if( pthread_create(&clients[started], &attr, &benchClient, run) ) break;
+  }
+
+  for( i = 0 ; i < started ; i++ ){
+    pthread_join(clients[i], NULL);
+  }
+
+  report(mode->name, run, nowSec() - start);
+  fflush(stdout);
+
+  kill(0, SIGKILL);
+
+  return 0;
+}
+
+/* benchClient is the thread of a single client, which runs streams of run one
+ * after another until all of them were started
+ */
+static void *benchClient(void *arg)
+{
+  struct benchRun *run = arg;
+  char            *buff;
+  int             idx;
+
+  buff = calloc(1, STANDIN_BUFF_BC);
+  if( buff == NULL ) return NULL;
+
+  while( (idx = __atomic_fetch_add(&run->nextStream, 1, __ATOMIC_RELAXED)) < run->streams ){
+    if( !runStream(run, idx, buff) ){
+      __atomic_fetch_add(&run->failures, 1, __ATOMIC_RELAXED);
+      run->connectMs[idx] = -1;
+    }
+  }
+
+  free(buff);
+
+  return NULL;
+}
+
+/* runStream runs the stream idx of run, using buff for what it sends and
+ * receives, and records its connect latency and throughput.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int runStream(struct benchRun *run, int idx, char *buff)
+{
+  double   start;
+  double   connected;
+  long     sent = 0;
+  uint64_t received = 0;
+  ssize_t  bc;
+  int      sock;
+
+  start = nowSec();
+
+  sock = getTorCon();
+  if( sock == -1 ){
+    return 0;
+  }
+
+  if( !torUrlCon(sock, "bench.invalid", strlen("bench.invalid"), 80) ){
+    close(sock);
+    return 0;
+  }
+
+  connected           = nowSec();
+  run->connectMs[idx] = (connected - start) * 1000;
+
+  /* Send the stream, receiving what is echoed meanwhile such that neither
+   * side fills up and blocks the other
+   */
+  while( sent < run->bytes ){
+    bc = run->bytes - sent < STANDIN_BUFF_BC ? run->bytes - sent : STANDIN_BUFF_BC;
+
+    bc = send(sock, buff, bc, MSG_NOSIGNAL);
+    if( bc <= 0 ){
+      close(sock);
+      return 0;
+    }
+    sent += bc;
+
+    while( (bc = recv(sock, buff, STANDIN_BUFF_BC, MSG_DONTWAIT)) > 0 ){
+      received += bc;
+    }
+  }
+
+  /* Then end it, and receive until the stand-in closes it */
+  shutdown(sock, SHUT_WR);
+
+  while( (bc = recv(sock, buff, STANDIN_BUFF_BC, 0)) > 0 ){
+    received += bc;
+  }
+
+  close(sock);
+
+  if( bc == -1 || (sKind == KIND_ECHO && received < (uint64_t)run->bytes) ){
+    return 0;
+  }
+
+  run->streamMBs[idx] = (sent + received) / (nowSec() - connected) / 1e6;
+  __atomic_fetch_add(&run->received, sent + received, __ATOMIC_RELAXED);
+
+  return 1;
+}
+
+/* report prints a line with the results of run, which took seconds */
+static void report(const char *name, struct benchRun *run, double seconds)
+{
+  double meanMBs = 0;
+  int    done    = 0;
+  int    i;
+
+  /* Failed streams are left out, they have negative latencies */
+  qsort(run->connectMs, run->streams, sizeof(double), &cmpDouble);
+  for( i = 0 ; i < run->streams ; i++ ){
+    meanMBs += run->streamMBs[i];
+  }
+  done = run->streams - run->failures;
+  if( done > 0 ) meanMBs /= done;
+
+  printf( "%-13s %9.0f %9.2f %9.2f %11.1f %11.1f %8d\n",
+          name,
+          done / seconds,
+          percentile(run->connectMs + run->failures, done, 50),
+          percentile(run->connectMs + run->failures, done, 99),
+          meanMBs,
+          run->received / seconds / 1e6,
+          run->failures );
+}
+
+/* percentile returns the pct percentile of the count values of sorted */
+static double percentile(double *sorted, int count, double pct)
+{
+  int idx;
+
+  if( count == 0 ) return 0;
+
+  idx = (int)(pct / 100 * count);
+  if( idx >= count ) idx = count - 1;
+
+  return sorted[idx];
+}
+
+/* cmpDouble compares two doubles for qsort */
+static int cmpDouble(const void *x, const void *y)
+{
+  double a = *(const double *)x;
+  double b = *(const double *)y;
+
+  return (a > b) - (a < b);
+}
+
+/* nowSec returns the seconds on the monotonic clock */
+static double nowSec(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
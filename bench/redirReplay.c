@@ -0,0 +1,935 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "isolNet.h"
+#include "torCon.h"
+#include "logger.h"
+#include "settings.h"
+
+
+/* RedirReplay replays a workload the redirector captured with REDIR_CAPTURE
+ * set (see redirCapture.c) against the redirector, such that a change to the
+ * relay can be checked for making a real workload slower, rather than only
+ * the uniform streams of RedirBench. It starts a stand-in for the Tor
+ * SocksPort on the loopback interface, then starts the redirector with
+ * isolNet(REDIRECT) and replays every stream of the capture through it, each
+ * starting as long after the first as it was accepted after it in the
+ * capture.
+ *
+ * A stream is replayed from both of its ends, with a client sending what the
+ * sandbox sent and the stand-in sending what Tor sent, in the sizes and at the
+ * times (from the end of the SOCKS handshake) the redirector received them in
+ * the capture, as bytes that are all zeros. The handshake itself is made with
+ * getTorCon and torUrlCon as the App makes it, and answered by the stand-in,
+ * as such the bytes the sandbox sent before Tor answered its handshake, and
+ * the bytes of that answer, are left out of the replay. The length of the
+ * answer is taken from the capture, where the redirector put it as its flow
+ * records found it, see socksReplyBc in redirFlow.c.
+ * The client tells the stand-in which stream it is by the host it connects to.
+ *
+ * Each end sends on schedule whether or not the other got what it sent
+ * before, such that a slower relay shows as the streams taking longer rather
+ * than the workload being sent slower, and shuts its socket down for writing
+ * once it sent everything and the stream was closed in the capture. A stream
+ * is timed from torUrlCon returning until the client got every byte the
+ * stand-in sent and the end of the stream, and is late by how much longer
+ * than in the capture that took. The streams are reported as the interactive
+ * ones, with fewer than REDIR_QOS_BULK_BC bytes in either direction, and the
+ * bulk ones, as the QoS of the relay tells them apart.
+ *
+ * Every relay mode runs in its own process, as with RedirBench.
+ *
+ * Whether the QoS keeps the interactive streams of a workload responsive while
+ * its bulk streams are throttled is told by replaying a capture that holds
+ * both twice, without and with a rate for the sandbox, and comparing the late
+ * of the interactive streams, such as for 50 MB/s:
+ *
+ *   RedirReplay -m epoll captureFile
+ *   RedirReplay -m epoll -q 50000000 captureFile
+ *
+ * The uring engine relays with the epoll one once a rate is set.
+ *
+ * Like the App, this must run with the CAP_SYS_ADMIN capability.
+ *
+ * Usage: RedirReplay [-m mode] [-t threads] [-p poolSize] [-x speed]
+ *                    [-q rate] captureFile
+ *
+ *   -m  fork, fork-splice, epoll, epoll-splice, uring or all (default all)
+ *   -t  event loop threads of the epoll redirector (default 1)
+ *   -p  pre-established Tor connections of the redirector (default 8)
+ *   -x  how many times faster than it was captured the workload is replayed,
+ *       which shortens the gaps between the sends as well (default 1)
+ *   -q  bytes a second of each direction of the sandbox, the qosRate of the
+ *       redirector (default 0, no shaping)
+ */
+
+
+enum{ CLASS_INTERACTIVE = 0, CLASS_BULK = 1 };
+
+enum{ STREAM_STACK_BC = 65536, REPLAY_BUFF_BC = 65536, UPSTREAM_BC = 128,
+      HOST_BC = 64 };
+
+/* The host a client connects to, which names the stream of the capture it is */
+#define REPLAY_HOST ".replay.invalid"
+
+/* replayMode is a relay mode of the redirector the capture can be replayed in */
+struct replayMode{
+  const char *name;
+  int        mode;
+  int        splice;
+};
+
+/* replayStep is a send of an end of a stream, of bc bytes at us microseconds
+ * from the end of the SOCKS handshake of the stream
+ */
+struct replayStep{
+  uint64_t us;
+  uint32_t bc;
+};
+
+/* replayStream is a stream of the capture. startUs is how long after the
+ * first stream of the capture it was accepted, closeUs how long after the end
+ * of its handshake it was closed, and steps[side] the stepCount[side] sends of
+ * bytes[side] bytes in total of the end of side, 0 being the sandbox and 1
+ * Tor. connectMs and lateMs are the results of replaying it, with connectMs
+ * being -1 if it failed.
+ */
+struct replayStream{
+  uint64_t          startUs;
+  uint64_t          closeUs;
+  struct replayStep *steps[2];
+  int               stepCount[2];
+  int               stepCap[2];
+  uint64_t          bytes[2];
+  double            connectMs;
+  double            lateMs;
+};
+
+/* captureTrack is what a stream is made of while the capture is loaded, with
+ * torBc being the bytes of Tor received before the end of its handshake
+ */
+struct captureTrack{
+  uint64_t openUs;
+  uint64_t handshookUs;
+  uint64_t torBc;
+  int      seen;
+  int      opened;
+  int      handshook;
+  int      closed;
+};
+
+
+static void   usage(void);
+static int    loadCapture(const char *path);
+static void   loadEvent(struct captureEvent *event, struct replayStream *stream,
+                        struct captureTrack *track);
+static int    addStep(struct replayStream *stream, int side, uint64_t us, uint32_t bc);
+static int    cmpStart(const void *x, const void *y);
+static int    startStandIn(char *upstream);
+static void   serveStandIn(int listenSock);
+static void   *standInConn(void *arg);
+static int    standInSocks(int sock);
+static int    recvAll(int sock, void *buff, size_t bc);
+static int    runMode(const struct replayMode *mode, int threads, int poolSize,
+                      const char *upstreams);
+static void   *replayClient(void *arg);
+static int    replayEnd(int sock, struct replayStream *stream, int side,
+                        double start, char *buff, uint64_t *received);
+static void   report(const char *name);
+static void   reportClass(const char *name, int cls, double *connectMs, double *lateMs);
+static int    streamClass(struct replayStream *stream);
+static double percentile(double *sorted, int count, double pct);
+static int    cmpDouble(const void *x, const void *y);
+static double nowSec(void);
+
+
+static const struct replayMode sModes[] = {
+  { "fork",         REDIR_FORK,  0 },
+  { "fork-splice",  REDIR_FORK,  1 },
+  { "epoll",        REDIR_EPOLL, 0 },
+  { "epoll-splice", REDIR_EPOLL, 1 },
+  { "uring",        REDIR_URING, 0 }
+};
+
+/* The streams of the capture, in the order they were accepted, and how many
+ * streams of it could not be replayed, not having finished their handshake or
+ * been closed while captured
+ */
+static struct replayStream *sStreams;
+static int                 sStreamCount;
+static int                 sSkipped;
+
+/* How many times faster than captured the workload is replayed */
+static double sSpeed = 1;
+
+/* The qosRate of the redirector */
+static int sQosRate;
+
+/* When the replay of the current mode started */
+static double sStart;
+
+
+int main(int argc, char *argv[])
+{
+  const char *modeName = "all";
+  char       upstream[UPSTREAM_BC];
+  uint64_t   bytes[2] = { 0, 0 };
+  pid_t      standIn;
+  int        threads  = 1;
+  int        poolSize = 8;
+  int        opt;
+  int        status;
+  int        i;
+  pid_t      pid;
+
+  while( (opt = getopt(argc, argv, "m:t:p:x:q:")) != -1 ){
+    switch( opt ){
+      case 'm': modeName = optarg;       break;
+      case 't': threads  = atoi(optarg); break;
+      case 'p': poolSize = atoi(optarg); break;
+      case 'x': sSpeed   = atof(optarg); break;
+      case 'q': sQosRate = atoi(optarg); break;
+      default:{
+        usage();
+        return 1;
+      }
+    }
+  }
+
+  if( optind != argc - 1 || sSpeed <= 0 || sQosRate < 0 ){
+    usage();
+    return 1;
+  }
+
+  if( !loadCapture(argv[optind]) ){
+    printf("Failed to load the capture %s\n", argv[optind]);
+    return 1;
+  }
+
+  if( sStreamCount == 0 ){
+    printf("The capture %s holds no stream that can be replayed\n", argv[optind]);
+    return 1;
+  }
+
+  /* The redirector logs to the same file the App does */
+  initLogFile(LOGFILE_NAME);
+
+  /* Ends sending to a closed socket must not kill the replay */
+  signal(SIGPIPE, SIG_IGN);
+
+  standIn = startStandIn(upstream);
+  if( standIn == -1 ){
+    printf("Failed to start the SOCKS5 stand-in\n");
+    return 1;
+  }
+
+  for( i = 0 ; i < sStreamCount ; i++ ){
+    bytes[0] += sStreams[i].bytes[0];
+    bytes[1] += sStreams[i].bytes[1];
+  }
+
+  printf( "%d streams (%d skipped) over %.2f s, %.1f MB from the sandbox and "
+          "%.1f MB from Tor, replayed at %gx\n\n",
+          sStreamCount, sSkipped, sStreams[sStreamCount - 1].startUs / 1e6,
+          bytes[0] / 1e6, bytes[1] / 1e6, sSpeed );
+  printf( "%-13s %-11s %8s %8s %9s %9s %9s %9s\n", "mode", "class", "streams",
+          "failed", "p50 ms", "p99 ms", "p50 late", "p99 late" );
+
+  for( i = 0 ; i < (int)(sizeof(sModes) / sizeof(sModes[0])) ; i++ ){
+    if( strcmp(modeName, "all") && strcmp(modeName, sModes[i].name) ) continue;
+
+    /* Each mode gets its own process, and with it its own redirector */
+    fflush(stdout);
+    pid = fork();
+    if( pid == -1 ){
+      printf("Failed to fork for replaying in %s\n", sModes[i].name);
+      break;
+    }
+
+    if( pid == 0 ){
+      _exit( runMode(&sModes[i], threads, poolSize, upstream) );
+    }
+
+    waitpid(pid, &status, 0);
+  }
+
+  kill(standIn, SIGKILL);
+  waitpid(standIn, &status, 0);
+
+  return 0;
+}
+
+/* usage prints how RedirReplay is used */
+static void usage(void)
+{
+  printf( "Usage: RedirReplay [-m fork|fork-splice|epoll|epoll-splice|uring|all]\n"
+          "                   [-t threads] [-p poolSize] [-x speed] [-q rate]\n"
+          "                   captureFile\n" );
+}
+
+
+/*********************************THE CAPTURE**********************************/
+
+/* loadCapture loads the streams of the capture file at path into sStreams,
+ * leaving out those that can't be replayed.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int loadCapture(const char *path)
+{
+  struct captureEvent *events;
+  struct captureTrack *tracks;
+  FILE                *capture;
+  long                bc;
+  size_t              count;
+  size_t              i;
+  uint32_t            maxStream = 0;
+
+  capture = fopen(path, "rb");
+  if( capture == NULL ) return 0;
+
+  if( fseek(capture, 0, SEEK_END) || (bc = ftell(capture)) < 0
+      || fseek(capture, 0, SEEK_SET) ){
+    fclose(capture);
+    return 0;
+  }
+
+  /* A capture cut short in an event leaves the event out */
+  count  = bc / sizeof(struct captureEvent);
+  events = malloc(count ? count * sizeof(struct captureEvent) : 1);
+  if( events == NULL || fread(events, sizeof(struct captureEvent), count, capture) != count ){
+    free(events);
+    fclose(capture);
+    return 0;
+  }
+
+  fclose(capture);
+
+  for( i = 0 ; i < count ; i++ ){
+    if( events[i].stream > maxStream ) maxStream = events[i].stream;
+  }
+
+  /* Streams are numbered from 1 in the order they were accepted */
+  sStreams = calloc(maxStream + 1, sizeof(struct replayStream));
+  tracks   = calloc(maxStream + 1, sizeof(struct captureTrack));
+  if( sStreams == NULL || tracks == NULL ){
+    free(events);
+    free(tracks);
+    return 0;
+  }
+
+  for( i = 0 ; i < count ; i++ ){
+    loadEvent(&events[i], &sStreams[events[i].stream], &tracks[events[i].stream]);
+  }
+
+  free(events);
+
+  /* Keep the streams that can be replayed, timed from the first of them */
+  for( i = 1 ; i <= maxStream ; i++ ){
+    if( !tracks[i].seen ) continue;
+
+    if( !tracks[i].opened || !tracks[i].handshook || !tracks[i].closed ){
+      free(sStreams[i].steps[0]);
+      free(sStreams[i].steps[1]);
+      sSkipped++;
+      continue;
+    }
+
+    sStreams[i].startUs       = tracks[i].openUs;
+    sStreams[sStreamCount++] = sStreams[i];
+  }
+
+  free(tracks);
+
+  qsort(sStreams, sStreamCount, sizeof(struct replayStream), &cmpStart);
+
+  for( i = sStreamCount ; i-- > 0 ; ){
+    sStreams[i].startUs -= sStreams[0].startUs;
+  }
+
+  return 1;
+}
+
+/* loadEvent adds the captured event to stream, which is tracked in track. The
+ * bytes the sandbox sent before the end of the handshake, and those of the
+ * reply of Tor that ended it, are left out, but the bytes that came along
+ * with the reply are not.
+ */
+static void loadEvent(struct captureEvent *event, struct replayStream *stream,
+                      struct captureTrack *track)
+{
+  uint64_t us = event->us - track->handshookUs;
+
+  track->seen = 1;
+
+  switch( event->kind ){
+    case CAPTURE_OPEN:{
+      track->opened = 1;
+      track->openUs = event->us;
+      break;
+    }
+
+    case CAPTURE_CLOSE:{
+      track->closed = 1;
+      if( track->handshook ) stream->closeUs = us;
+      break;
+    }
+
+    case CAPTURE_RECV:{
+      if( track->handshook ){
+        addStep(stream, event->side, us, event->bc);
+        break;
+      }
+
+      if( event->side == 1 ) track->torBc += event->bc;
+      break;
+    }
+
+    /* Follows the receive that finished the reply of Tor */
+    case CAPTURE_REPLY:{
+      if( track->handshook ) break;
+
+      track->handshook   = 1;
+      track->handshookUs = event->us;
+
+      if( track->torBc > event->bc ){
+        addStep(stream, 1, 0, track->torBc - event->bc);
+      }
+      break;
+    }
+
+    /* The sends only show how the relay passed the bytes on */
+    default: break;
+  }
+}
+
+/* addStep adds a send of bc bytes at us to the end of side of stream.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int addStep(struct replayStream *stream, int side, uint64_t us, uint32_t bc)
+{
+  struct replayStep *steps;
+  int               cap;
+
+  if( side != 0 && side != 1 ) return 0;
+
+  if( stream->stepCount[side] == stream->stepCap[side] ){
+    cap   = stream->stepCap[side] ? stream->stepCap[side] * 2 : 8;
+    steps = realloc(stream->steps[side], cap * sizeof(struct replayStep));
+    if( steps == NULL ) return 0;
+
+    stream->steps[side]   = steps;
+    stream->stepCap[side] = cap;
+  }
+
+  stream->steps[side][stream->stepCount[side]].us = us;
+  stream->steps[side][stream->stepCount[side]].bc = bc;
+  stream->stepCount[side]++;
+  stream->bytes[side] += bc;
+
+  return 1;
+}
+
+/* cmpStart orders streams by when they were accepted for qsort */
+static int cmpStart(const void *x, const void *y)
+{
+  uint64_t a = ((const struct replayStream *)x)->startUs;
+  uint64_t b = ((const struct replayStream *)y)->startUs;
+
+  return (a > b) - (a < b);
+}
+
+
+/******************************SOCKS5 STAND-IN*********************************/
+
+/* startStandIn starts the stand-in for the Tor SocksPort in a process of its
+ * own, listening on an ephemeral port of the loopback interface, the upstream
+ * of which it writes into upstream, of UPSTREAM_BC bytes.
+ *
+ * Returns the pid of the stand-in on success, -1 on error.
+ */
+static int startStandIn(char *upstream)
+{
+  struct sockaddr_in addr;
+  socklen_t          addrBc = sizeof(addr);
+  int                listenSock;
+  pid_t              pid;
+
+  listenSock = socket(AF_INET, SOCK_STREAM, 0);
+  if( listenSock == -1 ){
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port        = 0;
+
+  if( bind(listenSock, (struct sockaddr *)&addr, sizeof(addr))
+      || listen(listenSock, SOMAXCONN)
+      || getsockname(listenSock, (struct sockaddr *)&addr, &addrBc) ){
+    close(listenSock);
+    return -1;
+  }
+
+  snprintf(upstream, UPSTREAM_BC, "127.0.0.1:%u", ntohs(addr.sin_port));
+
+  pid = fork();
+  if( pid == 0 ){
+    serveStandIn(listenSock);
+    _exit(1);
+  }
+
+  close(listenSock);
+
+  return pid;
+}
+
+/* serveStandIn accepts connections on listenSock ad infinitum, serving each
+ * of them in a thread of its own
+ */
+static void serveStandIn(int listenSock)
+{
+  pthread_attr_t attr;
+  pthread_t      thread;
+  long           sock;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, STREAM_STACK_BC);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  while(1){
+    sock = accept(listenSock, NULL, NULL);
+    if( sock == -1 ) continue;
+
+    if( pthread_create(&thread, &attr, &standInConn, (void *)sock) ){
+      close(sock);
+    }
+  }
+}
+
+/* standInConn serves a single connection to the stand-in, answering its SOCKS5
+ * handshake and connect request and then replaying the Tor end of the stream
+ * it connected to
+ */
+static void *standInConn(void *arg)
+{
+  int      sock = (long)arg;
+  char     *buff;
+  uint64_t received;
+  int      idx;
+
+  /* The buffer doesn't fit on the small stacks of the threads */
+  buff = calloc(1, REPLAY_BUFF_BC);
+  idx  = buff == NULL ? -1 : standInSocks(sock);
+
+  if( idx != -1 ){
+    replayEnd(sock, &sStreams[idx], 1, nowSec(), buff, &received);
+  }
+
+  free(buff);
+  close(sock);
+
+  return NULL;
+}
+
+/* standInSocks answers the SOCKS5 method selection of the client on sock with
+ * username and password authentication if offered and no authentication
+ * otherwise, accepting any credentials, and its connect request with success.
+ *
+ * Returns the stream named by the host of the connect request, or -1 if the
+ * client misbehaved.
+ */
+static int standInSocks(int sock)
+{
+  unsigned char msg[262];
+  char          *end;
+  size_t        userBc;
+  size_t        hostBc;
+  long          idx;
+
+  /* Method selection, VER NMETHODS METHODS */
+  if( !recvAll(sock, msg, 2) || msg[0] != 5 || !recvAll(sock, msg + 2, msg[1]) ){
+    return -1;
+  }
+
+  /* Username and password authentication is selected when offered, as the
+   * client isolates its streams with it, and accepted as Tor does
+   */
+  if( memchr(msg + 2, 2, msg[1]) != NULL ){
+    if( send(sock, "\005\002", 2, MSG_NOSIGNAL) != 2 ){
+      return -1;
+    }
+
+    /* VER ULEN, then UNAME PLEN, then PASSWD */
+    if( !recvAll(sock, msg, 2) || msg[0] != 1 ){
+      return -1;
+    }
+
+    userBc = msg[1];
+    if( !recvAll(sock, msg, userBc + 1) || !recvAll(sock, msg, msg[userBc]) ){
+      return -1;
+    }
+
+    if( send(sock, "\001\000", 2, MSG_NOSIGNAL) != 2 ){
+      return -1;
+    }
+  }
+  else if( send(sock, "\005\000", 2, MSG_NOSIGNAL) != 2 ){
+    return -1;
+  }
+
+  /* Connect request to a host, VER CMD RSV ATYP LEN DST.ADDR DST.PORT */
+  if( !recvAll(sock, msg, 5) || msg[0] != 5 || msg[1] != 1 || msg[3] != 3 ){
+    return -1;
+  }
+
+  hostBc = msg[4];
+  if( !recvAll(sock, msg, hostBc + 2) ){
+    return -1;
+  }
+
+  msg[hostBc] = '\0';
+
+  idx = strtol((char *)msg, &end, 10);
+  if( end == (char *)msg || strcmp(end, REPLAY_HOST) || idx < 0 || idx >= sStreamCount ){
+    return -1;
+  }
+
+  /* Succeeded, bound to 0.0.0.0:0 as Tor replies */
+  if( send(sock, "\005\000\000\001\000\000\000\000\000\000", 10, MSG_NOSIGNAL) != 10 ){
+    return -1;
+  }
+
+  return idx;
+}
+
+/* recvAll receives exactly bc bytes from sock into buff.
+ *
+ * Returns 1 on success, 0 on error or disconnect.
+ */
+static int recvAll(int sock, void *buff, size_t bc)
+{
+  ssize_t got;
+  size_t  have = 0;
+
+  while( have < bc ){
+    got = recv(sock, (char *)buff + have, bc - have, 0);
+    if( got <= 0 ) return 0;
+    have += got;
+  }
+
+  return 1;
+}
+
+
+/******************************REPLAY CLIENTS**********************************/
+
+/* runMode starts the redirector in mode, relaying to the stand-in listed in
+ * upstreams, then replays every stream of the capture through it, each with a
+ * client of its own started when the stream was accepted in the capture, and
+ * reports the results. The redirector and this process are then killed.
+ *
+ * Returns 0 on success, 1 on error.
+ */
+static int runMode(const struct replayMode *mode, int threads, int poolSize,
+                   const char *upstreams)
+{
+  struct redirConf *conf = getRedirConf();
+  pthread_attr_t   attr;
+  pthread_t        *clients;
+  double           wait;
+  int              started;
+  int              i;
+
+  /* The redirector joins this process group, such that it dies with it */
+  setpgid(0, 0);
+
+  conf->mode         = mode->mode;
+  conf->splice       = mode->splice;
+  conf->threads      = threads;
+  conf->poolSize     = poolSize;
+  conf->torUpstreams = upstreams;
+  conf->qosRate      = sQosRate;
+
+  /* The replay is not itself captured, nor are its streams capped */
+  conf->capture    = 0;
+  conf->maxStreams = 0;
+
+  clients = calloc(sStreamCount, sizeof(pthread_t));
+  if( clients == NULL ){
+    printf("%-13s failed to allocate memory\n", mode->name);
+    return 1;
+  }
+
+  if( !isolNet(REDIRECT) ){
+    printf("%-13s failed to start the redirector\n", mode->name);
+    kill(0, SIGKILL);
+    return 1;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, STREAM_STACK_BC);
+
+  sStart = nowSec();
+
+  for( started = 0 ; started < sStreamCount ; started++ ){
+    wait = sStart + sStreams[started].startUs / 1e6 / sSpeed - nowSec();
+    if( wait > 0 ) usleep(wait * 1e6);
+
+    if( pthread_create(&clients[started], &attr, &replayClient, &sStreams[started]) ){
+      break;
+    }
+  }
+
+  for( i = 0 ; i < started ; i++ ){
+    pthread_join(clients[i], NULL);
+  }
+
+  for( i = started ; i < sStreamCount ; i++ ){
+    sStreams[i].connectMs = -1;
+  }
+
+  report(mode->name);
+  fflush(stdout);
+
+  kill(0, SIGKILL);
+
+  return 0;
+}
+
+/* replayClient is the thread of the client of a single stream, which replays
+ * the sandbox end of the stream and records its results
+ */
+static void *replayClient(void *arg)
+{
+  struct replayStream *stream = arg;
+  char                host[HOST_BC];
+  char                *buff;
+  double              start;
+  double              connected;
+  uint64_t            received = 0;
+  int                 sock     = -1;
+  int                 ok       = 0;
+
+  stream->connectMs = -1;
+
+  buff = calloc(1, REPLAY_BUFF_BC);
+  if( buff == NULL ) return NULL;
+
+  snprintf(host, sizeof(host), "%d" REPLAY_HOST, (int)(stream - sStreams));
+
+  start = nowSec();
+
+  sock = getTorCon();
+  if( sock != -1 && torUrlCon(sock, host, strlen(host), 80) ){
+    connected = nowSec();
+
+    ok = replayEnd(sock, stream, 0, connected, buff, &received)
+         && received == stream->bytes[1];
+  }
+
+  if( ok ){
+    stream->connectMs = (connected - start) * 1000;
+    stream->lateMs    = (nowSec() - connected) * 1000 - stream->closeUs / 1e3 / sSpeed;
+  }
+
+  if( sock != -1 ) close(sock);
+  free(buff);
+
+  return NULL;
+}
+
+/* replayEnd replays the end of side of stream on sock, the handshake of which
+ * ended at start, sending its steps on schedule while receiving what the other
+ * end sends, the bytes of which are stored in *received. Once every step was
+ * sent and the stream was closed in the capture, sock is shut down for writing
+ * and received from until the other end did the same.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int replayEnd(int sock, struct replayStream *stream, int side,
+                     double start, char *buff, uint64_t *received)
+{
+  struct pollfd end;
+  double        now;
+  double        at;
+  double        closeAt = start + stream->closeUs / 1e6 / sSpeed;
+  uint64_t      pending = 0;
+  ssize_t       bc;
+  int           next    = 0;
+  int           shut    = 0;
+  int           eof     = 0;
+  int           timeout;
+
+  *received = 0;
+
+  while( !shut || !eof ){
+    now = nowSec();
+
+    /* Every step that is due is added to the bytes left to send */
+    while( next < stream->stepCount[side] ){
+      at = start + stream->steps[side][next].us / 1e6 / sSpeed;
+      if( at > now ) break;
+
+      pending += stream->steps[side][next++].bc;
+    }
+
+    if( !shut && pending == 0 && next == stream->stepCount[side] && now >= closeAt ){
+      if( shutdown(sock, SHUT_WR) ) return 0;
+      shut = 1;
+      continue;
+    }
+
+    /* Wait for the next step, or the close, unless there is more to send */
+    timeout = -1;
+    if( !shut && pending == 0 ){
+      at = next < stream->stepCount[side]
+           ? start + stream->steps[side][next].us / 1e6 / sSpeed : closeAt;
+      timeout = (at - now) * 1000 + 1;
+    }
+
+    end.fd      = sock;
+    end.events  = (eof ? 0 : POLLIN) | (pending > 0 ? POLLOUT : 0);
+    end.revents = 0;
+
+    if( poll(&end, 1, timeout) == -1 && errno != EINTR ) return 0;
+
+    if( !eof && (end.revents & (POLLIN | POLLHUP | POLLERR)) ){
+      while( (bc = recv(sock, buff, REPLAY_BUFF_BC, MSG_DONTWAIT)) > 0 ){
+        *received += bc;
+      }
+
+      if( bc == 0 ) eof = 1;
+      if( bc == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ){
+        return 0;
+      }
+    }
+
+    if( pending > 0 && (end.revents & (POLLOUT | POLLERR)) ){
+      bc = send( sock, buff, pending < REPLAY_BUFF_BC ? pending : REPLAY_BUFF_BC,
+                 MSG_DONTWAIT | MSG_NOSIGNAL );
+      if( bc == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ){
+        return 0;
+      }
+      if( bc > 0 ) pending -= bc;
+    }
+  }
+
+  return 1;
+}
+
+/* report prints a line with the results of each class of the streams */
+static void report(const char *name)
+{
+  double *connectMs;
+  double *lateMs;
+
+  connectMs = calloc(sStreamCount, sizeof(double));
+  lateMs    = calloc(sStreamCount, sizeof(double));
+  if( connectMs == NULL || lateMs == NULL ){
+    printf("%-13s failed to allocate memory\n", name);
+    free(connectMs);
+    return;
+  }
+
+  reportClass(name, CLASS_INTERACTIVE, connectMs, lateMs);
+  reportClass(name, CLASS_BULK, connectMs, lateMs);
+
+  free(connectMs);
+  free(lateMs);
+}
+
+/* reportClass prints a line with the results of the streams of class cls,
+ * sorting them in connectMs and lateMs, each of sStreamCount of them
+ */
+static void reportClass(const char *name, int cls, double *connectMs, double *lateMs)
+{
+  int streams = 0;
+  int done    = 0;
+  int i;
+
+  for( i = 0 ; i < sStreamCount ; i++ ){
+    if( streamClass(&sStreams[i]) != cls ) continue;
+
+    streams++;
+    if( sStreams[i].connectMs < 0 ) continue;
+
+    connectMs[done] = sStreams[i].connectMs;
+    lateMs[done]    = sStreams[i].lateMs;
+    done++;
+  }
+
+  if( streams == 0 ) return;
+
+  qsort(connectMs, done, sizeof(double), &cmpDouble);
+  qsort(lateMs, done, sizeof(double), &cmpDouble);
+
+  printf( "%-13s %-11s %8d %8d %9.2f %9.2f %9.2f %9.2f\n",
+          name, cls == CLASS_BULK ? "bulk" : "interactive",
+          streams, streams - done,
+          percentile(connectMs, done, 50),
+          percentile(connectMs, done, 99),
+          percentile(lateMs, done, 50),
+          percentile(lateMs, done, 99) );
+}
+
+/* streamClass returns CLASS_BULK if either direction of stream is bulk to the
+ * QoS of the relay, CLASS_INTERACTIVE otherwise
+ */
+static int streamClass(struct replayStream *stream)
+{
+  if( stream->bytes[0] >= REDIR_QOS_BULK_BC || stream->bytes[1] >= REDIR_QOS_BULK_BC ){
+    return CLASS_BULK;
+  }
+
+  return CLASS_INTERACTIVE;
+}
+
+/* percentile returns the pct percentile of the count values of sorted */
+static double percentile(double *sorted, int count, double pct)
+{
+  int idx;
+
+  if( count == 0 ) return 0;
+
+  idx = (int)(pct / 100 * count);
+  if( idx >= count ) idx = count - 1;
+
+  return sorted[idx];
+}
+
+/* cmpDouble compares two doubles for qsort */
+static int cmpDouble(const void *x, const void *y)
+{
+  double a = *(const double *)x;
+  double b = *(const double *)y;
+
+  return (a > b) - (a < b);
+}
+
+/* nowSec returns the seconds on the monotonic clock */
+static double nowSec(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -21,6 +21,17 @@ list  (APPEND gui_sources
       "shared/source/logger.c" 
       "shared/source/security.c"
       "shared/source/isolNet.c"
+      "shared/source/redirEpoll.c"
+      "shared/source/redirPool.c"
+      "shared/source/redirUpstream.c"
+      "shared/source/redirUring.c"
+      "shared/source/redirTenant.c"
+      "shared/source/redirFlow.c"
+      "shared/source/redirCapture.c"
+      "shared/source/relayBuff.c"
+      "shared/source/relayPool.c"
+      "shared/source/relayQos.c"
+      "shared/source/timerWheel.c"
       "shared/source/isolFs.c"
       "shared/source/isolName.c"
       "shared/source/isolProc.c"
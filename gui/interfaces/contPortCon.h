@@ -1 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+/* The protocol of the control port is the app's own */
+extern "C"{
+  #include "controlProto.h"
+}
+
+/* upstreamStatus is the health of a Tor SocksPort of the app's redirector */
+struct upstreamStatus{
+  uint32_t state;    /* UPSTREAM_CLOSED, UPSTREAM_OPEN or UPSTREAM_HALF_OPEN */
+  uint32_t failures; /* Connects that failed in a row */
+  uint32_t retryMs;  /* Milliseconds until an open breaker lets a probe by */
+  uint32_t conns;    /* Open connections */
+};
+
+/* redirStatus is the status of the app's redirector */
+struct redirStatus{
+  uint32_t generation; /* Generations started, the first one included */
+  uint32_t draining;   /* Generations draining after a reload */
+  uint32_t streams;    /* Streams relayed by all of the generations */
+};
+
+/* flowStatus is the flow record of a stream the app's redirector closed, the
+ * times being milliseconds of CLOCK_MONOTONIC, with FLOW_NEVER for replyMs and
+ * firstByteMs meaning never
+ */
+struct flowStatus{
+  uint64_t openMs;      /* When the stream was accepted */
+  uint64_t closeMs;     /* When the stream was closed */
+  uint64_t bytesOut;    /* Bytes sent by the sandbox */
+  uint64_t bytesIn;     /* Bytes sent by Tor */
+  uint32_t replyMs;     /* Until Tor answered the SOCKS handshake */
+  uint32_t firstByteMs; /* Until Tor sent the first byte after */
+  uint32_t reason;      /* FLOW_DONE, FLOW_ABORTED or the timeout it expired */
+  uint32_t upstream;    /* The Tor SocksPort, FLOW_NO_UPSTREAM for none */
+  uint32_t tenant;      /* The sandbox, 0 unless the redirector is shared */
+};
+
 int initContPortCon(char *contPortToken);
+int getUpstreamHealth(int sock, struct upstreamStatus *statuses);
+int requestRedirReload(int sock, const char *upstreams);
+int getRedirStatus(int sock, struct redirStatus *status);
+int getFlowRecords(int sock, struct flowStatus *flows, uint32_t *dropped);
@@ -19,7 +19,7 @@ extern "C"{
   #include "net.h"
 }
 
-enum{ CONTROL_PORT_TOKEN_BC = 32 };
+#include "contPortCon.h"
 
 /* Singleton closure */
 static char *gToken;
@@ -57,6 +57,160 @@ int initContPortCon(char *contPortToken)
 
 
 
+/* getUpstreamHealth requests the health of the Tor SocksPorts over the 
+ * authenticated control port connection sock, and stores that of each in 
+ * statuses, which holds CONTROL_MAX_UPSTREAMS of them.
+ *
+ * Returns the number of SocksPorts on success, -1 on error.
+ */
+int getUpstreamHealth(int sock, struct upstreamStatus *statuses)
+{
+  uint32_t action = htonl(CONTROL_UPSTREAM_HEALTH);
+  uint32_t count  = 0;
+  uint32_t i;
+  
+  if( send( sock, &action, sizeof(action), 0 ) != sizeof(action) ){
+    logErr("Failed to request the health of the Tor SocksPorts");
+    return -1;
+  }
+  
+  if( recv( sock, &count, sizeof(count), MSG_WAITALL ) != sizeof(count) ){
+    logErr("Failed to receive the number of Tor SocksPorts");
+    return -1;
+  }
+  
+  count = ntohl(count);
+  if( count > CONTROL_MAX_UPSTREAMS ){
+    logErr("The control port reported more Tor SocksPorts than are supported");
+    return -1;
+  }
+  
+  if( count && recv( sock, statuses, count * sizeof(struct upstreamStatus), MSG_WAITALL ) 
+               != (ssize_t)(count * sizeof(struct upstreamStatus)) ){
+    logErr("Failed to receive the health of the Tor SocksPorts");
+    return -1;
+  }
+  
+  for( i = 0 ; i < count ; i++ ){
+    statuses[i].state    = ntohl(statuses[i].state);
+    statuses[i].failures = ntohl(statuses[i].failures);
+    statuses[i].retryMs  = ntohl(statuses[i].retryMs);
+    statuses[i].conns    = ntohl(statuses[i].conns);
+  }
+  
+  return count;
+}
+
+/* requestRedirReload has the redirector reload over the authenticated control 
+ * port connection sock, with the Tor SocksPorts of upstreams, or with those
+ * the app was started with if upstreams is NULL.
+ *
+ * Returns 1 once the reload is requested, 0 if the app refused it, -1 on error.
+ */
+int requestRedirReload(int sock, const char *upstreams)
+{
+  uint32_t action = htonl(CONTROL_REDIR_RELOAD);
+  uint32_t bc     = upstreams != NULL ? strlen(upstreams) : 0;
+  uint32_t netBc  = htonl(bc);
+  uint32_t reply  = 0;
+  
+  if( send( sock, &action, sizeof(action), 0 ) != sizeof(action)
+      || send( sock, &netBc, sizeof(netBc), 0 ) != sizeof(netBc)
+      || (bc && send( sock, upstreams, bc, 0 ) != (ssize_t)bc) ){
+    logErr("Failed to request a reload of the redirector");
+    return -1;
+  }
+  
+  if( recv( sock, &reply, sizeof(reply), MSG_WAITALL ) != sizeof(reply) ){
+    logErr("Failed to receive whether the redirector reloads");
+    return -1;
+  }
+  
+  return ntohl(reply);
+}
+
+/* getRedirStatus requests the status of the redirector over the authenticated
+ * control port connection sock, and stores it in status.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int getRedirStatus(int sock, struct redirStatus *status)
+{
+  uint32_t action = htonl(CONTROL_REDIR_STATUS);
+  
+  if( send( sock, &action, sizeof(action), 0 ) != sizeof(action) ){
+    logErr("Failed to request the status of the redirector");
+    return 0;
+  }
+  
+  if( recv( sock, status, sizeof(*status), MSG_WAITALL ) != sizeof(*status) ){
+    logErr("Failed to receive the status of the redirector");
+    return 0;
+  }
+  
+  status->generation = ntohl(status->generation);
+  status->draining   = ntohl(status->draining);
+  status->streams    = ntohl(status->streams);
+  
+  return 1;
+}
+
+
+
+/* getFlowRecords takes flow records of closed streams from the redirector over
+ * the authenticated control port connection sock, and stores them in flows,
+ * which holds CONTROL_FLOW_BATCH of them, and the records the app dropped so
+ * far in dropped. The records are taken, such that they are only ever got
+ * once, and fewer than CONTROL_FLOW_BATCH of them means there are no more.
+ *
+ * Returns the number of records on success, -1 on error.
+ */
+int getFlowRecords(int sock, struct flowStatus *flows, uint32_t *dropped)
+{
+  uint32_t action = htonl(CONTROL_FLOW_RECORDS);
+  uint32_t head[2];
+  uint32_t record[13];
+  uint32_t i;
+  
+  if( send( sock, &action, sizeof(action), 0 ) != sizeof(action) ){
+    logErr("Failed to request the flow records of the redirector");
+    return -1;
+  }
+  
+  if( recv( sock, head, sizeof(head), MSG_WAITALL ) != sizeof(head) ){
+    logErr("Failed to receive the number of flow records");
+    return -1;
+  }
+  
+  *dropped = ntohl(head[0]);
+  head[1]  = ntohl(head[1]);
+  if( head[1] > CONTROL_FLOW_BATCH ){
+    logErr("The control port sent more flow records than are supported");
+    return -1;
+  }
+  
+  for( i = 0 ; i < head[1] ; i++ ){
+    if( recv( sock, record, sizeof(record), MSG_WAITALL ) != sizeof(record) ){
+      logErr("Failed to receive a flow record");
+      return -1;
+    }
+    
+    flows[i].openMs      = (uint64_t)ntohl(record[0]) << 32 | ntohl(record[1]);
+    flows[i].closeMs     = (uint64_t)ntohl(record[2]) << 32 | ntohl(record[3]);
+    flows[i].bytesOut    = (uint64_t)ntohl(record[4]) << 32 | ntohl(record[5]);
+    flows[i].bytesIn     = (uint64_t)ntohl(record[6]) << 32 | ntohl(record[7]);
+    flows[i].replyMs     = ntohl(record[8]);
+    flows[i].firstByteMs = ntohl(record[9]);
+    flows[i].reason      = ntohl(record[10]);
+    flows[i].upstream    = ntohl(record[11]);
+    flows[i].tenant      = ntohl(record[12]);
+  }
+  
+  return head[1];
+}
+
+
+
 /* First byte sent is byte count of token, followed by the token */ 
 static int cpAuthenticate(int sock)
 {
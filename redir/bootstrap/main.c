@@ -0,0 +1,50 @@
+#include <stdio.h>
+
+#include "isolNet.h"
+#include "security.h"
+#include "logger.h"
+#include "prng.h"
+
+
+/* RedirShared runs a single network redirector shared by the App instances of
+ * every sandbox directory it is passed, rather than each of them cloning its
+ * own. It listens on tor_unix_socket in each of the directories, which must
+ * exist, and the App instances of those sandboxes are built with REDIR_SHARED
+ * set to 1. It should be started before them, and runs until it is killed.
+ *
+ * Like the App, this must run with the CAP_SYS_ADMIN capability.
+ *
+ * Usage: RedirShared sandboxDir [sandboxDir ...]
+ */
+
+int main(int argc, char *argv[])
+{
+  if( argc < 2 || argc - 1 > REDIR_MAX_TENANTS ){
+    printf("Usage: RedirShared sandboxDir [sandboxDir ...]\n");
+    return 1;
+  }
+
+  /* Prevent unexpected forensic traces by disabling core dumps and paging */
+  if( !mitigateForensicTraces() ){
+    printf("Failed to disable core dumps / swapping to counter disk forensics\n");
+    return 1;
+  }
+
+  if( !initLogFile("redirLog") ){
+    printf("Failed to initialize log file\n");
+    return 1;
+  }
+
+  /* The tokens of the sandboxes are drawn from the PRNG */
+  if( !initializePrng() ){
+    logErr("Failed to initialize the PRNG");
+    return 1;
+  }
+
+  /* This only returns if the redirector had an error */
+  redirTenants(argv + 1, argc - 1);
+
+  logErr("The shared redirector had an error");
+
+  return 1;
+}
@@ -0,0 +1,45 @@
+########################### SHARED REDIRECTOR CMAKE ############################
+
+project(RedirShared)
+
+# The shared redirector itself
+list  (APPEND redir_sources 
+      "redir/bootstrap/main.c"
+      )
+
+# The redirector it runs
+list  (APPEND redir_sources 
+      "shared/source/logger.c" 
+      "shared/source/security.c"
+      "shared/source/isolNet.c"
+      "shared/source/redirEpoll.c"
+      "shared/source/redirPool.c"
+      "shared/source/redirUpstream.c"
+      "shared/source/redirUring.c"
+      "shared/source/redirTenant.c"
+      "shared/source/redirFlow.c"
+      "shared/source/redirCapture.c"
+      "shared/source/relayBuff.c"
+      "shared/source/relayPool.c"
+      "shared/source/relayQos.c"
+      "shared/source/timerWheel.c"
+      "shared/source/net.c"
+      "shared/source/tweetNacl.c"
+      "shared/source/prng.c"
+      )
+
+
+add_executable(RedirShared ${redir_sources})
+
+# Header files can be found in these directories
+target_include_directories(RedirShared PUBLIC shared/interfaces)
+
+
+# We want to make the RedirShared executable in the parent directory 
+set_target_properties( RedirShared
+    PROPERTIES
+    RUNTIME_OUTPUT_DIRECTORY "${CMAKE_BINARY_DIR}"
+)
+
+# Dynamically linked libraries are required
+target_link_libraries(RedirShared "-lseccomp -lcap -lpthread")
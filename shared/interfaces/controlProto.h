@@ -0,0 +1,45 @@
+#pragma once
+
+#include "isolNet.h"
+
+/* The protocol of the control port, spoken by the App (see controller.c) and
+ * the GUI (see contPortCon.cxx). A control session begins with the client
+ * sending the CONTROL_PORT_TOKEN_BC bytes of the token of the App.
+ *
+ * The actions a control session can request, each sent as a uint32_t in 
+ * network order. CONTROL_UPSTREAM_HEALTH is replied to with the number of Tor 
+ * SocksPorts, at most CONTROL_MAX_UPSTREAMS, then for each of them its circuit
+ * breaker state (UPSTREAM_CLOSED, UPSTREAM_OPEN or UPSTREAM_HALF_OPEN), the 
+ * connects to it that failed in a row, the milliseconds until its open breaker
+ * lets a probe through and its open connections, each as a uint32_t in network
+ * order.
+ *
+ * CONTROL_REDIR_RELOAD is followed by a uint32_t in network order byte count,
+ * below CONTROL_UPSTREAMS_BC, and that many bytes of Tor SocksPorts for the 
+ * reloaded redirector, or none for those the App was started with, and is 
+ * replied to with a uint32_t in network order that is 1 once the reload is
+ * requested and 0 otherwise. The SocksPorts are for that reload alone, and 
+ * must be of those the App was started with, the redirector refuses a reload
+ * to any other. 
+ * CONTROL_REDIR_STATUS is replied to with the generations of the redirector
+ * started, those draining and the streams it relays, each as a uint32_t in 
+ * network order.
+ *
+ * CONTROL_FLOW_RECORDS takes up to CONTROL_FLOW_BATCH flow records of closed
+ * streams from the redirector, and is replied to with the flow records that 
+ * were dropped so far and the number of records taken, then for each of them
+ * its open and close times, bytes out and bytes in as two uint32_t each (the
+ * high half first), then its reply and first byte times (FLOW_NEVER for 
+ * never), close reason (FLOW_IDLE to FLOW_ABORTED), upstream (FLOW_NO_UPSTREAM
+ * for none) and tenant, each as a uint32_t in network order. A reply with 
+ * fewer than CONTROL_FLOW_BATCH records took every record there was.
+ */
+enum{ CONTROL_CLOSE = 0, CONTROL_UPSTREAM_HEALTH = 1, CONTROL_REDIR_RELOAD = 2,
+      CONTROL_REDIR_STATUS = 3, CONTROL_FLOW_RECORDS = 4 };
+
+/* The bytes of the token, the most Tor SocksPorts whose health is sent and
+ * the bytes a reload may list them in, and the most flow records a reply to
+ * CONTROL_FLOW_RECORDS holds
+ */
+enum{ CONTROL_PORT_TOKEN_BC = 32, CONTROL_MAX_UPSTREAMS = REDIR_MAX_UPSTREAMS,
+      CONTROL_UPSTREAMS_BC = REDIR_MAX_UPSTREAMS * 128, CONTROL_FLOW_BATCH = 64 };
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "torCon.h"
+
+int dnsCacheCon(int torSocket, char *url, uint8_t bc, uint16_t port);
+int dnsCacheLookup(char *url, uint8_t bc, struct socksAddr *addr);
+void dnsCachePut(char *url, uint8_t bc, struct socksAddr *addr, uint32_t ttl);
+void dnsCacheFlush(void);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "torCon.h"
+
+/* hedgeStats holds the counters of the hedged connects */
+struct hedgeStats{
+  uint64_t connects;  /* Hedged connects made */
+  uint64_t hedged;    /* Connects a second attempt was started for */
+  uint64_t hedgeWins; /* Connects the second attempt finished first */
+};
+
+int torHedgedCon(char *url, uint8_t bc, uint16_t port, struct socksAuth *auth);
+uint32_t hedgeDelayMs(char *url, uint8_t bc, uint16_t port);
+void getHedgeStats(struct hedgeStats *stats);
@@ -1,7 +1,151 @@
 #pragma once
 
+#include <stdint.h>
+
 enum{ REDIRECT = 1, SIMPLE = 0 };
 
+/* The redirector engines that can be selected with redirConf.mode */
+enum{ REDIR_FORK = 0, REDIR_EPOLL = 1, REDIR_URING = 2 };
+
+/* How the redirector spreads connections over the Tor SocksPorts, selected with
+ * redirConf.balance, see redirUpstream.c
+ */
+enum{ BALANCE_ROUND_ROBIN = 0, BALANCE_LEAST_CONN = 1, BALANCE_DEST_HASH = 2 };
+
+/* The most Tor SocksPorts the redirector can connect to */
+enum{ REDIR_MAX_UPSTREAMS = 8 };
+
+/* The most event loop threads and pooled Tor connections a reload of the 
+ * redirector may ask for
+ */
+enum{ REDIR_MAX_THREADS = 256, REDIR_MAX_POOL_SIZE = 4096 };
+
+/* The most sandboxes a shared redirector can serve, see redirTenant.c */
+enum{ REDIR_MAX_TENANTS = 64 };
+
+/* The states of the circuit breaker of a Tor SocksPort, see redirUpstream.c */
+enum{ UPSTREAM_CLOSED = 0, UPSTREAM_OPEN = 1, UPSTREAM_HALF_OPEN = 2 };
+
+/* The reasons a stream described by a flowRecord was closed for, the first
+ * three being the timeouts it can expire for. FLOW_DONE is a stream a side of
+ * which disconnected once everything either side sent was passed on, and
+ * FLOW_ABORTED one that was closed with bytes left to pass on, or by an error
+ * before either side disconnected.
+ */
+enum{ FLOW_IDLE = 0, FLOW_HANDSHAKE = 1, FLOW_LIFETIME = 2, FLOW_DONE = 3,
+      FLOW_ABORTED = 4 };
+
+/* The time of a flowRecord for what never happened, which longer times are
+ * cut short of, and its upstream for a stream that never got one
+ */
+enum{ FLOW_NEVER = INT32_MAX, FLOW_NO_UPSTREAM = UINT8_MAX };
+
+/* redirConf holds the runtime settings of the network redirector, it is 
+ * initialized from the defaults in settings.h and may be changed through the
+ * pointer returned by getRedirConf prior to calling isolNet(REDIRECT).
+ */
+struct redirConf{
+  int mode;       /* REDIR_FORK, REDIR_EPOLL or REDIR_URING */
+  int splice;     /* When 1 bytes are relayed with splice through pipes */
+  int poolSize;   /* Tor SocksPort connections kept pre-established */
+  int passFd;     /* When 1 connected Tor sockets are passed to the client */
+  int threads;    /* Event loop threads of the REDIR_EPOLL engine */
+  int pinThreads; /* When 1 each event loop thread is pinned to its own CPU */
+  int idleTimeout;      /* Seconds a connection may go without traffic */
+  int handshakeTimeout; /* Seconds a connection may take to finish SOCKS */
+  int lifeTimeout;      /* Seconds a connection may last, 0 for no limits */
+  int balance;          /* BALANCE_ROUND_ROBIN, BALANCE_LEAST_CONN or _DEST_HASH */
+  int backlog;          /* Connections that may wait on being accepted */
+  int maxStreams;       /* Connections relayed at once, 0 for no limits */
+  int qosRate;          /* Bytes a second of each direction of the sandbox */
+  int qosConnRate;      /* Bytes a second of each direction of a connection */
+  int shared;           /* When 1 a shared redirector serves the sandbox */
+  int capture;          /* When 1 the shapes of the streams are captured */
+  const char *torUpstreams; /* The Tor SocksPorts, ADDR:PORTs or unix:PATHs */
+};
+
+/* upstreamHealth is the health of a Tor SocksPort as the redirector sees it,
+ * with the times being milliseconds of CLOCK_MONOTONIC
+ */
+struct upstreamHealth{
+  uint32_t state;        /* UPSTREAM_CLOSED, UPSTREAM_OPEN or _HALF_OPEN */
+  uint32_t failures;     /* Connects that failed since the last that didn't */
+  uint64_t backoffMs;    /* How long the breaker stayed open the last time */
+  uint64_t retryMs;      /* When the open breaker lets the next probe through */
+  uint64_t connectFails; /* Connects that failed in total */
+};
+
+/* tenantStats holds the counters of a sandbox served by a shared redirector */
+struct tenantStats{
+  uint64_t streams;  /* Connections of the sandbox being relayed */
+  uint64_t accepted; /* Connections of the sandbox accepted in total */
+  uint64_t refused;  /* Connections of the sandbox closed for its cap */
+  uint64_t bytesOut; /* Bytes relayed from the sandbox to Tor */
+  uint64_t bytesIn;  /* Bytes relayed from Tor to the sandbox */
+};
+
+/* flowRecord describes a stream the redirector relayed, once it was closed,
+ * with the times being milliseconds of CLOCK_MONOTONIC. replyMs is the time
+ * from the stream being accepted until Tor answered its SOCKS handshake, which
+ * is how long the circuit and stream took, and firstByteMs the time until the
+ * first byte after that, which is how long the destination took to answer.
+ */
+struct flowRecord{
+  uint64_t openMs;      /* When the stream was accepted */
+  uint64_t closeMs;     /* When the stream was closed */
+  uint64_t bytesOut;    /* Bytes received from the sandbox */
+  uint64_t bytesIn;     /* Bytes received from Tor */
+  uint32_t replyMs;     /* Until Tor answered the handshake, or FLOW_NEVER */
+  uint32_t firstByteMs; /* Until Tor relayed the first byte after, or FLOW_NEVER */
+  uint8_t  reason;      /* FLOW_DONE, FLOW_ABORTED or the timeout expired */
+  uint8_t  upstream;    /* The Tor SocksPort, or FLOW_NO_UPSTREAM */
+  uint8_t  tenant;      /* The sandbox, 0 unless the redirector is shared */
+};
+
+/* captureEvent is an event of a stream captured by the redirector, us being
+ * the microseconds of CLOCK_MONOTONIC it happened at and stream the stream it
+ * happened to, numbered from 1. side is 0 for the sandbox and 1 for Tor, the
+ * side bc bytes were received from for CAPTURE_RECV and the side they were
+ * sent to for CAPTURE_SEND. CAPTURE_REPLY follows the receive that finished
+ * Tor's reply to the SOCKS handshake, with bc being the length of the reply.
+ * The capture file holds these one after another.
+ */
+enum{ CAPTURE_OPEN = 0, CAPTURE_RECV = 1, CAPTURE_SEND = 2, CAPTURE_CLOSE = 3,
+      CAPTURE_REPLY = 4 };
+
+struct captureEvent{
+  uint64_t us;
+  uint32_t stream;
+  uint32_t bc;
+  uint8_t  kind;
+  uint8_t  side;
+  uint8_t  unused[6];
+};
+
+/* redirStats holds the counters of the redirector process, which it keeps in
+ * memory shared with the process that called isolNet(REDIRECT).
+ */
+struct redirStats{
+  uint64_t poolHits;    /* Connections handed a pre-established Tor socket */
+  uint64_t poolMisses;  /* Connections that had to wait for a Tor connect */
+  uint64_t idleExpired;      /* Connections closed for going idle */
+  uint64_t handshakeExpired; /* Connections closed for a stalled handshake */
+  uint64_t lifeExpired;      /* Connections closed for lasting too long */
+  uint64_t upstreamConns[REDIR_MAX_UPSTREAMS]; /* Open to each Tor SocksPort */
+  uint64_t upstreams;   /* The Tor SocksPorts, once the redirector is inited */
+  uint64_t rejected;    /* Connections closed for not getting to a SocksPort */
+  uint64_t streams;     /* Connections being relayed */
+  uint64_t refused;     /* Connections closed for the cap on streams */
+  uint64_t throttled;   /* Times receiving waited on the QoS buckets */
+  struct upstreamHealth health[REDIR_MAX_UPSTREAMS];
+  uint64_t generation;  /* Generations of the redirector started so far */
+  uint64_t draining;    /* Generations draining after a reload */
+  uint64_t flowsDropped; /* Flow records dropped as the ring was full */
+  uint64_t captured;    /* Streams captured, see redirCapture.c */
+  uint64_t tenants;     /* The sandboxes, when the redirector is shared */
+  struct tenantStats tenant[REDIR_MAX_TENANTS];
+};
+
 /* isolNet shall implement network isolation such that the calling process loses
  * its ability to route traffic other than over connections to the Tor SocksPort.
  *
@@ -11,3 +155,54 @@ enum{ REDIRECT = 1, SIMPLE = 0 };
  * SocksPort going through a Unix Domain Socket connection.
  */
 int isolNet(int redirect);
+
+/* redirTenants runs a redirector in the calling process that is shared by the
+ * count sandbox directories of sandboxDirs, each of which gets a Unix Domain
+ * Socket of its own, such that the App instances using them set
+ * redirConf.shared rather than each cloning a redirector, see redirTenant.c.
+ * It never returns on success, and returns 0 on error.
+ */
+int redirTenants(char **sandboxDirs, int count);
+
+/* reloadRedirector has the redirector started by isolNet(REDIRECT) start a new
+ * generation with the current redirConf, which takes over its listening Unix
+ * Domain Socket, once it is initialized the current generation stops
+ * accepting and exits once its connections are closed. The generation relays
+ * to the Tor SocksPorts of upstreams, or of the torUpstreams of the redirConf
+ * if it is NULL, which must be of those the redirector was started with, the
+ * redirector refuses (and only logs) a reload that lists any other or has a
+ * setting out of bounds. It returns 1 once the reload is requested, 0 on 
+ * error or while an earlier reload is still pending.
+ */
+int reloadRedirector(const char *upstreams);
+
+/* takeFlowRecords takes up to max of the flow records of the closed streams
+ * of the redirector out of the ring they are kept in, oldest first, and
+ * stores them in records. The ring holds REDIR_FLOW_RECORDS of them, those of
+ * streams closed while it is full are dropped and counted in the redirStats.
+ * Returns the number of records taken.
+ */
+int takeFlowRecords(struct flowRecord *records, int max);
+
+/* getTorCon establishes a connection to the Tor SocksPort from the isolated
+ * network namespace through the redirector, and returns the socket on success
+ * or -1 on error. When redirConf.passFd is set, the returned socket is the 
+ * redirectors own connection to the SocksPort passed over to the caller.
+ */
+int getTorCon(void);
+
+/* requestTorCon and receiveTorCon split getTorCon in two, the first having the
+ * redirector connect to the Tor SocksPort and returning the socket the
+ * connection is then received on by the second, such that many connections 
+ * can be requested before waiting on any of them
+ */
+int requestTorCon(void);
+int receiveTorCon(int unixSock);
+
+/* getRedirConf returns a pointer to the redirector settings */
+struct redirConf *getRedirConf(void);
+
+/* getRedirStats returns a pointer to the redirector counters, or NULL if there
+ * is no redirector. The counters are only to be read outside of the redirector.
+ */
+struct redirStats *getRedirStats(void);
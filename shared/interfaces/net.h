@@ -1,7 +1,14 @@
 #pragma once
 
+#include <stdint.h>
+
 uint32_t getIncomingBc(int socket);
 int sendOutgoingBc(int socket, uint32_t outgoingBc);
 int ipv4Listen(const char *addr, uint16_t port);
 int udsConnect(char *udsPath, unsigned int bc);
-int udsListen(char *path, int bc);
+int udsListen(char *path, int bc, int backlog);
+int setNonBlocking(int fd);
+uint64_t clockMs(void);
+int sendFd(int socket, int fd);
+int passSock(int socket, int fd);
+int recvFd(int socket);
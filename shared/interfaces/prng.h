@@ -1,4 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+
 int initializePrng(void);
 int randomize(unsigned char *buff, unsigned long long byteCount);
+int randomizeHex(char *hex, unsigned long long byteCount);
+void hexEncode(char *hex, const unsigned char *bytes, size_t bc);
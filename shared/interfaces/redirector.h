@@ -0,0 +1,201 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "isolNet.h"
+
+/* These are shared between the redirector engines and are not meant to be 
+ * used outside of the redirector process.
+ */
+
+enum{ NS = 0, TOR = 1 };
+
+/* The kinds of sockets an event loop of the redirector waits on */
+enum{ END_LISTEN = 0, END_CONN = 1, END_POOL = 2, END_DRAIN = 3 };
+
+/* redirEnd identifies a socket registered with an event loop, the epoll_data 
+ * of each registered socket points to one such that events can be resolved to
+ * the object owning the socket, which for END_CONN is a connection of which 
+ * the socket is on side. For END_LISTEN side is the tenant the socket listens
+ * for, and END_DRAIN is the drain pipe of the generation of the redirector.
+ */
+struct redirEnd{
+  int  kind;
+  int  side;
+  void *owner;
+};
+
+/* The most size classes the relay pool can have, see relayPool.c */
+enum{ RELAY_CLASSES = 16 };
+
+/* relayDir is one direction of a redirected connection, see relayBuff.c. It
+ * holds len bytes received from its source socket that are not yet sent to its
+ * destination socket, starting at start in buff, or in the splice mode in pipe
+ * (buff is then NULL). buff is of the size class cls of the relay pool, or was
+ * secAlloc'd if cls is -1, and holds at most cap bytes. side is the side of 
+ * its source socket, NS or TOR, and tenant the sandbox of its connection.
+ */
+struct relayDir{
+  int    side;
+  int    tenant;
+  char   *buff;
+  int    cls;
+  size_t cap;
+  int    pipe[2];
+  size_t start;
+  size_t len;
+  int    paused;  /* Receiving is paused until the low watermark is reached */
+  size_t total;   /* Bytes received from the source socket in total */
+  int    eof;     /* The source socket disconnected */
+  int    shut;    /* The destination socket was shut down for writing */
+  int    throttled; /* Receiving waits on the QoS buckets, see relayQos.c */
+  uint64_t qosFull; /* When the QoS bucket of the connection is full again */
+  uint32_t capture; /* The stream it is captured as, or 0, see redirCapture.c */
+};
+
+/* Where the SOCKS handshake of a connection to a shared redirector is */
+enum{ GREET_METHODS = 0, GREET_AUTH = 1, GREET_DONE = 2 };
+
+/* tenantGreet is the SOCKS handshake of a connection of a tenant of a shared
+ * redirector, which it answers itself, see redirTenant.c. torLeft is the bytes
+ * of Tor's answers to the handshake of the redirector left to be taken.
+ */
+struct tenantGreet{
+  int state;
+  int torLeft;
+};
+
+/* The first bytes of Tor's reply to the SOCKS handshake that tell how long the
+ * reply is, see socksReplyBc in redirFlow.c
+ */
+enum{ FLOW_HEAD_BC = 9 };
+
+/* flowTrack is what the flow record of a stream is made of while the stream
+ * is relayed, see redirFlow.c. head holds the first headBc bytes Tor sent, and
+ * replyBc is the length of its reply to the handshake, or 0 until head tells.
+ */
+struct flowTrack{
+  uint64_t      openMs;
+  uint32_t      replyMs;
+  uint32_t      firstByteMs;
+  uint32_t      replyBc;
+  uint32_t      headBc;
+  unsigned char head[FLOW_HEAD_BC];
+};
+
+/* The levels of the timer wheel, each of WHEEL_SLOTS slots, see timerWheel.c */
+enum{ WHEEL_LEVELS = 4, WHEEL_BITS = 6, WHEEL_SLOTS = 1 << WHEEL_BITS };
+
+/* The timeouts a redirected connection can expire for, numbered as the
+ * FLOW_ reasons of its flow record
+ */
+enum{ EXPIRE_IDLE = 0, EXPIRE_HANDSHAKE = 1, EXPIRE_LIFETIME = 2 };
+
+/* redirTimer is a timer of a timer wheel, expires being the tick it expires
+ * at, and owner the object it times
+ */
+struct redirTimer{
+  struct redirTimer *next;
+  struct redirTimer **pprev;
+  uint64_t          expires;
+  void              (*fire)(struct redirTimer *timer);
+  void              *owner;
+};
+
+/* timerWheel is a hierarchical timer wheel, at tick with armed timers armed */
+struct timerWheel{
+  uint64_t          tick;
+  int               armed;
+  struct redirTimer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/* statAdd adds to a counter of the redirStats shared with the parent process,
+ * and statSub subtracts from one
+ */
+#define statAdd(field, value) \
+  __atomic_fetch_add(&getRedirStats()->field, (value), __ATOMIC_RELAXED)
+#define statSub(field, value) \
+  __atomic_fetch_sub(&getRedirStats()->field, (value), __ATOMIC_RELAXED)
+
+/* The most bytes of a connection that are looked at for its SOCKS request, a 
+ * handshake offering every method, an authentication and a request
+ */
+enum{ REDIR_PEEK_BC = 2 + 255 + 3 + 255 + 255 + 5 + 255 + 2 };
+
+int  initRedirStats(void);
+int  getTorSock(int upstream);
+int  startTorSock(int upstream);
+int  upstreamCount(void);
+void signalRedirInited(void);
+int  redirDrainFd(void);
+void redirDrained(void);
+
+int  pickUpstream(char *request, size_t bc);
+void closeTorSock(int torSock, int upstream);
+int  torSockConnected(int torSock, int upstream);
+int  upstreamAdmits(int upstream);
+void upstreamSucceeded(int upstream);
+void upstreamFailed(int upstream);
+
+void redirectEpoll(int *listens, int count);
+int  redirectUring(int unixListen);
+
+struct torPool;
+
+struct torPool *initTorPool(int epollFd, int size);
+int            takeTorSock(struct torPool *pool, int *upstream);
+void           refillTorPool(struct torPool *pool);
+void           handlePoolEvent(struct redirEnd *end, uint32_t events);
+void           drainTorPool(struct torPool *pool);
+
+int  initRelayDir(struct relayDir *dir, int side, int splice);
+void freeRelayDir(struct relayDir *dir);
+int  fillRelayDir(struct relayDir *dir, int src);
+int  flushRelayDir(struct relayDir *dir, int dst);
+int  relayWantsIn(struct relayDir *dir);
+int  relayWantsOut(struct relayDir *dir);
+
+int    initRelayQos(void);
+int    qosEnabled(void);
+size_t qosAllowance(struct relayDir *dir);
+void   qosCharge(struct relayDir *dir, size_t bc);
+int    qosResume(struct relayDir *dir);
+
+int  initTenants(int count);
+int  tenantCount(void);
+void initTenantGreet(struct tenantGreet *greet);
+int  greetTenant(struct tenantGreet *greet, int tenant, int nsSock, int torSock);
+int  takeTorGreeting(struct tenantGreet *greet, struct relayDir *dir,
+                     struct flowTrack *flow, int torSock);
+
+int    initFlowRing(void);
+void   openFlow(struct flowTrack *flow, uint64_t nowMs);
+void   feedFlow(struct flowTrack *flow, const void *bytes, size_t bc, uint64_t at);
+void   peekFlow(struct flowTrack *flow, int torSock, uint64_t torBytes);
+void   trackFlow(struct flowTrack *flow, uint64_t torBytes, uint32_t capture,
+                 uint64_t nowMs);
+int    flowReplied(struct flowTrack *flow, uint64_t torBytes);
+size_t socksReplyBc(const unsigned char *reply, size_t bc);
+int    flowEndReason(struct relayDir *dirs);
+void   recordFlow(struct flowTrack *flow, int reason, uint64_t bytesOut,
+                  uint64_t bytesIn, int upstream, int tenant);
+
+int      initCapture(void);
+uint32_t openCapture(void);
+void     captureIo(uint32_t stream, int kind, int side, size_t bc);
+void     captureReply(uint32_t stream, size_t bc);
+void     closeCapture(uint32_t stream);
+
+int    initRelayPool(void);
+char   *takeRelayBuff(int cls);
+void   giveRelayBuff(char *buff, int cls);
+size_t relayBuffBc(int cls);
+
+void     initTimerWheel(struct timerWheel *wheel, uint64_t nowMs);
+void     initTimer(struct redirTimer *timer, void (*fire)(struct redirTimer *), void *owner);
+void     armTimer(struct timerWheel *wheel, struct redirTimer *timer, uint64_t atMs);
+void     disarmTimer(struct timerWheel *wheel, struct redirTimer *timer);
+void     advanceTimerWheel(struct timerWheel *wheel, uint64_t nowMs);
+int      timerWheelWait(struct timerWheel *wheel, uint64_t nowMs);
+uint64_t redirDeadline(uint64_t startMs, uint64_t activeMs, int handshook, int *reason);
+void     countExpiry(int reason);
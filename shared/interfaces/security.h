@@ -4,6 +4,7 @@
 
 /************************POINTER SECURITY FUNCTIONS****************************/
 void *allocMemoryPane(size_t bytesRequested);
+void *allocSharedPane(size_t bytesRequested);
 int freezeMemoryPane(void *memoryPane, size_t bytesize);
 
 
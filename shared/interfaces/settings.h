@@ -5,6 +5,189 @@
 #define LOGFILE_NAME "/log"
 #define LOGFILE_NAME_BYTESIZE 4
 
-#define TOR_ADDR "192.168.56.1"
-#define TOR_PORT "9150"
+/* The Tor SocksPorts the redirector spreads connections over, as ADDR:PORTs 
+ * or unix:PATHs (for Tor's SocksPort unix:PATH, which spares a local Tor the
+ * loopback TCP/IP stack) separated by commas, of which there may be up to 
+ * REDIR_MAX_UPSTREAMS. Each Tor does its crypto on a single thread, such that
+ * running several of them raises how much can be relayed
+ */ 
+#define TOR_UPSTREAMS "192.168.56.1:9150"
 
+/* When 1 the Socks5 handshake and connect request are sent to Tor together,
+ * rather than the request waiting for the reply to the handshake 
+ */ 
+#define SOCKS_PIPELINE 1
+
+/* Which streams may share Tor circuits, ISOLATE_NONE (Tor decides), 
+ * ISOLATE_DEST (streams to the same destination), ISOLATE_STREAM (none) or 
+ * ISOLATE_GROUP (each ISOLATE_GROUP_STREAMS streams in turn), by having them
+ * authenticate to Tor with different credentials 
+ */ 
+#define ISOLATE_POLICY ISOLATE_DEST
+#define ISOLATE_GROUP_STREAMS 4
+
+/* The most idle Tor streams kept for reuse, in total and to any one URL:PORT,
+ * and the seconds each is kept for
+ */ 
+#define STREAM_POOL_SIZE 64
+#define STREAM_POOL_PER_DEST 4
+#define STREAM_POOL_IDLE 60
+
+/* The most URLs the addresses of which are cached, and the seconds each is 
+ * cached for, with 0 not caching addresses and connecting by URL, which a Tor
+ * with SafeSocks requires
+ */ 
+#define DNS_CACHE_SIZE 256
+#define DNS_CACHE_TTL 300
+
+/* A hedged connect starts a second attempt on a circuit of its own once the
+ * first took longer than the HEDGE_PERCENTILE percentile of the last 
+ * HEDGE_SAMPLES connects to the destination, or HEDGE_DELAY_MS milliseconds 
+ * while it has fewer than HEDGE_MIN_SAMPLES of them, and never sooner than 
+ * HEDGE_MIN_DELAY_MS. The latencies of HEDGE_DESTS destinations are kept, 
+ * hedges use random credentials of HEDGE_NONCE_BC bytes, and a hedged connect
+ * is given up on after HEDGE_TIMEOUT_MS milliseconds altogether
+ */ 
+#define HEDGE_PERCENTILE 90
+#define HEDGE_SAMPLES 32
+#define HEDGE_MIN_SAMPLES 8
+#define HEDGE_DELAY_MS 5000
+#define HEDGE_MIN_DELAY_MS 500
+#define HEDGE_DESTS 64
+#define HEDGE_NONCE_BC 16
+#define HEDGE_TIMEOUT_MS 60000
+
+
+
+/* The redirector engine, REDIR_FORK forks a process per connection, 
+ * REDIR_EPOLL multiplexes every connection in a single event loop and 
+ * REDIR_URING batches the I/O of every connection through an io_uring, falling
+ * back to REDIR_EPOLL on kernels without (or blocking) io_uring
+ */ 
+#define REDIR_MODE REDIR_EPOLL
+
+/* The most connections the epoll redirector will manage at once */ 
+#define REDIR_MAX_CONNS 1024
+
+/* The bytesize of each per direction relay buffer, relay buffers start out at
+ * this and double whenever they fill up, up to REDIR_BUFF_MAX_BC 
+ */ 
+#define REDIR_BUFF_BC 4096
+#define REDIR_BUFF_MAX_BC 262144
+
+/* The most bytes of relay buffers of each size the redirector keeps, which it
+ * maps and locks into memory REDIR_SLAB_CHUNK_BC bytes at a time as they are
+ * needed
+ */ 
+#define REDIR_SLAB_CLASS_BC 4194304
+#define REDIR_SLAB_CHUNK_BC 262144
+
+/* Receiving into a relay buffer (or pipe) is paused once it is REDIR_HIGH_WATER
+ * percent full, and resumed once sending drained it to REDIR_LOW_WATER percent
+ */ 
+#define REDIR_HIGH_WATER 75
+#define REDIR_LOW_WATER 25
+
+/* When 1 the redirector relays with splice through a pipe per direction, such
+ * that the relayed bytes are never copied into user space 
+ */ 
+#define REDIR_SPLICE 0
+
+/* The most bytes moved by a single splice, the default pipe capacity */ 
+#define REDIR_PIPE_BC 65536
+
+/* The number of Tor SocksPort connections the epoll redirector keeps 
+ * established ahead of time, such that accepted connections needn't wait 
+ */ 
+#define REDIR_POOL_SIZE 8
+
+/* When 1 the redirector connects to the Tor SocksPort and then passes the 
+ * connected socket to the client over the Unix Domain Socket, such that the 
+ * client speaks to the SocksPort directly rather than through a relay 
+ */ 
+#define REDIR_PASS_FD 0
+
+/* The number of event loops the epoll redirector runs, each in its own thread,
+ * and if they are each pinned to a CPU of their own (when 1) 
+ */ 
+#define REDIR_THREADS 1
+#define REDIR_PIN_THREADS 0
+
+/* The size of the submission queue of the io_uring redirector, and the number
+ * of registered REDIR_BUFF_BC buffers it has, two of which each connection uses.
+ * Its completion queue is sized from the buffers, see redirUring.c
+ */ 
+#define REDIR_URING_ENTRIES 256
+#define REDIR_URING_BUFFS 512
+
+/* The seconds a redirected connection may go without traffic, take to finish
+ * its SOCKS handshake, and last in total before it is closed, with 0 meaning
+ * no limit. The handshake is taken to be done once Tor sent the whole of its
+ * reply, as told by its SOCKS framing, see redirFlow.c
+ */ 
+#define REDIR_IDLE_TIMEOUT 600
+#define REDIR_HANDSHAKE_TIMEOUT 60
+#define REDIR_LIFE_TIMEOUT 0
+
+/* The flow records of closed streams the redirector keeps until the App takes
+ * them, see redirFlow.c
+ */ 
+#define REDIR_FLOW_RECORDS 1024
+
+/* When REDIR_CAPTURE is 1 the redirector captures the shape of every stream it
+ * relays, the times and sizes of its receives and sends but none of its bytes,
+ * into REDIR_CAPTURE_FILE in the sandbox directory, see redirCapture.c
+ */ 
+#define REDIR_CAPTURE 0
+#define REDIR_CAPTURE_FILE "redirCapture"
+
+/* How the redirector picks the Tor SocksPort of a connection, 
+ * BALANCE_ROUND_ROBIN (in turn), BALANCE_LEAST_CONN (the one with the fewest
+ * open connections) or BALANCE_DEST_HASH (by the destination of the SOCKS 
+ * request, such that a destination keeps to the circuits of one Tor)
+ */ 
+#define REDIR_BALANCE BALANCE_LEAST_CONN
+
+/* The connections that may wait on being accepted by the redirector, and the
+ * most it relays at once (0 for no limits), beyond which the connections it
+ * accepts are closed at once 
+ */ 
+#define REDIR_BACKLOG 128
+#define REDIR_MAX_STREAMS 1024
+
+/* The bytes a second the redirector receives in each direction in total, and
+ * in each direction of a single connection, with 0 not limiting. Each may be 
+ * exceeded by a burst of REDIR_QOS_BURST_MS milliseconds of it. A direction 
+ * is bulk once REDIR_QOS_BULK_BC bytes were received in it, and the bulk ones
+ * leave REDIR_QOS_RESERVE percent of the burst of the sandbox to the others. 
+ * Throttled directions are resumed every REDIR_QOS_TICK_MS milliseconds. The
+ * REDIR_URING engine falls back to REDIR_EPOLL when limiting 
+ */ 
+#define REDIR_QOS_RATE 0
+#define REDIR_QOS_CONN_RATE 0
+#define REDIR_QOS_BURST_MS 50
+#define REDIR_QOS_BULK_BC 1048576
+#define REDIR_QOS_RESERVE 25
+#define REDIR_QOS_TICK_MS 5
+
+/* The circuit breaker of a Tor SocksPort opens once UPSTREAM_FAILURES connects
+ * to it failed in a row, after which connections aren't sent to it until it 
+ * stayed open for a backoff of UPSTREAM_BACKOFF_MS milliseconds, which doubles
+ * each time the probe let through after it fails, up to UPSTREAM_BACKOFF_MAX_MS
+ */ 
+#define UPSTREAM_FAILURES 3
+#define UPSTREAM_BACKOFF_MS 500
+#define UPSTREAM_BACKOFF_MAX_MS 30000
+
+/* When REDIR_SHARED is 1 the App doesn't clone a redirector of its own, but is
+ * served by the shared redirector listening in its sandbox directory, which
+ * is started with RedirShared. With a shared redirector REDIR_MAX_STREAMS and
+ * REDIR_QOS_RATE apply to each of its sandboxes, and the handshake of each of
+ * their connections is authenticated to Tor with a token of TENANT_TOKEN_BC
+ * random bytes of the sandbox.
+ */ 
+#define REDIR_SHARED 0
+#define TENANT_TOKEN_BC 16
+
+/* The millisecond granularity of the timeouts of the redirector */ 
+#define REDIR_TICK_MS 1000
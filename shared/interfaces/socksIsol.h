@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "torCon.h"
+
+/* The isolation policies, which decide which streams may share a circuit:
+ * ISOLATE_NONE leaves it to Tor, ISOLATE_DEST has each destination use 
+ * circuits of its own, ISOLATE_STREAM has every stream use circuits of its own
+ * and ISOLATE_GROUP has each group of a number of streams share circuits
+ */
+enum{ ISOLATE_NONE = 0, ISOLATE_DEST = 1, ISOLATE_STREAM = 2, ISOLATE_GROUP = 3 };
+
+void setIsolationPolicy(int policy, int groupStreams);
+int getIsolationPolicy(void);
+int isolationAuth(char *addr, uint8_t bc, uint16_t port, struct socksAuth *auth);
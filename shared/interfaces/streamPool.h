@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "torCon.h"
+
+int streamPoolCon(char *url, uint8_t bc, uint16_t port, struct socksAuth *auth);
+int streamPoolPut(int torSocket, char *url, uint8_t bc, uint16_t port, 
+                  struct socksAuth *auth);
+void streamPoolFlush(void);
@@ -1,4 +1,84 @@
 #pragma once
 
-int torUrlCon(int torSocket, char *url, uint8_t bc, uint16_t port);
+#include <stdint.h>
+
+/* The statuses of a socksCon, SOCKS_PENDING until it either connected to its
+ * destination or failed to
+ */
+enum{ SOCKS_PENDING = 0, SOCKS_DONE = 1, SOCKS_FAILED = -1 };
+
+/* The Socks5 commands, SOCKS_CMD_RESOLVE and SOCKS_CMD_RESOLVE_PTR being Tor's
+ * extensions, and the address types
+ */
+enum{ SOCKS_CMD_CONNECT = 0x01, SOCKS_CMD_RESOLVE = 0xF0, SOCKS_CMD_RESOLVE_PTR = 0xF1 };
+enum{ SOCKS_ATYP_IPV4 = 1, SOCKS_ATYP_DOMAIN = 3, SOCKS_ATYP_IPV6 = 4 };
+
+/* socksAddr is an address as Socks5 has them, an IPv4 address of 4 bytes, an
+ * IPv6 address of 16 bytes, or a domain name of bc bytes, in network order
+ */
+struct socksAddr{
+  uint8_t atyp;
+  uint8_t bc;
+  char    addr[255];
+};
 
+/* socksAuth holds the username and password a Socks5 proxy is authenticated
+ * to with, which Tor doesn't check but isolates streams by, such that streams
+ * with different credentials don't share circuits
+ */
+struct socksAuth{
+  uint8_t userBc;
+  char    user[255];
+  uint8_t passBc;
+  char    pass[255];
+};
+
+/* socksCon is a non-blocking Socks5 connect over Tor in progress, which is 
+ * started with torUrlConStart and then driven by calling torUrlConStep each
+ * time its socket is ready for the events torUrlConEvents returns. Its fields
+ * are private to torCon.c, other than arg which is for the caller.
+ */
+struct socksCon{
+  int  socket;
+  int  status;
+  int  pipeline;
+  int  auth;
+  int  methodOk;
+  int  authOk;
+  int  replyOk;
+  char out[3 + 1 + 1 + 255 + 1 + 255 + 7 + 255]; /* Handshake, auth, request */
+  int  outBc;
+  int  authEnd;
+  int  outEnd;
+  int  outAt;
+  char in[2 + 2 + 4 + 1 + 255 + 2];              /* Method, auth, reply */
+  int  replyAt;
+  int  inAt;
+  void (*done)(struct socksCon *con, int status);
+  void *arg;
+};
+
+/* torTarget is a destination of torBatchCon, url being bc bytes long, with
+ * torBatchCon setting the fields after port
+ */
+struct torTarget{
+  char     *url;
+  uint8_t  bc;
+  uint16_t port;
+  int      socket;    /* The connected socket, or -1 */
+  int      status;    /* SOCKS_DONE or SOCKS_FAILED */
+  uint32_t latencyMs; /* Milliseconds until the connect finished */
+};
+
+void setSocksPipeline(int pipeline);
+int torUrlCon(int torSocket, char *url, uint8_t bc, uint16_t port);
+int torIpCon(int torSocket, struct socksAddr *ip, uint16_t port, char *name, 
+             uint8_t nameBc);
+int torResolve(int torSocket, char *url, uint8_t bc, struct socksAddr *resolved);
+int torResolvePtr(int torSocket, struct socksAddr *ip, struct socksAddr *name);
+int torUrlConStart(struct socksCon *con, int torSocket, char *url, uint8_t bc,
+                   uint16_t port, struct socksAuth *auth, 
+                   void (*done)(struct socksCon *, int));
+int torUrlConStep(struct socksCon *con);
+int torUrlConEvents(struct socksCon *con);
+int torBatchCon(struct torTarget *targets, int count, int timeoutMs);
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "dnsCache.h"
+#include "torCon.h"
+#include "isolNet.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+#include "net.h"
+
+
+/* The DNS cache keeps the addresses URLs resolved to over Tor, such that 
+ * connecting to a clearnet URL a second time connects to its address rather
+ * than having the exit resolve the URL once more before connecting. A URL not
+ * in the cache is resolved with Tor's RESOLVE extension over a connection to
+ * the SocksPort of its own, and then connected to by its address.
+ *
+ * Tor doesn't pass the TTL of the answer on over Socks5, so each address is 
+ * kept for DNS_CACHE_TTL seconds, which should be within the TTL most records
+ * have, and a cached address that can't be connected to is dropped. The cache
+ * holds up to DNS_CACHE_SIZE addresses, making room by dropping those closest
+ * to expiring. With DNS_CACHE_TTL at 0 nothing is cached, and as Tor warns of
+ * (and with SafeSocks refuses) connects to addresses, it must then be set to 0
+ * for Tors with SafeSocks.
+ *
+ * Onion services have no addresses, and connects to them always go by URL. 
+ * URLs are looked up regardless of case, as domain names are.
+ */
+
+
+/* dnsEntry is an address of the cache, with url being bc bytes long and bc 
+ * being 0 for an unused entry
+ */
+struct dnsEntry{
+  uint8_t          bc;
+  char             url[255];
+  struct socksAddr addr;
+  uint64_t         expiresMs;
+};
+
+
+static int      dnsResolve(char *url, uint8_t bc, struct socksAddr *addr);
+static int      ipLiteral(char *url, uint8_t bc, struct socksAddr *addr);
+static int      isOnion(char *url, uint8_t bc);
+static void     dropEntry(struct dnsEntry *entry);
+
+
+static struct dnsEntry sEntries[DNS_CACHE_SIZE];
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* dnsCacheCon establishes a connect to url:PORT over Tor as torUrlCon does, on
+ * torSocket connected to Tor's SocksPort, url being bc bytes long. Clearnet 
+ * URLs are connected to by their address, taken from the cache or resolved
+ * over Tor and cached, falling back to connecting by URL if resolving fails.
+ * URLs that are IP addresses are connected to as such. However it connects,
+ * the connect is isolated as one to url.
+ *
+ * Returns 1 on success and the socket is connected to the URL:PORT, on 
+ * error 0 is returned.  
+ */
+int dnsCacheCon(int torSocket, char *url, uint8_t bc, uint16_t port)
+{
+  struct socksAddr addr;
+  
+  /* Basic error checking */
+  if( url == NULL || bc == 0 ){
+    logErr("Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  if( ipLiteral(url, bc, &addr) ){
+    return torIpCon(torSocket, &addr, port, url, bc);
+  }
+  
+  if( DNS_CACHE_TTL == 0 || isOnion(url, bc) ){
+    return torUrlCon(torSocket, url, bc, port);
+  }
+  
+  /* Resolve the URL once, then connect to its address until it expires */ 
+  if( !dnsCacheLookup(url, bc, &addr) ){
+    if( !dnsResolve(url, bc, &addr) ){
+      return torUrlCon(torSocket, url, bc, port);
+    }
+    
+    dnsCachePut(url, bc, &addr, DNS_CACHE_TTL);
+  }
+  
+  if( !torIpCon(torSocket, &addr, port, url, bc) ){
+    logErr("Failed to connect to the cached address of a URL");
+    dnsCachePut(url, bc, &addr, 0);
+    return 0;
+  }
+  
+  return 1;
+}
+
+/* dnsCacheLookup looks the URL pointed to by url, of bc bytes, up in the 
+ * cache, storing its address in addr if it is there.
+ *
+ * Returns 1 if the URL was in the cache, 0 if not.
+ */
+int dnsCacheLookup(char *url, uint8_t bc, struct socksAddr *addr)
+{
+  uint64_t now = clockMs();
+  int      found = 0;
+  int      i;
+  
+  pthread_mutex_lock(&sLock);
+  
+  for( i = 0 ; i < DNS_CACHE_SIZE ; i++ ){
+    if( sEntries[i].bc != bc || strncasecmp(sEntries[i].url, url, bc) ) continue;
+    
+    if( sEntries[i].expiresMs <= now ){
+      dropEntry(&sEntries[i]);
+      break;
+    }
+    
+    memcpy(addr, &sEntries[i].addr, sizeof(struct socksAddr));
+    found = 1;
+    break;
+  }
+  
+  pthread_mutex_unlock(&sLock);
+  
+  return found;
+}
+
+/* dnsCachePut caches addr as the address of the URL pointed to by url, of bc
+ * bytes, for ttl seconds, replacing what the cache had for it, with a ttl of 0
+ * dropping the URL from the cache.
+ */
+void dnsCachePut(char *url, uint8_t bc, struct socksAddr *addr, uint32_t ttl)
+{
+  uint64_t now = clockMs();
+  int      slot = -1;
+  int      i;
+  
+  if( url == NULL || bc == 0 || addr == NULL ) return;
+  
+  pthread_mutex_lock(&sLock);
+  
+  /* Take the entry of the URL, else an unused or expired one, else the one
+   * closest to expiring 
+   */ 
+  for( i = 0 ; i < DNS_CACHE_SIZE ; i++ ){
+    if( sEntries[i].bc == bc && !strncasecmp(sEntries[i].url, url, bc) ){
+      slot = i;
+      break;
+    }
+    
+    if( sEntries[i].bc == 0 || sEntries[i].expiresMs <= now ){
+      if( slot == -1 || sEntries[slot].bc != 0 ) slot = i;
+      continue;
+    }
+    
+    if( slot == -1 || (sEntries[slot].bc != 0 && sEntries[i].expiresMs < sEntries[slot].expiresMs) ){
+      slot = i;
+    }
+  }
+  
+  /* Dropping a URL that isn't cached leaves the cache as it is */ 
+  if( ttl == 0 && (sEntries[slot].bc != bc || strncasecmp(sEntries[slot].url, url, bc)) ){
+    pthread_mutex_unlock(&sLock);
+    return;
+  }
+  
+  dropEntry(&sEntries[slot]);
+  
+  if( ttl != 0 ){
+    sEntries[slot].bc        = bc;
+    sEntries[slot].expiresMs = now + (uint64_t)ttl * 1000;
+    memcpy(sEntries[slot].url, url, bc);
+    memcpy(&sEntries[slot].addr, addr, sizeof(struct socksAddr));
+  }
+  
+  pthread_mutex_unlock(&sLock);
+}
+
+/* dnsCacheFlush drops every address of the cache, for when they must no longer
+ * be used, such as when changing identities
+ */
+void dnsCacheFlush(void)
+{
+  int i;
+  
+  pthread_mutex_lock(&sLock);
+  
+  for( i = 0 ; i < DNS_CACHE_SIZE ; i++ ){
+    dropEntry(&sEntries[i]);
+  }
+  
+  pthread_mutex_unlock(&sLock);
+}
+
+
+/* dnsResolve resolves the URL pointed to by url, of bc bytes, over Tor, storing
+ * its address in addr.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int dnsResolve(char *url, uint8_t bc, struct socksAddr *addr)
+{
+  int torSocket;
+  int resolved;
+  
+  /* Tor closes a connection once it answered a RESOLVE, so it gets its own */ 
+  torSocket = getTorCon();
+  if( torSocket == -1 ){
+    logErr("Failed to get a connection to the Tor SocksPort");
+    return 0;
+  }
+  
+  resolved = torResolve(torSocket, url, bc, addr);
+  close(torSocket);
+  
+  return resolved;
+}
+
+/* ipLiteral checks if the URL pointed to by url, of bc bytes, is an IPv4 or 
+ * IPv6 address, storing it in addr if it is.
+ *
+ * Returns 1 if url is an IP address, 0 if not.
+ */
+static int ipLiteral(char *url, uint8_t bc, struct socksAddr *addr)
+{
+  char text[256];
+  
+  memcpy(text, url, bc);
+  text[bc] = '\0';
+  
+  if( inet_pton(AF_INET, text, addr->addr) == 1 ){
+    addr->atyp = SOCKS_ATYP_IPV4;
+    addr->bc   = 4;
+    return 1;
+  }
+  
+  if( inet_pton(AF_INET6, text, addr->addr) == 1 ){
+    addr->atyp = SOCKS_ATYP_IPV6;
+    addr->bc   = 16;
+    return 1;
+  }
+  
+  return 0;
+}
+
+/* isOnion returns 1 if the URL pointed to by url, of bc bytes, is that of an
+ * onion service, 0 if not
+ */
+static int isOnion(char *url, uint8_t bc)
+{
+  size_t suffixBc = strlen(".onion");
+  
+  /* A trailing dot makes a name fully qualified, it is the same name */ 
+  if( bc > 0 && url[bc - 1] == '.' ) bc--;
+  
+  return bc >= suffixBc && !strncasecmp(url + bc - suffixBc, ".onion", suffixBc);
+}
+
+/* dropEntry clears entry such that no trace of the URL it had is left */
+static void dropEntry(struct dnsEntry *entry)
+{
+  secMemClear((volatile uint8_t *)entry, sizeof(struct dnsEntry));
+}
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hedgeCon.h"
+#include "torCon.h"
+#include "isolNet.h"
+#include "socksIsol.h"
+#include "prng.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+#include "net.h"
+
+
+/* A hedged connect cuts the long tail of connect latencies over Tor, where a
+ * slow circuit (typically to an onion service) stalls a connect for tens of 
+ * seconds while another circuit would connect in a few. It starts connecting
+ * as torUrlCon does, and if that hasn't succeeded after the hedge delay of the
+ * destination it starts a second attempt with credentials of its own, which 
+ * Tor isolates onto a circuit of its own, and then takes whichever attempt 
+ * succeeds first and closes the other. 
+ *
+ * The hedge delay of a destination is the HEDGE_PERCENTILE percentile of the
+ * latencies of its last HEDGE_SAMPLES connects, such that only its slowest 
+ * connects are hedged, and is HEDGE_DELAY_MS until it has HEDGE_MIN_SAMPLES of
+ * them. It is never less than HEDGE_MIN_DELAY_MS, which keeps a destination 
+ * that connects fast from being hedged for jitter. The latencies of up to 
+ * HEDGE_DESTS destinations are kept, those of the least recently connected to
+ * making room for others.
+ *
+ * A first attempt that is given up on, as the hedge won or the connect ran
+ * out of its HEDGE_TIMEOUT_MS, is recorded with the time it had taken so far,
+ * which its latency was at least, as is a hedge that timed out. Recording only
+ * the winners would leave out the slow circuits that hedging is for, and have
+ * the hedge delay shrink with every hedge that wins. A hedge that lost is not
+ * recorded, it was given up on once the first attempt connected, the latency
+ * of which is recorded.
+ */
+
+
+/* hedgeDest holds the latencies of the last connects to url:port, with url 
+ * being bc bytes long and bc being 0 for an unused entry
+ */
+struct hedgeDest{
+  uint8_t  bc;
+  char     url[255];
+  uint16_t port;
+  uint32_t samples[HEDGE_SAMPLES];
+  int      sampleCount;
+  int      nextSample;
+  uint64_t usedMs;
+};
+
+
+static int              startAttempt(struct socksCon *con, char *url, uint8_t bc,
+                                     uint16_t port, int hedge, struct socksAuth *auth);
+static void             recordLatency(char *url, uint8_t bc, uint16_t port, uint32_t ms);
+static struct hedgeDest *findDest(char *url, uint8_t bc, uint16_t port, int add);
+static int              cmpLatency(const void *x, const void *y);
+
+
+static struct hedgeDest  sDests[HEDGE_DESTS];
+static struct hedgeStats sStats;
+static pthread_mutex_t   sLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* torHedgedCon connects to url:PORT over Tor, url being bc bytes long, on a 
+ * connection it gets with getTorCon, hedging the connect with a second one on
+ * a circuit of its own if the first is slower than the destination usually 
+ * is, and giving up on both after HEDGE_TIMEOUT_MS. Unless auth is NULL the
+ * credentials the connected stream authenticated with are stored in it, such
+ * as for streamPoolPut.
+ *
+ * Returns the socket connected to url:PORT on success, -1 on error.
+ */
+int torHedgedCon(char *url, uint8_t bc, uint16_t port, struct socksAuth *auth)
+{
+  struct socksCon  cons[2];
+  struct socksAuth auths[2];
+  struct pollfd    fds[2];
+  uint64_t         starts[2];
+  uint64_t         hedgeAt;
+  uint64_t         deadline;
+  uint64_t         now;
+  int              attempts = 1;
+  int              winner = -1;
+  int              timeout;
+  int              i;
+  
+  /* Basic error checking */
+  if( url == NULL || bc == 0 ){
+    logErr("Something was NULL that shouldn't have been");
+    return -1; 
+  }
+  
+  starts[0] = clockMs();
+  hedgeAt   = starts[0] + hedgeDelayMs(url, bc, port);
+  deadline  = starts[0] + HEDGE_TIMEOUT_MS;
+  
+  if( !startAttempt(&cons[0], url, bc, port, 0, &auths[0]) ){
+    secMemClear((volatile uint8_t *)auths, sizeof(auths));
+    return -1;
+  }
+  
+  __atomic_fetch_add(&sStats.connects, 1, __ATOMIC_RELAXED);
+  
+  while( winner == -1 ){
+    /* Every attempt failed */ 
+    if( attempts == 2 && cons[0].status == SOCKS_FAILED && cons[1].status == SOCKS_FAILED ){
+      break;
+    }
+    
+    /* The first attempt failed before a hedge was due */ 
+    if( attempts == 1 && cons[0].status == SOCKS_FAILED ){
+      break;
+    }
+    
+    now = clockMs();
+    
+    if( now >= deadline ){
+      logWrn("A hedged connect timed out");
+      break;
+    }
+    
+    /* Hedge the first attempt once it took too long */ 
+    if( attempts == 1 && now >= hedgeAt ){
+      starts[1] = now;
+      if( startAttempt(&cons[1], url, bc, port, 1, &auths[1]) ){
+        __atomic_fetch_add(&sStats.hedged, 1, __ATOMIC_RELAXED);
+      }
+      attempts = 2;
+    }
+    
+    for( i = 0 ; i < 2 ; i++ ){
+      fds[i].fd      = -1;
+      fds[i].events  = 0;
+      fds[i].revents = 0;
+      
+      if( i < attempts && torUrlConEvents(&cons[i]) ){
+        fds[i].fd     = cons[i].socket;
+        fds[i].events = torUrlConEvents(&cons[i]);
+      }
+    }
+    
+    timeout = (int)(deadline - now);
+    if( attempts == 1 && hedgeAt < deadline ) timeout = (int)(hedgeAt - now);
+    
+    if( poll(fds, 2, timeout) == -1 ){
+      if( errno == EINTR ) continue;
+      logErr("Failed to poll the attempts of a hedged connect");
+      break;
+    }
+    
+    for( i = 0 ; i < attempts && winner == -1 ; i++ ){
+      if( fds[i].revents == 0 ) continue;
+      
+      if( torUrlConStep(&cons[i]) == SOCKS_DONE ){
+        winner = i;
+      }
+    }
+  }
+  
+  now = clockMs();
+  
+  if( winner != -1 ){
+    recordLatency(url, bc, port, now - starts[winner]);
+  }
+  
+  /* The attempts given up on while pending took at least as long as so far */ 
+  for( i = 0 ; i < attempts ; i++ ){
+    if( i != winner && cons[i].status == SOCKS_PENDING && (i == 0 || winner == -1) ){
+      recordLatency(url, bc, port, now - starts[i]);
+    }
+  }
+  
+  /* Close every attempt but the winner, the loser included */ 
+  for( i = 0 ; i < attempts ; i++ ){
+    if( i != winner && cons[i].socket != -1 ){
+      close(cons[i].socket);
+    }
+  }
+  
+  if( winner != -1 && auth != NULL ){
+    memcpy(auth, &auths[winner], sizeof(struct socksAuth));
+  }
+  
+  secMemClear((volatile uint8_t *)auths, sizeof(auths));
+  
+  if( winner == -1 ){
+    logErr("Failed to make hedged connection over Tor");
+    return -1;
+  }
+  
+  if( winner == 1 ){
+    __atomic_fetch_add(&sStats.hedgeWins, 1, __ATOMIC_RELAXED);
+  }
+  
+  return cons[winner].socket;
+}
+
+/* hedgeDelayMs returns the milliseconds a connect to url:PORT, url being bc
+ * bytes long, is given before it is hedged
+ */
+uint32_t hedgeDelayMs(char *url, uint8_t bc, uint16_t port)
+{
+  struct hedgeDest *dest;
+  uint32_t         sorted[HEDGE_SAMPLES];
+  uint32_t         delay = HEDGE_DELAY_MS;
+  int              count = 0;
+  int              idx;
+  
+  pthread_mutex_lock(&sLock);
+  
+  dest = findDest(url, bc, port, 0);
+  if( dest != NULL && dest->sampleCount >= HEDGE_MIN_SAMPLES ){
+    count = dest->sampleCount;
+    memcpy(sorted, dest->samples, count * sizeof(uint32_t));
+  }
+  
+  pthread_mutex_unlock(&sLock);
+  
+  if( count > 0 ){
+    qsort(sorted, count, sizeof(uint32_t), &cmpLatency);
+    
+    idx = (count * HEDGE_PERCENTILE) / 100;
+    if( idx >= count ) idx = count - 1;
+    delay = sorted[idx];
+  }
+  
+  return delay < HEDGE_MIN_DELAY_MS ? HEDGE_MIN_DELAY_MS : delay;
+}
+
+/* getHedgeStats copies the counters of the hedged connects into stats */
+void getHedgeStats(struct hedgeStats *stats)
+{
+  stats->connects  = __atomic_load_n(&sStats.connects, __ATOMIC_RELAXED);
+  stats->hedged    = __atomic_load_n(&sStats.hedged, __ATOMIC_RELAXED);
+  stats->hedgeWins = __atomic_load_n(&sStats.hedgeWins, __ATOMIC_RELAXED);
+}
+
+
+/* startAttempt gets a connection to the Tor SocksPort and starts connecting
+ * to url:PORT over it in con, with random credentials when hedge is 1 such 
+ * that Tor uses a circuit other than that of the first attempt, and with those
+ * of the isolation policy when hedge is 0. The credentials are stored in auth.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int startAttempt(struct socksCon *con, char *url, uint8_t bc,
+                        uint16_t port, int hedge, struct socksAuth *auth)
+{
+  int torSocket;
+  int started;
+  
+  con->socket = -1;
+  con->status = SOCKS_FAILED;
+  
+  if( hedge ){
+    /* Tor compares credentials as bytes, hex keeps them printable in logs */
+    if( !randomizeHex(auth->user, HEDGE_NONCE_BC) ){
+      logErr("Failed to get random credentials for a hedged connect");
+      return 0;
+    }
+    auth->userBc  = 2 * HEDGE_NONCE_BC;
+    auth->passBc  = 1;
+    auth->pass[0] = 'h';
+  }
+  else if( !isolationAuth(url, bc, port, auth) ){
+    logErr("Failed to get the isolation credentials of a hedged connect");
+    return 0;
+  }
+  
+  torSocket = getTorCon();
+  if( torSocket == -1 ){
+    logErr("Failed to get a connection to the Tor SocksPort");
+    return 0;
+  }
+  
+  started = torUrlConStart(con, torSocket, url, bc, port, auth->userBc ? auth : NULL, NULL);
+  
+  if( !started ){
+    close(torSocket);
+    return 0;
+  }
+  
+  return 1;
+}
+
+/* recordLatency records that connecting to url:port, url being bc bytes long,
+ * took ms milliseconds
+ */
+static void recordLatency(char *url, uint8_t bc, uint16_t port, uint32_t ms)
+{
+  struct hedgeDest *dest;
+  
+  pthread_mutex_lock(&sLock);
+  
+  dest = findDest(url, bc, port, 1);
+  
+  dest->samples[dest->nextSample] = ms;
+  dest->nextSample = (dest->nextSample + 1) % HEDGE_SAMPLES;
+  if( dest->sampleCount < HEDGE_SAMPLES ) dest->sampleCount++;
+  dest->usedMs = clockMs();
+  
+  pthread_mutex_unlock(&sLock);
+}
+
+/* findDest returns the latencies of url:port, url being bc bytes long, adding
+ * them when add is 1 and they aren't there yet, in place of those of the least
+ * recently connected to destination if needed.
+ *
+ * Returns a pointer to the latencies, or NULL if there are none and add is 0.
+ */
+static struct hedgeDest *findDest(char *url, uint8_t bc, uint16_t port, int add)
+{
+  struct hedgeDest *oldest = &sDests[0];
+  int              i;
+  
+  for( i = 0 ; i < HEDGE_DESTS ; i++ ){
+    if( sDests[i].bc == bc && sDests[i].port == port && !strncasecmp(sDests[i].url, url, bc) ){
+      return &sDests[i];
+    }
+    
+    if( sDests[i].usedMs < oldest->usedMs ) oldest = &sDests[i];
+  }
+  
+  if( !add ) return NULL;
+  
+  /* Unused entries have a usedMs of 0, so they are taken first */ 
+  secMemClear((volatile uint8_t *)oldest, sizeof(struct hedgeDest));
+  oldest->bc   = bc;
+  oldest->port = port;
+  memcpy(oldest->url, url, bc);
+  
+  return oldest;
+}
+
+/* cmpLatency compares two latencies for qsort */
+static int cmpLatency(const void *x, const void *y)
+{
+  uint32_t a = *(const uint32_t *)x;
+  uint32_t b = *(const uint32_t *)y;
+  
+  return (a > b) - (a < b);
+}
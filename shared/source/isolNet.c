@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stddef.h>
 
 #include <seccomp.h>
 #include <sys/mman.h>
@@ -12,21 +13,57 @@
 #include <sys/un.h>
 #include <poll.h>
 #include <errno.h> 
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <linux/io_uring.h>
 
 #include "isolNet.h"
 #include "security.h"
 #include "logger.h"
 #include "settings.h"
 #include "net.h"
+#include "redirector.h"
 
-enum{ SA_DATA_BC = 14, NS = 0, TOR = 1};
+enum{ UNIX_PREFIX_BC = 5, SUN_PATH_BC = 108 };
+enum{ UPSTREAMS_BC = REDIR_MAX_UPSTREAMS * (UNIX_PREFIX_BC + SUN_PATH_BC) };
+
+/* redirReload is a reload of the redirector requested by reloadRedirector, 
+ * pending until the supervisor took the redirConf of the new generation, with
+ * its Tor SocksPorts copied into torUpstreams.
+ */
+struct redirReload{
+  uint32_t         pending;
+  struct redirConf conf;
+  char             torUpstreams[UPSTREAMS_BC];
+};
 
 
 static int initRedirector();
 
 
 /* Used to signal that the network redirector is initialized */ 
-static int stoplight[2];  
+static int stoplight[2] = { -1, -1 };  
+
+/* The redirector settings, initialized from the defaults in settings.h */
+static struct redirConf gRedirConf = { REDIR_MODE, REDIR_SPLICE, REDIR_POOL_SIZE,
+                                       REDIR_PASS_FD, REDIR_THREADS, 
+                                       REDIR_PIN_THREADS, REDIR_IDLE_TIMEOUT,
+                                       REDIR_HANDSHAKE_TIMEOUT, 
+                                       REDIR_LIFE_TIMEOUT, REDIR_BALANCE,
+                                       REDIR_BACKLOG, REDIR_MAX_STREAMS,
+                                       REDIR_QOS_RATE, REDIR_QOS_CONN_RATE,
+                                       REDIR_SHARED, REDIR_CAPTURE, 
+                                       TOR_UPSTREAMS };
+
+/* The redirector counters, shared between the redirector and this process */
+static struct redirStats *gRedirStats;
+
+/* The reloads requested of the redirector, shared with its supervisor, which
+ * is woken up by a byte written into the pipe
+ */
+static struct redirReload *gRedirReload;
+static int                gReloadPipe[2] = { -1, -1 };
 
 
 /******************************PARENT PROCESS**********************************/
@@ -35,6 +72,11 @@ static int stoplight[2];
  * which uses a listening Unix Domain Socket to get connections from the child
  * network namespace, which it then redirects to the Tor SocksPort. 
  *
+ * The cloned process is the supervisor of the redirector, which listens on
+ * the Unix Domain Socket and then forks off the generations of the redirector
+ * that accept and redirect the connections, the first right away and each of
+ * the others when a reload is requested. See the redirector process below.
+ *
  * The parent process blocks waiting for the redirector to be initialized, after
  * which it initializes the network namespace for its own process (not the 
  * redirector process, which cannot be contained to a network namespace due to
@@ -55,9 +97,10 @@ int isolNet(int redirect)
   }
   
   /* If we are simply to initialize the network namespace without a redirector 
-   * then do so, otherwise we continue on for the redirection logic
+   * then do so, as we do when a shared redirector serves the sandbox, 
+   * otherwise we continue on for the redirection logic
    */ 
-  if( redirect == SIMPLE ){
+  if( redirect == SIMPLE || gRedirConf.shared ){
     if( unshare(CLONE_NEWNET) ){
       logErr("unshare clone_newnet failed");
       return 0;
@@ -65,6 +108,19 @@ int isolNet(int redirect)
     return 1;
   }
   
+  /* Allocate the counters before cloning such that they are shared with it */
+  if( !initRedirStats() ){
+    logErr("Failed to allocate the counters of the redirector");
+    return 0; 
+  }
+  
+  /* As are the reloads, which the supervisor is woken up for over the pipe */ 
+  gRedirReload = allocSharedPane(sizeof(struct redirReload));
+  if( gRedirReload == NULL || pipe(gReloadPipe) ){
+    logErr("Failed to initialize the reloads of the redirector");
+    return 0; 
+  }
+  
   /* Initialize the pipe the redirector process uses to signal initialization */ 
   if( pipe(stoplight) ){
     logErr("Failed to initialize the pipe for signaling redirector inited");
@@ -77,8 +133,8 @@ int isolNet(int redirect)
     return 0; 
   } 
   
-  /* Close the write pipe of this process */
-  if( close(stoplight[1]) ){
+  /* Close the write pipe of this process, and the read end of the reloads */
+  if( close(stoplight[1]) || close(gReloadPipe[0]) ){
     logErr("Failed to close the parents write pipe");
     return 0; 
   }
@@ -100,14 +156,157 @@ int isolNet(int redirect)
   return 1; 
 }
 
+/* reloadRedirector copies the current redirConf for the supervisor of the 
+ * redirector to start its next generation with, with upstreams as its Tor
+ * SocksPorts unless it is NULL, then wakes it up.
+ *
+ * Returns 1 on success, 0 on error or while a reload is pending.
+ */ 
+int reloadRedirector(const char *upstreams)
+{
+  uint32_t idle = 0;
+  
+  if( gRedirReload == NULL ){
+    logErr("There is no redirector to reload");
+    return 0; 
+  }
+  
+  if( !__atomic_compare_exchange_n( &gRedirReload->pending, &idle, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ){
+    logWrn("A reload of the redirector is already pending");
+    return 0; 
+  }
+  
+  if( upstreams == NULL ) upstreams = gRedirConf.torUpstreams;
+  
+  gRedirReload->conf = gRedirConf;
+  if( strlen(upstreams) >= UPSTREAMS_BC
+      || !secStrCpy(gRedirReload->torUpstreams, (char *)upstreams, UPSTREAMS_BC) ){
+    logErr("The Tor SocksPorts of the reloaded redirector are too long");
+    __atomic_store_n(&gRedirReload->pending, 0, __ATOMIC_RELEASE);
+    return 0; 
+  }
+  
+  if( write(gReloadPipe[1], "r", 1) != 1 ){
+    logErr("Failed to wake up the supervisor of the redirector");
+    __atomic_store_n(&gRedirReload->pending, 0, __ATOMIC_RELEASE);
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+/* getTorCon connects to the redirector over its Unix Domain Socket, which when
+ * the redirector passes connected Tor sockets is only used for receiving one. 
+ *
+ * Returns a socket connected to the Tor SocksPort on success, -1 on error.
+ */ 
+int getTorCon(void)
+{
+  return receiveTorCon(requestTorCon()); 
+}
+
+/* requestTorCon connects to the redirector over its Unix Domain Socket, which
+ * has the redirector begin connecting to the Tor SocksPort, without waiting on
+ * that, such that several connections can be requested before any of them is
+ * received with receiveTorCon.
+ *
+ * Returns the socket connected to the redirector on success, -1 on error.
+ */ 
+int requestTorCon(void)
+{
+  int unixSock;
+  
+  unixSock = udsConnect("/tor_unix_socket", strlen("/tor_unix_socket"));
+  if( unixSock == -1 ){
+    logErr("Failed to connect to the redirector");
+    return -1; 
+  }
+  
+  return unixSock; 
+}
+
+/* receiveTorCon receives the connection to the Tor SocksPort that unixSock, 
+ * returned by requestTorCon, was requested with, waiting on the redirector to
+ * pass it when it passes connected Tor sockets.
+ *
+ * Returns a socket connected to the Tor SocksPort on success, -1 on error.
+ */ 
+int receiveTorCon(int unixSock)
+{
+  int torSock;
+  
+  if( unixSock == -1 ){
+    return -1; 
+  }
+  
+  /* The redirector relays everything sent over the Unix Domain Socket, as a
+   * shared redirector always does
+   */ 
+  if( !gRedirConf.passFd || gRedirConf.shared ){
+    return unixSock; 
+  }
+  
+  /* The redirector passes a socket it connected to the Tor SocksPort */ 
+  torSock = recvFd(unixSock);
+  close(unixSock); 
+  if( torSock == -1 ){
+    logErr("Failed to receive a Tor SocksPort connection from the redirector");
+    return -1; 
+  }
+  
+  return torSock; 
+}
+
+/* getRedirConf returns a pointer to the redirector settings, which are read by
+ * the redirector process when isolNet(REDIRECT) clones it, such that changes 
+ * must be made prior to that.
+ */ 
+struct redirConf *getRedirConf(void)
+{
+  return &gRedirConf;
+}
+
+/* getRedirStats returns a pointer to the redirector counters */ 
+struct redirStats *getRedirStats(void)
+{
+  return gRedirStats;
+}
+
+/* initRedirStats allocates the redirector counters, and the ring of its flow
+ * records, in memory that stays shared with the redirector process once it is
+ * cloned.
+ *
+ * Returns 1 on success, 0 on error.
+ */ 
+int initRedirStats(void)
+{
+  gRedirStats = allocSharedPane(sizeof(struct redirStats));
+  if( gRedirStats == NULL ){
+    logErr("Failed to allocate shared memory for the redirector counters");
+    return 0; 
+  }
+  
+  if( !initFlowRing() ){
+    logErr("Failed to initialize the flow records of the redirector");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
 
 /******************************REDIRECTOR PROCESS******************************/
 
 /* The redirector process listens on a Unix Domain Socket for connections from 
  * the client namespace, after which it forwards them to the Tor SocksPort. 
- * Every new incoming connection from the client namespace results in a forked
- * process for managing the redirection of that connection, this is in essence 
- * the same behavior as would be expected from using forking socat redirection.
+ * In the REDIR_FORK mode every new incoming connection from the client 
+ * namespace results in a forked process for managing the redirection of that
+ * connection, this is in essence the same behavior as would be expected from 
+ * using forking socat redirection. In the REDIR_EPOLL mode a single process 
+ * multiplexes all of the connections instead, see redirEpoll.c, and in the
+ * REDIR_URING mode a single process batches them through an io_uring, see
+ * redirUring.c.
  */ 
 
 
@@ -115,10 +314,20 @@ int isolNet(int redirect)
 
 /* These functions are only used by the redirector logic */ 
 
-static void redirect(int unixListen);
-static int  getTorSock(void);
-static int  initgTors(void);
-static int  seccompWl(void);
+union torAddr;
+
+static void  superviseRedirector(int unixListen, int drain);
+static pid_t startGeneration(int unixListen, int current, int *drain);
+static void  runGeneration(int unixListen);
+static void  redirect(int unixListen);
+static void  drainForks(int unixListen);
+static int   finishTorSock(int torSock, int upstream);
+static int   initgTors(void);
+static int   initgTor(const char *upstream, union torAddr *torAddr, socklen_t *torLen);
+static int   selectUpstreams(const char *upstreams, int *selected, int *count);
+static int   reloadAllowed(struct redirConf *conf);
+static void  releaseStream(void);
+static int   seccompWl(int supervisor);
 
 
 
@@ -126,23 +335,61 @@ static int  seccompWl(void);
 
 /* These globals are only used by the redirector logic. 
  * 
- * gTorAddr and gTorLen will be used for all connect() syscalls for connecting 
- * to the Tor SocksPort. Only these will be able to be used with connect(), this
- * is enforced by SECCOMP. The memory pointed to by *gTorAddr will itself be 
- * mprotected to read only, such that attempts to overwrite it segfault.
+ * gTorAddrs and gTorLens will be used for all connect() syscalls for connecting
+ * to the Tor SocksPorts, gTorAddrs holding the gTorCount of them that the 
+ * supervisor was started with, named by gTorNames. Only these will be able to
+ * be used with connect(), this is enforced by SECCOMP. The memory pointed to 
+ * by gTorAddrs will itself be mprotected to read only, such that attempts to 
+ * overwrite it segfault. They are initialized by the supervisor before the 
+ * App runs, in memory of its own, and every generation inherits them.
+ *
+ * gUpstreams holds the gUpstreamCount upstreams of a generation, each being 
+ * the index of its SocksPort in gTorAddrs, such that a reload can pick which
+ * of the SocksPorts to connect to but cannot add any.
  */  
 
-static struct sockaddr  *gTorAddr;   
-static socklen_t        gTorLen;  
+/* torAddr is the address of a Tor SocksPort, on IPv4 or a Unix Domain Socket */
+union torAddr{
+  struct sockaddr    sa;
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+};
+
+static union torAddr    *gTorAddrs;   
+static socklen_t        gTorLens[REDIR_MAX_UPSTREAMS];  
+static char             gTorNames[REDIR_MAX_UPSTREAMS][UNIX_PREFIX_BC + SUN_PATH_BC];
+static int              gTorCount;
+static int              gUpstreams[REDIR_MAX_UPSTREAMS];
+static int              gUpstreamCount;
+
+/* The upstream of the connection of a forked relay process, which is counted
+ * closed when the process exits, along with its stream
+ */ 
+static int              gChildUpstream = -1;
+
+/* The flow of the stream of a forked relay process, which is recorded when the
+ * process exits, with the directions it relays once it has them, and the 
+ * timeout it expired for if it did
+ */ 
+static struct flowTrack gChildFlow;
+static struct relayDir  *gChildDirs;
+static int              gChildExpiry = -1;
+
+/* The read end of the drain pipe of this generation of the redirector, which 
+ * becomes readable once it is to drain, or -1 for the shared redirector
+ */ 
+static int              gDrainFd = -1;
 
 
 /*************************REDIRECTOR SPECIFIC FUNCTIONS************************/
 
-/* initRedirector initializes the redirector process that listens on a Unix 
- * Domain Socket for connections from the child network namespace, and then 
- * transparently forwards them to the Tor SocksPort. Because it is started 
- * with a call to clone, the return value is never reachable, however it 
- * returns 0 on error, and should never return on success. 
+/* initRedirector initializes the supervisor of the redirector, which listens
+ * on a Unix Domain Socket for connections from the child network namespace
+ * and starts the first generation of the redirector, which transparently 
+ * forwards them to the Tor SocksPort, then supervises the redirector. Because
+ * it is started with a call to clone, the return value is never reachable, 
+ * however it returns 0 on error, and only returns once the process that 
+ * started it can no longer request reloads. 
  *
  * Note: This function doesn't return void only because clone wants a function 
  * pointer with this prototype. 
@@ -152,30 +399,315 @@ static int initRedirector()
   /* The Unix Domain Socket for listening */ 
   int unixListen;
   
-  /* Initialize the static globals utilized for connect() to the SocksPort */ 
-  if( !initgTors() ){
+  /* The write end of the drain pipe of the current generation */ 
+  int drain; 
+  
+  close(gReloadPipe[1]); 
+  
+  /* Initialize the static globals utilized for connect() to the SocksPorts,
+   * which are the only ones any generation may ever connect to 
+   */ 
+  if( !initgTors() || !selectUpstreams(gRedirConf.torUpstreams, gUpstreams, &gUpstreamCount) ){
     logErr("Failed to initialize the static globals for getting connection to Tor");
     return 0;
   }
   
+  /* Begin listening on the Unix Domain Socket for connections from child NS,
+   * which every generation inherits 
+   */ 
+  unixListen = udsListen( "/tor_unix_socket", strlen("/tor_unix_socket"), 
+                          gRedirConf.backlog );
+  if( unixListen == -1 ){
+    logErr("Failed to bind unix domain socket for redirector");
+    return 0;
+  }
+  
+  /* The supervisor gets a SECCOMP whitelist of its own, which each generation
+   * inherits on top of its own, see seccompWl 
+   */ 
+  if( !seccompWl(1) ){
+    logErr("Failed to SECCOMP the supervisor of the redirector");
+    return 0; 
+  }
+  
+  if( startGeneration(unixListen, -1, &drain) == -1 ){
+    logErr("Failed to start the redirector");
+    return 0; 
+  }
+  
+  /* Signal to the parent process that the redirector accepts connections */ 
+  signalRedirInited(); 
+  
+  superviseRedirector(unixListen, drain);
+  
+  return 0; 
+}
+
+/* superviseRedirector starts a new generation of the redirector each time a
+ * reload is requested, with drain being the write end of the drain pipe of the
+ * current generation. Once the new generation is initialized the drain pipe of
+ * the current one is closed, which has it stop accepting and exit once its 
+ * connections are closed, such that no connection is dropped for the reload.
+ * A generation that fails to initialize leaves the current one serving.
+ *
+ * The reloads are requested by the App, which can write the memory they are
+ * passed in, as such the supervisor copies each into memory of its own before
+ * checking it, and refuses any that isn't within bounds or that lists a Tor 
+ * SocksPort it wasn't started with, see reloadAllowed. The supervisor is 
+ * SECCOMP'd with a whitelist that allows what its generations need, and as 
+ * the filters of a process and those it inherited must all allow a syscall, 
+ * each generation is held to the strictest of the two.
+ *
+ * This returns once the pipe of the reloads is closed, which the generations
+ * outlive.
+ */ 
+static void superviseRedirector(int unixListen, int drain)
+{
+  struct redirConf conf; 
+  char             upstreams[UPSTREAMS_BC];
+  int              selected[REDIR_MAX_UPSTREAMS];
+  int              count; 
+  char             wake; 
+  int              nextDrain; 
+  
+  while( read(gReloadPipe[0], &wake, 1) == 1 ){
+    /* Reap the generations that drained since */ 
+    while( waitpid(-1, NULL, WNOHANG) > 0 ); 
+    
+    /* Nothing is checked in the shared memory, which the App may still write */ 
+    memcpy(&conf, &gRedirReload->conf, sizeof(conf)); 
+    memcpy(upstreams, gRedirReload->torUpstreams, UPSTREAMS_BC);
+    upstreams[UPSTREAMS_BC - 1] = '\0'; 
+    conf.torUpstreams = upstreams; 
+    __atomic_store_n(&gRedirReload->pending, 0, __ATOMIC_RELEASE); 
+    
+    if( !reloadAllowed(&conf) || !selectUpstreams(upstreams, selected, &count) ){
+      logWrn("A reload of the redirector was refused, keeping the current generation");
+      continue; 
+    }
+    
+    gRedirConf     = conf; 
+    gUpstreamCount = count; 
+    memcpy(gUpstreams, selected, sizeof(selected)); 
+    
+    if( startGeneration(unixListen, drain, &nextDrain) == -1 ){
+      logWrn("A new generation of the redirector failed, keeping the current one");
+      continue; 
+    }
+    
+    statAdd(draining, 1); 
+    close(drain); 
+    drain = nextDrain; 
+    
+    logMsg("The redirector was reloaded, the previous generation is draining");
+  }
+}
+
+/* startGeneration forks off a new generation of the redirector, which accepts
+ * connections on unixListen, and waits for it to be initialized. The write
+ * end of its drain pipe is stored in *drain, which is closed to drain it, and
+ * current is that of the current generation (or -1), which the new one must 
+ * not hold on to as it would keep the current one from ever draining. The 
+ * capture file is opened here the first time a generation is to capture, 
+ * such that the generations after it keep appending to it.
+ *
+ * Returns the pid of the generation on success, -1 on error. 
+ */ 
+static pid_t startGeneration(int unixListen, int current, int *drain)
+{
+  int     drainPipe[2]; 
+  int     readyPipe[2]; 
+  char    ready; 
+  ssize_t got; 
+  pid_t   pid; 
+  
+  if( !initCapture() ){
+    logErr("Failed to open the capture file of a redirector generation");
+    return -1; 
+  }
+  
+  if( pipe(drainPipe) ){
+    logErr("Failed to get the drain pipe of a redirector generation");
+    return -1; 
+  }
+  
+  if( pipe(readyPipe) ){
+    logErr("Failed to get the pipe for signaling redirector inited");
+    close(drainPipe[0]); 
+    close(drainPipe[1]); 
+    return -1; 
+  }
+  
+  pid = fork(); 
+  
+  /* The generation signals its initialization over the ready pipe */ 
+  if( pid == 0 ){
+    close(drainPipe[1]); 
+    close(readyPipe[0]); 
+    close(gReloadPipe[0]); 
+    close(current); 
+    close(stoplight[0]); 
+    close(stoplight[1]); 
+    
+    gDrainFd     = drainPipe[0]; 
+    stoplight[0] = -1; 
+    stoplight[1] = readyPipe[1]; 
+    
+    runGeneration(unixListen); 
+    exit(-1); 
+  }
+  
+  close(drainPipe[0]); 
+  close(readyPipe[1]); 
+  
+  /* A generation that exits rather than signal closes the pipe unsignaled */ 
+  got = pid == -1 ? -1 : read(readyPipe[0], &ready, 1); 
+  close(readyPipe[0]); 
+  if( got != 1 ){
+    close(drainPipe[1]); 
+    return -1; 
+  }
+  
+  statAdd(generation, 1); 
+  *drain = drainPipe[1]; 
+  
+  return pid; 
+}
+
+/* runGeneration initializes a generation of the redirector, which accepts
+ * connections on the already listening unixListen, and then runs the 
+ * configured engine, with a SECCOMP whitelist of its own. It only returns on
+ * error.
+ */ 
+static void runGeneration(int unixListen)
+{
+  getRedirStats()->upstreams = gUpstreamCount;
+  
+  /* Carve out the relay buffers, which are locked into memory with mlock */ 
+  if( !initRelayPool() ){
+    logErr("Failed to initialize the relay buffer pool of the redirector");
+    return;
+  }
+  
+  /* The QoS buckets of the sandbox are shared with the forked relay processes */ 
+  if( !initRelayQos() ){
+    logErr("Failed to initialize the QoS buckets of the redirector");
+    return;
+  }
+  
   /* Initialize the SECCOMP syscall whitelist for the redirector process */ 
-  if( !seccompWl() ){
+  if( !seccompWl(0) ){
     logErr("Failed to SECCOMP the network redirector");
+    return; 
+  }
+  
+  /* Begin the actual redirector logic with the configured engine, neither of
+   * these should ever return 
+   */  
+  switch( gRedirConf.mode ){
+    case REDIR_URING:{
+      if( redirectUring(unixListen) ) break;
+      
+      /* The io_uring could not be set up, fall back to the epoll engine */ 
+      logWrn("Redirector falling back from io_uring to epoll");
+      redirectEpoll(&unixListen, 1);
+      break;
+    }
+    
+    case REDIR_EPOLL:{
+      redirectEpoll(&unixListen, 1);
+      break;
+    }
+    
+    default:{
+      redirect(unixListen);
+      break;
+    }
+  }
+}
+
+/* redirTenants runs the redirector shared by the count sandbox directories of
+ * sandboxDirs in the calling process, which is initialized as that cloned by
+ * isolNet(REDIRECT) is, and then listens on the Unix Domain Socket 
+ * tor_unix_socket in each of the directories, which the sandbox sees as its
+ * /tor_unix_socket. The shared redirector always runs the REDIR_EPOLL engine,
+ * as it answers the SOCKS handshakes, and never passes the Tor sockets.
+ *
+ * This function never returns on success, it returns 0 on error.
+ */ 
+int redirTenants(char **sandboxDirs, int count)
+{
+  int  listens[REDIR_MAX_TENANTS];
+  char path[SUN_PATH_BC];
+  int  bc;
+  int  i;
+  
+  if( sandboxDirs == NULL || count < 1 || count > REDIR_MAX_TENANTS ){
+    logErr("The sandboxes of the shared redirector were invalid");
     return 0; 
   }
   
+  gRedirConf.mode   = REDIR_EPOLL;
+  gRedirConf.passFd = 0;
   
-  /* Begin listening on the Unix Domain Socket for connections from child NS */ 
-  unixListen = udsListen("/tor_unix_socket", strlen("/tor_unix_socket"));
-  if( unixListen == -1 ){
-    logErr("Failed to bind unix domain socket for redirector");
+  /* The counters are shared with nobody, but kept where they always are */ 
+  if( !initRedirStats() ){
+    logErr("Failed to allocate the counters of the redirector");
+    return 0; 
+  }
+  
+  gRedirStats->tenants = count;
+  
+  /* Each of the tenants gets the token its streams are isolated with */ 
+  if( !initTenants(count) ){
+    logErr("Failed to initialize the tenants of the shared redirector");
+    return 0; 
+  }
+  
+  if( !initgTors() || !selectUpstreams(gRedirConf.torUpstreams, gUpstreams, &gUpstreamCount) ){
+    logErr("Failed to initialize the static globals for getting connection to Tor");
     return 0;
   }
   
-  /* Begin the actual redirector logic, this should never return */  
-  redirect(unixListen); 
+  getRedirStats()->upstreams = gUpstreamCount;
+  
+  if( !initRelayPool() ){
+    logErr("Failed to initialize the relay buffer pool of the redirector");
+    return 0;
+  }
+  
+  if( !initRelayQos() ){
+    logErr("Failed to initialize the QoS buckets of the redirector");
+    return 0;
+  }
+  
+  if( !initCapture() ){
+    logErr("Failed to open the capture file of the redirector");
+    return 0;
+  }
+  
+  if( !seccompWl(0) ){
+    logErr("Failed to SECCOMP the network redirector");
+    return 0; 
+  }
+  
+  /* Begin listening in each of the sandbox directories */ 
+  for( i = 0 ; i < count ; i++ ){
+    bc = snprintf(path, sizeof(path), "%s/tor_unix_socket", sandboxDirs[i]);
+    if( bc < 0 || bc >= (int)sizeof(path) ){
+      logErr("The path of a sandbox of the shared redirector is too long");
+      return 0; 
+    }
+    
+    listens[i] = udsListen(path, bc, gRedirConf.backlog);
+    if( listens[i] == -1 ){
+      logErr("Failed to bind unix domain socket for redirector");
+      return 0;
+    }
+  }
+  
+  redirectEpoll(listens, count);
   
-  /* If we made it here something went wrong, redirect should never return */ 
   return 0; 
 }
 
@@ -185,8 +717,24 @@ static int initRedirector()
  * are transparently redirected to the Tor SocksPort, then will continue waiting
  * for more new connections from the child namespace ad infinitum.
  *
+ * The connection to the Tor SocksPort is begun ahead of the accept with a
+ * non-blocking connect, which the forked process waits on to finish, such that
+ * a slow SocksPort holds up that connection alone rather than the accepting.
+ * In the passFd mode the forked process then passes it to the client.
+ *
+ * With BALANCE_DEST_HASH the forked process connects to the Tor SocksPort
+ * once the SOCKS request arrived, which picks the upstream, rather than the
+ * connection being established ahead of the accept. A connection for which no
+ * Tor SocksPort could be connected to is closed at once, such that while the
+ * circuit breakers are open the connections are rejected without connects, as
+ * is a connection accepted while redirConf.maxStreams are already relayed.
+ *
+ * Once the generation is to drain it stops accepting and waits on its forked
+ * processes, which relay their connections to completion, see drainForks.
+ *
  * redirect has as its parameter an int which must be an already listening 
- * Unix Domain Socket. This function never returns.
+ * Unix Domain Socket. This function only returns on error, if waiting for the
+ * connections fails.
  */ 
 static void redirect(int unixListen)
 {
@@ -194,24 +742,32 @@ static void redirect(int unixListen)
   struct sockaddr_un remote;
   int                clientIncoming;
   int                ret; 
-  int                len;
   socklen_t          structLen;
   int                torSock; 
-  void               *buff;
+  int                upstream = -1; 
+  int                deferred; 
+  struct pollfd      waitOn[2] = { { unixListen, POLLIN, 0 }, { gDrainFd, POLLIN, 0 } };
   
   
   /* A pointer to this is used with the accept syscall */ 
   structLen = sizeof(struct sockaddr_un);
   
+  /* The passFd client only sends once it has its socket */ 
+  deferred = gRedirConf.balance == BALANCE_DEST_HASH && !gRedirConf.passFd;
+  
   /* Begin the infinite loop in which we wait for incoming connections from the
    * child namespace, accept them, and then fork off into a new process that 
    * redirects them to the Tor SocksPort, ad infinitum.
    */ 
   while(1){
-    /* Establish a new connection to the Tor SocksPort. */ 
-    torSock = getTorSock();
-    if(torSock == -1){
-      continue; 
+    /* Begin establishing a new connection to the Tor SocksPort, which when it
+     * fails is tried again once a connection was accepted rather than right 
+     * away, as that would spin for as long as the SocksPort is down 
+     */ 
+    torSock = -1; 
+    if( !deferred ){
+      upstream = pickUpstream(NULL, 0);
+      if( upstream != -1 ) torSock = startTorSock(upstream);
     }
     
     /* If we have not already done so, signal to the parent process that we are
@@ -219,165 +775,578 @@ static void redirect(int unixListen)
      * network namespace. 
      */ 
     if(!initialized){
-      close(stoplight[0]); 
-      close(stoplight[1]);  //TODO make this a do while loop and put outside at top so not checking like this
+      signalRedirInited(); 
       initialized = 1; 
     }
     
     /* Block waiting for connections from the child network namespace, then 
-     * accept them when they come in. 
+     * accept them when they come in, unless the generation is to drain. The
+     * listening socket is shared with the other generations, such that one of
+     * them may have accepted the connection first. 
      */  
-    clientIncoming = accept(unixListen, &remote, &structLen);
+    waitOn[0].revents = 0; 
+    waitOn[1].revents = 0; 
+    if( poll(waitOn, 2, -1) == -1 ){
+      if( torSock != -1 ) closeTorSock(torSock, upstream); 
+      if( errno == EINTR ) continue; 
+      logErr("Redirector failed to wait for connections");
+      return; 
+    }
+    
+    if( waitOn[1].revents ){
+      if( torSock != -1 ) closeTorSock(torSock, upstream); 
+      drainForks(unixListen); 
+    }
+    
+    /* A listening socket that had an error would be reported over and over */ 
+    if( (waitOn[0].revents & (POLLERR | POLLHUP | POLLNVAL)) 
+        && !(waitOn[0].revents & POLLIN) ){
+      logErr("The listening socket of the redirector had an error");
+      if( torSock != -1 ) closeTorSock(torSock, upstream); 
+      return; 
+    }
+    
+    clientIncoming = -1; 
+    if( waitOn[0].revents & POLLIN ){
+      clientIncoming = accept(unixListen, &remote, &structLen);
+    }
+    
     if( clientIncoming == -1 ){
-      close(torSock); 
+      if( torSock != -1 ) closeTorSock(torSock, upstream); 
+      continue; 
+    }
+    
+    /* Admit no more than the cap on streams, the Tor connection is kept for 
+     * the next connection 
+     */ 
+    if( gRedirConf.maxStreams 
+        && getRedirStats()->streams >= (uint64_t)gRedirConf.maxStreams ){
+      statAdd(refused, 1);
+      close(clientIncoming);
+      if( torSock != -1 ) closeTorSock(torSock, upstream); 
       continue; 
     }
     
+    if( !deferred && torSock == -1 ){
+      upstream = pickUpstream(NULL, 0);
+      if( upstream != -1 ) torSock = startTorSock(upstream);
+      if( torSock == -1 ){
+        statAdd(rejected, 1);
+        close(clientIncoming);
+        continue; 
+      }
+    }
+    
     /* Now that we've an established connection from the child network namespace,
-     * fork off into a new process for handling it
+     * fork off into a new process for handling it, which is counted as a stream
+     * until it exits, unless it only passes the Tor connection to the client
      */ 
+    if( !gRedirConf.passFd ) statAdd(streams, 1);
     ret = fork();
     
     /* If we failed to fork off a new process, close the sockets and continue */
     if( ret == -1 ){
-      close(torSock);
+      if( !gRedirConf.passFd ) statSub(streams, 1);
+      if( torSock != -1 ) closeTorSock(torSock, upstream);
+      close(clientIncoming);
+      continue;
+    }
+    
+    /* If this is the parent fork, continue blocking waiting for new connections.
+     * The sockets are the child's now, the parent keeping them open would keep
+     * the connection from ever being seen as closed once the child exits, which
+     * is when the connection is counted closed. 
+     */
+    if( ret != 0 ){
+      if( torSock != -1 ) close(torSock);
       close(clientIncoming);
       continue;
     }
     
-    /* If this is the parent fork, continue blocking waiting for new connections */
-    if( ret != 0 ) continue;
+    /* Otherwise, this is the child fork for managing the redirection, which
+     * first waits on the connect begun ahead of the accept 
+     */
+    if( !deferred && !finishTorSock(torSock, upstream) ){
+      statAdd(rejected, 1);
+      closeTorSock(torSock, upstream);
+      if( !gRedirConf.passFd ) statSub(streams, 1);
+      exit(0); 
+    }
+    
+    /* In the passFd mode the client gets the Tor connection itself, so there
+     * is nothing left to redirect 
+     */ 
+    if( gRedirConf.passFd ){
+      passSock(clientIncoming, torSock);
+      closeTorSock(torSock, upstream);
+      exit(0); 
+    }
     
-    /* Otherwise, this is the child fork for managing the redirection. */
+    openFlow(&gChildFlow, clockMs());
+    
+    if( atexit(&releaseStream) ){
+      exit(-1); 
+    }
+    
+    /* Wait for the SOCKS request when the upstream is picked by it */ 
+    if( deferred ){
+      char          request[REDIR_PEEK_BC];
+      int           got;
+      struct pollfd first = { clientIncoming, POLLIN, 0 };
+      
+      got = poll( &first, 1, gRedirConf.handshakeTimeout 
+                             ? gRedirConf.handshakeTimeout * 1000 : -1 );
+      if( got == 0 ){
+        countExpiry(EXPIRE_HANDSHAKE); 
+        gChildExpiry = EXPIRE_HANDSHAKE; 
+        exit(0); 
+      }
+      
+      got = recv(clientIncoming, request, sizeof(request), MSG_PEEK);
+      if( got <= 0 ){
+        exit(0); 
+      }
+      
+      upstream = pickUpstream(request, got);
+      if( upstream != -1 ) torSock = getTorSock(upstream);
+      if( torSock == -1 ){
+        statAdd(rejected, 1);
+        exit(-1); 
+      }
+    }
+    
+    gChildUpstream = upstream;
     
     /* Prepare to use poll */
-    int pollRet; 
-    struct pollfd fds[2];
+    int             pollRet; 
+    int             side; 
+    int             timeout; 
+    int             reason; 
+    uint64_t        deadline; 
+    uint64_t        now       = clockMs(); 
+    uint64_t        startMs   = now; 
+    uint64_t        activeMs  = now; 
+    struct pollfd   fds[2];
+    struct relayDir dirs[2];
+    int             socks[2] = { clientIncoming, torSock };
     
-
+    /* Sends must not block this process, such that it keeps receiving from one
+     * side while the other is slow 
+     */ 
+    if( !setNonBlocking(clientIncoming) || !setNonBlocking(torSock) ){
+      exit(-1); 
+    }
     
-    /* Allocate a buffer for holding traffic to/from Tor */ 
-    buff = secAlloc(4096);
-    if( buff == NULL ){
-      logErr("Failed to allocate buffer for the redirector");
-      return;
+    /* Get a buffer (or in the splice mode a pipe) for each direction */ 
+    if( !initRelayDir(&dirs[NS], NS, gRedirConf.splice) 
+        || !initRelayDir(&dirs[TOR], TOR, gRedirConf.splice) ){
+      logErr("Failed to allocate buffers for the redirector");
+      exit(-1); 
     }
     
-    /* Continuously receive bytes from the child namespace, send to the Tor 
-     * SocksPort, receive the response from the Tor SocksPort, send to the 
-     * child namespace. When the socket is no longer in use, this will currently
-     * block indefinitely at the first recv
+    gChildDirs = dirs; 
+    
+    /* The stream is captured from here on, the SOCKS request included */ 
+    dirs[NS].capture  = openCapture(); 
+    dirs[TOR].capture = dirs[NS].capture; 
+    
+    /* Continuously relay bytes from the child namespace to the Tor SocksPort 
+     * and back, until both of the sides disconnected. A side disconnecting 
+     * only shuts the other side down for writing once everything it sent was
+     * passed on, such that a half closing client still gets its response.
      */ 
-    while(1){
-      /* Prepare poll structs */
+    while( !dirs[NS].shut || !dirs[TOR].shut ){
+      /* Prepare poll structs, a socket is waited on for being readable while
+       * its direction is below the high watermark, and for being writable while
+       * the other direction has bytes for it. A socket waited on for nothing is
+       * left out, as otherwise a hang up on it would end poll over and over.
+       */ 
+      for( side = NS ; side <= TOR ; side++ ){
+        fds[side].fd      = socks[side];
+        fds[side].events  = 0;
+        fds[side].revents = 0;
+        
+        qosResume(&dirs[side]);
+        
+        if( relayWantsIn(&dirs[side]) )   fds[side].events |= POLLIN;
+        if( relayWantsOut(&dirs[!side]) ) fds[side].events |= POLLOUT;
+        if( fds[side].events == 0 )       fds[side].fd      = -1; 
+      }
       
-      /* Detect incoming and outgoing traffic, + disconnect, on clientIncoming */
-      fds[NS].fd      = clientIncoming;
-      fds[NS].events  = POLLIN | POLLRDHUP;
-      fds[NS].revents = 0;
-    
-      /* Detect incoming and outgoing traffic, + disconnect, on torSock */
-      fds[TOR].fd      = torSock;
-      fds[TOR].events  = POLLIN | POLLRDHUP;
-      fds[TOR].revents = 0;
+      /* Block waiting for an event until the connection expires, if ever */ 
+      deadline = redirDeadline( startMs, activeMs, 
+                                flowReplied(&gChildFlow, dirs[TOR].total), 
+                                &reason );
+      timeout  = -1; 
+      if( deadline != 0 ) timeout = deadline > now ? deadline - now : 0; 
       
-      /* Block forever waiting for an event */ 
-      pollRet = poll((struct pollfd *)&fds, 2, -1);
+      /* A throttled direction is tried again once its buckets refilled some */ 
+      if( (dirs[NS].throttled || dirs[TOR].throttled) 
+          && (timeout == -1 || timeout > REDIR_QOS_TICK_MS) ){
+        timeout = REDIR_QOS_TICK_MS; 
+      }
+      
+      pollRet = poll((struct pollfd *)&fds, 2, timeout);
       if( pollRet == -1 ){
+        if( errno == EINTR ) continue; 
         logErr("Poll had an error in the redirector");
         exit(-1); 
       }
       
-      /* End this process if either of the remote sockets disconnected */
-      if( (fds[NS].revents & POLLRDHUP) || (fds[TOR].revents & POLLRDHUP) ){
-        exit(0); 
-      }
-      
-      /* If there are bytes from the child network namespace, receive and forward */
-      if( fds[NS].revents & POLLIN ){ 
-        len = recv(clientIncoming, buff, 4096, MSG_DONTWAIT);
-        if( len == -1 && errno != EAGAIN && errno != EWOULDBLOCK ){
-          logErr("Redirector failed to receive bytes from child namespace");
-          exit(-1); 
-        }
+      now = clockMs(); 
       
-        len = send(torSock, buff, len, 0);
-        if( len == -1 ){
-          logErr("Redirector failed to send bytes to the Tor SocksPort");
-          exit(-1); 
+      /* The connection went idle, stalled in its handshake, or lasted too long */ 
+      if( pollRet == 0 ){
+        if( deadline != 0 && now >= deadline ){
+          countExpiry(reason); 
+          gChildExpiry = reason; 
+          exit(0); 
         }
+        continue; 
       }
       
-      /* If there are bytes from Tor, receive and forward */ 
-      if( fds[TOR].revents & POLLIN ){ 
-        len = recv(torSock, buff, 4096, MSG_DONTWAIT);
-        if( len == -1  && errno != EAGAIN && errno != EWOULDBLOCK ){
-          logErr("Redirector failed to receive bytes from Tor");
-          exit(-1);  
+      activeMs = now; 
+      
+      for( side = NS ; side <= TOR ; side++ ){
+        if( fds[side].revents & (POLLERR | POLLNVAL) ){
+          exit(0); 
         }
-       
-        len = send(clientIncoming, buff, len, 0);
-        if( len == -1 ){
-          logErr("Redirector failed to send bytes to the child namespace");
-          exit(-1); 
+        
+        /* The socket is writable, the bytes for it are in the other direction */
+        if( (fds[side].revents & POLLOUT) 
+            && !flushRelayDir(&dirs[!side], socks[side]) ){
+          exit(0); 
+        }
+        
+        /* The socket is readable (a hang up is seen as a 0 byte read) */ 
+        if( fds[side].revents & (POLLIN | POLLHUP) ){
+          if( side == TOR ) peekFlow(&gChildFlow, socks[TOR], dirs[TOR].total); 
+          
+          if( !fillRelayDir(&dirs[side], socks[side]) 
+              || !flushRelayDir(&dirs[side], socks[!side]) ){
+            exit(0); 
+          }
+          
+          if( side == TOR ) trackFlow(&gChildFlow, dirs[TOR].total, dirs[TOR].capture, now); 
+        }
+        
+        /* A hang up of a side at EOF means its peer closed rather than half 
+         * closed, such that the bytes still meant for it cannot be delivered 
+         */ 
+        if( (fds[side].revents & POLLHUP) && dirs[side].eof && !dirs[!side].shut ){
+          exit(0); 
         }
       }
-      
     }
+    
+    exit(0); 
   }
 }
 
-/* getTorSock returns a socket to the Tor SocksPort on success or -1 on error */ 
-static int getTorSock(void)
+/* drainForks drains a generation of the REDIR_FORK engine, which stops
+ * accepting on unixListen and waits on each of its forked processes to exit,
+ * after which it exits itself. It never returns.
+ */ 
+static void drainForks(int unixListen)
 {
+  close(unixListen); 
+  
+  while( wait(NULL) != -1 || errno == EINTR ); 
+  
+  redirDrained(); 
+}
+
+/* finishTorSock waits on the connect of torSock to upstream, begun by 
+ * startTorSock, to finish, for no longer than the handshake timeout if there
+ * is one, and records its outcome with the circuit breaker of upstream. A 
+ * connect that timed out is recorded as failed.
+ *
+ * Returns 1 if torSock is connected, 0 on error.
+ */ 
+static int finishTorSock(int torSock, int upstream)
+{
+  struct pollfd connected = { torSock, POLLOUT, 0 };
+  int           got;
+  
+  do{
+    got = poll( &connected, 1, gRedirConf.handshakeTimeout 
+                               ? gRedirConf.handshakeTimeout * 1000 : -1 );
+  } while( got == -1 && errno == EINTR );
+  
+  if( got == -1 ){
+    logErr("Failed to wait on a connect to the Tor SocksPort");
+    return 0; 
+  }
+  
+  if( got == 0 ){
+    upstreamFailed(upstream); 
+    return 0; 
+  }
+  
+  return torSockConnected(torSock, upstream); 
+}
+
+/* signalRedirInited signals to the parent process that the redirector is 
+ * initialized to the point that it can accept connections from the child 
+ * network namespace, by writing a byte into the stoplight pipe it is blocking
+ * on, which is then closed. A generation of the redirector signals to the 
+ * supervisor that way, which tells a generation that exited apart by the 
+ * byte. 
+ */ 
+void signalRedirInited(void)
+{
+  if( stoplight[1] != -1 && write(stoplight[1], "i", 1) != 1 ){
+    logWrn("Failed to signal that the redirector is initialized");
+  }
+  
+  close(stoplight[0]); 
+  close(stoplight[1]); 
+  stoplight[0] = -1; 
+  stoplight[1] = -1; 
+}
+
+/* redirDrainFd returns the read end of the drain pipe of this generation of 
+ * the redirector, which becomes readable once the supervisor has it drain, or
+ * -1 if it is never drained. 
+ */ 
+int redirDrainFd(void)
+{
+  return gDrainFd; 
+}
+
+/* redirDrained is called by the engine of a draining generation once it no
+ * longer accepts and its last connection closed, the generation then exits.
+ */ 
+void redirDrained(void)
+{
+  statSub(draining, 1); 
+  logMsg("A generation of the redirector drained");
+  
+  exit(0); 
+}
+
+/* getTorSock returns a socket connected to the Tor SocksPort of upstream, 
+ * which is counted open, on success or -1 on error. The outcome of the connect
+ * is recorded with the circuit breaker of upstream.
+ */ 
+int getTorSock(int upstream)
+{
+  int tor = gUpstreams[upstream];
   int torSock;
   
   /* Get the socket for connecting to the Tor SocksPort */
-  torSock = socket(AF_INET, SOCK_STREAM, 0);
+  torSock = socket(gTorAddrs[tor].sa.sa_family, SOCK_STREAM, 0);
   if( torSock == -1 ){
     logErr("Failed to get socket");
     return -1;
   }
   
-  /* Connect to the Tor SocksPort */ 
-  if( connect(torSock, gTorAddr, gTorLen) ){
+  /* Connect to the Tor SocksPort, the breaker of which logs if it is down */ 
+  if( connect(torSock, &gTorAddrs[tor].sa, gTorLens[tor]) ){
     close(torSock); 
-    logErr("Failed to get a connection to Tor SocksPort");
+    upstreamFailed(upstream);
     return -1; 
   }
   
+  upstreamSucceeded(upstream);
+  statAdd(upstreamConns[upstream], 1);
+  
   return torSock;
 }
 
 
-/* initgTors initializes the static global struct sockadd and socklen_t used for
- * the connect() syscalls the redirector process makes to the Tor SocksPort. 
+/* startTorSock begins establishing a non-blocking connection to the Tor 
+ * SocksPort of upstream, which is counted open, the connection may still be 
+ * in progress when this returns, in which case the socket becomes writable 
+ * once it is established. A connect that fails at once is recorded with the
+ * circuit breaker of upstream, the outcome of one in progress is for the 
+ * caller to record.
  *
- * The memory pointed to by gTorAddr is mprotected to read only after 
+ * Returns the socket on success, -1 on error.
+ */ 
+int startTorSock(int upstream)
+{
+  int tor = gUpstreams[upstream];
+  int torSock;
+  
+  /* Get the socket for connecting to the Tor SocksPort */
+  torSock = socket(gTorAddrs[tor].sa.sa_family, SOCK_STREAM, 0);
+  if( torSock == -1 ){
+    logErr("Failed to get socket");
+    return -1;
+  }
+  
+  /* The connect must not block the event loop */ 
+  if( !setNonBlocking(torSock) ){
+    close(torSock); 
+    return -1; 
+  }
+  
+  /* Begin connecting to the Tor SocksPort, which for a Unix Domain Socket is
+   * never in progress 
+   */ 
+  if( connect(torSock, &gTorAddrs[tor].sa, gTorLens[tor]) && errno != EINPROGRESS ){
+    close(torSock); 
+    upstreamFailed(upstream);
+    return -1; 
+  }
+  
+  statAdd(upstreamConns[upstream], 1);
+  
+  return torSock;
+}
+
+/* upstreamCount returns the number of Tor SocksPorts the redirector connects to */ 
+int upstreamCount(void)
+{
+  return gUpstreamCount; 
+}
+
+/* releaseStream counts the stream of a forked relay process, and its 
+ * connection to the Tor SocksPort, closed as it exits, and records its flow
+ * and the end of its capture
+ */ 
+static void releaseStream(void)
+{
+  int reason = FLOW_ABORTED; 
+  
+  if( gChildExpiry != -1 )      reason = gChildExpiry; 
+  else if( gChildDirs != NULL ) reason = flowEndReason(gChildDirs); 
+  
+  recordFlow( &gChildFlow, reason, 
+              gChildDirs != NULL ? gChildDirs[NS].total : 0, 
+              gChildDirs != NULL ? gChildDirs[TOR].total : 0, 
+              gChildUpstream, 0 );
+  
+  if( gChildDirs != NULL ) closeCapture(gChildDirs[NS].capture); 
+  
+  statSub(streams, 1);
+  
+  if( gChildUpstream != -1 ) statSub(upstreamConns[gChildUpstream], 1);
+}
+
+
+/* initgTors initializes the static globals used for the connect() syscalls
+ * the redirector process makes to the Tor SocksPorts, with gTorAddrs holding
+ * one address for each of the upstreams of redirConf.torUpstreams, and 
+ * gTorNames the ADDR:PORT or unix:PATH it was listed as.
+ *
+ * The memory pointed to by gTorAddrs is mprotected to read only after 
  * initialization, such that if it is overwritten the process will immediately
  * segfault. 
  *
  * Note that the connect() syscall itself will be SECCOMP whitelisted such that
- * the redirector process can only use gTorAddr and gTorLen as arguments for it,
- * and that if separate arguments are used the process will immediately segfault.
- * Taken together, this should prevent proxy bypass attacks in the event that 
- * the redirector process is compromised.
+ * the redirector process can only use the addresses of gTorAddrs and their 
+ * gTorLens as arguments for it, and that if separate arguments are used the 
+ * process will immediately segfault. Taken together, this should prevent proxy
+ * bypass attacks in the event that the redirector process is compromised.
  *
- * Note that we only support SocksPort being on IPv4 addresses. 
+ * Note that we only support SocksPorts on IPv4 addresses and Unix Domain 
+ * Sockets. 
  *
  * Returns 1 on success, 0 on error.
  */ 
 static int initgTors(void)
+{
+  char upstreams[REDIR_MAX_UPSTREAMS * (UNIX_PREFIX_BC + SUN_PATH_BC)];
+  char *upstream;
+  char *savePtr;
+  
+  /* Alloc a memory pane for gTorAddrs, such that we can later freeze it */
+  gTorAddrs = allocMemoryPane(REDIR_MAX_UPSTREAMS * sizeof(union torAddr));
+  if( gTorAddrs == NULL ){
+    logErr("Failed to allocate the memory for the global Tor sockaddr structs");
+    return 0; 
+  }
+  
+  if( strlen(gRedirConf.torUpstreams) >= sizeof(upstreams) ){
+    logErr("The list of Tor SocksPorts is too long");
+    return 0; 
+  }
+  strcpy(upstreams, gRedirConf.torUpstreams);
+  
+  /* Each ADDR:PORT or unix:PATH of the comma separated list is an upstream */ 
+  for( upstream = strtok_r(upstreams, ",", &savePtr) ; upstream != NULL ;
+       upstream = strtok_r(NULL, ",", &savePtr) ){
+    if( gTorCount == REDIR_MAX_UPSTREAMS ){
+      logErr("More Tor SocksPorts were listed than are supported");
+      return 0; 
+    }
+    
+    if( !initgTor(upstream, &gTorAddrs[gTorCount], &gTorLens[gTorCount]) ){
+      logErr("Failed to prepare the address of a Tor SocksPort");
+      return 0; 
+    }
+    
+    /* initgTor refused any that doesn't fit a sun_path after its prefix */ 
+    strcpy(gTorNames[gTorCount], upstream);
+    
+    gTorCount++;
+  }
+  
+  if( gTorCount == 0 ){
+    logErr("No Tor SocksPorts were listed");
+    return 0; 
+  }
+  
+  /* Freeze the memory pointed to by gTorAddrs such that any attempts to
+   * overwrite it will immediately segfault, this coupled with the SECCOMP
+   * rules initialized later on to force connect() to use only these structs,
+   * this is in furtherance of preventing proxy bypass attacks
+   */
+  if( !freezeMemoryPane(gTorAddrs, REDIR_MAX_UPSTREAMS * sizeof(union torAddr)) ){
+    logErr("Failed to freeze the memory pane of global tor sockaddrs");
+    return 0; 
+  }
+  
+  return 1;
+}
+
+/* initgTor initializes torAddr and torLen for connect() syscalls to the Tor
+ * SocksPort of upstream, which is an IPv4 ADDR:PORT, or unix:PATH for a Tor 
+ * SocksPort on the Unix Domain Socket at PATH (Tor's SocksPort unix:PATH). A
+ * local Tor is best reached over its Unix Domain Socket, which spares every 
+ * stream the TCP/IP stack of the loopback interface.
+ *
+ * Returns 1 on success, 0 on error.
+ */ 
+static int initgTor(const char *upstream, union torAddr *torAddr, socklen_t *torLen)
 {
   struct addrinfo *preppedAddr;
   struct addrinfo hints;
+  char            addr[32];
+  char            *port;
+  size_t          pathBc;
   
-  /* Alloc a memory pane for gTorAddr, such that we can later freeze it */
-  gTorAddr = allocMemoryPane(sizeof(struct sockaddr));
-  if( gTorAddr == NULL ){
-    logErr("Failed to allocate the memory for the global Tor sockaddr struct");
+  /* The path and its NULL terminator must fit in sun_path */ 
+  if( !strncmp(upstream, "unix:", UNIX_PREFIX_BC) ){
+    pathBc = strlen(upstream + UNIX_PREFIX_BC);
+    if( pathBc == 0 || pathBc + 1 > SUN_PATH_BC ){
+      logErr("The path of a Tor SocksPort doesn't fit a Unix Domain Socket");
+      return 0; 
+    }
+    
+    torAddr->un.sun_family = AF_UNIX;
+    memcpy(torAddr->un.sun_path, upstream + UNIX_PREFIX_BC, pathBc + 1);
+    
+    *torLen = offsetof(struct sockaddr_un, sun_path) + pathBc + 1;
+    
+    return 1; 
+  }
+  
+  /* Split the ADDR from the PORT */ 
+  if( strlen(upstream) >= sizeof(addr) ){
+    logErr("The address of a Tor SocksPort is too long");
     return 0; 
   }
+  strcpy(addr, upstream);
+  
+  port = strrchr(addr, ':');
+  if( port == NULL ){
+    logErr("A Tor SocksPort was listed without a port");
+    return 0; 
+  }
+  *port++ = '\0';
   
   /* Hints allow us to tell getaddrinfo that we are only interested in 
    * SocksPorts on IPv4 addresses, and with TCP (which is implied by SOCK_STREAM).  
@@ -391,7 +1360,7 @@ static int initgTors(void)
   hints.ai_next      = NULL;
   
   /* Prepare the address information for addr:port */ 
-  if( getaddrinfo(TOR_ADDR, TOR_PORT, &hints, &preppedAddr) ){
+  if( getaddrinfo(addr, port, &hints, &preppedAddr) ){
     logErr("Failed to encode address"); 
     return 0; 
   }
@@ -399,6 +1368,7 @@ static int initgTors(void)
   /* Make sure that the prepared address is IPv4 */ 
   if( preppedAddr->ai_family != AF_INET ){
     logErr("Unexpected family type found, aborting");
+    freeaddrinfo(preppedAddr);
     return 0;
   }
   
@@ -410,26 +1380,15 @@ static int initgTors(void)
     logWrn("Multiple addrinfo structs found when looking up Tor, trying first");
   }
   
-  /* gTorLen is the static global that the redirector will use for accessing 
-   * the value of preppedAddr->ai_addrlen for all of its connect() syscalls. 
+  /* torLen is what the redirector will use for the value of 
+   * preppedAddr->ai_addrlen for all of its connect() syscalls to upstream 
    */ 
-  gTorLen = preppedAddr->ai_addrlen; 
+  *torLen = preppedAddr->ai_addrlen; 
   
-  /* copy over the required values to the struct pointed to by gTorSockAddr,
-   * such that it is initialized for connect() syscalls. 
+  /* copy over the required values to the struct pointed to by torAddr, such
+   * that it is initialized for connect() syscalls. 
    */ 
-  gTorAddr->sa_family = preppedAddr->ai_addr->sa_family;
-  memcpy(gTorAddr->sa_data, preppedAddr->ai_addr->sa_data, SA_DATA_BC); 
-  
-  /* Freeze the memory pointed to by gTorSockAddr such that any attempts to
-   * overwrite it will immediately segfault, this coupled with the SECCOMP
-   * rules initialized later on to force connect() to use only this struct,
-   * this is in furtherance of preventing proxy bypass attacks
-   */
-  if( !freezeMemoryPane(gTorAddr, sizeof(struct sockaddr)) ){
-    logErr("Failed to freeze the memory pane of global tor sockaddr");
-    return 0; 
-  }
+  memcpy(&torAddr->in, preppedAddr->ai_addr, sizeof(struct sockaddr_in)); 
   
   /* Free the memory allocated by getaddrinfo */ 
   freeaddrinfo(preppedAddr);
@@ -437,6 +1396,97 @@ static int initgTors(void)
   return 1;
 }
 
+/* selectUpstreams looks each ADDR:PORT or unix:PATH of the comma separated 
+ * list upstreams up in gTorNames, storing the index in gTorAddrs of each in 
+ * selected and their number in *count. A list that names a Tor SocksPort the
+ * supervisor wasn't started with, or one more than once, is refused, such 
+ * that a reload cannot have the redirector connect anywhere new.
+ *
+ * Returns 1 on success, 0 if the list is refused.
+ */ 
+static int selectUpstreams(const char *upstreams, int *selected, int *count)
+{
+  char list[UPSTREAMS_BC];
+  char *upstream;
+  char *savePtr;
+  int  i;
+  int  j;
+  
+  if( strlen(upstreams) >= sizeof(list) ){
+    logErr("The list of Tor SocksPorts is too long");
+    return 0; 
+  }
+  strcpy(list, upstreams);
+  
+  *count = 0;
+  
+  for( upstream = strtok_r(list, ",", &savePtr) ; upstream != NULL ;
+       upstream = strtok_r(NULL, ",", &savePtr) ){
+    for( i = 0 ; i < gTorCount && strcmp(upstream, gTorNames[i]) ; i++ );
+    if( i == gTorCount ){
+      logErr("A Tor SocksPort the redirector wasn't started with was listed");
+      return 0; 
+    }
+    
+    for( j = 0 ; j < *count && selected[j] != i ; j++ );
+    if( j < *count ){
+      logErr("A Tor SocksPort was listed more than once");
+      return 0; 
+    }
+    
+    /* Without repeats there are no more of them than gTorCount */ 
+    selected[(*count)++] = i;
+  }
+  
+  if( *count == 0 ){
+    logErr("No Tor SocksPorts were listed");
+    return 0; 
+  }
+  
+  return 1; 
+}
+
+/* reloadAllowed checks the redirConf of a reload, which the App requested, 
+ * such that the supervisor never starts a generation with a setting out of
+ * bounds. The SocksPorts of the reload are checked by selectUpstreams.
+ *
+ * Returns 1 if the generation may be started with conf, 0 if not.
+ */ 
+static int reloadAllowed(struct redirConf *conf)
+{
+  if( conf->mode != REDIR_FORK && conf->mode != REDIR_EPOLL && conf->mode != REDIR_URING ){
+    logErr("A reload of the redirector was for an unknown engine");
+    return 0; 
+  }
+  
+  if( conf->balance != BALANCE_ROUND_ROBIN && conf->balance != BALANCE_LEAST_CONN
+      && conf->balance != BALANCE_DEST_HASH ){
+    logErr("A reload of the redirector was for an unknown balancing policy");
+    return 0; 
+  }
+  
+  /* A supervised redirector is never the shared one */ 
+  if( (conf->splice | conf->passFd | conf->pinThreads | conf->capture) & ~1 
+      || conf->shared != 0 ){
+    logErr("A reload of the redirector had an invalid flag");
+    return 0; 
+  }
+  
+  if( conf->threads < 1 || conf->threads > REDIR_MAX_THREADS 
+      || conf->poolSize < 0 || conf->poolSize > REDIR_MAX_POOL_SIZE ){
+    logErr("A reload of the redirector had too many threads or pooled connections");
+    return 0; 
+  }
+  
+  if( conf->idleTimeout < 0 || conf->handshakeTimeout < 0 || conf->lifeTimeout < 0
+      || conf->backlog < 1 || conf->maxStreams < 0 || conf->qosRate < 0 
+      || conf->qosConnRate < 0 ){
+    logErr("A reload of the redirector had a negative setting");
+    return 0; 
+  }
+  
+  return 1; 
+}
 
 
 /* seccompWl applies a SECCOMP whitelisting filter to the redirector process, 
@@ -447,12 +1497,21 @@ static int initgTors(void)
  * present to the redirector process, as well as specifically for preventing 
  * proxy bypass attacks via restrictions on the networking syscalls (see code).
  *
+ * With supervisor set the filter is that of the supervisor, which every 
+ * generation inherits. It allows connect to each of the SocksPorts of gTorAddrs
+ * rather than only those of the generation, as well as what the supervisor 
+ * needs for starting a generation and a generation for initializing itself,
+ * which is opening the capture file, locking the relay buffers into memory,
+ * and loading its own filter.
+ *
  * Returns 1 on success, 0 on error.
  */ 
-static int seccompWl(void)
+static int seccompWl(int supervisor)
 {
   scmp_filter_ctx filter;
   int             ret = 0; 
+  int             tor;
+  int             i;
 
   /* Initialize SECCOMP filter such that non-whitelisted syscalls segfault */
   filter = seccomp_init(SCMP_ACT_KILL);
@@ -512,18 +1571,47 @@ static int seccompWl(void)
                            SCMP_CMP( 2 , SCMP_CMP_EQ , 0)
                          );
 
-  /* Only allow connect with the static global struct addrinfo *gTorAddr,
-   * the memory backing for which is set to read only with mprotect. This 
-   * prevents using connect for anything other than connecting to the Tor
-   * SocksPort, which prevents TCP proxy bypass attacks.
+  /* Only allow connect with the addresses of the static global gTorAddrs, 
+   * one rule for each upstream, the memory backing for which is set to read
+   * only with mprotect. This prevents using connect for anything other than 
+   * connecting to the Tor SocksPorts, which prevents TCP proxy bypass attacks,
+   * and for a SocksPort on a Unix Domain Socket connecting to any other path.
    *
-   * Additionally, only allow with gTorLen, which compliments gTorAddr.
+   * Additionally, only allow with the gTorLens of each, which compliment 
+   * gTorAddrs.
    */ 
-   ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
-                            SCMP_SYS(connect), 2,
-                            SCMP_CMP( 1 , SCMP_CMP_EQ, (scmp_datum_t)gTorAddr),
-                            SCMP_CMP( 2 , SCMP_CMP_EQ, gTorLen)
-                          ); 
+  for( i = 0 ; i < (supervisor ? gTorCount : gUpstreamCount) ; i++ ){
+    tor = supervisor ? i : gUpstreams[i];
+    
+    ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                             SCMP_SYS(connect), 2,
+                             SCMP_CMP( 1 , SCMP_CMP_EQ, (scmp_datum_t)&gTorAddrs[tor]),
+                             SCMP_CMP( 2 , SCMP_CMP_EQ, gTorLens[tor])
+                           ); 
+  }
+
+  /* Only allow sendmsg with no flags other than MSG_NOSIGNAL, which is used 
+   * for passing connected Tor sockets to the client over the Unix Domain 
+   * Socket. Note that SECCOMP cannot inspect the msg_name of the msghdr, 
+   * however it is ignored for the connected stream sockets this process has,
+   * which are the only sockets it can obtain. 
+   */  
+  ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                           SCMP_SYS(sendmsg), 1,  
+                           SCMP_CMP( 2 , SCMP_CMP_EQ , MSG_NOSIGNAL)
+                         );
+
+  /* Only allow getsockopt for getting the result of non-blocking connects */ 
+  ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                           SCMP_SYS(getsockopt), 2,
+                           SCMP_CMP( 1 , SCMP_CMP_EQ , SOL_SOCKET),
+                           SCMP_CMP( 2 , SCMP_CMP_EQ , SO_ERROR)
+                         );
+
+  /* Shutdown is used for passing the disconnect of one side of a redirected 
+   * connection on to the other side 
+   */ 
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(shutdown), 0);
 
   /* Poll is used for managing the sockets */
   ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(poll), 0);
@@ -537,6 +1625,28 @@ static int seccompWl(void)
   /* Accept is used for accepting connections from child net ns */
   ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(accept), 0);
 
+  /* The epoll redirector accepts with SOCK_NONBLOCK set by accept4 */ 
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(accept4), 0);
+
+  /* The epoll redirector multiplexes all of its sockets with these */ 
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(epoll_create1), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(epoll_ctl), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(epoll_wait), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(epoll_pwait), 0);
+
+  /* Only allow fcntl for getting and setting the file status flags, which is
+   * used for making the Tor and listening sockets non-blocking 
+   */ 
+  ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                           SCMP_SYS(fcntl), 1,
+                           SCMP_CMP( 1 , SCMP_CMP_EQ , F_GETFL)
+                         );
+
+  ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                           SCMP_SYS(fcntl), 1,
+                           SCMP_CMP( 1 , SCMP_CMP_EQ , F_SETFL)
+                         );
+
   /*******************************MEMORY SYSCALLS******************************/ 
 
   /* Allow mprotect unless it is trying to set memory as executable */ 
@@ -552,14 +1662,91 @@ static int seccompWl(void)
 
   /********************************OTHER SYSCALLS******************************/ 
 
+  /* The splice mode moves bytes from socket to socket through pipes */ 
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(pipe), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(pipe2), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(splice), 0);
+
   /* Clone is used by fork, the fork syscall itself doesn't appear to be */ 
   ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(clone), 0);
 
+  /* A draining REDIR_FORK generation waits on the processes it forked */
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(wait4), 0);
+
+  /* Clone3 takes its arguments in a struct which SECCOMP cannot inspect, it 
+   * fails with ENOSYS such that pthread_create falls back to using clone 
+   */ 
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(clone3), 0);
+
+  /* These are required by the event loop threads of the epoll redirector, for
+   * creating them, synchronizing them, pinning them to CPUs and having them 
+   * exit. Malloc is used by pthread_create, which may require brk. 
+   */ 
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(futex), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(set_robust_list), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(rseq), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(rt_sigprocmask), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(madvise), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(brk), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(gettid), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(sched_getaffinity), 0);
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(sched_setaffinity), 0);
+
+  /* These are only required by the io_uring redirector. Operations submitted 
+   * to an io_uring bypass SECCOMP, the ring is therefore restricted to accept,
+   * read fixed and send before being enabled, and io_uring_register is only 
+   * allowed for registering the buffers, the restrictions, and enabling it.
+   */ 
+  if( gRedirConf.mode == REDIR_URING || supervisor ){
+    ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(io_uring_setup), 0);
+    ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(io_uring_enter), 0);
+    ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                             SCMP_SYS(io_uring_register), 1,
+                             SCMP_CMP( 1 , SCMP_CMP_EQ , IORING_REGISTER_BUFFERS)
+                           );
+    ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                             SCMP_SYS(io_uring_register), 1,
+                             SCMP_CMP( 1 , SCMP_CMP_EQ , IORING_REGISTER_RESTRICTIONS)
+                           );
+    ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                             SCMP_SYS(io_uring_register), 1,
+                             SCMP_CMP( 1 , SCMP_CMP_EQ , IORING_REGISTER_ENABLE_RINGS)
+                           );
+  }
+
+  /* The timeouts of the redirector are kept on the monotonic clock, which is 
+   * normally read without a syscall 
+   */ 
+  ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(clock_gettime), 0);
+
   /* Unlink is used for removing any existing file with the name used for the
    * Unix Domain Socket.
    */ 
   ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(unlink), 0);
   
+  /* These are only required by the supervisor and the generations it starts.
+   * A reload may turn capturing on, for which the supervisor opens the capture
+   * file with the flags of initCapture alone. A generation locks its relay 
+   * buffers into memory, then loads its own filter after setting no_new_privs,
+   * both of which can only add restrictions.
+   */ 
+  if( supervisor ){
+    ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                             SCMP_SYS(openat), 1,
+                             SCMP_CMP( 2 , SCMP_CMP_EQ , O_WRONLY | O_CREAT | O_TRUNC | O_APPEND)
+                           );
+    ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(mlock), 0);
+    ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(seccomp), 0);
+    ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                             SCMP_SYS(prctl), 1,
+                             SCMP_CMP( 0 , SCMP_CMP_EQ , PR_SET_NO_NEW_PRIVS)
+                           );
+    ret |= seccomp_rule_add( filter, SCMP_ACT_ALLOW, 
+                             SCMP_SYS(prctl), 1,
+                             SCMP_CMP( 0 , SCMP_CMP_EQ , PR_SET_SECCOMP)
+                           );
+  }
+  
   /* These are required to exit */
   ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(exit_group), 0);
   ret |= seccomp_rule_add(filter, SCMP_ACT_ALLOW , SCMP_SYS(exit), 0);
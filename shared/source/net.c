@@ -6,6 +6,8 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/un.h> 
+#include <fcntl.h>
+#include <time.h>
 
 #include "logger.h"
 #include "security.h"
@@ -128,9 +130,10 @@ int ipv4Listen(const char *addr, uint16_t port)
 
 
 /* listenUds returns a bound and listening Unix Domain Socket on the path 
- * pointed to by path, or otherwise -1 on error
+ * pointed to by path, on which up to backlog connections may wait on being
+ * accepted, or otherwise -1 on error
  */
-int udsListen(char *path, int bc)
+int udsListen(char *path, int bc, int backlog)
 {
   struct sockaddr_un local;
   int                unixSock;
@@ -171,7 +174,7 @@ int udsListen(char *path, int bc)
   }
   
   /* Start listening */
-  if( listen(unixSock, 20) ){
+  if( listen(unixSock, backlog) ){
     logErr("Failed to listen on Unix Domain Socket");
     return -1;
   }
@@ -230,3 +233,164 @@ int udsConnect(char *udsPath, unsigned int bc)
   
   return unixSock;
 }
+
+
+/* clockMs returns the milliseconds on the monotonic clock, which the timeouts
+ * and latencies of connections are measured with
+ */
+uint64_t clockMs(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/* setNonBlocking sets O_NONBLOCK on the file descriptor fd.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int setNonBlocking(int fd)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if( flags == -1 ){
+    logErr("Failed to get the file status flags");
+    return 0;
+  }
+
+  if( fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ){
+    logErr("Failed to set the file status flags");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/* sendFd passes the file descriptor fd to the process at the other end of the
+ * connected Unix Domain Socket socket, as SCM_RIGHTS ancillary data of a 
+ * single byte message. This is the send counterpart to recvFd.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int sendFd(int socket, int fd)
+{
+  struct msghdr  msg;
+  struct iovec   iov;
+  struct cmsghdr *cmsg;
+  char           byte = 0;
+  union{
+    struct cmsghdr align;
+    char           buff[CMSG_SPACE(sizeof(int))];
+  } control;
+  
+  /* Basic error checking */
+  if( socket == -1 || fd == -1 ){
+    logErr("Invalid file descriptor passed to sendFd");
+    return 0;
+  }
+  
+  /* Ancillary data can't be sent without at least one byte of real data */
+  iov.iov_base = &byte;
+  iov.iov_len  = 1;
+  
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buff;
+  msg.msg_controllen = sizeof(control.buff);
+  
+  /* The file descriptor goes in the SCM_RIGHTS control message */
+  cmsg             = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  
+  if( sendmsg(socket, &msg, MSG_NOSIGNAL) != 1 ){
+    logErr("Failed to pass a file descriptor over unix domain socket");
+    return 0;
+  }
+  
+  return 1;
+}
+
+/* passSock passes the connected socket fd to the process at the other end of
+ * the connected Unix Domain Socket socket with sendFd, clearing O_NONBLOCK on
+ * fd first. The flag is shared with the passed copy, and its receiver uses it
+ * as the blocking socket udsConnect would have returned.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int passSock(int socket, int fd)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if( flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1 ){
+    logErr("Failed to set a passed socket blocking");
+    return 0;
+  }
+
+  return sendFd(socket, fd);
+}
+
+/* recvFd receives a file descriptor passed by sendFd from the process at the
+ * other end of the connected Unix Domain Socket socket.
+ *
+ * Returns the received file descriptor on success, -1 on error.
+ */
+int recvFd(int socket)
+{
+  struct msghdr  msg;
+  struct iovec   iov;
+  struct cmsghdr *cmsg;
+  char           byte;
+  int            fd;
+  union{
+    struct cmsghdr align;
+    char           buff[CMSG_SPACE(sizeof(int))];
+  } control;
+  
+  /* Basic error checking */
+  if( socket == -1 ){
+    logErr("Socket passed to recvFd is invalid");
+    return -1;
+  }
+  
+  iov.iov_base = &byte;
+  iov.iov_len  = 1;
+  
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buff;
+  msg.msg_controllen = sizeof(control.buff);
+  
+  if( recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1 ){
+    logErr("Failed to receive a file descriptor over unix domain socket");
+    return -1;
+  }
+  
+  /* Make sure that exactly one file descriptor was passed, and no more were
+   * cut off, which would otherwise leak 
+   */
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if( cmsg == NULL 
+      || (msg.msg_flags & MSG_CTRUNC)
+      || cmsg->cmsg_level != SOL_SOCKET 
+      || cmsg->cmsg_type  != SCM_RIGHTS 
+      || cmsg->cmsg_len   != CMSG_LEN(sizeof(int)) ){
+    logErr("Unix domain socket message didn't carry a file descriptor");
+    return -1;
+  }
+  
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  
+  return fd;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "logger.h"
+#include "security.h"
 #include "prng.h"
 
 
@@ -76,3 +77,51 @@ int randomize(unsigned char *buff, unsigned long long byteCount)
   
   return 1; 
 }
+
+/* randomizeHex fills the buffer pointed to by hex with byteCount random bytes
+ * in lowercase hex, which is 2 * byteCount chars, not NULL terminated. The 
+ * random bytes themselves are cleared once encoded.
+ *
+ * Returns 0 on error, 1 on success.
+ */
+int randomizeHex(char *hex, unsigned long long byteCount)
+{
+  unsigned char bytes[64];
+  size_t        chunk;
+  
+  if( hex == NULL ){
+    logErr("Something was NULL that shouldn't have been");
+    return 0;
+  }
+  
+  while( byteCount > 0 ){
+    chunk = byteCount < sizeof(bytes) ? byteCount : sizeof(bytes);
+    
+    if( !randomize(bytes, chunk) ){
+      secMemClear(bytes, sizeof(bytes));
+      return 0;
+    }
+    
+    hexEncode(hex, bytes, chunk);
+    
+    hex       += 2 * chunk;
+    byteCount -= chunk;
+  }
+  
+  secMemClear(bytes, sizeof(bytes));
+  
+  return 1;
+}
+
+/* hexEncode writes the bc bytes pointed to by bytes into the buffer pointed to
+ * by hex in lowercase hex, which is 2 * bc chars, not NULL terminated.
+ */
+void hexEncode(char *hex, const unsigned char *bytes, size_t bc)
+{
+  size_t i;
+  
+  for( i = 0 ; i < bc ; i++ ){
+    hex[2 * i]     = "0123456789abcdef"[bytes[i] >> 4];
+    hex[2 * i + 1] = "0123456789abcdef"[bytes[i] & 15];
+  }
+}
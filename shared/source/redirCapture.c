@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+
+
+/* With redirConf.capture set the redirector captures the shape of every stream
+ * it relays, such that a workload seen in the sandbox can be replayed against
+ * the redirector later on, without Tor and without the bytes of the streams,
+ * to tell if a change to the relay made it slower. The bytes themselves are
+ * never captured, only when each of the receives and sends of a stream was
+ * made, and how many bytes it moved, such that a capture holds nothing of what
+ * the sandbox said but the sizes and timing of its streams. The length of
+ * Tor's reply to the handshake is captured as well, as found by the flow
+ * record of the stream, such that a replay can tell the reply apart from the
+ * bytes that came along with it.
+ *
+ * The events are appended to REDIR_CAPTURE_FILE as captureEvents, one write
+ * each, which the file being opened for appending keeps whole as the event
+ * loop threads and forked processes of every generation write into it. The
+ * file is opened by the supervisor of the redirector before it starts the
+ * first generation to capture, which truncates it, and every generation after
+ * that inherits it, such that a reload doesn't cut the capture short. The
+ * streams are numbered across the generations by the redirStats.
+ *
+ * Capturing costs a write for each receive and send of the relay, as such it
+ * is only meant for capturing a workload, not to be left on.
+ */
+
+
+enum{ NS_PER_US = 1000, US_PER_S = 1000000 };
+
+
+static void writeCapture(uint32_t stream, int kind, int side, size_t bc);
+
+
+/* The capture file, or -1 if nothing was ever captured */
+static int sCaptureFd = -1;
+
+
+/* initCapture opens the capture file, truncating it, the first time it is
+ * called with redirConf.capture set, such that it is inherited by every
+ * generation of the redirector started after.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int initCapture(void)
+{
+  if( !getRedirConf()->capture || sCaptureFd != -1 ) return 1;
+
+  sCaptureFd = open( REDIR_CAPTURE_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                     S_IRUSR | S_IWUSR );
+  if( sCaptureFd == -1 ){
+    logErr("Failed to open the capture file of the redirector");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* openCapture begins capturing a stream that was just accepted.
+ *
+ * Returns the stream it is captured as, or 0 if streams are not captured.
+ */
+uint32_t openCapture(void)
+{
+  uint32_t stream;
+
+  if( !getRedirConf()->capture || sCaptureFd == -1 ) return 0;
+
+  stream = statAdd(captured, 1) + 1;
+
+  writeCapture(stream, CAPTURE_OPEN, NS, 0);
+
+  return stream;
+}
+
+/* captureIo captures bc bytes of stream being received from side, with kind
+ * CAPTURE_RECV, or sent to side, with kind CAPTURE_SEND
+ */
+void captureIo(uint32_t stream, int kind, int side, size_t bc)
+{
+  if( stream == 0 ) return;
+
+  writeCapture(stream, kind, side, bc);
+}
+
+/* captureReply captures Tor's reply to the SOCKS handshake of stream being
+ * finished, the reply being bc bytes
+ */
+void captureReply(uint32_t stream, size_t bc)
+{
+  if( stream == 0 ) return;
+
+  writeCapture(stream, CAPTURE_REPLY, TOR, bc);
+}
+
+/* closeCapture captures stream being closed */
+void closeCapture(uint32_t stream)
+{
+  if( stream == 0 ) return;
+
+  writeCapture(stream, CAPTURE_CLOSE, NS, 0);
+}
+
+
+/* writeCapture appends an event of kind to the capture file. An event that
+ * could not be written is lost rather than retried, as the relay must never
+ * wait on the capture.
+ */
+static void writeCapture(uint32_t stream, int kind, int side, size_t bc)
+{
+  struct captureEvent event;
+  struct timespec     now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  memset(&event, 0, sizeof(event));
+  event.us     = (uint64_t)now.tv_sec * US_PER_S + now.tv_nsec / NS_PER_US;
+  event.stream = stream;
+  event.bc     = bc > UINT32_MAX ? UINT32_MAX : bc;
+  event.kind   = kind;
+  event.side   = side;
+
+  if( write(sCaptureFd, &event, sizeof(event)) != sizeof(event) ) return;
+}
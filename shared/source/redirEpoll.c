@@ -0,0 +1,1023 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+#include "net.h"
+
+enum{ MAX_EVENTS = 64 };
+
+
+/* The epoll redirector multiplexes every connection from the child network
+ * namespace, as well as its corresponding connection to the Tor SocksPort, in
+ * a single process with a single event loop. Each redirected connection has a
+ * state object, which holds its two sockets as well as a relayDir for each of
+ * the two directions, such that a send that would block does not block the
+ * event loop but rather is finished once the socket is writable again, and
+ * such that either side disconnecting only ends its own direction.
+ *
+ * The state objects are carved out of a table allocated once at startup, such
+ * that at most REDIR_MAX_CONNS connections are redirected at once.
+ *
+ * With redirConf.threads above 1 there are as many event loops, each running
+ * in its own thread with its own epoll instance, connection table (of an equal
+ * share of REDIR_MAX_CONNS) and pool. All of them wait on the listening socket
+ * with EPOLLEXCLUSIVE, such that an incoming connection wakes only one of them,
+ * and a connection stays with the loop that accepted it for its lifetime.
+ *
+ * When redirConf.splice is set, each direction has a pipe rather than a buffer
+ * and the bytes are moved from socket to pipe to socket with splice, such that
+ * the payload never enters user space.
+ *
+ * Each loop has a timer wheel with a timer for each of its connections, which
+ * closes those that went idle, stalled in their SOCKS handshake, or outlived
+ * their lifetime, such that dead connections don't hold state objects forever.
+ *
+ * With BALANCE_DEST_HASH a connection is only paired with a connection to the
+ * Tor SocksPort once its SOCKS request arrived, which picks the upstream, and
+ * the pool is left empty as its connections would be to no upstream in 
+ * particular.
+ *
+ * A connection that missed the pool has its Tor SocksPort connected to with a
+ * non-blocking connect, as does one waiting on its SOCKS request, which is
+ * finished once its socket is writable, and until then nothing is received
+ * from the child namespace, such that a slow SocksPort only holds up the
+ * connections sent to it rather than the event loop. In the passFd mode such
+ * a connection is passed to the client once it is connected.
+ *
+ * A connection a direction of which is throttled by its QoS buckets is kept on
+ * the throttled list of its loop, the directions on which are tried again 
+ * every REDIR_QOS_TICK_MS, such that waiting on the buckets costs nothing when
+ * nothing waits on them. Connections accepted while redirConf.maxStreams are
+ * relayed by all of the loops together are closed at once.
+ *
+ * A shared redirector has a listening socket for each of its tenants, all of
+ * which are registered with every loop, and the connections accepted on one
+ * are those of its tenant, which are capped and counted by tenant, and whose
+ * SOCKS handshakes are answered rather than relayed, see redirTenant.c.
+ *
+ * When the generation of the redirector drains, every loop stops waiting on
+ * the listening sockets and empties its pool, and keeps relaying the
+ * connections it has until their last is closed. The generation exits once
+ * every loop has.
+ */
+
+
+/* redirConn is the state of a single redirected connection. dir[NS] holds the
+ * bytes received from the child namespace that are not yet sent to Tor, and
+ * dir[TOR] holds the bytes received from Tor that are not yet sent to the
+ * child namespace. While connecting is set its Tor side is waited on for
+ * the connect to finish alone, and a passing connection is only held until
+ * then in the passFd mode, relaying nothing.
+ */
+struct redirConn{
+  struct redirLoop *loop;
+  struct redirEnd  end[2];
+  int              fd[2];
+  uint32_t         events[2];
+  struct relayDir  dir[2];
+  struct redirTimer timer;
+  uint64_t         startMs;
+  uint64_t         activeMs;
+  int              upstream;
+  int              tenant;
+  int              expiry;
+  int              connecting;
+  int              passing;
+  struct flowTrack flow;
+  struct tenantGreet greet;
+  struct redirConn *next;
+  struct redirConn *throttledNext;
+  struct redirConn **throttledPrev;
+};
+
+/* redirLoop is the state of a single event loop. freeConns is the list of its
+ * unused state objects, closedConns is the list of state objects closed while
+ * handling the current batch of events, which are only released once the batch
+ * has been handled because later events in it may still point to them.
+ */
+struct redirLoop{
+  int              epoll;
+  int              *listens;
+  int              cpu;
+  int              listenCount;
+  struct redirEnd  listenEnds[REDIR_MAX_TENANTS];
+  struct redirEnd  drainEnd;
+  struct redirConn *freeConns;
+  struct redirConn *closedConns;
+  struct redirConn *throttled;
+  struct torPool   *pool;
+  struct timerWheel wheel;
+  uint64_t         now;
+  int              live;
+  int              draining;
+};
+
+
+static int  initLoop(struct redirLoop *loop, int *listens, int count, int share);
+static int  pickCpu(cpu_set_t *allowed, int n);
+static void *runLoop(void *arg);
+static void serveLoop(struct redirLoop *loop);
+static int  initConnTable(struct redirLoop *loop, int conns);
+static void acceptConns(struct redirLoop *loop, int tenant);
+static int  connectUpstream(struct redirConn *conn);
+static void connectedUpstream(struct redirConn *conn);
+static int  allocRelay(struct redirConn *conn);
+static void freeRelay(struct redirConn *conn);
+static void relayEvent(struct redirConn *conn, int side, uint32_t revents);
+static int  greetConn(struct redirConn *conn, int side);
+static int  updateInterest(struct redirConn *conn);
+static void armConnTimer(struct redirConn *conn);
+static void connExpired(struct redirTimer *timer);
+static void closeConn(struct redirConn *conn);
+static void releaseClosed(struct redirLoop *loop);
+static void trackThrottled(struct redirConn *conn);
+static void resumeThrottled(struct redirLoop *loop);
+static void drainLoop(struct redirLoop *loop);
+static void loopDrained(struct redirLoop *loop);
+
+
+static int sSplice;
+static int sDeferred;
+static int sShared;
+static int sThreads;
+
+/* The loops that relayed their last connection since the generation drains */
+static int sDrainedLoops;
+
+
+/* redirectEpoll starts redirConf.threads event loops, each with its own epoll
+ * instance with which the count already listening Unix Domain Sockets of 
+ * listens are registered, one for each tenant of a shared redirector and
+ * otherwise one alone, which then accept connections from the client 
+ * namespaces and redirect them to the Tor SocksPort ad infinitum. The calling
+ * thread runs the first of the event loops.
+ *
+ * This function never returns on success, it returns on error.
+ */
+void redirectEpoll(int *listens, int count)
+{
+  struct redirLoop *loops;
+  pthread_t        thread;
+  cpu_set_t        allowed;
+  int              threads;
+  int              i;
+
+  sSplice = getRedirConf()->splice;
+
+  /* The passFd client only sends once it has its socket */
+  sDeferred = getRedirConf()->balance == BALANCE_DEST_HASH && !getRedirConf()->passFd;
+
+  sShared = tenantCount() > 0;
+
+  threads = getRedirConf()->threads;
+  if( threads < 1 ) threads = 1;
+  sThreads = threads;
+
+  /* Accepting must never block the event loops */
+  for( i = 0 ; i < count ; i++ ){
+    if( !setNonBlocking(listens[i]) ){
+      logErr("Failed to set the redirector listening socket non-blocking");
+      return;
+    }
+  }
+
+  loops = secAlloc(threads * sizeof(struct redirLoop));
+  if( loops == NULL ){
+    logErr("Failed to allocate memory for the redirector event loops");
+    return;
+  }
+
+  /* When pinning, the loops are spread over the CPUs this process may use */
+  if( getRedirConf()->pinThreads && sched_getaffinity(0, sizeof(allowed), &allowed) ){
+    logWrn("Failed to get the CPUs of the redirector, not pinning its threads");
+    getRedirConf()->pinThreads = 0;
+  }
+
+  for( i = 0 ; i < threads ; i++ ){
+    loops[i].cpu = -1;
+
+    if( getRedirConf()->pinThreads ){
+      loops[i].cpu = pickCpu(&allowed, i);
+    }
+
+    if( !initLoop(&loops[i], listens, count, threads) ){
+      logErr("Failed to initialize an event loop of the redirector");
+      return;
+    }
+  }
+
+  /* Every loop but the first gets its own thread */
+  for( i = 1 ; i < threads ; i++ ){
+    if( pthread_create(&thread, NULL, &runLoop, &loops[i]) ){
+      logErr("Failed to start a thread of the redirector");
+      return;
+    }
+  }
+
+  /* Signal to the parent process that we can accept connections */
+  signalRedirInited();
+
+  runLoop(&loops[0]);
+}
+
+/* initLoop initializes loop for serving one share of the connections accepted
+ * on the count sockets of listens, with share being the number of loops the
+ * connections and pool are split between.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int initLoop(struct redirLoop *loop, int *listens, int count, int share)
+{
+  struct epoll_event ev;
+  int                conns;
+  int                poolSize;
+  int                tenant;
+
+  loop->listens     = listens;
+  loop->listenCount = count;
+  loop->live        = 0;
+  loop->draining    = 0;
+  loop->freeConns   = NULL;
+  loop->closedConns = NULL;
+  loop->throttled   = NULL;
+  loop->now         = clockMs();
+
+  initTimerWheel(&loop->wheel, loop->now);
+
+  /* Every loop gets at least one state object, and one pooled connection if
+   * there is a pool at all
+   */
+  conns    = REDIR_MAX_CONNS / share;
+  poolSize = sDeferred ? 0 : getRedirConf()->poolSize;
+  if( conns < 1 ) conns = 1;
+  if( poolSize > 0 ){
+    poolSize /= share;
+    if( poolSize < 1 ) poolSize = 1;
+  }
+
+  /* Allocate the state objects for the connections */
+  if( !initConnTable(loop, conns) ){
+    logErr("Failed to initialize the connection table of the epoll redirector");
+    return 0;
+  }
+
+  /* Get the epoll instance used for multiplexing all of the sockets */
+  loop->epoll = epoll_create1(0);
+  if( loop->epoll == -1 ){
+    logErr("Failed to create the epoll instance of the redirector");
+    return 0;
+  }
+
+  /* Begin establishing the pool of Tor SocksPort connections */
+  loop->pool = initTorPool(loop->epoll, poolSize);
+  if( loop->pool == NULL ){
+    logErr("Failed to initialize the pool of Tor SocksPort connections");
+    return 0;
+  }
+
+  /* With several loops only one of them is woken per incoming connection */
+  for( tenant = 0 ; tenant < count ; tenant++ ){
+    loop->listenEnds[tenant].kind  = END_LISTEN;
+    loop->listenEnds[tenant].side  = tenant;
+    loop->listenEnds[tenant].owner = loop;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &loop->listenEnds[tenant];
+    if( share > 1 ) ev.events |= EPOLLEXCLUSIVE;
+
+    if( epoll_ctl(loop->epoll, EPOLL_CTL_ADD, listens[tenant], &ev) ){
+      logErr("Failed to register the listening socket with epoll");
+      return 0;
+    }
+  }
+
+  /* Every loop is woken once the generation is to drain */
+  if( redirDrainFd() != -1 ){
+    loop->drainEnd.kind  = END_DRAIN;
+    loop->drainEnd.side  = 0;
+    loop->drainEnd.owner = loop;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &loop->drainEnd;
+
+    if( epoll_ctl(loop->epoll, EPOLL_CTL_ADD, redirDrainFd(), &ev) ){
+      logErr("Failed to register the drain pipe of the redirector with epoll");
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* pickCpu returns the CPU the nth loop is pinned to, with the loops being
+ * spread round robin over the CPUs in allowed.
+ */
+static int pickCpu(cpu_set_t *allowed, int n)
+{
+  int cpu;
+
+  n %= CPU_COUNT(allowed);
+
+  for( cpu = 0 ; cpu < CPU_SETSIZE ; cpu++ ){
+    if( CPU_ISSET(cpu, allowed) && n-- == 0 ) return cpu;
+  }
+
+  return -1;
+}
+
+/* runLoop is the thread entry point of an event loop, it pins the thread to 
+ * the CPU of loop if there is one and then serves loop. It only returns if 
+ * the loop had an error, in which case the remaining loops keep serving.
+ */
+static void *runLoop(void *arg)
+{
+  struct redirLoop *loop = arg;
+  cpu_set_t        cpus;
+
+  if( loop->cpu != -1 ){
+    CPU_ZERO(&cpus);
+    CPU_SET(loop->cpu, &cpus);
+
+    if( pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) ){
+      logWrn("Failed to pin a redirector thread to its CPU");
+    }
+  }
+
+  serveLoop(loop);
+
+  logErr("An event loop of the redirector had an error");
+
+  return NULL;
+}
+
+/* serveLoop waits for events on the epoll instance of loop and handles them, 
+ * ad infinitum. It only returns on error.
+ */
+static void serveLoop(struct redirLoop *loop)
+{
+  struct epoll_event events[MAX_EVENTS];
+  struct redirEnd    *end;
+  struct redirConn   *conn;
+  int                ready;
+  int                wait;
+  int                i;
+
+  while(1){
+    /* Wait no longer than until the next tick of the timers, if any are armed,
+     * or that of QoS if any connections are throttled
+     */
+    wait = timerWheelWait(&loop->wheel, loop->now);
+    if( loop->throttled != NULL && (wait == -1 || wait > REDIR_QOS_TICK_MS) ){
+      wait = REDIR_QOS_TICK_MS;
+    }
+
+    ready = epoll_wait(loop->epoll, events, MAX_EVENTS, wait);
+    if( ready == -1 ){
+      if( errno != EINTR ){
+        logErr("Epoll had an error in the redirector");
+        return;
+      }
+      ready = 0;
+    }
+
+    loop->now = clockMs();
+
+    for( i = 0 ; i < ready ; i++ ){
+      end = events[i].data.ptr;
+
+      switch( end->kind ){
+        /* New connections from the child namespace */
+        case END_LISTEN:{
+          acceptConns(loop, end->side);
+          refillTorPool(loop->pool);
+          break;
+        }
+
+        /* Pooled connections to the Tor SocksPort */
+        case END_POOL:{
+          handlePoolEvent(end, events[i].events);
+          break;
+        }
+
+        /* The generation of the redirector is to drain */
+        case END_DRAIN:{
+          drainLoop(loop);
+          break;
+        }
+
+        /* Redirected connections, skipping those closed earlier in the batch */
+        default:{
+          conn = end->owner;
+          if( conn->fd[NS] == -1 ) break;
+          relayEvent(conn, end->side, events[i].events);
+          break;
+        }
+      }
+    }
+
+    /* Close the connections whose timeouts expired */
+    advanceTimerWheel(&loop->wheel, loop->now);
+
+    resumeThrottled(loop);
+
+    releaseClosed(loop);
+
+    if( loop->draining && loop->live == 0 ) loopDrained(loop);
+  }
+}
+
+
+/* initConnTable allocates a table of conns connection state objects for loop
+ * and links all of them into its list of unused state objects.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int initConnTable(struct redirLoop *loop, int conns)
+{
+  struct redirConn *table;
+  int              i;
+
+  table = secAlloc(conns * sizeof(struct redirConn));
+  if( table == NULL ){
+    logErr("Failed to allocate memory for the connection table");
+    return 0;
+  }
+
+  for( i = 0 ; i < conns ; i++ ){
+    table[i].loop    = loop;
+    table[i].fd[NS]  = -1;
+    table[i].fd[TOR] = -1;
+    table[i].throttledPrev = NULL;
+    table[i].next    = loop->freeConns;
+    loop->freeConns  = &table[i];
+  }
+
+  return 1;
+}
+
+/* acceptConns accepts the pending connections from the child namespace on the
+ * listening socket of tenant of loop, then for each of them takes a connection
+ * to the Tor SocksPort from the pool or begins establishing one (unless that
+ * waits on the SOCKS request) and registers the sockets with epoll. 
+ * Connections that cannot be redirected are closed.
+ */
+static void acceptConns(struct redirLoop *loop, int tenant)
+{
+  struct tenantStats *stats = &getRedirStats()->tenant[tenant];
+  struct redirConn   *conn;
+  int                clientIncoming;
+  int                torSock;
+  int                upstream = -1;
+  int                connecting;
+  int                side;
+
+  while(1){
+    clientIncoming = accept4(loop->listens[tenant], NULL, NULL, SOCK_NONBLOCK);
+    if( clientIncoming == -1 ){
+      if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ){
+        logErr("Redirector failed to accept a connection");
+      }
+      return;
+    }
+
+    /* Make sure that there is a state object left for the connection */
+    if( loop->freeConns == NULL ){
+      logWrn("Connection table is full, dropping connection from child namespace");
+      close(clientIncoming);
+      continue;
+    }
+
+    /* Admit no more than the cap on streams, which is that of the tenant of
+     * a shared redirector
+     */
+    statAdd(tenant[tenant].accepted, 1);
+
+    if( getRedirConf()->maxStreams
+        && (sShared ? stats->streams : getRedirStats()->streams)
+           >= (uint64_t)getRedirConf()->maxStreams ){
+      statAdd(refused, 1);
+      statAdd(tenant[tenant].refused, 1);
+      close(clientIncoming);
+      continue;
+    }
+
+    /* Take an established connection to the Tor SocksPort from the pool, or
+     * begin establishing a new one if the pool has none ready
+     */
+    torSock    = -1;
+    connecting = 0;
+    if( !sDeferred ){
+      torSock = takeTorSock(loop->pool, &upstream);
+    }
+
+    if( torSock != -1 ){
+      statAdd(poolHits, 1);
+    }
+    else if( !sDeferred ){
+      statAdd(poolMisses, 1);
+
+      /* With every Tor SocksPort down the connection is rejected at once */
+      upstream = pickUpstream(NULL, 0);
+      if( upstream != -1 ) torSock = startTorSock(upstream);
+      if( torSock == -1 ){
+        statAdd(rejected, 1);
+        close(clientIncoming);
+        continue;
+      }
+
+      connecting = 1;
+    }
+
+    /* In the passFd mode the client gets the Tor connection itself, so there
+     * is nothing left to redirect, once it is connected
+     */
+    if( getRedirConf()->passFd && !connecting ){
+      passSock(clientIncoming, torSock);
+      closeTorSock(torSock, upstream);
+      close(clientIncoming);
+      continue;
+    }
+
+    /* Take a state object and allocate what holds the bytes it relays */
+    conn = loop->freeConns;
+    if( !allocRelay(conn) ){
+      logErr("Failed to allocate buffers for the redirected connection");
+      if( torSock != -1 ) closeTorSock(torSock, upstream);
+      close(clientIncoming);
+      continue;
+    }
+    loop->freeConns = conn->next;
+    loop->live++;
+
+    /* A connection held to be passed is no stream of the redirector */
+    conn->passing = getRedirConf()->passFd;
+    if( !conn->passing ){
+      statAdd(streams, 1);
+      statAdd(tenant[tenant].streams, 1);
+    }
+
+    conn->fd[NS]     = clientIncoming;
+    conn->fd[TOR]    = torSock;
+    conn->upstream   = upstream;
+    conn->tenant     = tenant;
+    conn->connecting = connecting;
+    conn->dir[NS].tenant  = tenant;
+    conn->dir[TOR].tenant = tenant;
+    conn->startMs    = loop->now;
+    conn->activeMs   = loop->now;
+    conn->expiry     = -1;
+    conn->dir[NS].capture  = conn->passing ? 0 : openCapture();
+    conn->dir[TOR].capture = conn->dir[NS].capture;
+
+    openFlow(&conn->flow, loop->now);
+    initTimer(&conn->timer, &connExpired, conn);
+    initTenantGreet(&conn->greet);
+
+    for( side = NS ; side <= TOR ; side++ ){
+      conn->end[side].kind  = END_CONN;
+      conn->end[side].side  = side;
+      conn->end[side].owner = conn;
+      conn->events[side]    = 0;
+    }
+
+    /* Both sides start out waiting for bytes to relay, or the Tor side for
+     * its connect alone
+     */
+    if( !updateInterest(conn) ){
+      closeConn(conn);
+      continue;
+    }
+
+    armConnTimer(conn);
+  }
+}
+
+/* connectUpstream begins connecting conn to the Tor SocksPort of the upstream
+ * picked by the SOCKS request that conn received from the child namespace, 
+ * which is left to be relayed once the connect finished.
+ *
+ * Returns 1 on success, 0 on error or if the child namespace disconnected.
+ */
+static int connectUpstream(struct redirConn *conn)
+{
+  char    request[REDIR_PEEK_BC];
+  ssize_t got;
+
+  got = recv(conn->fd[NS], request, sizeof(request), MSG_PEEK | MSG_DONTWAIT);
+  if( got <= 0 ){
+    return 0;
+  }
+
+  conn->upstream = pickUpstream(request, got);
+  if( conn->upstream != -1 ) conn->fd[TOR] = startTorSock(conn->upstream);
+  if( conn->fd[TOR] == -1 ){
+    statAdd(rejected, 1);
+    return 0;
+  }
+
+  conn->connecting = 1;
+
+  return 1;
+}
+
+/* connectedUpstream finishes the connect of conn to the Tor SocksPort, once its
+ * Tor side became writable or had an error, after which both of its sides are
+ * waited on for relaying, or in the passFd mode its Tor side is passed to the
+ * client. conn is closed if the connect failed.
+ */
+static void connectedUpstream(struct redirConn *conn)
+{
+  if( !torSockConnected(conn->fd[TOR], conn->upstream) ){
+    statAdd(rejected, 1);
+    closeConn(conn);
+    return;
+  }
+
+  conn->connecting = 0;
+
+  if( conn->passing ){
+    passSock(conn->fd[NS], conn->fd[TOR]);
+    closeConn(conn);
+    return;
+  }
+
+  if( !updateInterest(conn) ){
+    closeConn(conn);
+  }
+}
+
+/* allocRelay prepares the two directions of conn for relaying, getting a
+ * buffer or in the splice mode a pipe for each of them.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int allocRelay(struct redirConn *conn)
+{
+  if( !initRelayDir(&conn->dir[NS], NS, sSplice) ){
+    return 0;
+  }
+
+  if( !initRelayDir(&conn->dir[TOR], TOR, sSplice) ){
+    freeRelayDir(&conn->dir[NS]);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* freeRelay frees what was allocated for conn by allocRelay */
+static void freeRelay(struct redirConn *conn)
+{
+  freeRelayDir(&conn->dir[NS]);
+  freeRelayDir(&conn->dir[TOR]);
+}
+
+/* relayEvent handles the events revents that happened on the side socket of
+ * conn. If the socket is writable the bytes held for it by the other direction
+ * are sent, and if it is readable bytes are received from it and then sent on
+ * to the socket on the other side. A side disconnecting only shuts the other
+ * socket down for writing once everything it sent was passed on, and the
+ * connection is closed once both directions are shut down, or when either of
+ * the sockets has an error.
+ */
+static void relayEvent(struct redirConn *conn, int side, uint32_t revents)
+{
+  conn->activeMs = conn->loop->now;
+
+  /* Only the Tor side is waited on while it connects */
+  if( conn->connecting ){
+    if( side == TOR ) connectedUpstream(conn);
+    return;
+  }
+
+  if( revents & EPOLLERR ){
+    closeConn(conn);
+    return;
+  }
+
+  /* The first bytes from the child namespace pick the upstream, and are left
+   * in the socket until it is connected
+   */
+  if( conn->fd[TOR] == -1 ){
+    if( !connectUpstream(conn) || !updateInterest(conn) ){
+      closeConn(conn);
+    }
+    return;
+  }
+
+  /* The socket is writable, the bytes for it are in the other direction */
+  if( (revents & EPOLLOUT) && !flushRelayDir(&conn->dir[!side], conn->fd[side]) ){
+    closeConn(conn);
+    return;
+  }
+
+  /* The socket is readable (a hang up is seen as a 0 byte read), which for
+   * a tenant of a shared redirector is the handshake until that is answered
+   */
+  if( revents & (EPOLLIN | EPOLLHUP) ){
+    if( !greetConn(conn, side) ){
+      closeConn(conn);
+      return;
+    }
+
+    if( side == TOR ) peekFlow(&conn->flow, conn->fd[TOR], conn->dir[TOR].total);
+
+    if( (side == NS ? conn->greet.state == GREET_DONE : conn->greet.torLeft == 0)
+        && (!fillRelayDir(&conn->dir[side], conn->fd[side])
+            || !flushRelayDir(&conn->dir[side], conn->fd[!side])) ){
+      closeConn(conn);
+      return;
+    }
+
+    if( side == TOR ){
+      trackFlow( &conn->flow, conn->dir[TOR].total, conn->dir[TOR].capture,
+                 conn->loop->now );
+    }
+  }
+
+  /* A hang up of a side at EOF means its peer closed rather than half closed,
+   * such that the bytes still meant for it can no longer be delivered 
+   */
+  if( (revents & EPOLLHUP) && conn->dir[side].eof && !conn->dir[!side].shut ){
+    closeConn(conn);
+    return;
+  }
+
+  /* Both directions passed their disconnect on, there is nothing left to do */
+  if( conn->dir[NS].shut && conn->dir[TOR].shut ){
+    closeConn(conn);
+    return;
+  }
+
+  trackThrottled(conn);
+
+  if( !updateInterest(conn) ){
+    closeConn(conn);
+  }
+}
+
+/* greetConn drives the SOCKS handshake of conn with the bytes that arrived on
+ * its side socket, if it is of a tenant of a shared redirector, see 
+ * redirTenant.c. Otherwise there is no handshake to answer, and the greet of
+ * conn stays GREET_DONE.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int greetConn(struct redirConn *conn, int side)
+{
+  if( side == NS && conn->greet.state != GREET_DONE ){
+    return greetTenant(&conn->greet, conn->tenant, conn->fd[NS], conn->fd[TOR]);
+  }
+
+  if( side == TOR && conn->greet.torLeft > 0 ){
+    return takeTorGreeting(&conn->greet, &conn->dir[TOR], &conn->flow, conn->fd[TOR]);
+  }
+
+  return 1;
+}
+
+/* updateInterest registers the events each of the sockets of conn should be
+ * waited on for. A socket is waited on for being readable while its direction
+ * is below the high watermark and not at EOF, and for being writable when the
+ * other direction has bytes that weren't sent to it yet, such that a slow
+ * reader applies back pressure to the other side rather than having its bytes
+ * buffered without bound.
+ *
+ * A socket waited on for nothing is removed from epoll until it is waited on
+ * again, as otherwise a hang up on it would be reported over and over while
+ * the connection waits on its other socket. While the Tor side connects it is
+ * waited on for being writable alone, and the other side for nothing.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int updateInterest(struct redirConn *conn)
+{
+  struct epoll_event ev;
+  int                side;
+  int                op;
+
+  for( side = NS ; side <= TOR ; side++ ){
+    if( conn->fd[side] == -1 ) continue;
+
+    ev.events   = 0;
+    ev.data.ptr = &conn->end[side];
+
+    if( conn->connecting ){
+      if( side == TOR ) ev.events = EPOLLOUT;
+    }
+    else{
+      if( relayWantsIn(&conn->dir[side]) )   ev.events |= EPOLLIN;
+      if( relayWantsOut(&conn->dir[!side]) ) ev.events |= EPOLLOUT;
+    }
+
+    if( ev.events == conn->events[side] ) continue;
+
+    op = EPOLL_CTL_MOD;
+    if( ev.events == 0 )            op = EPOLL_CTL_DEL;
+    if( conn->events[side] == 0 )   op = EPOLL_CTL_ADD;
+
+    if( epoll_ctl(conn->loop->epoll, op, conn->fd[side], &ev) ){
+      logErr("Failed to modify the events of a redirected socket");
+      return 0;
+    }
+
+    conn->events[side] = ev.events;
+  }
+
+  return 1;
+}
+
+/* armConnTimer arms the timer of conn for the earliest of its deadlines, if
+ * any of the timeouts apply
+ */
+static void armConnTimer(struct redirConn *conn)
+{
+  uint64_t deadline;
+  int      reason;
+
+  deadline = redirDeadline( conn->startMs, conn->activeMs,
+                            flowReplied(&conn->flow, conn->dir[TOR].total),
+                            &reason );
+  if( deadline == 0 ) return;
+
+  armTimer(&conn->loop->wheel, &conn->timer, deadline);
+}
+
+/* connExpired is fired by the timer of a connection, which is closed if one
+ * of its deadlines passed, or otherwise has its timer rearmed for the deadline
+ * activity moved out.
+ */
+static void connExpired(struct redirTimer *timer)
+{
+  struct redirConn *conn = timer->owner;
+  uint64_t         deadline;
+  int              reason;
+
+  deadline = redirDeadline( conn->startMs, conn->activeMs,
+                            flowReplied(&conn->flow, conn->dir[TOR].total),
+                            &reason );
+  if( deadline == 0 ) return;
+
+  if( deadline > conn->loop->now ){
+    armTimer(&conn->loop->wheel, timer, deadline);
+    return;
+  }
+
+  /* A connect that never finished counts against its upstream */
+  if( conn->connecting ) upstreamFailed(conn->upstream);
+
+  countExpiry(reason);
+  conn->expiry = reason;
+  closeConn(conn);
+}
+
+/* closeConn closes both of the sockets of conn, records its flow and the end
+ * of its capture unless it was held to be passed, frees its buffers, and puts
+ * it on the list of state objects its loop closed during the current batch of
+ * events.
+ */
+static void closeConn(struct redirConn *conn)
+{
+  if( !conn->passing ){
+    recordFlow( &conn->flow,
+                conn->expiry != -1 ? conn->expiry : flowEndReason(conn->dir),
+                conn->dir[NS].total, conn->dir[TOR].total, conn->upstream,
+                conn->tenant );
+    closeCapture(conn->dir[NS].capture);
+
+    statSub(streams, 1);
+    statSub(tenant[conn->tenant].streams, 1);
+    statAdd(tenant[conn->tenant].bytesOut, conn->dir[NS].total);
+    statAdd(tenant[conn->tenant].bytesIn, conn->dir[TOR].total);
+  }
+
+  disarmTimer(&conn->loop->wheel, &conn->timer);
+
+  conn->dir[NS].throttled  = 0;
+  conn->dir[TOR].throttled = 0;
+  trackThrottled(conn);
+
+  close(conn->fd[NS]);
+  if( conn->fd[TOR] != -1 ) closeTorSock(conn->fd[TOR], conn->upstream);
+  conn->fd[NS]  = -1;
+  conn->fd[TOR] = -1;
+
+  freeRelay(conn);
+
+  conn->next              = conn->loop->closedConns;
+  conn->loop->closedConns = conn;
+}
+
+/* releaseClosed moves the state objects loop closed during the batch of events
+ * that was just handled onto its list of unused state objects.
+ */
+static void releaseClosed(struct redirLoop *loop)
+{
+  struct redirConn *conn;
+
+  while( loop->closedConns != NULL ){
+    conn              = loop->closedConns;
+    loop->closedConns = conn->next;
+    conn->next        = loop->freeConns;
+    loop->freeConns   = conn;
+    loop->live--;
+  }
+}
+
+/* trackThrottled links conn into the throttled list of its loop if either of
+ * its directions is throttled, or unlinks it if neither is
+ */
+static void trackThrottled(struct redirConn *conn)
+{
+  struct redirLoop *loop = conn->loop;
+
+  if( conn->dir[NS].throttled || conn->dir[TOR].throttled ){
+    if( conn->throttledPrev != NULL ) return;
+
+    conn->throttledNext = loop->throttled;
+    conn->throttledPrev = &loop->throttled;
+    if( loop->throttled != NULL ) loop->throttled->throttledPrev = &conn->throttledNext;
+    loop->throttled = conn;
+    return;
+  }
+
+  if( conn->throttledPrev == NULL ) return;
+
+  *conn->throttledPrev = conn->throttledNext;
+  if( conn->throttledNext != NULL ) conn->throttledNext->throttledPrev = conn->throttledPrev;
+  conn->throttledPrev = NULL;
+}
+
+/* resumeThrottled resumes the throttled directions of the connections of loop
+ * whose QoS buckets refilled, which are then waited on for being readable
+ * again
+ */
+static void resumeThrottled(struct redirLoop *loop)
+{
+  struct redirConn *conn;
+  struct redirConn *next;
+  int              resumed;
+
+  for( conn = loop->throttled ; conn != NULL ; conn = next ){
+    next = conn->throttledNext;
+
+    resumed  = qosResume(&conn->dir[NS]);
+    resumed |= qosResume(&conn->dir[TOR]);
+    if( !resumed ) continue;
+
+    trackThrottled(conn);
+
+    if( !updateInterest(conn) ){
+      closeConn(conn);
+    }
+  }
+}
+
+/* drainLoop stops loop from accepting connections and empties its pool, as
+ * the generation of the redirector drains, such that it is left relaying the
+ * connections it has.
+ */
+static void drainLoop(struct redirLoop *loop)
+{
+  int tenant;
+
+  if( loop->draining ) return;
+
+  for( tenant = 0 ; tenant < loop->listenCount ; tenant++ ){
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, loop->listens[tenant], NULL);
+  }
+
+  epoll_ctl(loop->epoll, EPOLL_CTL_DEL, redirDrainFd(), NULL);
+
+  drainTorPool(loop->pool);
+
+  loop->draining = 1;
+}
+
+/* loopDrained counts loop as drained once it relayed its last connection,
+ * and exits the generation once every loop is, which never returns. Drained
+ * loops only wait on that.
+ */
+static void loopDrained(struct redirLoop *loop)
+{
+  loop->draining = 0;
+
+  if( __atomic_add_fetch(&sDrainedLoops, 1, __ATOMIC_ACQ_REL) == sThreads ){
+    redirDrained();
+  }
+}
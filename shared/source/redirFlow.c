@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+#include "net.h"
+
+
+/* The redirector keeps a flow record of each stream it relayed once the stream
+ * is closed, such that the App can tell the streams that were slow because of
+ * Tor (a slow reply to the handshake, the circuit and stream being built, or a
+ * slow first byte, the destination answering over the circuit) apart from the
+ * streams that were slow because of the relay (a long lifetime with few bytes
+ * after a quick first byte).
+ *
+ * The records are kept in a ring of REDIR_FLOW_RECORDS of them, in memory
+ * shared with the processes of the REDIR_FORK engine, the generations of the
+ * redirector and the App, which takes them out of the ring. The ring is a
+ * bounded queue with a sequence number for each of its slots, such that the
+ * event loop threads and forked processes put records into it and the control
+ * sessions take them out without a lock, each claiming its slot with a compare
+ * and swap. A stream closed while the ring is full has its record dropped
+ * rather than overwrite one the App did not take yet, and is counted in the
+ * redirStats, as the redirector must never wait on the App.
+ */
+
+
+/* flowSlot is a slot of the ring, with seq being its position in the ring if
+ * it is free to be put into, one past that if it holds a record to be taken
+ */
+struct flowSlot{
+  uint64_t          seq;
+  struct flowRecord record;
+};
+
+/* flowRing is the ring of flow records, with tail being the position of the
+ * next record put into it and head that of the next record taken out
+ */
+struct flowRing{
+  uint64_t        head;
+  uint64_t        tail;
+  struct flowSlot slots[REDIR_FLOW_RECORDS];
+};
+
+
+static uint32_t flowSince(uint64_t openMs, uint64_t nowMs);
+
+
+static struct flowRing *sFlowRing;
+
+
+/* initFlowRing allocates the ring of flow records in memory that stays shared
+ * with the redirector once it is cloned.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int initFlowRing(void)
+{
+  uint64_t i;
+
+  sFlowRing = allocSharedPane(sizeof(struct flowRing));
+  if( sFlowRing == NULL ){
+    logErr("Failed to allocate shared memory for the flow records of the redirector");
+    return 0;
+  }
+
+  for( i = 0 ; i < REDIR_FLOW_RECORDS ; i++ ){
+    sFlowRing->slots[i].seq = i;
+  }
+
+  return 1;
+}
+
+/* openFlow begins tracking the flow of a stream accepted at nowMs */
+void openFlow(struct flowTrack *flow, uint64_t nowMs)
+{
+  flow->openMs      = nowMs;
+  flow->replyMs     = FLOW_NEVER;
+  flow->firstByteMs = FLOW_NEVER;
+  flow->replyBc     = 0;
+  flow->headBc      = 0;
+}
+
+/* feedFlow takes what the head of flow lacks out of the bc bytes at bytes, 
+ * which Tor sent after the first at bytes of the stream, and finds the length
+ * of the reply to the handshake once the head tells it.
+ */
+void feedFlow(struct flowTrack *flow, const void *bytes, size_t bc, uint64_t at)
+{
+  size_t skip;
+  size_t take;
+
+  if( flow->replyBc != 0 || at > flow->headBc ) return;
+
+  skip = flow->headBc - at;
+  if( skip >= bc ) return;
+
+  take = bc - skip;
+  if( take > FLOW_HEAD_BC - flow->headBc ) take = FLOW_HEAD_BC - flow->headBc;
+
+  memcpy(flow->head + flow->headBc, (const unsigned char *)bytes + skip, take);
+  flow->headBc += take;
+
+  flow->replyBc = socksReplyBc(flow->head, flow->headBc);
+}
+
+/* peekFlow feeds flow with the bytes torSock holds for it, without taking them
+ * off torSock, with torBytes being those taken off it so far. This is for the
+ * engines that relay the bytes without seeing them (the splice mode), or see
+ * them only once they were passed on, as such it is called before torSock is
+ * received from, and only until the length of the reply is known.
+ */
+void peekFlow(struct flowTrack *flow, int torSock, uint64_t torBytes)
+{
+  unsigned char in[FLOW_HEAD_BC];
+  ssize_t       got;
+
+  if( flow->replyBc != 0 || torBytes >= FLOW_HEAD_BC ) return;
+
+  got = recv(torSock, in, FLOW_HEAD_BC - torBytes, MSG_PEEK | MSG_DONTWAIT);
+  if( got > 0 ) feedFlow(flow, in, got, torBytes);
+}
+
+/* trackFlow notes when the Tor direction of a stream passed the reply to its
+ * handshake and its first byte after that, with torBytes being those it
+ * received in total by nowMs. The end of the reply is captured as well, with
+ * capture being the stream it is captured as, or 0.
+ */
+void trackFlow(struct flowTrack *flow, uint64_t torBytes, uint32_t capture,
+               uint64_t nowMs)
+{
+  if( flow->replyMs == FLOW_NEVER && flowReplied(flow, torBytes) ){
+    flow->replyMs = flowSince(flow->openMs, nowMs);
+    captureReply(capture, flow->replyBc);
+  }
+
+  if( flow->firstByteMs == FLOW_NEVER && flowReplied(flow, torBytes)
+      && torBytes > flow->replyBc ){
+    flow->firstByteMs = flowSince(flow->openMs, nowMs);
+  }
+}
+
+/* flowReplied returns 1 if Tor finished its reply to the handshake of the 
+ * stream of flow within the torBytes it sent, 0 otherwise.
+ */
+int flowReplied(struct flowTrack *flow, uint64_t torBytes)
+{
+  return flow->replyBc != 0 && torBytes >= flow->replyBc;
+}
+
+/* socksReplyBc finds the length of the reply of a Socks5 server to the 
+ * handshake of its client out of the first bc bytes of it, which is the 
+ * method selection, the answer to the authentication if one was selected, 
+ * and the reply to the request. A reply that fails the handshake ends early,
+ * as the server then closes the connection. See socksDestHash in 
+ * redirUpstream.c for the client side of the handshake.
+ *
+ * Returns the length of the reply, or 0 if the bc bytes don't tell it yet.
+ */
+size_t socksReplyBc(const unsigned char *reply, size_t bc)
+{
+  size_t at = 2;
+
+  /* VER [1] || METHOD [1], with METHOD 0 for none and 2 for username and 
+   * password
+   */
+  if( bc < 2 ) return 0;
+  if( reply[1] != 0 && reply[1] != 2 ) return 2;
+
+  /* VER [1] || STATUS [1] */
+  if( reply[1] == 2 ){
+    if( bc < 4 ) return 0;
+    if( reply[3] != 0 ) return 4;
+    at = 4;
+  }
+
+  /* VER [1] || REP [1] || RSV [1] || ATYP [1] || BND.ADDR [var] || BND.PORT [2] */
+  if( bc < at + 4 ) return 0;
+
+  switch( reply[at + 3] ){
+    case 1:{
+      return at + 4 + 4 + 2;
+    }
+
+    case 3:{
+      if( bc < at + 5 ) return 0;
+      return at + 4 + 1 + reply[at + 4] + 2;
+    }
+
+    case 4:{
+      return at + 4 + 16 + 2;
+    }
+
+    default:{
+      return at + 4;
+    }
+  }
+}
+
+/* flowEndReason returns the reason a stream relayed in the two directions of
+ * dirs was closed for, unless it expired. A client closing rather than half
+ * closing its socket once it got its answer is done, even though the stream
+ * is then closed before Tor disconnected.
+ */
+int flowEndReason(struct relayDir *dirs)
+{
+  if( !dirs[NS].eof && !dirs[TOR].eof ) return FLOW_ABORTED;
+
+  if( relayWantsOut(&dirs[NS]) || relayWantsOut(&dirs[TOR]) ) return FLOW_ABORTED;
+
+  return FLOW_DONE;
+}
+
+/* recordFlow puts the flow record of a stream closed for reason into the ring,
+ * with bytesOut and bytesIn being the bytes it received from either side and
+ * upstream and tenant those it was relayed for, or drops it if the ring is
+ * full.
+ */
+void recordFlow(struct flowTrack *flow, int reason, uint64_t bytesOut,
+                uint64_t bytesIn, int upstream, int tenant)
+{
+  struct flowSlot *slot;
+  uint64_t        pos;
+  uint64_t        seq;
+
+  if( sFlowRing == NULL ) return;
+
+  pos = __atomic_load_n(&sFlowRing->tail, __ATOMIC_RELAXED);
+
+  while(1){
+    slot = &sFlowRing->slots[pos % REDIR_FLOW_RECORDS];
+    seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    /* The slot was not taken yet, the ring is full */
+    if( seq < pos ){
+      statAdd(flowsDropped, 1);
+      return;
+    }
+
+    /* Another stream put its record first, try the next position */
+    if( seq > pos ){
+      pos = __atomic_load_n(&sFlowRing->tail, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    if( __atomic_compare_exchange_n( &sFlowRing->tail, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ){
+      break;
+    }
+  }
+
+  slot->record.openMs      = flow->openMs;
+  slot->record.closeMs     = clockMs();
+  slot->record.bytesOut    = bytesOut;
+  slot->record.bytesIn     = bytesIn;
+  slot->record.replyMs     = flow->replyMs;
+  slot->record.firstByteMs = flow->firstByteMs;
+  slot->record.reason      = reason;
+  slot->record.upstream    = upstream == -1 ? FLOW_NO_UPSTREAM : upstream;
+  slot->record.tenant      = tenant;
+
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* takeFlowRecords takes up to max of the records in the ring, oldest first,
+ * and stores them in records.
+ *
+ * Returns the number of records taken.
+ */
+int takeFlowRecords(struct flowRecord *records, int max)
+{
+  struct flowSlot *slot;
+  uint64_t        pos;
+  uint64_t        seq;
+  int             taken = 0;
+
+  if( sFlowRing == NULL ) return 0;
+
+  pos = __atomic_load_n(&sFlowRing->head, __ATOMIC_RELAXED);
+
+  while( taken < max ){
+    slot = &sFlowRing->slots[pos % REDIR_FLOW_RECORDS];
+    seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    /* The slot holds no record yet, the ring is empty */
+    if( seq < pos + 1 ) break;
+
+    /* Another session took the record first, try the next position */
+    if( seq > pos + 1 ){
+      pos = __atomic_load_n(&sFlowRing->head, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    if( !__atomic_compare_exchange_n( &sFlowRing->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ){
+      continue;
+    }
+
+    records[taken++] = slot->record;
+
+    __atomic_store_n(&slot->seq, pos + REDIR_FLOW_RECORDS, __ATOMIC_RELEASE);
+
+    pos++;
+  }
+
+  return taken;
+}
+
+
+/* flowSince returns the milliseconds from openMs to nowMs, cut short of
+ * FLOW_NEVER
+ */
+static uint32_t flowSince(uint64_t openMs, uint64_t nowMs)
+{
+  if( nowMs < openMs ) return 0;
+  if( nowMs - openMs >= FLOW_NEVER ) return FLOW_NEVER - 1;
+
+  return nowMs - openMs;
+}
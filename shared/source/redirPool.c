@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+
+
+/* The pool keeps up to a configured number of connections to the Tor SocksPort
+ * established ahead of time, such that a connection accepted from the child
+ * namespace can immediately be handed one rather than waiting on a connect.
+ * The pooled connections are established with non-blocking connects that are
+ * waited on by the event loop of the redirector, and every connection taken
+ * from the pool is replaced with a new one in the background.
+ *
+ * A pooled connection that becomes readable before being taken was closed (or
+ * otherwise disturbed) by Tor, it is discarded and replaced.
+ *
+ * A slot registers each of its sockets with the other of its two ends in
+ * turn, such that an event of the socket it had before being restarted, which
+ * may still be in the batch of events being handled, points to the end the 
+ * slot no longer uses and is dropped, rather than being taken for an event of
+ * its current socket. Only the socket a slot had when the batch was waited
+ * for can have events in it, and the slot registers at most one more socket
+ * during the batch, as that one has no events to empty the slot with, such
+ * that two ends are enough.
+ *
+ * The upstream of each pooled connection is picked when it is started, such
+ * that the pool is spread over the Tor SocksPorts as the connections are. A
+ * slot is left empty while no upstream admits connections, and the pooled 
+ * connects are what usually probes an upstream whose circuit breaker is open.
+ */
+
+
+enum{ SLOT_EMPTY = 0, SLOT_CONNECTING = 1, SLOT_READY = 2 };
+
+/* poolSlot is a slot of a pool, end[gen & 1] is registered with the event 
+ * loop of the pool while the slot is not empty.
+ */
+struct poolSlot{
+  struct redirEnd end[2];
+  struct torPool  *pool;
+  int             fd;
+  int             upstream;
+  int             state;
+  unsigned        gen;
+};
+
+/* torPool is a pool of slotCount slots, each event loop has its own */
+struct torPool{
+  struct poolSlot *slots;
+  int             slotCount;
+  int             epoll;
+};
+
+
+static void startSlot(struct poolSlot *slot);
+static void emptySlot(struct poolSlot *slot);
+
+
+/* initTorPool allocates a pool of size slots, the sockets of which will be
+ * registered with the epoll instance epollFd, then begins establishing a
+ * connection to the Tor SocksPort for each of the slots. A size of 0 results
+ * in a pool that is always empty.
+ *
+ * Returns a pointer to the pool on success, NULL on error.
+ */
+struct torPool *initTorPool(int epollFd, int size)
+{
+  struct torPool *pool;
+  int            i;
+
+  if( epollFd == -1 || size < 0 ){
+    logErr("Invalid argument passed to initTorPool");
+    return NULL;
+  }
+
+  /* The slots follow the pool in the same allocation */
+  pool = secAlloc(sizeof(struct torPool) + size * sizeof(struct poolSlot));
+  if( pool == NULL ){
+    logErr("Failed to allocate memory for the Tor connection pool");
+    return NULL;
+  }
+
+  pool->slots     = (struct poolSlot *)(pool + 1);
+  pool->slotCount = size;
+  pool->epoll     = epollFd;
+
+  for( i = 0 ; i < size ; i++ ){
+    pool->slots[i].end[0].kind  = END_POOL;
+    pool->slots[i].end[0].side  = 0;
+    pool->slots[i].end[0].owner = &pool->slots[i];
+    pool->slots[i].end[1]       = pool->slots[i].end[0];
+    pool->slots[i].end[1].side  = 1;
+    pool->slots[i].pool         = pool;
+    pool->slots[i].fd           = -1;
+    pool->slots[i].state        = SLOT_EMPTY;
+    pool->slots[i].gen          = 0;
+  }
+
+  refillTorPool(pool);
+
+  return pool;
+}
+
+/* takeTorSock takes an established connection to the Tor SocksPort out of 
+ * pool, which is no longer registered with the event loop, and begins
+ * establishing its replacement. The upstream of the connection is stored in
+ * *upstream.
+ *
+ * Returns the non-blocking socket on success, -1 if none are ready.
+ */
+int takeTorSock(struct torPool *pool, int *upstream)
+{
+  struct poolSlot *slot;
+  int             torSock;
+  int             i;
+
+  for( i = 0 ; i < pool->slotCount ; i++ ){
+    slot = &pool->slots[i];
+    if( slot->state != SLOT_READY ) continue;
+
+    if( epoll_ctl(pool->epoll, EPOLL_CTL_DEL, slot->fd, NULL) ){
+      logErr("Failed to remove a pooled Tor connection from epoll");
+      emptySlot(slot);
+      continue;
+    }
+
+    torSock     = slot->fd;
+    *upstream   = slot->upstream;
+    slot->fd    = -1;
+    slot->state = SLOT_EMPTY;
+
+    startSlot(slot);
+
+    return torSock;
+  }
+
+  return -1;
+}
+
+/* refillTorPool begins establishing a connection to the Tor SocksPort for each
+ * of the empty slots of pool, such as those that previously failed.
+ */
+void refillTorPool(struct torPool *pool)
+{
+  int i;
+
+  for( i = 0 ; i < pool->slotCount ; i++ ){
+    if( pool->slots[i].state == SLOT_EMPTY ) startSlot(&pool->slots[i]);
+  }
+}
+
+/* handlePoolEvent handles the events that happened on the pooled connection of
+ * end. A connecting socket that became writable has finished connecting, with
+ * success if it has no error, one that had an error or hung up without
+ * becoming writable failed to connect, and a ready socket with any event was
+ * disturbed. The events of a socket the slot no longer has are dropped.
+ */
+void handlePoolEvent(struct redirEnd *end, uint32_t events)
+{
+  struct poolSlot    *slot = end->owner;
+  struct epoll_event ev;
+
+  /* The pool was drained earlier in the batch of events, or the slot was 
+   * restarted since the socket had the events
+   */
+  if( slot->state == SLOT_EMPTY || end != &slot->end[slot->gen & 1] ) return;
+
+  if( slot->state == SLOT_READY ){
+    emptySlot(slot);
+    startSlot(slot);
+    return;
+  }
+
+  if( !(events & EPOLLOUT) ){
+    if( events & (EPOLLERR | EPOLLHUP) ){
+      upstreamFailed(slot->upstream);
+      emptySlot(slot);
+    }
+    return;
+  }
+
+  /* The connect finished, find out if it was with success */
+  if( !torSockConnected(slot->fd, slot->upstream) ){
+    emptySlot(slot);
+    return;
+  }
+
+  /* A ready socket is waited on only for being disturbed */
+  ev.events   = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = &slot->end[slot->gen & 1];
+  if( epoll_ctl(slot->pool->epoll, EPOLL_CTL_MOD, slot->fd, &ev) ){
+    logErr("Failed to modify the events of a pooled Tor connection");
+    emptySlot(slot);
+    return;
+  }
+
+  slot->state = SLOT_READY;
+}
+
+/* drainTorPool closes the connections of pool, which is left without slots
+ * such that it is never refilled, as its generation of the redirector drains.
+ */
+void drainTorPool(struct torPool *pool)
+{
+  int i;
+
+  for( i = 0 ; i < pool->slotCount ; i++ ){
+    if( pool->slots[i].state != SLOT_EMPTY ) emptySlot(&pool->slots[i]);
+  }
+
+  pool->slotCount = 0;
+}
+
+
+/* startSlot begins establishing a connection to the Tor SocksPort for the empty
+ * slot and registers it with the event loop under the next end of the slot, 
+ * the slot is left empty on error.
+ */
+static void startSlot(struct poolSlot *slot)
+{
+  struct epoll_event ev;
+
+  slot->upstream = pickUpstream(NULL, 0);
+  if( slot->upstream == -1 ) return;
+
+  slot->fd = startTorSock(slot->upstream);
+  if( slot->fd == -1 ) return;
+
+  ev.events   = EPOLLOUT;
+  ev.data.ptr = &slot->end[(slot->gen + 1) & 1];
+  if( epoll_ctl(slot->pool->epoll, EPOLL_CTL_ADD, slot->fd, &ev) ){
+    logErr("Failed to register a pooled Tor connection with epoll");
+    closeTorSock(slot->fd, slot->upstream);
+    slot->fd = -1;
+    return;
+  }
+
+  slot->gen++;
+  slot->state = SLOT_CONNECTING;
+}
+
+/* emptySlot closes the connection of slot, which removes it from the epoll
+ * instance as well.
+ */
+static void emptySlot(struct poolSlot *slot)
+{
+  closeTorSock(slot->fd, slot->upstream);
+  slot->fd    = -1;
+  slot->state = SLOT_EMPTY;
+}
@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+#include "prng.h"
+
+
+/* A redirector can be shared by many sandboxes rather than each of them
+ * cloning its own, each of which has its own SECCOMP filter, pool, relay
+ * buffers and connections to Tor, which with dozens of sandboxes on a host are
+ * dozens of redirectors that mostly sit idle. Each sandbox is a tenant of the
+ * shared redirector, which listens on a Unix Domain Socket in its sandbox
+ * directory, such that what a sandbox costs the shared redirector is that
+ * socket, and the tenant of a connection is that of the socket it was
+ * accepted on. The shared redirector runs the REDIR_EPOLL engine, its event
+ * loops waiting on the sockets of every tenant.
+ *
+ * Tor isolates streams by the credentials of their SOCKS authentication, and
+ * the sandboxes pick theirs on their own, such that the streams of two of them
+ * could share circuits. The shared redirector therefore answers the SOCKS
+ * method selection and authentication of the connections itself, and then
+ * authenticates to Tor with the random token of the tenant ahead of the
+ * username of the client, such that the streams of different tenants never
+ * share circuits while those of a tenant are isolated from each other as they
+ * are without sharing. Tor's answers to this are taken from the Tor direction
+ * of the connection rather than relayed, and what follows the authentication
+ * (the request, in the same bytes with a pipelining client) is relayed as is.
+ *
+ * The counters of each tenant are kept in the redirStats, and the cap on
+ * streams and the QoS buckets of the sandbox apply to each of the tenants,
+ * such that one of them cannot take what the others are given.
+ */
+
+
+enum{ SOCKS_VER = 5, AUTH_VER = 1, METHOD_NONE = 0, METHOD_USERPASS = 2,
+      METHOD_REFUSED = 0xFF };
+
+/* The token of a tenant in hex, as it is put ahead of the username */
+enum{ TOKEN_HEX_BC = TENANT_TOKEN_BC * 2 };
+
+
+static int authTor(struct tenantGreet *greet, int tenant, int torSock,
+                   unsigned char *user, size_t userBc,
+                   unsigned char *pass, size_t passBc);
+static int takeGreeting(int nsSock, size_t bc);
+
+
+/* Tor's answers to the handshake of the redirector, the method selection of
+ * the username and password authentication and its success
+ */
+static const unsigned char sTorGreeting[] = { SOCKS_VER, METHOD_USERPASS, AUTH_VER, 0 };
+
+/* The tokens of the tenants, in hex, read only once initialized */
+static char *sTokens;
+static int  sTenantCount;
+
+
+/* initTenants draws a random token for each of the count tenants of a shared
+ * redirector, the memory of which is then frozen.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int initTenants(int count)
+{
+  int i;
+
+  sTokens = allocMemoryPane(REDIR_MAX_TENANTS * TOKEN_HEX_BC);
+  if( sTokens == NULL ){
+    logErr("Failed to allocate the memory for the tokens of the tenants");
+    return 0;
+  }
+
+  for( i = 0 ; i < count ; i++ ){
+    if( !randomizeHex(sTokens + i * TOKEN_HEX_BC, TENANT_TOKEN_BC) ){
+      logErr("Failed to draw the token of a tenant");
+      return 0;
+    }
+  }
+
+  if( !freezeMemoryPane(sTokens, REDIR_MAX_TENANTS * TOKEN_HEX_BC) ){
+    logErr("Failed to freeze the tokens of the tenants");
+    return 0;
+  }
+
+  sTenantCount = count;
+
+  return 1;
+}
+
+/* tenantCount returns the tenants of a shared redirector, or 0 if the
+ * redirector serves a single sandbox
+ */
+int tenantCount(void)
+{
+  return sTenantCount;
+}
+
+/* initTenantGreet readies greet for the handshake of a new connection, which
+ * is only answered by a shared redirector
+ */
+void initTenantGreet(struct tenantGreet *greet)
+{
+  greet->state   = sTenantCount > 0 ? GREET_METHODS : GREET_DONE;
+  greet->torLeft = 0;
+}
+
+/* greetTenant drives the SOCKS handshake of a connection of tenant, with the
+ * client on nsSock and Tor on torSock, as far as the bytes that arrived from
+ * the client allow. The method selection and authentication of the client are
+ * taken from nsSock and answered, and once they are the redirector
+ * authenticates to Tor on torSock, after which greet is GREET_DONE and nsSock
+ * is relayed.
+ *
+ * Returns 1 on success, 0 on error or if the client disconnected.
+ */
+int greetTenant(struct tenantGreet *greet, int tenant, int nsSock, int torSock)
+{
+  unsigned char in[REDIR_PEEK_BC];
+  unsigned char answer[2];
+  ssize_t       got;
+  size_t        userBc;
+  size_t        passBc;
+  size_t        bc;
+
+  while( greet->state != GREET_DONE ){
+    got = recv(nsSock, in, sizeof(in), MSG_PEEK | MSG_DONTWAIT);
+    if( got == 0 ) return 0;
+    if( got == -1 ) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    /* VER [1] || NMETHODS [1] || METHODS [NMETHODS] */
+    if( greet->state == GREET_METHODS ){
+      if( got >= 1 && in[0] != SOCKS_VER ) return 0;
+      if( got < 2 || (size_t)got < 2 + (size_t)in[1] ) return 1;
+
+      answer[0] = SOCKS_VER;
+      answer[1] = memchr(in + 2, METHOD_USERPASS, in[1]) != NULL ? METHOD_USERPASS
+                : memchr(in + 2, METHOD_NONE, in[1]) != NULL     ? METHOD_NONE
+                :                                                  METHOD_REFUSED;
+
+      if( !takeGreeting(nsSock, 2 + in[1])
+          || send(nsSock, answer, 2, MSG_NOSIGNAL | MSG_DONTWAIT) != 2
+          || answer[1] == METHOD_REFUSED ){
+        return 0;
+      }
+
+      if( answer[1] == METHOD_NONE ){
+        return authTor(greet, tenant, torSock, NULL, 0, NULL, 0);
+      }
+
+      greet->state = GREET_AUTH;
+      continue;
+    }
+
+    /* VER [1] || ULEN [1] || UNAME [ULEN] || PLEN [1] || PASSWD [PLEN] */
+    if( got >= 1 && in[0] != AUTH_VER ) return 0;
+    if( got < 2 || (size_t)got < 3 + (size_t)in[1] ) return 1;
+
+    userBc = in[1];
+    passBc = in[2 + userBc];
+    bc     = 3 + userBc + passBc;
+    if( (size_t)got < bc ) return 1;
+
+    answer[0] = AUTH_VER;
+    answer[1] = 0;
+
+    if( !takeGreeting(nsSock, bc)
+        || send(nsSock, answer, 2, MSG_NOSIGNAL | MSG_DONTWAIT) != 2 ){
+      return 0;
+    }
+
+    return authTor(greet, tenant, torSock, in + 2, userBc, in + 3 + userBc, passBc);
+  }
+
+  return 1;
+}
+
+/* takeTorGreeting takes Tor's answers to the handshake of the redirector from
+ * torSock as they arrive, which are counted (and captured) as received in
+ * dir, the Tor direction of the connection, and fed to flow, as they stand in
+ * for those the client got.
+ *
+ * Returns 1 on success, 0 on error, if Tor disconnected, or if it didn't
+ * accept the handshake.
+ */
+int takeTorGreeting(struct tenantGreet *greet, struct relayDir *dir,
+                    struct flowTrack *flow, int torSock)
+{
+  unsigned char in[sizeof(sTorGreeting)];
+  size_t        at;
+  ssize_t       got;
+
+  while( greet->torLeft > 0 ){
+    at  = sizeof(sTorGreeting) - greet->torLeft;
+    got = recv(torSock, in, greet->torLeft, MSG_DONTWAIT);
+    if( got == 0 ) return 0;
+    if( got == -1 ) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    if( memcmp(in, sTorGreeting + at, got) ){
+      logWrn("Tor didn't accept the handshake of a tenant of the redirector");
+      return 0;
+    }
+
+    feedFlow(flow, in, got, dir->total);
+
+    greet->torLeft -= got;
+    dir->total     += got;
+
+    captureIo(dir->capture, CAPTURE_RECV, TOR, got);
+  }
+
+  return 1;
+}
+
+
+/* authTor sends the handshake of the connection of tenant to Tor on torSock,
+ * a method selection of username and password authentication and then the
+ * token of tenant followed by the userBc bytes of user as the username, and
+ * pass as the password, or the token alone when the client didn't
+ * authenticate. A username too long for SOCKS is cut short, and an empty
+ * password is sent as a single 0, as SOCKS has no empty passwords. torSock is
+ * connected and has sent nothing yet, such that the handshake fits into its
+ * send buffer.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int authTor(struct tenantGreet *greet, int tenant, int torSock,
+                   unsigned char *user, size_t userBc,
+                   unsigned char *pass, size_t passBc)
+{
+  unsigned char out[3 + 2 + 255 + 1 + 255];
+  size_t        at = 0;
+
+  if( userBc > 255 - TOKEN_HEX_BC ) userBc = 255 - TOKEN_HEX_BC;
+
+  /* VER [1] || NMETHODS [1] || METHODS [1] */
+  out[at++] = SOCKS_VER;
+  out[at++] = 1;
+  out[at++] = METHOD_USERPASS;
+
+  /* VER [1] || ULEN [1] || UNAME [ULEN] || PLEN [1] || PASSWD [PLEN] */
+  out[at++] = AUTH_VER;
+  out[at++] = TOKEN_HEX_BC + userBc;
+  memcpy(out + at, sTokens + tenant * TOKEN_HEX_BC, TOKEN_HEX_BC);
+  at += TOKEN_HEX_BC;
+  if( userBc ) memcpy(out + at, user, userBc);
+  at += userBc;
+
+  if( passBc == 0 ){
+    out[at++] = 1;
+    out[at++] = '0';
+  }
+  else{
+    out[at++] = passBc;
+    memcpy(out + at, pass, passBc);
+    at += passBc;
+  }
+
+  if( send(torSock, out, at, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)at ){
+    secMemClear(out, sizeof(out));
+    return 0;
+  }
+
+  secMemClear(out, sizeof(out));
+
+  greet->state   = GREET_DONE;
+  greet->torLeft = sizeof(sTorGreeting);
+
+  return 1;
+}
+
+/* takeGreeting takes the bc bytes of the handshake of the client that were
+ * peeked at from nsSock.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int takeGreeting(int nsSock, size_t bc)
+{
+  unsigned char in[REDIR_PEEK_BC];
+
+  return recv(nsSock, in, bc, MSG_DONTWAIT) == (ssize_t)bc;
+}
@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "logger.h"
+#include "settings.h"
+#include "net.h"
+
+
+/* The redirector spreads its connections over every Tor SocksPort of
+ * redirConf.torUpstreams, each being an upstream. A single Tor does its
+ * crypto on a single thread, such that it caps how much can be relayed no
+ * matter how the redirector relays, while several of them on a host scale
+ * with its CPUs.
+ *
+ * The open connections to each upstream are counted in the redirStats, such
+ * that they are shared with the processes of the REDIR_FORK engine. A
+ * connection is counted from its connect until the redirector closes it, and
+ * in the passFd mode the redirector closes its own copy once it was passed,
+ * such that the connections to each upstream are then counted as 0.
+ *
+ * BALANCE_ROUND_ROBIN picks the upstreams in turn, and BALANCE_LEAST_CONN
+ * the one with the fewest open connections, in turn between those tied, which
+ * is round robin in the passFd mode. BALANCE_DEST_HASH picks the upstream by
+ * the hash of the destination of the SOCKS request, such that the circuits a
+ * destination was reached over (and for onion services, its descriptors and
+ * rendezvous) are reused. This requires the upstream to be connected once the
+ * request arrived rather than ahead of time, and the request to be sent with
+ * the handshake (as the SOCKS_PIPELINE client does), with the connections
+ * that send their handshake alone being balanced as with BALANCE_LEAST_CONN.
+ * The passFd mode has the client wait for its socket before it sends, as such
+ * it is balanced as with BALANCE_LEAST_CONN as well.
+ *
+ * Each upstream has a circuit breaker, such that a SocksPort that is down is
+ * neither connected to over and over nor has connections wait on it. The 
+ * breaker is closed while the upstream is up, and opens once UPSTREAM_FAILURES
+ * connects to it failed in a row, after which no connections are sent to it 
+ * for its backoff. Once the backoff ran out the breaker is half open, letting a
+ * single connect through as a probe, which closes the breaker if it succeeds
+ * or opens it for twice the backoff if it fails. A probe that never finishes 
+ * is given up on after as long as the backoff, letting the next one through.
+ *
+ * The probe is whichever connect is picked next. That is often not one of a
+ * client, as the REDIR_FORK engine connects to Tor ahead of the accept and 
+ * the pool connects in the background.
+ *
+ * The connections picked while no upstream admits connections are rejected at
+ * once, such that clients fail fast rather than wait on a SocksPort that is 
+ * down. The health of the upstreams is kept in the redirStats, such that it is
+ * shared with the processes of the REDIR_FORK engine and seen by the app, and
+ * the breakers only log when they open and close, rather than each failure.
+ */
+
+
+static int socksDestHash(char *request, size_t bc, uint32_t *hash);
+static int leastConnUp(int start, int count);
+
+
+static unsigned sNextUpstream;
+
+
+/* pickUpstream picks the upstream of a connection according to the balancing
+ * policy, with request being the bc bytes the client sent so far, or NULL if
+ * it is yet to send, out of the upstreams that admit connections. A 
+ * destination whose upstream is open is balanced as with BALANCE_LEAST_CONN.
+ *
+ * Returns the index of the upstream, or -1 if none admit connections.
+ */
+int pickUpstream(char *request, size_t bc)
+{
+  uint32_t hash;
+  int      count = upstreamCount();
+  int      start;
+  int      pick;
+  int      i;
+
+  if( getRedirConf()->balance == BALANCE_DEST_HASH && request != NULL
+      && socksDestHash(request, bc, &hash) && upstreamAdmits(hash % count) ){
+    return hash % count;
+  }
+
+  /* The event loop threads of the epoll engine share the turn */
+  start = __atomic_fetch_add(&sNextUpstream, 1, __ATOMIC_RELAXED) % count;
+
+  /* An open upstream whose backoff ran out gets the connection as its probe, 
+   * which with BALANCE_ROUND_ROBIN it would get in turn anyway
+   */
+  for( i = 0 ; i < count ; i++ ){
+    pick = (start + i) % count;
+
+    if( getRedirConf()->balance != BALANCE_ROUND_ROBIN
+        && __atomic_load_n(&getRedirStats()->health[pick].state, __ATOMIC_RELAXED) == UPSTREAM_CLOSED ){
+      continue;
+    }
+
+    if( upstreamAdmits(pick) ) return pick;
+  }
+
+  if( getRedirConf()->balance != BALANCE_ROUND_ROBIN ){
+    pick = leastConnUp(start, count);
+    if( pick != -1 ) return pick;
+  }
+
+  return -1;
+}
+
+/* closeTorSock closes torSock, a connection to upstream, and counts it closed */
+void closeTorSock(int torSock, int upstream)
+{
+  close(torSock);
+
+  statSub(upstreamConns[upstream], 1);
+}
+
+/* torSockConnected finds out if the connect of torSock to upstream, begun by
+ * startTorSock, finished with success, once torSock became writable or had an
+ * error, and records the outcome with the circuit breaker of upstream.
+ *
+ * Returns 1 if torSock is connected, 0 if the connect failed.
+ */
+int torSockConnected(int torSock, int upstream)
+{
+  socklen_t errBc = sizeof(int);
+  int       err   = 0;
+
+  if( getsockopt(torSock, SOL_SOCKET, SO_ERROR, &err, &errBc) || err != 0 ){
+    upstreamFailed(upstream);
+    return 0;
+  }
+
+  upstreamSucceeded(upstream);
+
+  return 1;
+}
+
+/* upstreamAdmits returns 1 if a connection may be sent to upstream, which is
+ * while its breaker is closed, and for a single probe once the backoff of its
+ * open breaker ran out, which half opens it. Otherwise it returns 0.
+ */
+int upstreamAdmits(int upstream)
+{
+  struct upstreamHealth *health = &getRedirStats()->health[upstream];
+  uint64_t              now;
+  uint64_t              retry;
+  uint64_t              backoff;
+
+  if( __atomic_load_n(&health->state, __ATOMIC_RELAXED) == UPSTREAM_CLOSED ){
+    return 1;
+  }
+
+  now     = clockMs();
+  retry   = __atomic_load_n(&health->retryMs, __ATOMIC_RELAXED);
+  backoff = __atomic_load_n(&health->backoffMs, __ATOMIC_RELAXED);
+  if( now < retry ) return 0;
+
+  /* Whoever moves the retry first gets to probe, the others keep waiting */
+  if( !__atomic_compare_exchange_n( &health->retryMs, &retry, now + backoff, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ){
+    return 0;
+  }
+
+  __atomic_store_n(&health->state, UPSTREAM_HALF_OPEN, __ATOMIC_RELAXED);
+
+  return 1;
+}
+
+/* upstreamSucceeded records that a connect to upstream succeeded, closing its
+ * breaker
+ */
+void upstreamSucceeded(int upstream)
+{
+  struct upstreamHealth *health = &getRedirStats()->health[upstream];
+
+  __atomic_store_n(&health->failures, 0, __ATOMIC_RELAXED);
+
+  if( __atomic_load_n(&health->state, __ATOMIC_RELAXED) == UPSTREAM_CLOSED ) return;
+
+  if( __atomic_exchange_n(&health->state, UPSTREAM_CLOSED, __ATOMIC_RELAXED) != UPSTREAM_CLOSED ){
+    logMsg("A Tor SocksPort recovered, its circuit breaker closed");
+  }
+}
+
+/* upstreamFailed records that a connect to upstream failed, opening its 
+ * breaker once UPSTREAM_FAILURES failed in a row, or once again for twice the
+ * backoff if it was the probe of the half open breaker. The connects that were
+ * in progress as the breaker opened don't reopen it when they fail.
+ */
+void upstreamFailed(int upstream)
+{
+  struct upstreamHealth *health = &getRedirStats()->health[upstream];
+  uint32_t              state = UPSTREAM_CLOSED;
+  uint64_t              backoff;
+
+  __atomic_fetch_add(&health->connectFails, 1, __ATOMIC_RELAXED);
+
+  if( __atomic_add_fetch(&health->failures, 1, __ATOMIC_RELAXED) >= UPSTREAM_FAILURES
+      && __atomic_compare_exchange_n( &health->state, &state, UPSTREAM_OPEN, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ){
+    backoff = UPSTREAM_BACKOFF_MS;
+    logWrn("A Tor SocksPort is down, its circuit breaker opened");
+  }
+  else if( state == UPSTREAM_HALF_OPEN
+           && __atomic_compare_exchange_n( &health->state, &state, UPSTREAM_OPEN, 0,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ){
+    backoff = __atomic_load_n(&health->backoffMs, __ATOMIC_RELAXED) * 2;
+    if( backoff > UPSTREAM_BACKOFF_MAX_MS ) backoff = UPSTREAM_BACKOFF_MAX_MS;
+  }
+  else{
+    return;
+  }
+
+  __atomic_store_n(&health->backoffMs, backoff, __ATOMIC_RELAXED);
+  __atomic_store_n(&health->retryMs, clockMs() + backoff, __ATOMIC_RELAXED);
+}
+
+
+/* leastConnUp returns the upstream with the fewest open connections out of the
+ * count upstreams whose breakers are closed, in turn from start between those 
+ * tied, or -1 if all of them are open.
+ */
+static int leastConnUp(int start, int count)
+{
+  struct redirStats *stats = getRedirStats();
+  uint64_t          fewest = 0;
+  uint64_t          conns;
+  int               pick   = -1;
+  int               i;
+
+  for( i = 0 ; i < count ; i++ ){
+    if( __atomic_load_n(&stats->health[(start + i) % count].state, __ATOMIC_RELAXED) != UPSTREAM_CLOSED ){
+      continue;
+    }
+
+    conns = __atomic_load_n(&stats->upstreamConns[(start + i) % count], __ATOMIC_RELAXED);
+    if( pick == -1 || conns < fewest ){
+      pick   = (start + i) % count;
+      fewest = conns;
+    }
+  }
+
+  return pick;
+}
+
+/* socksDestHash hashes the destination of the Socks5 request that follows the
+ * handshake, and the authentication if any, in the bc bytes of request, which
+ * is of the Socks5 client of the redirected connection. The address is lower
+ * cased and the port left out, such that a host is a single destination.
+ *
+ * Returns 1 on success, 0 if request doesn't hold a whole request.
+ */
+static int socksDestHash(char *request, size_t bc, uint32_t *hash)
+{
+  unsigned char *in = (unsigned char *)request;
+  size_t        at;
+  size_t        addrBc;
+  size_t        i;
+
+  /* VER [1] || NMETHODS [1] || METHODS [NMETHODS] */
+  if( bc < 2 || in[0] != 5 ) return 0;
+  at = 2 + in[1];
+
+  /* VER [1] || ULEN [1] || UNAME [ULEN] || PLEN [1] || PASSWD [PLEN], the
+   * version of which is 1 where that of the request is 5
+   */
+  if( at < bc && in[at] == 1 ){
+    if( at + 2 > bc ) return 0;
+    at += 2 + in[at + 1];
+    if( at + 1 > bc ) return 0;
+    at += 1 + in[at];
+  }
+
+  /* VER [1] || CMD [1] || RSV [1] || ATYP [1] || DST.ADDR [var] */
+  if( at + 5 > bc || in[at] != 5 ) return 0;
+
+  switch( in[at + 3] ){
+    case 1:{
+      addrBc = 4;
+      break;
+    }
+
+    case 3:{
+      addrBc = 1 + in[at + 4];
+      break;
+    }
+
+    case 4:{
+      addrBc = 16;
+      break;
+    }
+
+    default:{
+      return 0;
+    }
+  }
+
+  if( at + 4 + addrBc > bc ) return 0;
+
+  /* FNV-1a over ATYP || DST.ADDR */
+  *hash = 2166136261u;
+  for( i = at + 3 ; i < at + 4 + addrBc ; i++ ){
+    *hash = (*hash ^ tolower(in[i])) * 16777619u;
+  }
+
+  return 1;
+}
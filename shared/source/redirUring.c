@@ -0,0 +1,1037 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+#include "net.h"
+
+enum{ OP_ACCEPT = 0, OP_READ = 1, OP_SEND = 2, OP_DRAIN = 3, OP_CANCEL = 4,
+      OP_CONNECT = 5, OP_POOL = 6 };
+
+enum{ URING_ACCEPTS = 8, URING_POOL_EVENTS = 64 };
+
+/* The most completions that can be pending at once, two for each connection,
+ * the accepts and their cancels as the generation drains, and the polls on
+ * the drain pipe and on the pool
+ */
+enum{ URING_CQ_ENTRIES = REDIR_URING_BUFFS + 2 * URING_ACCEPTS + 2 };
+
+
+/* The io_uring redirector relays every connection with a single io_uring, such
+ * that the accepts, receives and sends of all of the connections are submitted
+ * to the kernel in batches with one io_uring_enter syscall per iteration of its
+ * loop rather than with a syscall each. The receives are into registered
+ * buffers drawn from a fixed pool allocated at startup, which the kernel maps
+ * once rather than on every receive.
+ *
+ * Operations performed by an io_uring are not subject to SECCOMP, as such the
+ * ring is created disabled and is restricted to the accept, read fixed, send,
+ * poll and cancel operations before being enabled, such that a compromised 
+ * redirector cannot
+ * use it for connecting or opening sockets. Connections to the Tor SocksPort
+ * are established with non-blocking connect syscalls, which SECCOMP restricts
+ * to gTorAddrs. An accepted connection is handed one from the pool of those
+ * established ahead of time when it has one ready, see redirPool.c, the epoll
+ * instance of which is polled on the ring, and otherwise polls its own connect
+ * on the ring before either of its directions begins receiving.
+ *
+ * The upstream of a connection is picked when it is accepted, such that the 
+ * io_uring redirector cannot balance by BALANCE_DEST_HASH, for which the epoll
+ * redirector is used instead. The receives are queued as soon as a direction
+ * has room rather than when its QoS buckets allow, such that the epoll 
+ * redirector is used instead when QoS limits as well. It never passes its Tor
+ * connections to the clients either, which in the passFd mode would wait on
+ * one forever, such that the epoll redirector passes them instead.
+ *
+ * Each connection has one operation in flight per direction, which alternates
+ * between receiving from the source socket into the buffer of the direction
+ * and sending the buffer to the other socket, such that a direction never
+ * holds more than one buffer of bytes. When a side disconnects the other
+ * socket is shut down for writing, as everything received before the
+ * disconnect was already sent, and the connection is released once both
+ * sides disconnected. On error both sockets are shut down, which completes
+ * the operation in flight in the other direction, and the connection is
+ * released once nothing is in flight.
+ *
+ * Connections that go idle, stall in their SOCKS handshake or outlive their
+ * lifetime are shut down by the timers of a timer wheel, with io_uring_enter
+ * waiting no longer than until the next tick of the wheel.
+ *
+ * A poll on the drain pipe of the generation completes once it is to drain,
+ * upon which the accepts in flight are cancelled and not queued again, and
+ * the generation exits once the last of its connections was released.
+ */
+
+
+/* uringOp is an operation in flight, the user_data of its submission points
+ * to it such that its completion can be resolved to its connection.
+ */
+struct uringOp{
+  int              kind;
+  int              dir;
+  struct uringConn *conn;
+};
+
+/* uringConn is the state of a single connection relayed by the io_uring. The
+ * direction dir relays bytes received from fd[dir] in the registered buffer
+ * buffIdx[dir] to fd[!dir], and capture is the stream it is captured as, or
+ * 0, see redirCapture.c. While connecting is set the operation in flight in
+ * the TOR direction is the poll for the connect of fd[TOR] to finish.
+ */
+struct uringConn{
+  int              fd[2];
+  int              buffIdx[2];
+  size_t           len[2];
+  size_t           sent[2];
+  struct uringOp   op[2];
+  int              eof[2];
+  int              upstream;
+  int              inFlight;
+  int              closing;
+  int              connecting;
+  int              expiry;
+  size_t           nsBytes;
+  size_t           torBytes;
+  uint32_t         capture;
+  struct flowTrack flow;
+  struct redirTimer timer;
+  uint64_t         startMs;
+  uint64_t         activeMs;
+  struct uringConn *next;
+};
+
+/* uringRing holds the mappings of the submission and completion queues */
+struct uringRing{
+  int                 fd;
+  unsigned            *sqHead;
+  unsigned            *sqTail;
+  unsigned            *sqMask;
+  unsigned            *sqArray;
+  unsigned            sqEntries;
+  struct io_uring_sqe *sqes;
+  unsigned            *cqHead;
+  unsigned            *cqTail;
+  unsigned            *cqMask;
+  struct io_uring_cqe *cqes;
+  unsigned            toSubmit;
+};
+
+
+static int  initRing(unsigned entries, unsigned cqEntries);
+static int  restrictRing(void);
+static int  initBuffPool(void);
+static struct io_uring_sqe *getSqe(void);
+static int  submitAndWait(void);
+static void queueAccept(struct uringOp *op);
+static void queueRead(struct uringConn *conn, int dir);
+static void queueSend(struct uringConn *conn, int dir);
+static void queueConnect(struct uringConn *conn);
+static void queuePool(void);
+static void handleAccept(struct uringOp *op, int res);
+static void handleConnect(struct uringConn *conn, int res);
+static void handlePool(void);
+static void queueDrain(void);
+static void drainRing(void);
+static void handleRead(struct uringConn *conn, int dir, int res);
+static void handleSend(struct uringConn *conn, int dir, int res);
+static void armConnTimer(struct uringConn *conn);
+static void connExpired(struct redirTimer *timer);
+static void shutConn(struct uringConn *conn);
+
+
+static struct uringRing sRing;
+static char             *sBuffs;
+static int              *sFreeBuffs;
+static int              sFreeBuffCount;
+static struct uringConn *sFreeConns;
+static struct uringOp   sAcceptOps[URING_ACCEPTS];
+static int              sListen;
+static struct timerWheel sWheel;
+static uint64_t         sNow;
+static struct uringOp   sDrainOp   = { OP_DRAIN, 0, NULL };
+static struct uringOp   sCancelOp  = { OP_CANCEL, 0, NULL };
+static struct uringOp   sPoolOp    = { OP_POOL, 0, NULL };
+static struct torPool   *sPool;
+static int              sPoolEpoll;
+static int              sDraining;
+static int              sAccepting;
+static int              sLive;
+
+
+/* redirectUring sets up the io_uring and its pool of registered buffers, then
+ * accepts connections on the already listening Unix Domain Socket unixListen
+ * and redirects them to the Tor SocksPort ad infinitum.
+ *
+ * Returns 0 if the io_uring could not be set up, for instance because the
+ * kernel lacks support for it or it is blocked, or cannot be used with the
+ * balancing policy, QoS or the passFd mode, in which case another engine
+ * should be used. Once set up
+ * this only returns on error, returning 1.
+ */
+int redirectUring(int unixListen)
+{
+  struct io_uring_cqe *cqe;
+  struct uringOp      *op;
+  unsigned            head;
+  int                 i;
+
+  sListen = unixListen;
+  sNow    = clockMs();
+
+  if( getRedirConf()->balance == BALANCE_DEST_HASH ){
+    logWrn("The io_uring redirector cannot balance by destination");
+    return 0;
+  }
+
+  if( qosEnabled() ){
+    logWrn("The io_uring redirector cannot limit the rates of QoS");
+    return 0;
+  }
+
+  if( getRedirConf()->passFd ){
+    logWrn("The io_uring redirector cannot pass Tor connections to clients");
+    return 0;
+  }
+
+  initTimerWheel(&sWheel, sNow);
+
+  /* Accepts are completed by the ring rather than failing with EAGAIN, which
+   * the epoll engine of another generation may have set on the listening
+   * socket it shares with this one
+   */
+  if( fcntl(sListen, F_SETFL, fcntl(sListen, F_GETFL) & ~O_NONBLOCK) == -1 ){
+    logWrn("Failed to set the redirector listening socket blocking");
+    return 0;
+  }
+
+  /* Create the ring, which is disabled until it is restricted */
+  if( !initRing(REDIR_URING_ENTRIES, URING_CQ_ENTRIES) ){
+    logWrn("Failed to set up an io_uring for the redirector");
+    return 0;
+  }
+
+  /* Allocate and register the fixed pool of buffers and connections */
+  if( !initBuffPool() ){
+    logWrn("Failed to register the io_uring buffers of the redirector");
+    close(sRing.fd);
+    return 0;
+  }
+
+  /* Restrict the operations the ring can perform, then enable it */
+  if( !restrictRing() ){
+    logWrn("Failed to restrict the io_uring of the redirector");
+    close(sRing.fd);
+    return 0;
+  }
+
+  /* Begin establishing the pool of Tor SocksPort connections, the epoll
+   * instance of which has its events polled on the ring
+   */
+  sPoolEpoll = epoll_create1(0);
+  if( sPoolEpoll == -1 ){
+    logWrn("Failed to create the epoll instance of the io_uring redirector pool");
+    close(sRing.fd);
+    return 0;
+  }
+
+  sPool = initTorPool(sPoolEpoll, getRedirConf()->poolSize);
+  if( sPool == NULL ){
+    logWrn("Failed to initialize the pool of Tor SocksPort connections");
+    close(sPoolEpoll);
+    close(sRing.fd);
+    return 0;
+  }
+
+  queuePool();
+
+  /* Several accepts are kept in flight such that bursts are batched */
+  for( i = 0 ; i < URING_ACCEPTS ; i++ ){
+    sAcceptOps[i].kind = OP_ACCEPT;
+    queueAccept(&sAcceptOps[i]);
+  }
+  sAccepting = URING_ACCEPTS;
+
+  queueDrain();
+
+  /* Signal to the parent process that we can accept connections */
+  signalRedirInited();
+
+  while(1){
+    if( !submitAndWait() ){
+      logErr("Failed to submit to the io_uring of the redirector");
+      return 1;
+    }
+
+    /* Handle every completion, queueing the submissions that follow them */
+    head = *sRing.cqHead;
+    while( head != __atomic_load_n(sRing.cqTail, __ATOMIC_ACQUIRE) ){
+      cqe = &sRing.cqes[head & *sRing.cqMask];
+      op  = (struct uringOp *)(uintptr_t)cqe->user_data;
+
+      switch( op->kind ){
+        case OP_ACCEPT:{
+          handleAccept(op, cqe->res);
+          refillTorPool(sPool);
+          break;
+        }
+
+        case OP_CONNECT:{
+          handleConnect(op->conn, cqe->res);
+          break;
+        }
+
+        case OP_POOL:{
+          handlePool();
+          break;
+        }
+
+        case OP_READ:{
+          handleRead(op->conn, op->dir, cqe->res);
+          break;
+        }
+
+        case OP_SEND:{
+          handleSend(op->conn, op->dir, cqe->res);
+          break;
+        }
+
+        case OP_DRAIN:{
+          drainRing();
+          break;
+        }
+
+        /* Cancelled accepts complete on their own */
+        default:{
+          break;
+        }
+      }
+
+      head++;
+    }
+
+    __atomic_store_n(sRing.cqHead, head, __ATOMIC_RELEASE);
+
+    /* Shut down the connections whose timeouts expired */
+    advanceTimerWheel(&sWheel, sNow);
+
+    if( sDraining && sAccepting == 0 && sLive == 0 ) redirDrained();
+  }
+}
+
+
+/* initRing creates a disabled io_uring of entries submission queue entries and
+ * at least cqEntries completion queue entries, and maps its queues into
+ * memory. The completion queue is sized for every operation that can be in
+ * flight rather than by the kernel default of twice the submission queue, as
+ * completions that overflow it would be lost on kernels without
+ * IORING_FEAT_NODROP.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int initRing(unsigned entries, unsigned cqEntries)
+{
+  struct io_uring_params params;
+  size_t                 sqBc;
+  size_t                 cqBc;
+  char                   *sq;
+  char                   *cq;
+
+  memset(&params, 0, sizeof(params));
+  params.flags      = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE;
+  params.cq_entries = cqEntries;
+
+  sRing.fd = syscall(__NR_io_uring_setup, entries, &params);
+  if( sRing.fd == -1 ){
+    return 0;
+  }
+
+  if( params.cq_entries < cqEntries ){
+    close(sRing.fd);
+    return 0;
+  }
+
+  /* Waiting with a timeout, for the timers, requires IORING_ENTER_EXT_ARG */
+  if( !(params.features & IORING_FEAT_EXT_ARG) ){
+    close(sRing.fd);
+    return 0;
+  }
+
+  /* Map the submission and completion queue rings, which share a mapping on
+   * kernels with IORING_FEAT_SINGLE_MMAP
+   */
+  sqBc = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqBc = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if( params.features & IORING_FEAT_SINGLE_MMAP ){
+    if( cqBc > sqBc ) sqBc = cqBc;
+  }
+
+  sq = mmap( NULL, sqBc, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             sRing.fd, IORING_OFF_SQ_RING );
+  if( sq == MAP_FAILED ){
+    logErr("Failed to map the io_uring submission queue");
+    close(sRing.fd);
+    return 0;
+  }
+
+  cq = sq;
+  if( !(params.features & IORING_FEAT_SINGLE_MMAP) ){
+    cq = mmap( NULL, cqBc, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               sRing.fd, IORING_OFF_CQ_RING );
+    if( cq == MAP_FAILED ){
+      logErr("Failed to map the io_uring completion queue");
+      close(sRing.fd);
+      return 0;
+    }
+  }
+
+  sRing.sqes = mmap( NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     sRing.fd, IORING_OFF_SQES );
+  if( sRing.sqes == MAP_FAILED ){
+    logErr("Failed to map the io_uring submission queue entries");
+    close(sRing.fd);
+    return 0;
+  }
+
+  sRing.sqHead    = (unsigned *)(sq + params.sq_off.head);
+  sRing.sqTail    = (unsigned *)(sq + params.sq_off.tail);
+  sRing.sqMask    = (unsigned *)(sq + params.sq_off.ring_mask);
+  sRing.sqArray   = (unsigned *)(sq + params.sq_off.array);
+  sRing.sqEntries = params.sq_entries;
+  sRing.cqHead    = (unsigned *)(cq + params.cq_off.head);
+  sRing.cqTail    = (unsigned *)(cq + params.cq_off.tail);
+  sRing.cqMask    = (unsigned *)(cq + params.cq_off.ring_mask);
+  sRing.cqes      = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  sRing.toSubmit  = 0;
+
+  return 1;
+}
+
+/* restrictRing restricts the disabled ring to accept, read fixed, send, poll
+ * and cancel operations, then enables it. After this no further registrations are
+ * allowed on the ring.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int restrictRing(void)
+{
+  struct io_uring_restriction restrictions[5];
+
+  memset(restrictions, 0, sizeof(restrictions));
+  restrictions[0].opcode = IORING_RESTRICTION_SQE_OP;
+  restrictions[0].sqe_op = IORING_OP_ACCEPT;
+  restrictions[1].opcode = IORING_RESTRICTION_SQE_OP;
+  restrictions[1].sqe_op = IORING_OP_READ_FIXED;
+  restrictions[2].opcode = IORING_RESTRICTION_SQE_OP;
+  restrictions[2].sqe_op = IORING_OP_SEND;
+  restrictions[3].opcode = IORING_RESTRICTION_SQE_OP;
+  restrictions[3].sqe_op = IORING_OP_POLL_ADD;
+  restrictions[4].opcode = IORING_RESTRICTION_SQE_OP;
+  restrictions[4].sqe_op = IORING_OP_ASYNC_CANCEL;
+
+  if( syscall( __NR_io_uring_register, sRing.fd, IORING_REGISTER_RESTRICTIONS,
+               restrictions, 5 ) ){
+    return 0;
+  }
+
+  if( syscall( __NR_io_uring_register, sRing.fd, IORING_REGISTER_ENABLE_RINGS,
+               NULL, 0 ) ){
+    return 0;
+  }
+
+  return 1;
+}
+
+/* initBuffPool allocates REDIR_URING_BUFFS buffers of REDIR_BUFF_BC bytes in a
+ * single allocation and registers them with the ring, then allocates a
+ * connection state object for every two of them.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int initBuffPool(void)
+{
+  struct iovec     *iovs;
+  struct uringConn *conns;
+  int              i;
+
+  sBuffs     = secAlloc(REDIR_URING_BUFFS * REDIR_BUFF_BC);
+  iovs       = secAlloc(REDIR_URING_BUFFS * sizeof(struct iovec));
+  sFreeBuffs = secAlloc(REDIR_URING_BUFFS * sizeof(int));
+  conns      = secAlloc((REDIR_URING_BUFFS / 2) * sizeof(struct uringConn));
+  if( sBuffs == NULL || iovs == NULL || sFreeBuffs == NULL || conns == NULL ){
+    logErr("Failed to allocate memory for the io_uring buffer pool");
+    return 0;
+  }
+
+  for( i = 0 ; i < REDIR_URING_BUFFS ; i++ ){
+    iovs[i].iov_base = sBuffs + (i * REDIR_BUFF_BC);
+    iovs[i].iov_len  = REDIR_BUFF_BC;
+    sFreeBuffs[i]    = i;
+  }
+  sFreeBuffCount = REDIR_URING_BUFFS;
+
+  if( syscall( __NR_io_uring_register, sRing.fd, IORING_REGISTER_BUFFERS,
+               iovs, REDIR_URING_BUFFS ) ){
+    return 0;
+  }
+
+  for( i = 0 ; i < REDIR_URING_BUFFS / 2 ; i++ ){
+    conns[i].next = sFreeConns;
+    sFreeConns    = &conns[i];
+  }
+
+  return 1;
+}
+
+/* getSqe returns the next free submission queue entry, zeroed, first making
+ * room by submitting the queued entries if the queue is full.
+ *
+ * Returns a pointer to the entry on success, NULL on error.
+ */
+static struct io_uring_sqe *getSqe(void)
+{
+  struct io_uring_sqe *sqe;
+  unsigned            tail;
+  unsigned            idx;
+
+  tail = *sRing.sqTail;
+  if( tail - __atomic_load_n(sRing.sqHead, __ATOMIC_ACQUIRE) == sRing.sqEntries ){
+    if( syscall(__NR_io_uring_enter, sRing.fd, sRing.toSubmit, 0, 0, NULL, 0) == -1 ){
+      logErr("Failed to submit a full io_uring submission queue");
+      return NULL;
+    }
+    sRing.toSubmit = 0;
+  }
+
+  idx                = tail & *sRing.sqMask;
+  sqe                = &sRing.sqes[idx];
+  sRing.sqArray[idx] = idx;
+  memset(sqe, 0, sizeof(*sqe));
+
+  __atomic_store_n(sRing.sqTail, tail + 1, __ATOMIC_RELEASE);
+  sRing.toSubmit++;
+
+  return sqe;
+}
+
+/* submitAndWait submits every queued entry and waits for at least one
+ * completion, or until the next tick of the timers if any are armed, with a
+ * single syscall.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int submitAndWait(void)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec      ts;
+  unsigned                      flags = IORING_ENTER_GETEVENTS;
+  void                          *argPtr = NULL;
+  size_t                        argBc = 0;
+  int                           wait;
+  int                           ret;
+
+  wait = timerWheelWait(&sWheel, sNow);
+  if( wait != -1 ){
+    memset(&arg, 0, sizeof(arg));
+    ts.tv_sec  = wait / 1000;
+    ts.tv_nsec = (wait % 1000) * 1000000;
+    arg.ts     = (uintptr_t)&ts;
+
+    flags  |= IORING_ENTER_EXT_ARG;
+    argPtr  = &arg;
+    argBc   = sizeof(arg);
+  }
+
+  ret = syscall( __NR_io_uring_enter, sRing.fd, sRing.toSubmit, 1,
+                 flags, argPtr, argBc );
+
+  sNow = clockMs();
+
+  if( ret == -1 ){
+    /* Timing out or being interrupted with nothing submitted isn't an error */
+    return errno == ETIME || errno == EINTR;
+  }
+
+  sRing.toSubmit -= ret;
+
+  return 1;
+}
+
+/* queueAccept queues an accept on the listening socket for op */
+static void queueAccept(struct uringOp *op)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = getSqe();
+  if( sqe == NULL ) return;
+
+  sqe->opcode    = IORING_OP_ACCEPT;
+  sqe->fd        = sListen;
+  sqe->user_data = (uintptr_t)op;
+}
+
+/* queueDrain queues a poll on the drain pipe of the generation, if it has
+ * one, which completes once the generation is to drain
+ */
+static void queueDrain(void)
+{
+  struct io_uring_sqe *sqe;
+
+  if( redirDrainFd() == -1 ) return;
+
+  sqe = getSqe();
+  if( sqe == NULL ) return;
+
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = redirDrainFd();
+  sqe->poll32_events = POLLIN;
+  sqe->user_data     = (uintptr_t)&sDrainOp;
+}
+
+/* drainRing cancels the accepts in flight and closes the pooled connections
+ * as the generation drains, such that only the connections already accepted
+ * are relayed
+ */
+static void drainRing(void)
+{
+  struct io_uring_sqe *sqe;
+  int                 i;
+
+  sDraining = 1;
+
+  drainTorPool(sPool);
+
+  for( i = 0 ; i < URING_ACCEPTS ; i++ ){
+    sqe = getSqe();
+    if( sqe == NULL ) return;
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->addr      = (uintptr_t)&sAcceptOps[i];
+    sqe->user_data = (uintptr_t)&sCancelOp;
+  }
+}
+
+/* queueRead queues a receive from fd[dir] of conn into the buffer of dir */
+static void queueRead(struct uringConn *conn, int dir)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = getSqe();
+  if( sqe == NULL ){
+    shutConn(conn);
+    return;
+  }
+
+  conn->op[dir].kind = OP_READ;
+
+  sqe->opcode    = IORING_OP_READ_FIXED;
+  sqe->fd        = conn->fd[dir];
+  sqe->addr      = (uintptr_t)(sBuffs + conn->buffIdx[dir] * REDIR_BUFF_BC);
+  sqe->len       = REDIR_BUFF_BC;
+  sqe->buf_index = conn->buffIdx[dir];
+  sqe->user_data = (uintptr_t)&conn->op[dir];
+
+  conn->inFlight++;
+}
+
+/* queueSend queues a send of the unsent bytes in the buffer of dir to the
+ * socket on the other side of conn
+ */
+static void queueSend(struct uringConn *conn, int dir)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = getSqe();
+  if( sqe == NULL ){
+    shutConn(conn);
+    return;
+  }
+
+  conn->op[dir].kind = OP_SEND;
+
+  sqe->opcode    = IORING_OP_SEND;
+  sqe->fd        = conn->fd[!dir];
+  sqe->addr      = (uintptr_t)( sBuffs + conn->buffIdx[dir] * REDIR_BUFF_BC
+                                + conn->sent[dir] );
+  sqe->len       = conn->len[dir] - conn->sent[dir];
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t)&conn->op[dir];
+
+  conn->inFlight++;
+}
+
+/* queueConnect queues a poll for the connect of the Tor side of conn to
+ * finish, which is done once the socket is writable or has an error
+ */
+static void queueConnect(struct uringConn *conn)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = getSqe();
+  if( sqe == NULL ){
+    shutConn(conn);
+    return;
+  }
+
+  conn->op[TOR].kind = OP_CONNECT;
+
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = conn->fd[TOR];
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data     = (uintptr_t)&conn->op[TOR];
+
+  conn->inFlight++;
+}
+
+/* queuePool queues a poll on the epoll instance of the pool, which completes
+ * once any of the pooled connections has events
+ */
+static void queuePool(void)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = getSqe();
+  if( sqe == NULL ) return;
+
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = sPoolEpoll;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data     = (uintptr_t)&sPoolOp;
+}
+
+/* handleAccept handles the completion of the accept of op, with res being the
+ * accepted socket or a negative errno. The accepted connection is paired with
+ * a pooled connection to the Tor SocksPort and both of its directions begin
+ * receiving, or with a new connection that they wait on the connect of, then
+ * the accept is queued again unless the generation drains.
+ */
+static void handleAccept(struct uringOp *op, int res)
+{
+  struct uringConn *conn;
+  int              torSock;
+  int              connecting;
+  int              dir;
+
+  if( !sDraining ) queueAccept(op);
+  else sAccepting--;
+
+  if( res < 0 ){
+    if( res != -EAGAIN && res != -EINTR && res != -ECANCELED ){
+      logErr("Redirector failed to accept a connection");
+    }
+    return;
+  }
+
+  /* Make sure that there is a state object, and buffers, for the connection */
+  if( sFreeConns == NULL || sFreeBuffCount < 2 ){
+    logWrn("Buffer pool is exhausted, dropping connection from child namespace");
+    close(res);
+    return;
+  }
+
+  /* Admit no more than the cap on streams */
+  if( getRedirConf()->maxStreams
+      && getRedirStats()->streams >= (uint64_t)getRedirConf()->maxStreams ){
+    statAdd(refused, 1);
+    close(res);
+    return;
+  }
+
+  /* Take an established connection to the Tor SocksPort from the pool, or
+   * begin establishing a new one if the pool has none ready
+   */
+  conn       = sFreeConns;
+  connecting = 0;
+  torSock    = takeTorSock(sPool, &conn->upstream);
+
+  if( torSock != -1 ){
+    statAdd(poolHits, 1);
+  }
+  else{
+    statAdd(poolMisses, 1);
+
+    /* With every Tor SocksPort down the connection is rejected at once */
+    conn->upstream = pickUpstream(NULL, 0);
+    if( conn->upstream != -1 ) torSock = startTorSock(conn->upstream);
+    if( torSock == -1 ){
+      statAdd(rejected, 1);
+      close(res);
+      return;
+    }
+
+    connecting = 1;
+  }
+
+  sFreeConns = conn->next;
+  sLive++;
+  statAdd(streams, 1);
+
+  conn->fd[NS]   = res;
+  conn->fd[TOR]  = torSock;
+  conn->inFlight   = 0;
+  conn->closing    = 0;
+  conn->connecting = connecting;
+  conn->expiry     = -1;
+  conn->nsBytes  = 0;
+  conn->torBytes = 0;
+  conn->capture  = openCapture();
+  conn->startMs  = sNow;
+  conn->activeMs = sNow;
+
+  openFlow(&conn->flow, sNow);
+
+  initTimer(&conn->timer, &connExpired, conn);
+  armConnTimer(conn);
+
+  for( dir = NS ; dir <= TOR ; dir++ ){
+    conn->buffIdx[dir]  = sFreeBuffs[--sFreeBuffCount];
+    conn->len[dir]      = 0;
+    conn->sent[dir]     = 0;
+    conn->eof[dir]      = 0;
+    conn->op[dir].dir   = dir;
+    conn->op[dir].conn  = conn;
+  }
+
+  if( connecting ){
+    queueConnect(conn);
+    return;
+  }
+
+  for( dir = NS ; dir <= TOR ; dir++ ){
+    queueRead(conn, dir);
+  }
+}
+
+/* handleConnect handles the completion of the poll for the connect of the Tor
+ * side of conn, with res being the events polled or a negative errno, after
+ * which both of its directions begin receiving. conn is shut down if the
+ * connect failed.
+ */
+static void handleConnect(struct uringConn *conn, int res)
+{
+  int dir;
+
+  conn->inFlight--;
+
+  if( conn->closing ){
+    shutConn(conn);
+    return;
+  }
+
+  if( res < 0 || !torSockConnected(conn->fd[TOR], conn->upstream) ){
+    statAdd(rejected, 1);
+    shutConn(conn);
+    return;
+  }
+
+  conn->connecting = 0;
+
+  for( dir = NS ; dir <= TOR ; dir++ ){
+    queueRead(conn, dir);
+  }
+}
+
+/* handlePool handles the events of the pooled connections once the poll on
+ * the epoll instance of the pool completed, then polls it again unless the
+ * generation drains
+ */
+static void handlePool(void)
+{
+  struct epoll_event events[URING_POOL_EVENTS];
+  int                ready;
+  int                i;
+
+  ready = epoll_wait(sPoolEpoll, events, URING_POOL_EVENTS, 0);
+
+  for( i = 0 ; i < ready ; i++ ){
+    handlePoolEvent(events[i].data.ptr, events[i].events);
+  }
+
+  if( !sDraining ) queuePool();
+}
+
+/* handleRead handles the completion of a receive in the direction dir of conn,
+ * with res being the bytes received or a negative errno. Received bytes are
+ * sent on, a disconnect is passed on to the other socket, and an error shuts
+ * the connection down.
+ */
+static void handleRead(struct uringConn *conn, int dir, int res)
+{
+  conn->inFlight--;
+  conn->activeMs = sNow;
+
+  if( res < 0 || conn->closing ){
+    shutConn(conn);
+    return;
+  }
+
+  /* The source disconnected, pass it on and keep relaying the other way */
+  if( res == 0 ){
+    conn->eof[dir] = 1;
+
+    if( conn->eof[!dir] || (shutdown(conn->fd[!dir], SHUT_WR) && errno != ENOTCONN) ){
+      shutConn(conn);
+    }
+    return;
+  }
+
+  conn->len[dir]  = res;
+  conn->sent[dir] = 0;
+
+  captureIo(conn->capture, CAPTURE_RECV, dir, res);
+
+  if( dir == NS ) conn->nsBytes += res;
+
+  if( dir == TOR ){
+    feedFlow(&conn->flow, sBuffs + conn->buffIdx[dir] * REDIR_BUFF_BC, res, conn->torBytes);
+    conn->torBytes += res;
+    trackFlow(&conn->flow, conn->torBytes, conn->capture, sNow);
+  }
+
+  queueSend(conn, dir);
+}
+
+/* handleSend handles the completion of a send in the direction dir of conn,
+ * with res being the bytes sent or a negative errno. A short send is resumed,
+ * otherwise the direction goes back to receiving.
+ */
+static void handleSend(struct uringConn *conn, int dir, int res)
+{
+  conn->inFlight--;
+  conn->activeMs = sNow;
+
+  if( res < 0 || conn->closing ){
+    shutConn(conn);
+    return;
+  }
+
+  conn->sent[dir] += res;
+
+  captureIo(conn->capture, CAPTURE_SEND, !dir, res);
+
+  if( conn->sent[dir] < conn->len[dir] ){
+    queueSend(conn, dir);
+    return;
+  }
+
+  queueRead(conn, dir);
+}
+
+/* armConnTimer arms the timer of conn for the earliest of its deadlines, if
+ * any of the timeouts apply
+ */
+static void armConnTimer(struct uringConn *conn)
+{
+  uint64_t deadline;
+  int      reason;
+
+  deadline = redirDeadline( conn->startMs, conn->activeMs,
+                            flowReplied(&conn->flow, conn->torBytes), &reason );
+  if( deadline == 0 ) return;
+
+  armTimer(&sWheel, &conn->timer, deadline);
+}
+
+/* connExpired is fired by the timer of a connection, which is shut down if one
+ * of its deadlines passed, or otherwise has its timer rearmed for the deadline
+ * activity moved out.
+ */
+static void connExpired(struct redirTimer *timer)
+{
+  struct uringConn *conn = timer->owner;
+  uint64_t         deadline;
+  int              reason;
+
+  deadline = redirDeadline( conn->startMs, conn->activeMs,
+                            flowReplied(&conn->flow, conn->torBytes), &reason );
+  if( deadline == 0 ) return;
+
+  if( deadline > sNow ){
+    armTimer(&sWheel, timer, deadline);
+    return;
+  }
+
+  /* A connect that never finished counts against its upstream */
+  if( conn->connecting ) upstreamFailed(conn->upstream);
+
+  countExpiry(reason);
+  conn->expiry = reason;
+  shutConn(conn);
+}
+
+/* shutConn shuts both sockets of conn down, which completes the operation in
+ * flight in its other direction, or cancels the poll for its connect, and
+ * once nothing is in flight closes the sockets, records the flow and the end
+ * of the capture of conn and returns it and its buffers to the pool. A
+ * connection is recorded as done if a side of it disconnected with nothing
+ * left to send, as with flowEndReason.
+ */
+static void shutConn(struct uringConn *conn)
+{
+  struct io_uring_sqe *sqe;
+  int                 dir;
+  int                 reason;
+
+  if( !conn->closing ){
+    conn->closing = 1;
+    disarmTimer(&sWheel, &conn->timer);
+    shutdown(conn->fd[NS], SHUT_RDWR);
+    shutdown(conn->fd[TOR], SHUT_RDWR);
+
+    if( conn->connecting && conn->inFlight > 0 ){
+      sqe = getSqe();
+      if( sqe != NULL ){
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = (uintptr_t)&conn->op[TOR];
+        sqe->user_data = (uintptr_t)&sCancelOp;
+      }
+    }
+  }
+
+  if( conn->inFlight > 0 ) return;
+
+  close(conn->fd[NS]);
+  closeTorSock(conn->fd[TOR], conn->upstream);
+  statSub(streams, 1);
+
+  reason = FLOW_ABORTED;
+  if( conn->expiry != -1 ){
+    reason = conn->expiry;
+  }
+  else if( (conn->eof[NS] || conn->eof[TOR])
+           && conn->sent[NS] == conn->len[NS] && conn->sent[TOR] == conn->len[TOR] ){
+    reason = FLOW_DONE;
+  }
+
+  recordFlow(&conn->flow, reason, conn->nsBytes, conn->torBytes, conn->upstream, 0);
+  closeCapture(conn->capture);
+
+  for( dir = NS ; dir <= TOR ; dir++ ){
+    conn->fd[dir] = -1;
+
+    secMemClear( (volatile uint8_t *)(sBuffs + conn->buffIdx[dir] * REDIR_BUFF_BC),
+                 REDIR_BUFF_BC );
+    sFreeBuffs[sFreeBuffCount++] = conn->buffIdx[dir];
+  }
+
+  conn->next = sFreeConns;
+  sFreeConns = conn;
+  sLive--;
+}
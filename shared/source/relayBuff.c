@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+
+
+/* A relayDir is one direction of a redirected connection, holding the bytes
+ * received from its source socket that are not yet sent to its destination
+ * socket. The bytes are held in a buffer taken from the relay pool, or in the
+ * splice mode in a pipe of REDIR_PIPE_BC bytes. The buffer starts out at the
+ * smallest size of the pool and is swapped for one of twice the size whenever
+ * receiving fills it, such that bulk streams are received with fewer syscalls.
+ *
+ * Receiving is paused once the held bytes reach the high watermark and only
+ * resumed once sending has brought them down to the low watermark, such that
+ * a slow destination applies back pressure to the source, without receiving
+ * being toggled on and off for every few bytes sent.
+ *
+ * When the source disconnects the direction is at EOF, and once every held
+ * byte is sent the destination is shut down for writing such that its peer
+ * sees the disconnect, while the other direction keeps relaying. This keeps
+ * working the clients that half close after sending a request and then wait
+ * for the response.
+ *
+ * Receiving is also limited to what the QoS buckets of the direction allow
+ * (see relayQos.c). A direction whose buckets hold no tokens is throttled 
+ * until its engine resumes it.
+ *
+ * A direction of a stream being captured captures each of its receives and
+ * sends, see redirCapture.c.
+ */
+
+
+static void growRelayDir(struct relayDir *dir);
+
+
+/* initRelayDir prepares dir, of which side is the source, for relaying, 
+ * allocating its buffer, or in the splice mode (when splice is 1) getting a 
+ * non-blocking pipe for it. dir is of tenant 0, which a shared redirector
+ * changes for the connections of its other tenants, and isn't captured until
+ * its engine sets the stream it is captured as.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int initRelayDir(struct relayDir *dir, int side, int splice)
+{
+  dir->side      = side;
+  dir->tenant    = 0;
+  dir->throttled = 0;
+  dir->qosFull   = 0;
+  dir->capture   = 0;
+  dir->buff   = NULL;
+  dir->cls    = -1;
+  dir->cap    = REDIR_PIPE_BC;
+  dir->start  = 0;
+  dir->len    = 0;
+  dir->total  = 0;
+  dir->paused = 0;
+  dir->eof    = 0;
+  dir->shut   = 0;
+
+  if( splice ){
+    if( pipe2(dir->pipe, O_NONBLOCK) ){
+      logErr("Failed to get a pipe for splicing");
+      return 0;
+    }
+
+    return 1;
+  }
+
+  dir->pipe[0] = -1;
+  dir->pipe[1] = -1;
+
+  /* Take the smallest buffer from the pool, or allocate one if none are left */
+  dir->buff = takeRelayBuff(0);
+  if( dir->buff != NULL ){
+    dir->cls = 0;
+    dir->cap = relayBuffBc(0);
+    return 1;
+  }
+
+  dir->buff = secAlloc(REDIR_BUFF_BC);
+  if( dir->buff == NULL ){
+    logErr("Failed to allocate a relay buffer");
+    return 0;
+  }
+  dir->cap = REDIR_BUFF_BC;
+
+  return 1;
+}
+
+/* freeRelayDir frees what initRelayDir got for dir */
+void freeRelayDir(struct relayDir *dir)
+{
+  if( dir->buff == NULL ){
+    close(dir->pipe[0]);
+    close(dir->pipe[1]);
+    return;
+  }
+
+  if( dir->cls != -1 ){
+    giveRelayBuff(dir->buff, dir->cls);
+    dir->buff = NULL;
+    return;
+  }
+
+  if( !secFree((void **)&dir->buff, REDIR_BUFF_BC) ){
+    logErr("Failed to free a relay buffer");
+  }
+}
+
+/* fillRelayDir receives the bytes available on the source socket src into dir
+ * until it would block, the high watermark is reached, the QoS buckets of dir
+ * run out, in which case it is throttled, or src disconnects, in which case 
+ * dir is at EOF.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int fillRelayDir(struct relayDir *dir, int src)
+{
+  ssize_t got;
+  size_t  room;
+  size_t  allow;
+
+  while( relayWantsIn(dir) ){
+    /* Move the held bytes to the front of the buffer to make room after them */
+    if( dir->buff != NULL && dir->start != 0 ){
+      memmove(dir->buff, dir->buff + dir->start, dir->len);
+      dir->start = 0;
+    }
+
+    room  = dir->cap - dir->len;
+    allow = qosAllowance(dir);
+
+    if( allow == 0 ){
+      dir->throttled = 1;
+      statAdd(throttled, 1);
+      return 1;
+    }
+
+    if( room > allow ) room = allow;
+
+    if( dir->buff == NULL ){
+      got = splice( src, NULL, dir->pipe[1], NULL, room,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    }
+    else{
+      got = recv(src, dir->buff + dir->len, room, MSG_DONTWAIT);
+    }
+
+    if( got == 0 ){
+      dir->eof = 1;
+      return 1;
+    }
+
+    if( got == -1 ){
+      if( errno == EAGAIN || errno == EWOULDBLOCK ) return 1;
+      if( errno == EINTR ) continue;
+      return 0;
+    }
+
+    dir->len   += got;
+    dir->total += got;
+
+    qosCharge(dir, got);
+    captureIo(dir->capture, CAPTURE_RECV, dir->side, got);
+
+    if( dir->len == dir->cap ) growRelayDir(dir);
+
+    if( dir->len * 100 >= dir->cap * REDIR_HIGH_WATER ) dir->paused = 1;
+  }
+
+  return 1;
+}
+
+/* flushRelayDir sends the bytes held by dir to the destination socket dst until
+ * it would block or none are left, resuming receiving once the low watermark
+ * is reached. If dir is at EOF and nothing is left dst is shut down for
+ * writing.
+ *
+ * Returns 1 on success (including when not all bytes could be sent), 0 on
+ * error.
+ */
+int flushRelayDir(struct relayDir *dir, int dst)
+{
+  ssize_t sent;
+
+  while( dir->len > 0 ){
+    if( dir->buff == NULL ){
+      sent = splice( dir->pipe[0], NULL, dst, NULL, dir->len,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    }
+    else{
+      sent = send( dst, dir->buff + dir->start, dir->len,
+                   MSG_DONTWAIT | MSG_NOSIGNAL );
+    }
+
+    if( sent == -1 ){
+      if( errno == EAGAIN || errno == EWOULDBLOCK ) break;
+      if( errno == EINTR ) continue;
+      return 0;
+    }
+
+    dir->start += sent;
+    dir->len   -= sent;
+
+    captureIo(dir->capture, CAPTURE_SEND, !dir->side, sent);
+  }
+
+  if( dir->len == 0 ) dir->start = 0;
+
+  if( dir->len * 100 <= dir->cap * REDIR_LOW_WATER ) dir->paused = 0;
+
+  /* Pass the disconnect of the source on once everything before it was sent */
+  if( dir->eof && dir->len == 0 && !dir->shut ){
+    if( shutdown(dst, SHUT_WR) && errno != ENOTCONN ){
+      return 0;
+    }
+    dir->shut = 1;
+  }
+
+  return 1;
+}
+
+/* relayWantsIn returns 1 if the source socket of dir should be received from */
+int relayWantsIn(struct relayDir *dir)
+{
+  return !dir->eof && !dir->paused && !dir->throttled;
+}
+
+/* relayWantsOut returns 1 if dir has bytes for its destination socket */
+int relayWantsOut(struct relayDir *dir)
+{
+  return dir->len > 0;
+}
+
+
+/* growRelayDir swaps the buffer of dir, which is full, for one of the next
+ * size class of the relay pool. The buffer is kept if the pool has none left,
+ * or if it is the largest or wasn't taken from the pool.
+ */
+static void growRelayDir(struct relayDir *dir)
+{
+  char *bigger;
+
+  if( dir->buff == NULL || dir->cls == -1 ) return;
+
+  bigger = takeRelayBuff(dir->cls + 1);
+  if( bigger == NULL ) return;
+
+  memcpy(bigger, dir->buff + dir->start, dir->len);
+  giveRelayBuff(dir->buff, dir->cls);
+
+  dir->buff  = bigger;
+  dir->start = 0;
+  dir->cls++;
+  dir->cap   = relayBuffBc(dir->cls);
+}
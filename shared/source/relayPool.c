@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+
+
+/* The relay pool holds the buffers of the relayDirs, carved out of slabs
+ * mapped as the buffers are needed rather than with a secAlloc per 
+ * connection. The buffers come in size classes that double from REDIR_BUFF_BC
+ * up to REDIR_BUFF_MAX_BC, and a relayDir starts out with the smallest class
+ * and moves up a class whenever its buffer fills, such that bulk streams are
+ * relayed with fewer syscalls while mostly idle connections keep small 
+ * buffers.
+ *
+ * A class grows by a slab of REDIR_SLAB_CHUNK_BC bytes of buffers whenever it
+ * has none left, up to REDIR_SLAB_CLASS_BC bytes of them, such that the memory
+ * locked by the pool follows the connections relayed rather than what every
+ * class could hold, which would exceed the RLIMIT_MEMLOCK a redirector without
+ * CAP_IPC_LOCK has. The smallest class gets its first slab as the pool is 
+ * initialized, as every connection takes from it. The slabs are kept until 
+ * the process exits.
+ *
+ * Every buffer is followed by a page guard, the first of a slab by one as 
+ * well, such that overflowing a buffer segfaults rather than spilling into the
+ * next one. The buffers are locked into memory, the guards are not, and a 
+ * buffer is zeroed when it is returned.
+ *
+ * The free list of each class has its own lock, as the event loop threads of
+ * the epoll redirector share the pool. A forked relay process has its own copy
+ * of the pool. When a class is exhausted and can't grow takeRelayBuff fails,
+ * which leaves a growing relayDir with its current buffer, and initRelayDir 
+ * falls back to secAlloc.
+ */
+
+
+/* relayClass is a size class of the pool, free holds the freeCount buffers of
+ * it that aren't taken, out of the count carved so far and at most max
+ */
+struct relayClass{
+  size_t          buffBc;
+  char            **free;
+  int             freeCount;
+  int             count;
+  int             max;
+  pthread_mutex_t lock;
+};
+
+
+static int  growRelayClass(struct relayClass *class);
+static void freeRelayClasses(void);
+
+
+static struct relayClass sClasses[RELAY_CLASSES];
+static int               sClassCount;
+
+
+/* initRelayPool sets up the size classes of the relay pool, and maps the first
+ * slab of the smallest class.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int initRelayPool(void)
+{
+  struct relayClass *class;
+  size_t            buffBc;
+
+  for( buffBc = REDIR_BUFF_BC ; buffBc <= REDIR_BUFF_MAX_BC && sClassCount < RELAY_CLASSES ; buffBc *= 2 ){
+    class = &sClasses[sClassCount];
+
+    class->buffBc    = buffBc;
+    class->freeCount = 0;
+    class->count     = 0;
+    class->max       = REDIR_SLAB_CLASS_BC / buffBc;
+    if( class->max < 1 ) class->max = 1;
+
+    class->free = secAlloc(class->max * sizeof(char *));
+    if( class->free == NULL ){
+      logErr("Failed to allocate the free list of a size class of the relay pool");
+      freeRelayClasses();
+      return 0;
+    }
+
+    if( pthread_mutex_init(&class->lock, NULL) ){
+      logErr("Failed to initialize the lock of a size class of the relay pool");
+      secFree((void **)&class->free, class->max * sizeof(char *));
+      freeRelayClasses();
+      return 0;
+    }
+
+    sClassCount++;
+  }
+
+  /* Relayed bytes must never be swapped out, as with secAlloc'd memory, such
+   * that the redirector doesn't start rather than leave forensic traces
+   */
+  if( !growRelayClass(&sClasses[0]) ){
+    logErr("Failed to map and lock the first slab of the relay pool");
+    freeRelayClasses();
+    return 0;
+  }
+
+  return 1;
+}
+
+/* takeRelayBuff takes a buffer of the size class cls out of the pool, growing
+ * the class by a slab if it has none left.
+ *
+ * Returns a pointer to the buffer on success, NULL if the class has none left
+ * and can't grow, or doesn't exist.
+ */
+char *takeRelayBuff(int cls)
+{
+  struct relayClass *class;
+  char              *buff = NULL;
+
+  if( cls < 0 || cls >= sClassCount ) return NULL;
+
+  class = &sClasses[cls];
+
+  pthread_mutex_lock(&class->lock);
+  if( class->freeCount == 0 ) growRelayClass(class);
+  if( class->freeCount > 0 ){
+    buff = class->free[--class->freeCount];
+  }
+  pthread_mutex_unlock(&class->lock);
+
+  return buff;
+}
+/* giveRelayBuff zeroes buff, which was taken out of the size class cls, and
+ * returns it to the pool.
+ */
+void giveRelayBuff(char *buff, int cls)
+{
+  struct relayClass *class = &sClasses[cls];
+
+  secMemClear((volatile uint8_t *)buff, class->buffBc);
+
+  pthread_mutex_lock(&class->lock);
+  class->free[class->freeCount++] = buff;
+  pthread_mutex_unlock(&class->lock);
+}
+
+/* relayBuffBc returns the bytesize of the buffers of the size class cls, or 0
+ * if there is no such class.
+ */
+size_t relayBuffBc(int cls)
+{
+  if( cls < 0 || cls >= sClassCount ) return 0;
+
+  return sClasses[cls].buffBc;
+}
+
+
+/* growRelayClass maps a slab of REDIR_SLAB_CHUNK_BC bytes of buffers for 
+ * class, or fewer if that would take it past its max, and adds them to its
+ * free list. Each buffer is guarded with the page following it, the first 
+ * with the page preceding it as well, and locked into memory. The slab is 
+ * unmapped on error. The class is locked, or not yet shared.
+ *
+ * Returns 1 on success, 0 on error or if class is at its max.
+ */
+static int growRelayClass(struct relayClass *class)
+{
+  size_t pageBc;
+  size_t slotBc;
+  size_t slabBc;
+  char   *slab;
+  char   *buff;
+  int    count;
+  int    i;
+
+  pageBc = sysconf(_SC_PAGESIZE);
+  slotBc = ((class->buffBc + pageBc - 1) / pageBc) * pageBc + pageBc;
+
+  count = REDIR_SLAB_CHUNK_BC / class->buffBc;
+  if( count < 1 ) count = 1;
+  if( count > class->max - class->count ) count = class->max - class->count;
+  if( count <= 0 ) return 0;
+
+  slabBc = pageBc + count * slotBc;
+
+  slab = mmap( NULL, slabBc, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( slab == MAP_FAILED ) return 0;
+
+  if( mprotect(slab, pageBc, PROT_NONE) ){
+    munmap(slab, slabBc);
+    return 0;
+  }
+
+  for( i = 0 ; i < count ; i++ ){
+    buff = slab + pageBc + i * slotBc;
+
+    if( mprotect(buff + slotBc - pageBc, pageBc, PROT_NONE)
+        || mlock(buff, slotBc - pageBc) ){
+      munmap(slab, slabBc);
+      return 0;
+    }
+  }
+
+  for( i = 0 ; i < count ; i++ ){
+    class->free[class->freeCount++] = slab + pageBc + i * slotBc;
+  }
+
+  class->count += count;
+
+  return 1;
+}
+
+/* freeRelayClasses frees the free lists and locks of the size classes set up
+ * by initRelayPool, which failed, such that the pool is left without classes.
+ * No slab was mapped but for the one that failed, which was unmapped.
+ */
+static void freeRelayClasses(void)
+{
+  while( sClassCount > 0 ){
+    sClassCount--;
+    pthread_mutex_destroy(&sClasses[sClassCount].lock);
+    secFree( (void **)&sClasses[sClassCount].free,
+             sClasses[sClassCount].max * sizeof(char *) );
+  }
+}
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+
+
+/* The QoS layer schedules how fast the redirector receives the bytes of each
+ * direction of the connections it relays, rather than each of them being
+ * received as fast as its source sends. Without it a single bulk download can
+ * fill the Tor circuits and the buffers of the sandbox, such that interactive
+ * streams sharing them wait behind its bytes.
+ *
+ * Each direction is limited by two token buckets, one of the connection,
+ * refilled at redirConf.qosConnRate, and one of the sandbox shared by every
+ * connection in the direction, refilled at redirConf.qosRate. Both hold up to
+ * REDIR_QOS_BURST_MS milliseconds of their rate, and the bytes received are
+ * taken from both of them, such that a connection is held to its own rate as
+ * well as to its share of that of the sandbox. A rate of 0 doesn't limit.
+ *
+ * A direction is of the interactive class until REDIR_QOS_BULK_BC bytes were
+ * received in it, after which it is of the bulk class. The bulk class may only
+ * take from the bucket of the sandbox while it holds more than the
+ * REDIR_QOS_RESERVE percent of its burst that is kept for the interactive
+ * class, such that an interactive stream finds its bytes relayed at once no
+ * matter how many bulk streams are in flight.
+ *
+ * The buckets are kept as the time at which they are full again, such that
+ * taking from one is a single compare and swap. The buckets of the sandbox are
+ * kept in memory shared with the processes of the REDIR_FORK engine, and are
+ * shared by the event loop threads of the REDIR_EPOLL engine. A shared 
+ * redirector has buckets of the sandbox for each of its tenants, each of which
+ * is refilled at redirConf.qosRate, such that a sandbox cannot take the share
+ * of another.
+ *
+ * A direction whose buckets hold no tokens is throttled. Nothing more is 
+ * received from its source until its engine resumes it, which the engine
+ * tries every REDIR_QOS_TICK_MS milliseconds.
+ */
+
+
+enum{ NS_PER_MS = 1000000, NS_PER_S = 1000000000 };
+
+
+static size_t   bucketTokens(uint64_t full, uint64_t now, uint64_t rate, uint64_t burstNs);
+static uint64_t bucketTake(uint64_t full, uint64_t now, uint64_t rate, size_t bc);
+static uint64_t qosNowNs(void);
+
+
+/* The time at which the bucket of the sandbox of each direction is full, for
+ * each tenant
+ */
+static uint64_t *sSandboxFull;
+
+
+/* initRelayQos allocates the buckets of the sandbox in memory that stays
+ * shared with the processes the redirector forks.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int initRelayQos(void)
+{
+  sSandboxFull = allocSharedPane(REDIR_MAX_TENANTS * 2 * sizeof(uint64_t));
+  if( sSandboxFull == NULL ){
+    logErr("Failed to allocate shared memory for the QoS buckets of the redirector");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* qosEnabled returns 1 if either of the rates of the redirConf limits */
+int qosEnabled(void)
+{
+  return getRedirConf()->qosRate > 0 || getRedirConf()->qosConnRate > 0;
+}
+
+/* qosAllowance returns the bytes dir may receive right now, which is 0 if the
+ * buckets of dir hold too few tokens, or SIZE_MAX if QoS is off.
+ */
+size_t qosAllowance(struct relayDir *dir)
+{
+  struct redirConf *conf  = getRedirConf();
+  uint64_t         *sandboxFull = &sSandboxFull[dir->tenant * 2 + dir->side];
+  uint64_t         burstNs = (uint64_t)REDIR_QOS_BURST_MS * NS_PER_MS;
+  uint64_t         now;
+  size_t           allow = SIZE_MAX;
+  size_t           tokens;
+
+  if( !qosEnabled() ) return SIZE_MAX;
+
+  now = qosNowNs();
+
+  if( conf->qosConnRate > 0 ){
+    allow = bucketTokens(dir->qosFull, now, conf->qosConnRate, burstNs);
+  }
+
+  if( conf->qosRate > 0 ){
+    /* The bulk class leaves the reserve of the sandbox to the interactive */
+    if( dir->total >= REDIR_QOS_BULK_BC ){
+      burstNs = burstNs * (100 - REDIR_QOS_RESERVE) / 100;
+    }
+
+    tokens = bucketTokens( __atomic_load_n(sandboxFull, __ATOMIC_RELAXED),
+                           now, conf->qosRate, burstNs );
+    if( tokens < allow ) allow = tokens;
+  }
+
+  return allow;
+}
+
+/* qosCharge takes the bc bytes dir received from its buckets */
+void qosCharge(struct relayDir *dir, size_t bc)
+{
+  struct redirConf *conf = getRedirConf();
+  uint64_t         *sandboxFull = &sSandboxFull[dir->tenant * 2 + dir->side];
+  uint64_t         now;
+  uint64_t         full;
+
+  if( !qosEnabled() || bc == 0 ) return;
+
+  now = qosNowNs();
+
+  if( conf->qosConnRate > 0 ){
+    dir->qosFull = bucketTake(dir->qosFull, now, conf->qosConnRate, bc);
+  }
+
+  if( conf->qosRate > 0 ){
+    full = __atomic_load_n(sandboxFull, __ATOMIC_RELAXED);
+
+    while( !__atomic_compare_exchange_n( sandboxFull, &full,
+                                         bucketTake(full, now, conf->qosRate, bc), 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+  }
+}
+
+/* qosResume resumes receiving for dir if it is throttled and its buckets hold
+ * tokens again.
+ *
+ * Returns 1 if dir was resumed, 0 otherwise.
+ */
+int qosResume(struct relayDir *dir)
+{
+  if( !dir->throttled || qosAllowance(dir) == 0 ) return 0;
+
+  dir->throttled = 0;
+
+  return 1;
+}
+
+
+/* bucketTokens returns the tokens held at now by a bucket full at full, which
+ * is refilled at rate tokens a second and holds those of burstNs nanoseconds.
+ * The tokens are only handed out REDIR_BUFF_BC at a time (or all of them for
+ * a smaller bucket), as otherwise a direction whose buckets ran out would be
+ * received from a few bytes at a time, as fast as they refill.
+ */
+static size_t bucketTokens(uint64_t full, uint64_t now, uint64_t rate, uint64_t burstNs)
+{
+  uint64_t cap = burstNs * rate / NS_PER_S;
+  uint64_t tokens;
+
+  if( full <= now ) return cap;
+  if( full - now >= burstNs ) return 0;
+
+  tokens = (burstNs - (full - now)) * rate / NS_PER_S;
+  if( tokens < REDIR_BUFF_BC && tokens < cap ) return 0;
+
+  return tokens;
+}
+
+/* bucketTake returns when a bucket full at full, and refilled at rate tokens a
+ * second, is full again once bc tokens were taken from it at now
+ */
+static uint64_t bucketTake(uint64_t full, uint64_t now, uint64_t rate, size_t bc)
+{
+  if( full < now ) full = now;
+
+  return full + (uint64_t)bc * NS_PER_S / rate;
+}
+
+/* qosNowNs returns the nanoseconds on the monotonic clock */
+static uint64_t qosNowNs(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec * NS_PER_S + now.tv_nsec;
+}
@@ -99,6 +99,39 @@ void *allocMemoryPane(size_t bytesRequested)
   return memoryPane;                                    
 }
 
+/* allocSharedPane returns bytesRequested of zeroed read/write memory rounded 
+ * up to be a multiple of the memory page bytesize, which unlike the memory of
+ * allocMemoryPane stays shared with the child processes forked or cloned 
+ * after its allocation (rather than being copied on write).
+ *
+ * Returns a pointer to the first allocated byte on success, NULL on error.
+ */
+void *allocSharedPane(size_t bytesRequested)
+{
+  void *sharedPane;
+  
+  /* It makes no sense to allocate a shared pane of 0 bytes */ 
+  if( bytesRequested < 1 ){
+    logErr("Cannot allocate a shared pane of fewer than one byte");
+    return NULL;
+  }
+  
+  /* mmap rounds the length up to a multiple of the page bytesize itself, and
+   * anonymous mappings are always zero filled 
+   */ 
+  sharedPane = mmap( NULL, 
+                     bytesRequested, 
+                     PROT_WRITE | PROT_READ,
+                     MAP_SHARED | MAP_ANONYMOUS,
+                     -1, 0 );
+  if( sharedPane == MAP_FAILED ){
+    logErr("Failed to mmap memory for the shared pane");
+    return NULL;  
+  }
+  
+  return sharedPane;
+}
+
 /* freezeMemoryPane sets the page(s) pointed to by memoryPane to be read only,
  * such that writing to it will cause a defensive segfault. bytesize is the 
  * full bytesize of the memory pane, OR the number of bytes that the user 
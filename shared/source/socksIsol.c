@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "socksIsol.h"
+#include "torCon.h"
+#include "prng.h"
+#include "tweetNacl.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+
+
+/* Tor places streams that authenticated to its SocksPort with different 
+ * usernames and passwords on different circuits (IsolateSOCKSAuth, which is 
+ * on by default), without checking the credentials. The isolation policy 
+ * decides which credentials (isolation tokens) each stream authenticates with,
+ * and so which streams may share circuits. Without it every stream shares the
+ * circuit Tor picks, such that parallel bulk streams queue on a single circuit
+ * rather than spreading over as many as there are streams, and such that 
+ * streams to unrelated destinations can be linked by their exit.
+ *
+ * A token is derived from a secret drawn at random once per process, such that
+ * the tokens of a destination aren't the same from one run to the next, and 
+ * from the destination (lower cased, as domain names are case insensitive) 
+ * for ISOLATE_DEST, or the count of streams so far for ISOLATE_STREAM and, 
+ * divided by the streams per group, for ISOLATE_GROUP. The port isn't part of
+ * a destination, such that resolving a URL and connecting to it share circuits.
+ */
+
+
+enum{ ISOL_SECRET_BC = 32, ISOL_TOKEN_BC = 16 };
+
+
+static int  initSecret(void);
+
+
+static int             sPolicy       = ISOLATE_POLICY;
+static int             sGroupStreams = ISOLATE_GROUP_STREAMS;
+static uint64_t        sStreams;
+static unsigned char   sSecret[ISOL_SECRET_BC];
+static int             sSecretInit;
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* setIsolationPolicy sets the isolation policy to policy, one of the ISOLATE_
+ * values, with groupStreams being the streams of each group for ISOLATE_GROUP
+ */
+void setIsolationPolicy(int policy, int groupStreams)
+{
+  pthread_mutex_lock(&sLock);
+  
+  sPolicy       = policy;
+  sGroupStreams = groupStreams > 0 ? groupStreams : 1;
+  
+  pthread_mutex_unlock(&sLock);
+}
+
+/* getIsolationPolicy returns the isolation policy, one of the ISOLATE_ values */
+int getIsolationPolicy(void)
+{
+  int policy;
+  
+  pthread_mutex_lock(&sLock);
+  policy = sPolicy;
+  pthread_mutex_unlock(&sLock);
+  
+  return policy;
+}
+
+/* isolationAuth sets auth to the credentials a stream to the address addr, of
+ * bc bytes, on port is to authenticate with according to the isolation 
+ * policy, with a userBc of 0 meaning that it isn't to authenticate.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int isolationAuth(char *addr, uint8_t bc, uint16_t port, struct socksAuth *auth)
+{
+  unsigned char input[ISOL_SECRET_BC + 1 + 255];
+  unsigned char digest[crypto_hash_BYTES];
+  uint64_t      stream;
+  size_t        inputBc;
+  int           policy;
+  int           i;
+  
+  (void)port;
+  
+  auth->userBc = 0;
+  auth->passBc = 0;
+  
+  pthread_mutex_lock(&sLock);
+  
+  policy = sPolicy;
+  if( policy == ISOLATE_NONE ){
+    pthread_mutex_unlock(&sLock);
+    return 1;
+  }
+  
+  if( !sSecretInit && !initSecret() ){
+    pthread_mutex_unlock(&sLock);
+    return 0;
+  }
+  
+  /* secret [32] || policy [1] || destination or stream count [var] */ 
+  memcpy(input, sSecret, ISOL_SECRET_BC);
+  input[ISOL_SECRET_BC] = policy;
+  inputBc = ISOL_SECRET_BC + 1;
+  
+  if( policy == ISOLATE_DEST ){
+    for( i = 0 ; i < bc ; i++ ){
+      input[inputBc++] = tolower((unsigned char)addr[i]);
+    }
+  }
+  else{
+    stream = sStreams++;
+    if( policy == ISOLATE_GROUP ) stream /= sGroupStreams;
+    
+    memcpy(&input[inputBc], &stream, sizeof(stream));
+    inputBc += sizeof(stream);
+  }
+  
+  pthread_mutex_unlock(&sLock);
+  
+  crypto_hash(digest, input, inputBc);
+  
+  /* The token is the start of the digest in hex, Tor needs no more than that */
+  hexEncode(auth->user, digest, ISOL_TOKEN_BC);
+  auth->userBc  = 2 * ISOL_TOKEN_BC;
+  auth->pass[0] = 'i';
+  auth->passBc  = 1;
+  
+  secMemClear((volatile uint8_t *)input, sizeof(input));
+  secMemClear((volatile uint8_t *)digest, sizeof(digest));
+  
+  return 1;
+}
+
+
+/* initSecret draws the secret the tokens are derived from, which must be done
+ * holding sLock.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int initSecret(void)
+{
+  if( !randomize(sSecret, ISOL_SECRET_BC) ){
+    logErr("Failed to draw the secret of the isolation tokens");
+    return 0;
+  }
+  
+  sSecretInit = 1;
+  
+  return 1;
+}
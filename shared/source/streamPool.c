@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "streamPool.h"
+#include "torCon.h"
+#include "dnsCache.h"
+#include "isolNet.h"
+#include "socksIsol.h"
+#include "security.h"
+#include "logger.h"
+#include "settings.h"
+#include "net.h"
+
+
+/* The stream pool keeps idle Tor streams that are already connected to a
+ * URL:PORT, such that a later connect to the same URL:PORT can reuse one 
+ * rather than having Tor open a new stream, which costs a round trip over the
+ * circuit to the destination. Only streams of protocols that allow for reuse
+ * (for example HTTP with keep-alive, once the response was read in full) are 
+ * to be put into the pool, the pool cannot tell if a stream is between 
+ * messages.
+ *
+ * The pool holds up to STREAM_POOL_SIZE streams, up to STREAM_POOL_PER_DEST
+ * of them for any one URL:PORT, each for up to STREAM_POOL_IDLE seconds. The
+ * idle streams are checked as the pool is used rather than from a thread of
+ * its own, and a stream is checked for its health before being reused, such
+ * that a stream the destination or Tor closed meanwhile, or that has bytes 
+ * that weren't asked for, is closed rather than handed out.
+ *
+ * A stream is only reused by a connect that would authenticate with the same 
+ * credentials, as it is on the circuit Tor isolated those credentials onto,
+ * such that the pool keeps to the isolation policy. The policy decides the
+ * credentials of a connect by its destination alone only with ISOLATE_NONE
+ * and ISOLATE_DEST, and nothing is pooled with the others: with ISOLATE_STREAM
+ * no two streams share credentials, and with ISOLATE_GROUP a stream reused 
+ * would carry the circuit of its group over to a later one. A hedged stream 
+ * that won with credentials of its own is never reused for the same reason.
+ */
+
+
+/* poolStream is an idle stream of the pool, connected to url:port having
+ * authenticated with auth, with sock being -1 for an unused entry
+ */
+struct poolStream{
+  int              sock;
+  uint16_t         port;
+  uint8_t          bc;
+  char             url[255];
+  struct socksAuth auth;
+  uint64_t         idleSinceMs;
+};
+
+
+static int      newStream(char *url, uint8_t bc, uint16_t port);
+static void     expireStreams(uint64_t now);
+static void     dropStream(struct poolStream *stream);
+static int      streamHealthy(int sock);
+static int      streamIs(struct poolStream *stream, char *url, uint8_t bc, uint16_t port,
+                         struct socksAuth *auth);
+static int      policyPools(void);
+
+
+static struct poolStream sStreams[STREAM_POOL_SIZE];
+static int               sInit;
+static pthread_mutex_t   sLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* streamPoolCon returns a socket connected to url:PORT over Tor, url being bc
+ * bytes long, reusing an idle stream of the pool if there is a healthy one 
+ * that authenticated with the credentials the isolation policy assigns to the
+ * connect, and otherwise connecting with getTorCon and dnsCacheCon. The 
+ * credentials the stream authenticated with are stored in auth, which is to be
+ * passed to streamPoolPut along with the socket, and are cleared when the 
+ * isolation policy doesn't pool.
+ *
+ * Returns the socket on success, -1 on error.
+ */
+int streamPoolCon(char *url, uint8_t bc, uint16_t port, struct socksAuth *auth)
+{
+  uint64_t now;
+  int      torSocket = -1;
+  int      newest;
+  int      i;
+  
+  /* Basic error checking */
+  if( url == NULL || bc == 0 || auth == NULL ){
+    logErr("Something was NULL that shouldn't have been");
+    return -1; 
+  }
+  
+  /* The credentials of a policy that doesn't pool are those dnsCacheCon picks,
+   * which are left unknown rather than drawn twice, as that would count the 
+   * stream twice towards its group
+   */ 
+  auth->userBc = 0;
+  auth->passBc = 0;
+  
+  if( !policyPools() ){
+    return newStream(url, bc, port);
+  }
+  
+  if( !isolationAuth(url, bc, port, auth) ){
+    logErr("Failed to get the isolation credentials of a pooled stream");
+    return -1;
+  }
+  
+  now = clockMs();
+  
+  pthread_mutex_lock(&sLock);
+  
+  expireStreams(now);
+  
+  /* Take the most recently idle stream, which is the least likely to have 
+   * been closed meanwhile 
+   */ 
+  while( 1 ){
+    newest = -1;
+    
+    for( i = 0 ; i < STREAM_POOL_SIZE ; i++ ){
+      if( !streamIs(&sStreams[i], url, bc, port, auth) ) continue;
+      if( newest == -1 || sStreams[i].idleSinceMs > sStreams[newest].idleSinceMs ){
+        newest = i;
+      }
+    }
+    
+    if( newest == -1 ) break;
+    
+    if( streamHealthy(sStreams[newest].sock) ){
+      torSocket = sStreams[newest].sock;
+      sStreams[newest].sock = -1;
+      dropStream(&sStreams[newest]);
+      break;
+    }
+    
+    dropStream(&sStreams[newest]);
+  }
+  
+  pthread_mutex_unlock(&sLock);
+  
+  if( torSocket != -1 ){
+    return torSocket;
+  }
+  
+  /* Nothing to reuse, open a new stream, which dnsCacheCon authenticates with
+   * the same credentials as they depend on the destination alone
+   */ 
+  return newStream(url, bc, port);
+}
+
+/* streamPoolPut puts torSocket, connected to url:PORT over Tor with url being
+ * bc bytes long and with nothing left to be received on it, into the pool for
+ * reuse by connects that authenticate with auth, the credentials torSocket 
+ * authenticated with as streamPoolCon or torHedgedCon stored them. If the 
+ * isolation policy doesn't pool, the pool is full for url:PORT or altogether,
+ * or torSocket isn't healthy, torSocket is closed instead. Either way the
+ * caller gives up torSocket.
+ *
+ * Returns 1 if torSocket was pooled, 0 if it was closed.
+ */
+int streamPoolPut(int torSocket, char *url, uint8_t bc, uint16_t port, 
+                  struct socksAuth *auth)
+{
+  uint64_t now;
+  int      unused = -1;
+  int      oldest = -1;
+  int      same   = 0;
+  int      i;
+  
+  /* Basic error checking */
+  if( torSocket == -1 || url == NULL || bc == 0 || auth == NULL ){
+    logErr("Something was NULL that shouldn't have been");
+    if( torSocket != -1 ) close(torSocket);
+    return 0;
+  }
+  
+  if( !policyPools() || !streamHealthy(torSocket) ){
+    close(torSocket);
+    return 0;
+  }
+  
+  now = clockMs();
+  
+  pthread_mutex_lock(&sLock);
+  
+  expireStreams(now);
+  
+  for( i = 0 ; i < STREAM_POOL_SIZE ; i++ ){
+    if( sStreams[i].sock == -1 ){
+      if( unused == -1 ) unused = i;
+      continue;
+    }
+    
+    if( streamIs(&sStreams[i], url, bc, port, auth) ) same++;
+    
+    if( oldest == -1 || sStreams[i].idleSinceMs < sStreams[oldest].idleSinceMs ){
+      oldest = i;
+    }
+  }
+  
+  /* The destination already has as many idle streams as it may */ 
+  if( same >= STREAM_POOL_PER_DEST ){
+    pthread_mutex_unlock(&sLock);
+    close(torSocket);
+    return 0;
+  }
+  
+  /* Make room by closing the stream that has been idle the longest */ 
+  if( unused == -1 ){
+    dropStream(&sStreams[oldest]);
+    unused = oldest;
+  }
+  
+  sStreams[unused].sock        = torSocket;
+  sStreams[unused].port        = port;
+  sStreams[unused].bc          = bc;
+  sStreams[unused].idleSinceMs = now;
+  memcpy(sStreams[unused].url, url, bc);
+  memcpy(&sStreams[unused].auth, auth, sizeof(struct socksAuth));
+  
+  pthread_mutex_unlock(&sLock);
+  
+  return 1;
+}
+
+/* streamPoolFlush closes every stream of the pool, for when they must no 
+ * longer be reused, such as when changing identities
+ */
+void streamPoolFlush(void)
+{
+  int i;
+  
+  pthread_mutex_lock(&sLock);
+  
+  for( i = 0 ; i < STREAM_POOL_SIZE ; i++ ){
+    if( sInit && sStreams[i].sock != -1 ) dropStream(&sStreams[i]);
+  }
+  
+  pthread_mutex_unlock(&sLock);
+}
+
+
+/* newStream connects to url:PORT over Tor, url being bc bytes long, on a new
+ * stream.
+ *
+ * Returns the socket on success, -1 on error.
+ */
+static int newStream(char *url, uint8_t bc, uint16_t port)
+{
+  int torSocket;
+  
+  torSocket = getTorCon();
+  if( torSocket == -1 ){
+    logErr("Failed to get a connection to the Tor SocksPort");
+    return -1;
+  }
+  
+  if( !dnsCacheCon(torSocket, url, bc, port) ){
+    logErr("Failed to connect to the destination over Tor");
+    close(torSocket);
+    return -1;
+  }
+  
+  return torSocket;
+}
+
+/* expireStreams closes the streams of the pool that have been idle for longer
+ * than STREAM_POOL_IDLE seconds as of now
+ */
+static void expireStreams(uint64_t now)
+{
+  int i;
+  
+  /* Entries are unused when sock is -1, which a static array isn't zeroed to */ 
+  if( !sInit ){
+    for( i = 0 ; i < STREAM_POOL_SIZE ; i++ ){
+      sStreams[i].sock = -1;
+    }
+    sInit = 1;
+  }
+  
+  for( i = 0 ; i < STREAM_POOL_SIZE ; i++ ){
+    if( sStreams[i].sock == -1 ) continue;
+    
+    if( now - sStreams[i].idleSinceMs >= (uint64_t)STREAM_POOL_IDLE * 1000 ){
+      dropStream(&sStreams[i]);
+    }
+  }
+}
+
+/* dropStream closes the socket of stream, unless it was taken out already, and
+ * clears it such that no trace of its destination is left
+ */
+static void dropStream(struct poolStream *stream)
+{
+  if( stream->sock != -1 ){
+    close(stream->sock);
+  }
+  
+  secMemClear((volatile uint8_t *)stream, sizeof(struct poolStream));
+  stream->sock = -1;
+}
+
+/* streamHealthy checks without blocking that sock is still open and has no
+ * bytes waiting on it, which an idle stream shouldn't have.
+ *
+ * Returns 1 if sock can be reused, 0 if not.
+ */
+static int streamHealthy(int sock)
+{
+  char    peek;
+  ssize_t got;
+  
+  got = recv(sock, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+  
+  return got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* streamIs returns 1 if stream is in use and connected to url:port, url being
+ * bc bytes long, having authenticated with auth
+ */
+static int streamIs(struct poolStream *stream, char *url, uint8_t bc, uint16_t port,
+                    struct socksAuth *auth)
+{
+  return stream->sock != -1 && stream->port == port && stream->bc == bc 
+         && !memcmp(stream->url, url, bc)
+         && stream->auth.userBc == auth->userBc && stream->auth.passBc == auth->passBc
+         && !memcmp(stream->auth.user, auth->user, auth->userBc)
+         && !memcmp(stream->auth.pass, auth->pass, auth->passBc);
+}
+
+/* policyPools returns 1 if the isolation policy allows streams to be pooled, 
+ * which is when it decides their credentials by their destination alone
+ */
+static int policyPools(void)
+{
+  int policy = getIsolationPolicy();
+  
+  return policy == ISOLATE_NONE || policy == ISOLATE_DEST;
+}
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "settings.h"
+
+
+/* The timer wheel keeps the timers of an event loop of the redirector, such
+ * that arming, disarming and expiring a timer take constant time no matter
+ * how many connections the loop has. Time advances in ticks of
+ * REDIR_TICK_MS, and the wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots,
+ * with a slot of the first level spanning a single tick and a slot of each
+ * further level spanning all of the slots of the level below it. A timer is
+ * placed in the slot of the lowest level that reaches its expiry, and the
+ * timers of a slot of a higher level are moved down (cascaded) once the
+ * wheel reaches the ticks the slot spans.
+ *
+ * The redirector arms a single timer per connection, for the earliest of its
+ * idle, SOCKS handshake and lifetime deadlines. Activity on a connection only
+ * records when it happened rather than rearming the timer, and a timer that
+ * expires before the deadline it was armed for moved out is simply rearmed.
+ */
+
+
+static void placeTimer(struct timerWheel *wheel, struct redirTimer *timer);
+static void unlinkTimer(struct redirTimer *timer);
+static void cascade(struct timerWheel *wheel, int level);
+
+
+/* initTimerWheel initializes wheel with no timers, starting at nowMs */
+void initTimerWheel(struct timerWheel *wheel, uint64_t nowMs)
+{
+  memset(wheel, 0, sizeof(*wheel));
+
+  wheel->tick = nowMs / REDIR_TICK_MS;
+}
+
+/* initTimer initializes timer as disarmed, such that when armed and expired
+ * fire is called with it
+ */
+void initTimer(struct redirTimer *timer, void (*fire)(struct redirTimer *), void *owner)
+{
+  timer->next  = NULL;
+  timer->pprev = NULL;
+  timer->fire  = fire;
+  timer->owner = owner;
+}
+
+/* armTimer arms timer to expire at atMs, rearming it if it is already armed */
+void armTimer(struct timerWheel *wheel, struct redirTimer *timer, uint64_t atMs)
+{
+  disarmTimer(wheel, timer);
+
+  /* Round up such that a timer never expires before its time */
+  timer->expires = (atMs + REDIR_TICK_MS - 1) / REDIR_TICK_MS;
+  if( timer->expires <= wheel->tick ) timer->expires = wheel->tick + 1;
+
+  placeTimer(wheel, timer);
+  wheel->armed++;
+}
+
+/* disarmTimer disarms timer if it is armed */
+void disarmTimer(struct timerWheel *wheel, struct redirTimer *timer)
+{
+  if( timer->pprev == NULL ) return;
+
+  unlinkTimer(timer);
+  wheel->armed--;
+}
+
+/* advanceTimerWheel advances wheel to nowMs, firing every timer that expired
+ * on the way. The fired timers are disarmed, and may be rearmed when fired.
+ */
+void advanceTimerWheel(struct timerWheel *wheel, uint64_t nowMs)
+{
+  struct redirTimer *expired;
+  struct redirTimer *timer;
+  uint64_t          nowTick = nowMs / REDIR_TICK_MS;
+  int               level;
+
+  while( wheel->tick < nowTick ){
+    wheel->tick++;
+
+    /* Cascade the timers of the higher levels that are now within reach */
+    for( level = 1 ; level < WHEEL_LEVELS ; level++ ){
+      if( (wheel->tick >> ((level - 1) * WHEEL_BITS)) & (WHEEL_SLOTS - 1) ) break;
+      cascade(wheel, level);
+    }
+
+    /* Detach the expired timers first, as firing them may rearm them */
+    expired = wheel->slots[0][wheel->tick & (WHEEL_SLOTS - 1)];
+    wheel->slots[0][wheel->tick & (WHEEL_SLOTS - 1)] = NULL;
+    if( expired != NULL ) expired->pprev = &expired;
+
+    while( expired != NULL ){
+      timer = expired;
+      unlinkTimer(timer);
+      wheel->armed--;
+
+      timer->fire(timer);
+    }
+  }
+}
+
+/* timerWheelWait returns the milliseconds from nowMs to the next tick of wheel
+ * when it has timers armed, which is how long an event loop may wait for
+ * events before it must advance wheel, or -1 if it may wait indefinitely.
+ */
+int timerWheelWait(struct timerWheel *wheel, uint64_t nowMs)
+{
+  if( wheel->armed == 0 ) return -1;
+
+  return REDIR_TICK_MS - (nowMs % REDIR_TICK_MS);
+}
+
+
+/* redirDeadline returns the millisecond at which a connection established at
+ * startMs and last active at activeMs expires, with handshook being 1 once its
+ * SOCKS handshake is done, and sets *reason to the EXPIRE_ value of the
+ * timeout that expires it. The timeouts are those of the redirConf, with those
+ * of 0 not applying.
+ *
+ * Returns the deadline, or 0 if none of the timeouts apply.
+ */
+uint64_t redirDeadline(uint64_t startMs, uint64_t activeMs, int handshook, int *reason)
+{
+  struct redirConf *conf = getRedirConf();
+  uint64_t         deadline = 0;
+
+  if( conf->idleTimeout ){
+    deadline = activeMs + (uint64_t)conf->idleTimeout * 1000;
+    *reason  = EXPIRE_IDLE;
+  }
+
+  if( !handshook && conf->handshakeTimeout ){
+    if( deadline == 0 || startMs + (uint64_t)conf->handshakeTimeout * 1000 < deadline ){
+      deadline = startMs + (uint64_t)conf->handshakeTimeout * 1000;
+      *reason  = EXPIRE_HANDSHAKE;
+    }
+  }
+
+  if( conf->lifeTimeout ){
+    if( deadline == 0 || startMs + (uint64_t)conf->lifeTimeout * 1000 < deadline ){
+      deadline = startMs + (uint64_t)conf->lifeTimeout * 1000;
+      *reason  = EXPIRE_LIFETIME;
+    }
+  }
+
+  return deadline;
+}
+
+/* countExpiry adds a connection expired for reason to the redirector counters */
+void countExpiry(int reason)
+{
+  switch( reason ){
+    case EXPIRE_IDLE:{
+      statAdd(idleExpired, 1);
+      break;
+    }
+
+    case EXPIRE_HANDSHAKE:{
+      statAdd(handshakeExpired, 1);
+      break;
+    }
+
+    default:{
+      statAdd(lifeExpired, 1);
+      break;
+    }
+  }
+}
+
+
+/* placeTimer links the armed timer into the slot of wheel for its expiry */
+static void placeTimer(struct timerWheel *wheel, struct redirTimer *timer)
+{
+  struct redirTimer **slot;
+  uint64_t          delta = 0;
+  uint64_t          expires = timer->expires;
+  int               level = 0;
+
+  if( expires > wheel->tick ) delta = expires - wheel->tick;
+
+  /* Find the lowest level that reaches the expiry, clamping to the highest */
+  while( level < WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * WHEEL_BITS)) ){
+    level++;
+  }
+
+  if( delta >= (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) ){
+    expires = wheel->tick + (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+  }
+
+  slot = &wheel->slots[level][(expires >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+
+  timer->next  = *slot;
+  timer->pprev = slot;
+  if( *slot != NULL ) (*slot)->pprev = &timer->next;
+  *slot = timer;
+}
+
+/* unlinkTimer unlinks timer from the slot it is in */
+static void unlinkTimer(struct redirTimer *timer)
+{
+  *timer->pprev = timer->next;
+  if( timer->next != NULL ) timer->next->pprev = timer->pprev;
+
+  timer->next  = NULL;
+  timer->pprev = NULL;
+}
+
+/* cascade moves the timers of the slot of level the wheel just reached into
+ * the slots of the lower levels
+ */
+static void cascade(struct timerWheel *wheel, int level)
+{
+  struct redirTimer **slot;
+  struct redirTimer *timer;
+
+  slot = &wheel->slots[level][(wheel->tick >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+
+  while( *slot != NULL ){
+    timer = *slot;
+    unlinkTimer(timer);
+    placeTimer(wheel, timer);
+  }
+}
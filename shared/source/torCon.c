@@ -4,15 +4,50 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "logger.h"
 #include "net.h"
 #include "torCon.h"
+#include "isolNet.h"
+#include "security.h"
+#include "socksIsol.h"
+#include "settings.h"
 
 
-static int socks5ValidateResponse(int socket);
-static int socks5UrlCon(int socket, char *url, uint8_t bc, uint16_t port);
-static int socks5Handshake(int socket);
+static int socks5Request(int socket, uint8_t cmd, struct socksAddr *dst, 
+                         uint16_t port, char *name, uint8_t nameBc,
+                         struct socksAddr *bound);
+static int socks5ValidateResponse(int socket, struct socksAddr *bound);
+static int socks5SendRequest(int socket, uint8_t cmd, struct socksAddr *dst, uint16_t port);
+static int socks5Handshake(int socket, struct socksAuth *auth);
+static int socks5PipelinedCon(int socket, uint8_t cmd, struct socksAddr *dst, 
+                              uint16_t port, struct socksAuth *auth,
+                              struct socksAddr *bound);
+static int socks5CheckMethod(char *methodReply, uint8_t method);
+static int socks5FormatAuth(char *authRequest, struct socksAuth *auth);
+static int socks5CheckResponse(char *responseHead);
+static int socks5RecvBound(int socket, uint8_t atyp, struct socksAddr *bound);
+static int socks5FormatRequest(char *socksRequest, uint8_t cmd, struct socksAddr *dst, 
+                               uint16_t port);
+static int socks5AddrBc(uint8_t atyp);
+static int socks5ReplyBc(struct socksCon *con);
+static int socks5Finish(struct socksCon *con, int status);
+
+
+/* When 1 torUrlCon pipelines the Socks5 handshake with the connect request */
+static int sPipeline = SOCKS_PIPELINE;
+
+
+/* setSocksPipeline sets if torUrlCon sends the Socks5 handshake and the connect
+ * request together (when pipeline is 1), saving a round trip to the proxy, or
+ * waits for the reply to the handshake before sending the request (when 0). 
+ */
+void setSocksPipeline(int pipeline)
+{
+  sPipeline = pipeline;
+}
 
 
 /* torUrlCon is passed a socket connected to Tor's SocksPort, a URL, the byte
@@ -24,6 +59,8 @@ static int socks5Handshake(int socket);
  */
 int torUrlCon(int torSocket, char *url, uint8_t bc, uint16_t port)
 {
+  struct socksAddr dst;
+  
   /* Basic error checking */
   if( url == NULL || bc == 0 ){
     logErr("Something was NULL that shouldn't have been");
@@ -36,20 +73,514 @@ int torUrlCon(int torSocket, char *url, uint8_t bc, uint16_t port)
     return 0;
   }
   
+  /* The URL is passed on to Tor, which resolves it at the exit */ 
+  dst.atyp = SOCKS_ATYP_DOMAIN;
+  dst.bc   = bc;
+  memcpy(dst.addr, url, bc);
+  
+  if( !socks5Request(torSocket, SOCKS_CMD_CONNECT, &dst, port, NULL, 0, NULL) ){
+    logErr("Failed to make requested connection over Socks5 proxy");
+    return 0; 
+  }
+  
+  return 1;
+}
+
+/* torIpCon is passed a socket connected to Tor's SocksPort, an IPv4 or IPv6
+ * address, and a port, and it establishes a connect to the ADDRESS:PORT over
+ * Tor, such that the exit needn't resolve a URL first. When name isn't NULL it
+ * is the URL, of nameBc bytes, that ip was resolved from, and the connect gets
+ * the credentials the isolation policy assigns to the URL rather than to ip, 
+ * such that it shares circuits with the resolve and with connects by URL.
+ *
+ * Returns 1 on success and the socket is connected to the ADDRESS:PORT, on 
+ * error 0 is returned.  
+ */
+int torIpCon(int torSocket, struct socksAddr *ip, uint16_t port, char *name, 
+             uint8_t nameBc)
+{
+  /* Basic error checking */
+  if( ip == NULL ){
+    logErr("Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  if( socks5AddrBc(ip->atyp) != ip->bc ){
+    logErr("The address passed to torIpCon is not an IP address");
+    return 0; 
+  }
+  
+  /* Make sure the socket is valid */
+  if( torSocket == -1 ){
+    logErr("The socket passed to torIpCon was invalid");
+    return 0;
+  }
+  
+  if( !socks5Request(torSocket, SOCKS_CMD_CONNECT, ip, port, name, nameBc, NULL) ){
+    logErr("Failed to make requested connection over Socks5 proxy");
+    return 0; 
+  }
+  
+  return 1;
+}
+
+/* torResolve is passed a socket connected to Tor's SocksPort, over which it
+ * has the URL pointed to by url, of bc bytes, resolved with Tor's RESOLVE 
+ * extension to Socks5, storing the IPv4 or IPv6 address in resolved. Tor 
+ * closes the socket after answering, such that it can't be used further.
+ *
+ * Reference: https://spec.torproject.org/socks-extensions.html
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int torResolve(int torSocket, char *url, uint8_t bc, struct socksAddr *resolved)
+{
+  struct socksAddr dst;
+  
+  /* Basic error checking */
+  if( url == NULL || bc == 0 || resolved == NULL ){
+    logErr("Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  /* Make sure the socket is valid */
+  if( torSocket == -1 ){
+    logErr("The socket passed to torResolve was invalid");
+    return 0;
+  }
+  
+  dst.atyp = SOCKS_ATYP_DOMAIN;
+  dst.bc   = bc;
+  memcpy(dst.addr, url, bc);
+  
+  if( !socks5Request(torSocket, SOCKS_CMD_RESOLVE, &dst, 0, NULL, 0, resolved) ){
+    logErr("Failed to resolve URL over Socks5 proxy");
+    return 0; 
+  }
+  
+  /* The address is in BND.ADDR, which must be an IP address */ 
+  if( resolved->atyp != SOCKS_ATYP_IPV4 && resolved->atyp != SOCKS_ATYP_IPV6 ){
+    logErr("Socks5 proxy resolved URL to something other than an IP address");
+    return 0;
+  }
+  
+  return 1;
+}
+
+/* torResolvePtr is passed a socket connected to Tor's SocksPort, over which it
+ * has the IPv4 or IPv6 address ip reverse resolved with Tor's RESOLVE_PTR 
+ * extension to Socks5, storing the domain name in name. Tor closes the socket
+ * after answering, such that it can't be used further.
+ *
+ * Reference: https://spec.torproject.org/socks-extensions.html
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int torResolvePtr(int torSocket, struct socksAddr *ip, struct socksAddr *name)
+{
+  /* Basic error checking */
+  if( ip == NULL || name == NULL ){
+    logErr("Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  if( socks5AddrBc(ip->atyp) != ip->bc ){
+    logErr("The address passed to torResolvePtr is not an IP address");
+    return 0; 
+  }
+  
+  /* Make sure the socket is valid */
+  if( torSocket == -1 ){
+    logErr("The socket passed to torResolvePtr was invalid");
+    return 0;
+  }
+  
+  if( !socks5Request(torSocket, SOCKS_CMD_RESOLVE_PTR, ip, 0, NULL, 0, name) ){
+    logErr("Failed to reverse resolve address over Socks5 proxy");
+    return 0; 
+  }
+  
+  /* The domain name is in BND.ADDR */ 
+  if( name->atyp != SOCKS_ATYP_DOMAIN ){
+    logErr("Socks5 proxy reverse resolved address to something other than a name");
+    return 0;
+  }
+  
+  return 1;
+}
+
+
+/* torUrlConStart starts a non-blocking connect to url:PORT over Tor, with url
+ * being bc bytes long, on torSocket, which must be connected to Tor's 
+ * SocksPort (or connecting, if it is non-blocking), keeping its progress in
+ * con. As every send and receive is made with MSG_DONTWAIT, torSocket may be
+ * left blocking for whoever uses it after the connect. The connect
+ * is then driven by calling torUrlConStep whenever torSocket is ready for the
+ * events returned by torUrlConEvents, such that a single event loop can have 
+ * any number of them in flight. When done is not NULL it is called with con
+ * and the final status once the connect succeeded or failed. When auth is not
+ * NULL the proxy is authenticated to with its username and password, else 
+ * with the credentials the isolation policy assigns to the connect.
+ *
+ * The Socks5 handshake, authentication and request are pipelined as with 
+ * torUrlCon, and the replies are received without reading anything past them
+ * off of torSocket.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+int torUrlConStart(struct socksCon *con, int torSocket, char *url, uint8_t bc,
+                   uint16_t port, struct socksAuth *auth, 
+                   void (*done)(struct socksCon *, int))
+{
+  struct socksAddr dst;
+  struct socksAuth policyAuth;
+  int              greetingBc = 3;
+  
+  /* Basic error checking */
+  if( con == NULL || url == NULL || bc == 0 ){
+    logErr("Something was NULL that shouldn't have been");
+    return 0; 
+  }
+  
+  /* Make sure the socket is valid */
+  if( torSocket == -1 ){
+    logErr("The socket passed to torUrlConStart was invalid");
+    return 0;
+  }
+  
+  if( auth == NULL ){
+    if( !isolationAuth(url, bc, port, &policyAuth) ){
+      logErr("Failed to get the isolation credentials of a Socks5 request");
+      return 0;
+    }
+    if( policyAuth.userBc ) auth = &policyAuth;
+  }
+  
+  con->socket   = torSocket;
+  con->status   = SOCKS_PENDING;
+  con->pipeline = sPipeline;
+  con->auth     = auth != NULL;
+  con->methodOk = 0;
+  con->authOk   = 0;
+  con->replyOk  = 0;
+  con->replyAt  = con->auth ? 2 + 2 : 2;
+  con->inAt     = 0;
+  con->outAt    = 0;
+  con->done     = done;
+  
+  /* The handshake [3] || the authentication [var] || the connect request 
+   * [var], each only being sent once the one before it was answered when not
+   * pipelining 
+   */ 
+  dst.atyp = SOCKS_ATYP_DOMAIN;
+  dst.bc   = bc;
+  memcpy(dst.addr, url, bc);
+  
+  memcpy(&con->out[0], con->auth ? "\005\001\002" : "\005\001\000", greetingBc);
+  con->authEnd = greetingBc;
+  if( con->auth ){
+    con->authEnd += socks5FormatAuth(&con->out[greetingBc], auth);
+  }
+  
+  con->outBc  = con->authEnd + socks5FormatRequest( &con->out[con->authEnd], 
+                                                    SOCKS_CMD_CONNECT, &dst, port );
+  
+  if( auth == &policyAuth ){
+    secMemClear((volatile uint8_t *)&policyAuth, sizeof(policyAuth));
+  }
+  con->outEnd = con->pipeline ? con->outBc : greetingBc;
+  
+  return 1;
+}
+
+/* torUrlConStep advances con as far as its socket allows without blocking, 
+ * sending what it has to send and receiving the replies of the proxy as they
+ * arrive.
+ *
+ * Returns SOCKS_DONE once the socket is connected to the URL:PORT, 
+ * SOCKS_FAILED if connecting failed, and SOCKS_PENDING while it must be called
+ * again once the socket is ready for the events of torUrlConEvents.
+ */
+int torUrlConStep(struct socksCon *con)
+{
+  ssize_t got;
+  ssize_t sent;
+  int     needBc;
+  
+  if( con->status != SOCKS_PENDING ){
+    return con->status; 
+  }
+  
+  while( 1 ){
+    /* Send what is to be sent at this point of the connect */
+    if( con->outAt < con->outEnd ){
+      sent = send( con->socket, &con->out[con->outAt], con->outEnd - con->outAt,
+                   MSG_DONTWAIT | MSG_NOSIGNAL );
+      if( sent == -1 ){
+        if( errno == EAGAIN || errno == EWOULDBLOCK ) return SOCKS_PENDING;
+        if( errno == EINTR ) continue;
+        logErr("Failed to transmit connection request to Socks5 Proxy");
+        return socks5Finish(con, SOCKS_FAILED);
+      }
+      
+      con->outAt += sent;
+      continue;
+    }
+    
+    /* Check the reply to the handshake, then send what waited on it */
+    if( con->inAt >= 2 && !con->methodOk ){
+      if( !socks5CheckMethod(con->in, con->auth ? 2 : 0) ){
+        return socks5Finish(con, SOCKS_FAILED);
+      }
+      
+      con->methodOk = 1;
+      if( con->outEnd < con->authEnd ) con->outEnd = con->authEnd;
+      if( !con->auth ) con->outEnd = con->outBc;
+      continue;
+    }
+    
+    /* Check the reply to the authentication, VER [1] || STATUS [1] */
+    if( con->auth && con->inAt >= 4 && !con->authOk ){
+      if( con->in[3] != 0 ){
+        logErr("Socks proxy didn't accept the username and password");
+        return socks5Finish(con, SOCKS_FAILED);
+      }
+      
+      con->authOk = 1;
+      con->outEnd = con->outBc;
+      continue;
+    }
+    
+    /* Check the fixed bytes of the reply to the request */
+    if( con->inAt >= con->replyAt + 4 && !con->replyOk ){
+      if( !socks5CheckResponse(&con->in[con->replyAt]) ){
+        return socks5Finish(con, SOCKS_FAILED);
+      }
+      
+      con->replyOk = 1;
+    }
+    
+    needBc = socks5ReplyBc(con);
+    if( needBc == -1 ){
+      logErr("Something unexpected happened with the Socks Proxy response");
+      return socks5Finish(con, SOCKS_FAILED);
+    }
+    
+    if( con->inAt == needBc ){
+      return socks5Finish(con, SOCKS_DONE);
+    }
+    
+    /* Receive no more than what is known to be left of the replies */
+    got = recv(con->socket, &con->in[con->inAt], needBc - con->inAt, MSG_DONTWAIT);
+    if( got == 0 ){
+      logErr("Socks5 Proxy closed the connection during the connect");
+      return socks5Finish(con, SOCKS_FAILED);
+    }
+    
+    if( got == -1 ){
+      if( errno == EAGAIN || errno == EWOULDBLOCK ) return SOCKS_PENDING;
+      if( errno == EINTR ) continue;
+      logErr("Failed to receive validation from Socks5 proxy");
+      return socks5Finish(con, SOCKS_FAILED);
+    }
+    
+    con->inAt += got;
+  }
+}
+
+/* torUrlConEvents returns the poll events (POLLIN or POLLOUT, which equal
+ * EPOLLIN and EPOLLOUT) the socket of con must be ready for before the next 
+ * call to torUrlConStep, or 0 if con is no longer pending.
+ */
+int torUrlConEvents(struct socksCon *con)
+{
+  if( con->status != SOCKS_PENDING ) return 0;
+  
+  return con->outAt < con->outEnd ? POLLOUT : POLLIN;
+}
+
+
+/* torBatchCon connects to each of the count targets over Tor at once, driving
+ * all of their connects from a single poll loop, such that connecting to them
+ * all takes about as long as the slowest of them rather than all of them 
+ * summed. The connections to the SocksPort are all requested of the redirector
+ * with requestTorCon before any is received with receiveTorCon, such that in
+ * the passFd mode the redirector connects them at once as well. Connects not
+ * done within timeoutMs milliseconds fail, with -1 meaning no limit, though
+ * receiving the connections to the SocksPort isn't bounded by it.
+ *
+ * The socket, status and latency of each target are set, with socket being the
+ * connected socket (blocking, as those of getTorCon are) if status is 
+ * SOCKS_DONE and -1 otherwise, and latencyMs the milliseconds until the 
+ * connect succeeded or failed.
+ *
+ * Returns the number of targets connected to, or -1 on error.
+ */
+int torBatchCon(struct torTarget *targets, int count, int timeoutMs)
+{
+  struct socksCon *cons;
+  struct pollfd   *fds;
+  uint64_t        start;
+  uint64_t        elapsed;
+  int             pending = 0;
+  int             connected = 0;
+  int             ready;
+  int             i;
+  
+  /* Basic error checking */
+  if( targets == NULL || count <= 0 ){
+    logErr("Something was NULL that shouldn't have been");
+    return -1; 
+  }
+  
+  cons = secAlloc(count * sizeof(struct socksCon));
+  fds  = secAlloc(count * sizeof(struct pollfd));
+  if( cons == NULL || fds == NULL ){
+    logErr("Failed to allocate memory for a batch of connects");
+    if( cons != NULL ) secFree((void **)&cons, count * sizeof(struct socksCon));
+    if( fds != NULL ) secFree((void **)&fds, count * sizeof(struct pollfd));
+    return -1;
+  }
+  
+  start = clockMs();
+  
+  /* Request every connection to the SocksPort before receiving any of them */ 
+  for( i = 0 ; i < count ; i++ ){
+    targets[i].socket    = requestTorCon();
+    targets[i].status    = SOCKS_FAILED;
+    targets[i].latencyMs = 0;
+    cons[i].status       = SOCKS_FAILED;
+  }
+  
+  /* Start every connect before waiting on any of them */ 
+  for( i = 0 ; i < count ; i++ ){
+    targets[i].socket = receiveTorCon(targets[i].socket);
+    if( targets[i].socket == -1 ){
+      continue;
+    }
+    
+    if( !torUrlConStart( &cons[i], targets[i].socket, targets[i].url, 
+                         targets[i].bc, targets[i].port, NULL, NULL ) ){
+      continue;
+    }
+    
+    pending++;
+  }
+  
+  while( pending > 0 ){
+    for( i = 0 ; i < count ; i++ ){
+      fds[i].fd      = torUrlConEvents(&cons[i]) ? cons[i].socket : -1;
+      fds[i].events  = torUrlConEvents(&cons[i]);
+      fds[i].revents = 0;
+    }
+    
+    elapsed = clockMs() - start;
+    if( timeoutMs != -1 && elapsed >= (uint64_t)timeoutMs ){
+      break;
+    }
+    
+    ready = poll(fds, count, timeoutMs == -1 ? -1 : timeoutMs - (int)elapsed);
+    if( ready == -1 ){
+      if( errno == EINTR ) continue;
+      logErr("Failed to poll the sockets of a batch of connects");
+      break;
+    }
+    
+    for( i = 0 ; i < count && ready > 0 ; i++ ){
+      if( fds[i].revents == 0 ) continue;
+      ready--;
+      
+      if( torUrlConStep(&cons[i]) != SOCKS_PENDING ){
+        targets[i].latencyMs = clockMs() - start;
+        pending--;
+      }
+    }
+  }
+  
+  /* Hand over the connected sockets, closing those of failed connects */ 
+  for( i = 0 ; i < count ; i++ ){
+    if( cons[i].status == SOCKS_PENDING ){
+      targets[i].latencyMs = clockMs() - start;
+    }
+    
+    targets[i].status = cons[i].status == SOCKS_DONE ? SOCKS_DONE : SOCKS_FAILED;
+    
+    if( targets[i].status == SOCKS_DONE ){
+      connected++;
+      continue;
+    }
+    
+    if( targets[i].socket != -1 ){
+      close(targets[i].socket);
+      targets[i].socket = -1;
+    }
+  }
+  
+  secFree((void **)&cons, count * sizeof(struct socksCon));
+  secFree((void **)&fds, count * sizeof(struct pollfd));
+  
+  return connected;
+}
+
+
+/* socks5Request makes the Socks5 request cmd for dst:PORT to the Socks5 proxy
+ * socket is connected to, first engaging in the handshake, pipelined with the
+ * request unless pipelining was turned off, and authenticating with the 
+ * credentials the isolation policy assigns to the request, as a request for
+ * name, of nameBc bytes, unless name is NULL. If bound isn't NULL the 
+ * BND.ADDR of the reply is stored in it.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int socks5Request(int socket, uint8_t cmd, struct socksAddr *dst, 
+                         uint16_t port, char *name, uint8_t nameBc,
+                         struct socksAddr *bound)
+{
+  struct socksAuth auth;
+  struct socksAuth *authPtr;
+  int              requested;
+  
+  if( name == NULL ){
+    name   = dst->addr;
+    nameBc = dst->bc;
+  }
+  
+  if( !isolationAuth(name, nameBc, port, &auth) ){
+    logErr("Failed to get the isolation credentials of a Socks5 request");
+    return 0;
+  }
+  authPtr = auth.userBc ? &auth : NULL;
+  
+  /* Send the handshake and the request at once, then take both replies */
+  if( sPipeline ){
+    requested = socks5PipelinedCon(socket, cmd, dst, port, authPtr, bound);
+    secMemClear((volatile uint8_t *)&auth, sizeof(auth));
+    
+    if( !requested ){
+      logErr("Failed to make pipelined request to Socks5 proxy");
+      return 0;
+    }
+    
+    return 1;
+  }
+  
   /* Engage in the Socks 5 handshake */
-  if( !socks5Handshake(torSocket) ){
+  requested = socks5Handshake(socket, authPtr);
+  secMemClear((volatile uint8_t *)&auth, sizeof(auth));
+  
+  if( !requested ){
     logErr("Failed to engage in the socks 5 handshake");
     return 0;
   }
   
-  /* Request connection to url:port over Socks5 Proxy */
-  if( !socks5UrlCon(torSocket, url, bc, port) ){
-    logErr("Failed to make requested connection over Socks5 proxy");
+  /* Make the request to the Socks5 Proxy */
+  if( !socks5SendRequest(socket, cmd, dst, port) ){
+    logErr("Failed to make request to Socks5 proxy");
     return 0; 
   }
   
-  /* Ensure that the connection was established */
-  if( !socks5ValidateResponse(torSocket) ){
+  /* Ensure that the request succeeded */
+  if( !socks5ValidateResponse(socket, bound) ){
     logErr("Failed to validate the Socks5 connection");
     return 0;
   }
@@ -57,19 +588,22 @@ int torUrlCon(int torSocket, char *url, uint8_t bc, uint16_t port)
   return 1;
 }
 
-
 /* socks5Handshake is passed a socket connected to a Socks5 proxy, over which it
- * engages in the Socks5 handshake. The proxy must support Socks5, currently we
- * are not supporting authentication so the proxy must not require it. 
+ * engages in the Socks5 handshake. The proxy must support Socks5, and when 
+ * auth is NULL must not require authentication, otherwise it is authenticated
+ * to with the username and password of auth.
  *
  * Reference: https://www.ietf.org/rfc/rfc1928.txt 
+ * Reference: https://www.ietf.org/rfc/rfc1929.txt 
  *
  * Returns 1 on success, 0 on error.
  */ 
-static int socks5Handshake(int socket)
+static int socks5Handshake(int socket, struct socksAuth *auth)
 { 
   int  responseBc = 2;
   int  sendBc     = 3;
+  int  authBc;
+  char authRequest[3 + 255 + 255];
   char proxyResponse[responseBc]; 
   
   /* Ensure the socket is valid */
@@ -79,36 +613,161 @@ static int socks5Handshake(int socket)
   }
   
   /* Send the initial three bytes of the handshake to the Socks5 Proxy */
-  if( send(socket, "\005\001\000", sendBc, 0) != sendBc ){
+  if( send(socket, auth ? "\005\001\002" : "\005\001\000", sendBc, 0) != sendBc ){
     logErr("Failed to send first byte sequence of Socks5 handshake");
     return 0; 
   } 
   
   /* Receive the initial response from the Socks5 Proxy */
-  if( recv(socket, proxyResponse, responseBc, 0) != responseBc ){
+  if( recv(socket, proxyResponse, responseBc, MSG_WAITALL) != responseBc ){
     logErr("Failed to receive first response during Socks5 handshake");
     return 0;
   }
   
-  /* Ensure that the proxy supports Socks5 */
-  if( proxyResponse[0] != 5 ){
-    logErr("Socks proxy doesn't support Socks5");
+  if( !socks5CheckMethod(proxyResponse, auth ? 2 : 0) ){
+    return 0;
+  }
+  
+  if( auth == NULL ){
+    return 1;
+  }
+  
+  /* Authenticate with the username and password */ 
+  authBc = socks5FormatAuth(authRequest, auth);
+  
+  if( send(socket, authRequest, authBc, 0) != authBc ){
+    logErr("Failed to send username and password to Socks5 proxy");
+    secMemClear((volatile uint8_t *)authRequest, sizeof(authRequest));
+    return 0; 
+  }
+  secMemClear((volatile uint8_t *)authRequest, sizeof(authRequest));
+  
+  /* VER [1] || STATUS [1], with a STATUS of 0 being success */ 
+  if( recv(socket, proxyResponse, responseBc, MSG_WAITALL) != responseBc ){
+    logErr("Failed to receive authentication response from Socks5 proxy");
     return 0;
   }
   
-  /* Ensure that the proxy supports a lack of authentication */
   if( proxyResponse[1] != 0 ){
-    logErr("Socks proxy doesn't support a lack of authentication");
+    logErr("Socks proxy didn't accept the username and password");
     return 0;
   }
   
   return 1; 
 }
 
-/* socks5UrlCon makes a request to the Socks5 proxy to establish a connection 
- * to the URL pointed to by url, which is bc bytes long, on the port denoted 
- * by port. Socket must already be connected to the Socks5 proxy, and must 
- * have already engaged in the Socks5 handshake.  
+/* socks5PipelinedCon sends the Socks5 handshake, the authentication with auth
+ * unless it is NULL, and the request cmd for the address dst on the port 
+ * denoted by port in a single write to the Socks5 proxy socket is connected 
+ * to, rather than waiting for the reply to the handshake first, and then 
+ * receives the replies to each, storing BND.ADDR in bound unless it is NULL.
+ * This saves a full round trip to the proxy, which Tor allows for as it reads
+ * the request once it has answered the handshake.
+ *
+ * The replies to the handshake and authentication and the fixed bytes of the
+ * reply to the request are received together, then the bound address that
+ * follows them, such that nothing past the reply is read from socket.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int socks5PipelinedCon(int socket, uint8_t cmd, struct socksAddr *dst, 
+                              uint16_t port, struct socksAuth *auth,
+                              struct socksAddr *bound)
+{
+  int  greetingBc  = 3;
+  int  authReplyBc = auth ? 2 : 0;
+  int  replyBc     = 2 + authReplyBc + 4; // Method selection, auth, VER REP RSV ATYP
+  int  requestBc;
+  int  sentBc;
+  int  gotBc;
+  char socksRequest[3 + 3 + 255 + 255 + 1 + 1 + 1 + 1 + 1 + 255 + 2];
+  char proxyResponse[2 + 2 + 4];
+  
+  /* Basic error checking */
+  if( dst == NULL ){
+    logErr("Something was NULL that shouldn't have been"); 
+    return 0; 
+  }
+  
+  /* Ensure the socket is valid */
+  if( socket == -1 ){
+    logErr("Socket passed to socks5PipelinedCon is not valid");
+    return 0;
+  }
+  
+  /* The handshake [3] || the authentication [var] || the request [var] */
+  memcpy(&socksRequest[0], auth ? "\005\001\002" : "\005\001\000", greetingBc);
+  requestBc = greetingBc;
+  if( auth ){
+    requestBc += socks5FormatAuth(&socksRequest[requestBc], auth);
+  }
+  requestBc += socks5FormatRequest(&socksRequest[requestBc], cmd, dst, port);
+  
+  sentBc = send(socket, socksRequest, requestBc, 0);
+  secMemClear((volatile uint8_t *)socksRequest, sizeof(socksRequest));
+  
+  if( sentBc != requestBc ){
+    logErr("Failed to transmit pipelined connection request to Socks5 Proxy");
+    return 0;
+  }
+  
+  /* A proxy refusing the handshake closes the socket after its reply */
+  gotBc = recv(socket, proxyResponse, replyBc, MSG_WAITALL);
+  if( gotBc < 2 ){
+    logErr("Failed to receive first response during Socks5 handshake");
+    return 0;
+  }
+  
+  if( !socks5CheckMethod(proxyResponse, auth ? 2 : 0) ){
+    return 0;
+  }
+  
+  /* A proxy refusing the credentials closes the socket after its reply too */
+  if( auth && gotBc >= 4 && proxyResponse[3] != 0 ){
+    logErr("Socks proxy didn't accept the username and password");
+    return 0;
+  }
+  
+  if( gotBc != replyBc ){
+    logErr("Failed to receive validation from Socks5 proxy");
+    return 0;
+  }
+  
+  if( !socks5CheckResponse(&proxyResponse[2 + authReplyBc]) ){
+    return 0;
+  }
+  
+  return socks5RecvBound(socket, proxyResponse[2 + authReplyBc + 3], bound);
+}
+
+/* socks5CheckMethod ensures that the method selection reply of a Socks5 proxy,
+ * pointed to by methodReply and 2 bytes long, selected method, 0 being a lack
+ * of authentication and 2 a username and password.
+ *
+ * Returns 1 if it does, 0 if not.
+ */
+static int socks5CheckMethod(char *methodReply, uint8_t method)
+{
+  /* Ensure that the proxy supports Socks5 */
+  if( methodReply[0] != 5 ){
+    logErr("Socks proxy doesn't support Socks5");
+    return 0;
+  }
+  
+  /* Ensure that the proxy supports the authentication offered */
+  if( (uint8_t)methodReply[1] != method ){
+    logErr("Socks proxy doesn't support the authentication offered");
+    return 0;
+  }
+  
+  return 1;
+}
+
+/* socks5SendRequest makes the request cmd to the Socks5 proxy, for the address
+ * dst on the port denoted by port, cmd being SOCKS_CMD_CONNECT to establish a
+ * connection or one of Tor's RESOLVE extensions. Socket must already be 
+ * connected to the Socks5 proxy, and must have already engaged in the Socks5
+ * handshake.  
  *
  * Reference: https://www.ietf.org/rfc/rfc1928.txt
  *
@@ -119,79 +778,117 @@ static int socks5Handshake(int socket)
  * +----+-----+-------+------+----------+----------+
  * | 1  |  1  | X'00' |  1   |[bc1]+Var |    2     |
  * +----+-----+-------+------+----------+----------+
+ *
+ * DST.ADDR is prefixed with its bytesize only when it is a domain name (ATYP
+ * 3), IPv4 (ATYP 1) and IPv6 (ATYP 4) addresses being of 4 and 16 bytes.
  *  
  * Returns 1 on success, 0 on error.
  */
-static int socks5UrlCon(int socket, char *url, uint8_t bc, uint16_t port)
+static int socks5SendRequest(int socket, uint8_t cmd, struct socksAddr *dst, uint16_t port)
 {
-  uint8_t      maxBc = 255;                          // (2^8 - 1) = 255  
-  unsigned int fixedSocksBc = 1 + 1 + 1 + 1 + 1 + 2; // See diagram 
-  unsigned int actualBc = maxBc + fixedSocksBc;
-  char         socksRequest[fixedSocksBc + maxBc];    
+  uint8_t maxBc = 255;                          // (2^8 - 1) = 255  
+  int     fixedSocksBc = 1 + 1 + 1 + 1 + 1 + 2; // See diagram 
+  int     actualBc;
+  char    socksRequest[fixedSocksBc + maxBc];    
   
   /* Basic error checking */
-  if( url == NULL || bc == 0 ){
+  if( dst == NULL ){
     logErr("Something was NULL that shouldn't have been"); 
     return 0; 
   }
   
   /* Ensure the socket is valid */
   if( socket == -1 ){
-    logErr("Socket passed to socks5UrlCon is not valid");
+    logErr("Socket passed to socks5SendRequest is not valid");
     return 0;
   }
   
+  /* Only the bytes of the request are sent, not the whole of socksRequest */
+  actualBc = socks5FormatRequest(socksRequest, cmd, dst, port);
+  
+  /* Initialize the Socks 5 Connection */  
+  if( send(socket, socksRequest, actualBc, 0) != actualBc ){
+    logErr("Failed to transmit request to Socks5 Proxy");
+    return 0;
+  }
+  
+  return 1; 
+}
+
+/* socks5FormatRequest formats the Socks5 request cmd for the address dst on
+ * the port denoted by port into socksRequest, which must have room for 7 + 255
+ * bytes. See socks5SendRequest for the format.
+ *
+ * Returns the bytesize of the request.
+ */
+static int socks5FormatRequest(char *socksRequest, uint8_t cmd, struct socksAddr *dst, 
+                               uint16_t port)
+{
+  int addrBc = 0;
+  
   /* format the destination port in network order in accordance with RFC */
   port = htons(port);
   
   /* with || denoting concatenation and [x] denoting of x bytes: 
   *
-  *  socks version five [1] || connect [1] || RSV is NULL [1] || 
-  *  url is url not an IP addr [1] || prepend url with bytesize as octet [1] ||
-  *  url [var bytes] || destination port in network octet order [2]    
+  *  socks version five [1] || cmd [1] || RSV is NULL [1] || ATYP [1] ||
+  *  when a domain name, prepend it with bytesize as octet [1] ||
+  *  address [var bytes] || destination port in network octet order [2]    
   */
-  memcpy(&socksRequest[0], "\005\001\000\003", 4);
-  memcpy(&socksRequest[4], &bc, 1);
-  memcpy(&socksRequest[5], url, bc);
-  memcpy(&socksRequest[5 + bc], &port, 2);
+  socksRequest[0] = 5;
+  socksRequest[1] = cmd;
+  socksRequest[2] = 0;
+  socksRequest[3] = dst->atyp;
   
-  /* Initialize the Socks 5 Connection */  
-  if( send(socket, socksRequest, actualBc, 0) != actualBc ){
-    logErr("Failed to transmit URL connection request to Socks5 Proxy");
-    return 0;
+  if( dst->atyp == SOCKS_ATYP_DOMAIN ){
+    socksRequest[4 + addrBc++] = dst->bc;
   }
   
-  return 1; 
+  memcpy(&socksRequest[4 + addrBc], dst->addr, dst->bc);
+  addrBc += dst->bc;
+  
+  memcpy(&socksRequest[4 + addrBc], &port, 2);
+  
+  return 4 + addrBc + 2;
+}
+
+/* socks5FormatAuth formats the username and password authentication of auth
+ * into authRequest, which must have room for 3 + 255 + 255 bytes.
+ *
+ * Reference: https://www.ietf.org/rfc/rfc1929.txt
+ *
+ * +----+------+----------+------+----------+
+ * |VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+ * +----+------+----------+------+----------+
+ * | 1  |  1   | 1 to 255 |  1   | 1 to 255 |
+ * +----+------+----------+------+----------+
+ *
+ * Returns the bytesize of the authentication.
+ */
+static int socks5FormatAuth(char *authRequest, struct socksAuth *auth)
+{
+  authRequest[0] = 1;
+  authRequest[1] = auth->userBc;
+  memcpy(&authRequest[2], auth->user, auth->userBc);
+  authRequest[2 + auth->userBc] = auth->passBc;
+  memcpy(&authRequest[3 + auth->userBc], auth->pass, auth->passBc);
+  
+  return 3 + auth->userBc + auth->passBc;
 }
 
 /*
  * socks5ValidateResponse gets the final response from the socks server and 
- * ensures that everything has gone correctly.
+ * ensures that everything has gone correctly, storing BND.ADDR in bound 
+ * unless it is NULL.
  * 
  * reference https://www.ietf.org/rfc/rfc1928.txt
  * 
  * returns 0 on error (or failure) and 1 on success. 
  * 
  */
-static int socks5ValidateResponse(int socket)
+static int socks5ValidateResponse(int socket, struct socksAddr *bound)
 {
-  uint8_t domainBc;
-  uint8_t ipv4Octets   = 4;
-  uint8_t ipv6Octets    = 16; 
-  
-  uint8_t uint8Max = 255;                   //(2^8 - 1) = 255
-  uint8_t fixedBc  = 1 + 1 + 1 + 1 + 1 + 2; //See Diagram, 1 fixed is actually var 
-  
-  /* For holding responses from the Socks5 Proxy. The maximum bytes that will 
-   * be written to it are in the case that the Socks5 Proxy is on a domain, 
-   * in which case BND.ADDR consists of an initial octect encoding the number 
-   * of subsequent octets. Since an octet can only encode up to 255, this means
-   * BND.ADDR can only be up to 255 + 1 bytes. The other bytes are fixed, see 
-   * the diagram. In the case that the proxy is not on a domain, BND.ADDR will 
-   * either be 4 bytes in the case it is on an IPv4 address, or 16 in the case
-   * that it is on an IPv6 address.    
-   */
-  char proxyResponse[uint8Max + fixedBc]; 
+  char proxyResponse[4];
   
   /* Make sure that the socket is valid */
   if(socket == -1){
@@ -207,49 +904,92 @@ static int socks5ValidateResponse(int socket)
   * | 1  |  1  | X'00' |  1   | [~bc1]Var|    2     |
   * +----+-----+-------+------+----------+----------+
   */
-  if( recv(socket, proxyResponse, 4, 0) != 4 ){
+  if( recv(socket, proxyResponse, 4, MSG_WAITALL) != 4 ){
     logErr("Failed to receive validation from Socks5 proxy");
     return 0; 
   }
   
-  if(proxyResponse[0] != 5){
+  if( !socks5CheckResponse(proxyResponse) ){
+    return 0;
+  }
+  
+  return socks5RecvBound(socket, proxyResponse[3], bound);
+}
+
+/* socks5CheckResponse ensures that the first 4 bytes of the reply of a Socks5
+ * proxy to a request, pointed to by responseHead, report success.
+ *
+ * Returns 1 on success, 0 if the request failed.
+ */
+static int socks5CheckResponse(char *responseHead)
+{
+  if(responseHead[0] != 5){
     logErr("Socks server doesn't think it is version 5"); 
     return 0; 
   }
   
-  if(proxyResponse[1] != 0){
+  if(responseHead[1] != 0){
     logErr("Connection failed"); 
     return 0; 
   }
   
-  /* proxyResponse[3] is ATYP and determines the bytesize of BND.ADDR.
+  return 1;
+}
+
+/* socks5RecvBound receives BND.ADDR and BND.PORT, the rest of the reply of a
+ * Socks5 proxy to a request, off of socket, with atyp being the ATYP of the 
+ * reply, storing BND.ADDR in bound unless it is NULL.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int socks5RecvBound(int socket, uint8_t atyp, struct socksAddr *bound)
+{
+  uint8_t domainBc = 0;
+  uint8_t ipv4Octets   = 4;
+  uint8_t ipv6Octets   = 16; 
+  
+  uint8_t uint8Max = 255; //(2^8 - 1) = 255
+  
+  /* For holding the rest of the response from the Socks5 Proxy. The maximum
+   * bytes that will be written to it are in the case that the Socks5 Proxy is
+   * on a domain, in which case BND.ADDR consists of an initial octect encoding
+   * the number of subsequent octets. Since an octet can only encode up to 255,
+   * this means BND.ADDR can only be up to 255 + 1 bytes, followed by the 2 of
+   * BND.PORT. In the case that the proxy is not on a domain, BND.ADDR will 
+   * either be 4 bytes in the case it is on an IPv4 address, or 16 in the case
+   * that it is on an IPv6 address.    
+   */
+  char proxyResponse[uint8Max + 2]; 
+  
+  /* atyp determines the bytesize of BND.ADDR.
    * if ATYP is 1, BND.ADDR is an IPv4 address encoded as 4 octets.
    * if ATYP is 3, BND.ADDR is a domain name of variable octets 
    * if ATYP is 4, BND.ADDR is an IPv6 address encoded as 16 octets. 
    *
-   * We don't really care about this, only that success was had, however,
-   * we do want to make sure to clear the socket buffer 
+   * For a connect we don't really care about this, only that success was 
+   * had, however, we do want to make sure to clear the socket buffer. For 
+   * Tor's RESOLVE extensions BND.ADDR is the answer.
    */ 
-  switch(proxyResponse[3]){
+  switch(atyp){
     case 1: //Socks proxy is on ipv4, need to clear 4 + 2 octets 
-      if( recv(socket, proxyResponse, ipv4Octets + 2, 0) != ipv4Octets + 2 ){
+      if( recv(socket, proxyResponse, ipv4Octets + 2, MSG_WAITALL) != ipv4Octets + 2 ){
         logErr("Failed to receive validation response from Socks5 Proxy");
         return 0; 
       }
       break;
     case 3: //Socks proxy is on a domain, need to clear variable octets + 2
-      if( recv(socket, proxyResponse, 1, 0) != 1 ){ //First octet encodes count
+      if( recv(socket, proxyResponse, 1, MSG_WAITALL) != 1 ){ //First octet encodes count
         logErr("Failed to get byte encoding domain octet count");
         return 0;
       }
       domainBc = proxyResponse[0]; 
-      if( recv(socket, proxyResponse, domainBc + 2, 0) != domainBc + 2 ){
+      if( recv(socket, proxyResponse, domainBc + 2, MSG_WAITALL) != domainBc + 2 ){
         logErr("Failed to receive validation from Socks5 Proxy");
         return 0;
       }
       break;
     case 4: //Socks proxy is on ipv6, need to clear 16 + 2 octets
-      if( recv(socket, proxyResponse, ipv6Octets + 2, 0) != ipv6Octets + 2 ){
+      if( recv(socket, proxyResponse, ipv6Octets + 2, MSG_WAITALL) != ipv6Octets + 2 ){
         logErr("Failed to receive validation from Socks5 Proxy");
         return 0; 
       }
@@ -258,5 +998,78 @@ static int socks5ValidateResponse(int socket)
       logErr("Something unexpected happened with the Socks Proxy response");
       return 0; 
   }
+  
+  if( bound != NULL ){
+    bound->atyp = atyp;
+    bound->bc   = atyp == SOCKS_ATYP_DOMAIN ? domainBc : socks5AddrBc(atyp);
+    memcpy(bound->addr, proxyResponse, bound->bc);
+  }
+  
   return 1; 
 }
+
+/* socks5AddrBc returns the bytesize of an address of the ATYP atyp, or -1 if
+ * it is a domain name (of variable bytes) or invalid.
+ */
+static int socks5AddrBc(uint8_t atyp)
+{
+  switch( atyp ){
+    case SOCKS_ATYP_IPV4: return 4;
+    case SOCKS_ATYP_IPV6: return 16;
+    default:              return -1;
+  }
+}
+
+/* socks5ReplyBc returns the bytes con is to have received once the replies of
+ * the proxy it awaits are in, as far as can be told from what it received so
+ * far, with the reply to the handshake taking up the first 2 bytes, followed 
+ * by the 2 of the reply to the authentication if it authenticates. 
+ *
+ * Returns the bytesize, or -1 if the reply has an invalid ATYP.
+ */
+static int socks5ReplyBc(struct socksCon *con)
+{
+  int at = con->replyAt;
+  
+  /* Before the handshake (and authentication) was answered only ask for the
+   * reply to the request as well when it was pipelined, such that its reply 
+   * is already on the way
+   */ 
+  if( !con->methodOk ){
+    return con->pipeline ? at + 4 : 2;
+  }
+  
+  if( con->auth && !con->authOk ){
+    return con->pipeline ? at + 4 : 2 + 2;
+  }
+  
+  if( con->inAt < at + 4 ){
+    return at + 4;
+  }
+  
+  /* See socks5RecvBound for what ATYP means to the bytesize of BND.ADDR */
+  switch( con->in[at + 3] ){
+    case 1:  return at + 4 + 4 + 2;
+    case 4:  return at + 4 + 16 + 2;
+    case 3:{
+      if( con->inAt < at + 4 + 1 ) return at + 4 + 1;
+      return at + 4 + 1 + (uint8_t)con->in[at + 4] + 2;
+    }
+    default: return -1;
+  }
+}
+
+/* socks5Finish ends con with status, calling its done callback if it has one.
+ *
+ * Returns status.
+ */
+static int socks5Finish(struct socksCon *con, int status)
+{
+  con->status = status;
+  
+  if( con->done != NULL ){
+    con->done(con, status);
+  }
+  
+  return status;
+}
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "isolNet.h"
+#include "redirector.h"
+#include "settings.h"
+
+
+/* The tests of the parts of the redirector that work without a network: the
+ * parser of Tor's replies to the SOCKS handshake the flow records are timed
+ * with, and the timer wheel the connections expire with. Each is driven from
+ * a table of cases, and what the redirector would otherwise provide them
+ * with is stood in for below.
+ */
+
+
+/* A reply of Tor to the handshake, the first bc bytes of which are parsed */
+struct replyCase{
+  const char    *what;
+  unsigned char bytes[16];
+  size_t        bc;
+  size_t        replyBc;
+};
+
+/* A timer armed ticks after the wheel started, and the tick it fired at */
+struct timerCase{
+  uint64_t          ticks;
+  uint64_t          firedTick;
+  int               fired;
+  struct redirTimer timer;
+};
+
+static int gPassCount;
+static int gFailCount;
+
+static struct redirConf  sConf;
+static struct redirStats sStats;
+
+static struct timerWheel *sWheel;
+static int               sRearms;
+
+
+static void check(int passed, const char *what);
+
+static void testSocksReplyBc(void);
+static void testFeedFlow(void);
+static void testTimerCascade(void);
+static void testTimerDisarm(void);
+
+static void fireTimer(struct redirTimer *timer);
+static void fireRearm(struct redirTimer *timer);
+
+
+int main()
+{
+  printf("BEGIN TESTING\n");
+
+  printf("BEGIN redirFlow.c TESTING\n\n");
+  testSocksReplyBc();
+  testFeedFlow();
+  printf("END redirFlow.c TESTING\n\n");
+
+  printf("BEGIN timerWheel.c TESTING\n\n");
+  testTimerCascade();
+  testTimerDisarm();
+  printf("END timerWheel.c TESTING\n\n");
+
+  printf("DONE TESTING\n\n");
+
+  printf("%i failed, %i passed\n", gFailCount, gPassCount);
+
+  return gFailCount != 0;
+}
+
+
+/* getRedirConf stands in for that of isolNet.c */
+struct redirConf *getRedirConf(void)
+{
+  return &sConf;
+}
+
+/* getRedirStats stands in for that of isolNet.c */
+struct redirStats *getRedirStats(void)
+{
+  return &sStats;
+}
+
+/* captureReply stands in for that of redirCapture.c, nothing is captured */
+void captureReply(uint32_t stream, size_t bc)
+{
+  (void)stream;
+  (void)bc;
+}
+
+/* relayWantsOut stands in for that of relayBuff.c, no direction is relayed */
+int relayWantsOut(struct relayDir *dir)
+{
+  (void)dir;
+  return 0;
+}
+
+
+/*
+ * redirFlow.c tests
+ */
+
+
+/* socksReplyBc tells the length of each reply once its head does, and not
+ * before
+ */
+static void testSocksReplyBc(void)
+{
+  static const struct replyCase cases[] = {
+    { "no authentication, IPv4",
+      { 5, 0, 5, 0, 0, 1, 127, 0, 0, 1, 0, 80 }, 12, 12 },
+    { "no authentication, domain",
+      { 5, 0, 5, 0, 0, 3, 11 }, 7, 2 + 4 + 1 + 11 + 2 },
+    { "no authentication, IPv6",
+      { 5, 0, 5, 0, 0, 4, 0, 0, 0 }, FLOW_HEAD_BC, 2 + 4 + 16 + 2 },
+    { "username and password, IPv4",
+      { 5, 2, 1, 0, 5, 0, 0, 1, 127 }, FLOW_HEAD_BC, 14 },
+    { "username and password, domain",
+      { 5, 2, 1, 0, 5, 0, 0, 3, 7 }, FLOW_HEAD_BC, 4 + 4 + 1 + 7 + 2 },
+    { "username and password, IPv6",
+      { 5, 2, 1, 0, 5, 0, 0, 4, 0 }, FLOW_HEAD_BC, 4 + 4 + 16 + 2 },
+    { "a failed authentication",
+      { 5, 2, 1, 1 }, 4, 4 },
+    { "a failed authentication with more to follow",
+      { 5, 2, 1, 1, 5, 0, 0, 1, 127 }, FLOW_HEAD_BC, 4 },
+    { "no acceptable method",
+      { 5, 0xFF }, 2, 2 },
+    { "a failed request with an unknown ATYP",
+      { 5, 0, 5, 1, 0, 0 }, 6, 6 },
+    { "no bytes",
+      { 0 }, 0, 0 },
+    { "a truncated method selection",
+      { 5 }, 1, 0 },
+    { "a truncated authentication",
+      { 5, 2, 1 }, 3, 0 },
+    { "a truncated request, no authentication",
+      { 5, 0, 5, 0, 0 }, 5, 0 },
+    { "a truncated domain, no authentication",
+      { 5, 0, 5, 0, 0, 3 }, 6, 0 },
+    { "a truncated request, username and password",
+      { 5, 2, 1, 0, 5, 0, 0 }, 7, 0 },
+    { "a truncated domain, username and password",
+      { 5, 2, 1, 0, 5, 0, 0, 3 }, 8, 0 }
+  };
+
+  char   what[128];
+  size_t i;
+
+  printf("BEGIN TESTING socksReplyBc\n");
+
+  for( i = 0 ; i < sizeof(cases) / sizeof(cases[0]) ; i++ ){
+    snprintf(what, sizeof(what), "socksReplyBc parsed %s", cases[i].what);
+    check(socksReplyBc(cases[i].bytes, cases[i].bc) == cases[i].replyBc, what);
+  }
+
+  printf("END TESTING socksReplyBc\n\n");
+}
+
+/* feedFlow finds the length of a reply received a byte at a time, as well as
+ * one received again from its start, as peekFlow does
+ */
+static void testFeedFlow(void)
+{
+  static const unsigned char reply[] = { 5, 2, 1, 0, 5, 0, 0, 3, 7 };
+
+  struct flowTrack flow;
+  size_t           i;
+
+  printf("BEGIN TESTING feedFlow\n");
+
+  openFlow(&flow, 0);
+  for( i = 0 ; i < sizeof(reply) ; i++ ){
+    if( flow.replyBc != 0 ) break;
+    feedFlow(&flow, reply + i, 1, i);
+  }
+  check(flow.replyBc == 18 && i == sizeof(reply), "feedFlow parsed a reply received a byte at a time");
+  check(!flowReplied(&flow, 17) && flowReplied(&flow, 18), "flowReplied once the reply was received");
+
+  openFlow(&flow, 0);
+  feedFlow(&flow, reply, 4, 0);
+  feedFlow(&flow, reply, sizeof(reply), 0);
+  check(flow.replyBc == 18, "feedFlow parsed a reply received again from its start");
+
+  openFlow(&flow, 0);
+  feedFlow(&flow, reply + 5, 4, 5);
+  check(flow.headBc == 0 && flow.replyBc == 0, "feedFlow ignored bytes past a gap in the head");
+
+  printf("END TESTING feedFlow\n\n");
+}
+
+
+/*
+ * timerWheel.c tests
+ */
+
+
+/* Every timer fires at the very tick it was armed for, from each level of
+ * the wheel, including those it is cascaded down from, and no matter which
+ * tick the wheel started at
+ */
+static void testTimerCascade(void)
+{
+  static const uint64_t starts[] = { 0, 1, 4031, 262100 };
+  static const uint64_t ticks[]  = { 1, 2, 63, 64, 65, 127, 128, 4095, 4096,
+                                     4097, 8191, 262143, 262144, 262145 };
+  enum{ TIMER_CASES = sizeof(ticks) / sizeof(ticks[0]) };
+
+  struct timerCase  cases[TIMER_CASES];
+  struct timerWheel wheel;
+  uint64_t          start;
+  char              what[128];
+  size_t            s;
+  size_t            i;
+  int               onTime;
+
+  printf("BEGIN TESTING timer wheel cascading\n");
+
+  sWheel = &wheel;
+
+  for( s = 0 ; s < sizeof(starts) / sizeof(starts[0]) ; s++ ){
+    start = starts[s];
+    initTimerWheel(&wheel, start * REDIR_TICK_MS);
+
+    for( i = 0 ; i < TIMER_CASES ; i++ ){
+      cases[i].ticks = ticks[i];
+      cases[i].fired = 0;
+      initTimer(&cases[i].timer, fireTimer, &cases[i]);
+      armTimer(&wheel, &cases[i].timer, (start + ticks[i]) * REDIR_TICK_MS);
+    }
+
+    /* Advance in uneven steps, such that ticks are crossed rather than hit */
+    while( wheel.armed != 0 && wheel.tick < start + ticks[TIMER_CASES - 1] ){
+      advanceTimerWheel(&wheel, (wheel.tick + 1 + wheel.tick % 3) * REDIR_TICK_MS + 7);
+    }
+
+    for( i = 0 ; i < TIMER_CASES ; i++ ){
+      onTime = cases[i].fired == 1;
+      snprintf(what, sizeof(what), "A timer armed %llu ticks after tick %llu fired once",
+               (unsigned long long)ticks[i], (unsigned long long)start);
+      check(onTime, what);
+    }
+
+    /* As the wheel skips ticks, a timer fires at most a step late */
+    onTime = 1;
+    for( i = 0 ; i < TIMER_CASES ; i++ ){
+      if( cases[i].firedTick < start + ticks[i] || cases[i].firedTick > start + ticks[i] + 3 ){
+        onTime = 0;
+      }
+    }
+    snprintf(what, sizeof(what), "No timer armed after tick %llu fired early",
+             (unsigned long long)start);
+    check(onTime, what);
+    check(wheel.armed == 0, "The wheel has no timers armed once they all fired");
+  }
+
+  /* Advancing a tick at a time, each timer fires at its very tick */
+  initTimerWheel(&wheel, 4031 * REDIR_TICK_MS);
+  for( i = 0 ; i < TIMER_CASES ; i++ ){
+    cases[i].ticks = ticks[i];
+    cases[i].fired = 0;
+    initTimer(&cases[i].timer, fireTimer, &cases[i]);
+    armTimer(&wheel, &cases[i].timer, (4031 + ticks[i]) * REDIR_TICK_MS);
+  }
+
+  while( wheel.armed != 0 && wheel.tick < 4031 + ticks[TIMER_CASES - 1] ){
+    advanceTimerWheel(&wheel, (wheel.tick + 1) * REDIR_TICK_MS);
+  }
+
+  onTime = 1;
+  for( i = 0 ; i < TIMER_CASES ; i++ ){
+    if( cases[i].fired != 1 || cases[i].firedTick != 4031 + ticks[i] ) onTime = 0;
+  }
+  check(onTime, "Every timer fired at its very tick, a tick at a time");
+
+  printf("END TESTING timer wheel cascading\n\n");
+}
+
+/* A disarmed timer never fires, a timer armed for a past time fires at the
+ * next tick, and a timer rearmed as it fires fires again
+ */
+static void testTimerDisarm(void)
+{
+  struct timerCase  cases[3];
+  struct timerWheel wheel;
+  int               i;
+
+  printf("BEGIN TESTING timer wheel disarming and rearming\n");
+
+  sWheel = &wheel;
+  initTimerWheel(&wheel, 1000 * REDIR_TICK_MS);
+
+  for( i = 0 ; i < 3 ; i++ ){
+    cases[i].fired = 0;
+    initTimer(&cases[i].timer, fireTimer, &cases[i]);
+  }
+
+  armTimer(&wheel, &cases[0].timer, 5000 * REDIR_TICK_MS);
+  disarmTimer(&wheel, &cases[0].timer);
+  disarmTimer(&wheel, &cases[0].timer);
+  check(wheel.armed == 0, "disarmTimer disarmed a timer of a higher level once");
+
+  armTimer(&wheel, &cases[1].timer, 10 * REDIR_TICK_MS);
+  check(cases[1].timer.expires == 1001, "armTimer armed a timer for a past time for the next tick");
+
+  cases[2].ticks = 100;
+  sRearms = 1;
+  initTimer(&cases[2].timer, fireRearm, &cases[2]);
+  armTimer(&wheel, &cases[2].timer, 1100 * REDIR_TICK_MS);
+  armTimer(&wheel, &cases[2].timer, 1050 * REDIR_TICK_MS);
+  check(wheel.armed == 2, "armTimer rearmed an armed timer in place of arming it twice");
+
+  advanceTimerWheel(&wheel, 6000 * REDIR_TICK_MS);
+
+  check(cases[0].fired == 0, "A disarmed timer did not fire");
+  check(cases[1].fired == 1 && cases[1].firedTick == 1001, "A timer armed for a past time fired at the next tick");
+  check(cases[2].fired == 2 && cases[2].firedTick == 1150, "A timer rearmed as it fired fired again");
+  check(wheel.armed == 0 && timerWheelWait(&wheel, 0) == -1, "The wheel has no timers to wait for once they fired");
+
+  printf("END TESTING timer wheel disarming and rearming\n\n");
+}
+
+/* fireTimer notes the tick the timer of a timerCase fired at */
+static void fireTimer(struct redirTimer *timer)
+{
+  struct timerCase *fired = timer->owner;
+
+  fired->fired++;
+  fired->firedTick = sWheel->tick;
+}
+
+/* fireRearm notes the tick the timer of a timerCase fired at, and rearms it
+ * ticks later for as many times as sRearms
+ */
+static void fireRearm(struct redirTimer *timer)
+{
+  struct timerCase *fired = timer->owner;
+
+  fireTimer(timer);
+
+  if( sRearms > 0 ){
+    sRearms--;
+    armTimer(sWheel, timer, (sWheel->tick + fired->ticks) * REDIR_TICK_MS);
+  }
+}
+
+/* check counts a test passed or failed and prints its outcome */
+static void check(int passed, const char *what)
+{
+  if( passed ){
+    printf("TEST PASS: %s\n", what);
+    gPassCount++;
+  }
+  else{
+    printf("TEST FAIL: %s\n", what);
+    gFailCount++;
+  }
+}
@@ -0,0 +1,67 @@
+############################### TESTS CMAKE ####################################
+
+project(TorConTests)
+
+# The Socks5 client the tests connect with, its DNS cache, and what they
+# depend on
+list  (APPEND tor_con_test_sources 
+      "shared/tests/torConTests.c"
+      "shared/source/logger.c" 
+      "shared/source/torCon.c"
+      "shared/source/dnsCache.c"
+      "shared/source/socksIsol.c"
+      "shared/source/security.c"
+      "shared/source/net.c"
+      "shared/source/tweetNacl.c"
+      "shared/source/prng.c"
+      )
+
+
+add_executable(TorConTests ${tor_con_test_sources})
+
+# Header files can be found in these directories
+target_include_directories(TorConTests PUBLIC shared/interfaces)
+
+
+# We want to make the TorConTests executable in the parent directory 
+set_target_properties( TorConTests
+    PROPERTIES
+    RUNTIME_OUTPUT_DIRECTORY "${CMAKE_BINARY_DIR}"
+)
+
+# Dynamically linked libraries are required
+target_link_libraries(TorConTests "-lpthread")
+
+# The tests are run by ctest 
+enable_testing()
+add_test(NAME TorConTests COMMAND TorConTests)
+
+
+# The parts of the redirector that work without a network, its parser of the
+# replies to the SOCKS handshake and its timer wheel, and what they depend on
+list  (APPEND redir_test_sources 
+      "shared/tests/redirTests.c"
+      "shared/source/logger.c" 
+      "shared/source/redirFlow.c"
+      "shared/source/timerWheel.c"
+      "shared/source/security.c"
+      "shared/source/net.c"
+      )
+
+
+add_executable(RedirTests ${redir_test_sources})
+
+# Header files can be found in these directories
+target_include_directories(RedirTests PUBLIC shared/interfaces)
+
+
+# We want to make the RedirTests executable in the parent directory 
+set_target_properties( RedirTests
+    PROPERTIES
+    RUNTIME_OUTPUT_DIRECTORY "${CMAKE_BINARY_DIR}"
+)
+
+# Dynamically linked libraries are required
+target_link_libraries(RedirTests "-lpthread")
+
+add_test(NAME RedirTests COMMAND RedirTests)
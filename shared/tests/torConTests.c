@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "torCon.h"
+#include "dnsCache.h"
+#include "socksIsol.h"
+#include "net.h"
+#include "logger.h"
+#include "settings.h"
+
+
+/* The tests of the Socks5 client and of the DNS cache, which connect over Tor
+ * through a stand-in for the Tor SocksPort on the loopback interface. The 
+ * stand-in answers every connection as Tor would, but only after a delay 
+ * before each of its replies, such that a client that receives without 
+ * blocking sees its replies missing rather than merely late. It records the 
+ * credentials each connection authenticated with.
+ */
+
+
+enum{ STANDIN_DELAY_US = 20000, STANDIN_CONNS = 64 };
+
+static int gPassCount;
+static int gFailCount;
+
+/* The credentials of each connection the stand-in answered, in order, and
+ * the connections it is yet to answer
+ */
+static struct socksAuth sStandInAuths[STANDIN_CONNS];
+static int              sStandInConns;
+static int              sStandInBusy;
+static pthread_mutex_t  sStandInLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sockaddr_in sStandInAddr;
+
+
+static int  startStandIn(void);
+static void *runStandIn(void *arg);
+static void *serveStandIn(void *arg);
+static int  answerStandIn(int sock, struct socksAuth *auth);
+static int  settleStandIn(void);
+static int  recvAll(int sock, void *buff, size_t bc);
+static void check(int passed, const char *what);
+
+static void testPassedSockBlocks(void);
+static void testPassedSockHandshake(void);
+static void testBatchCon(void);
+static void testCachedConIsolation(void);
+
+
+int main()
+{
+  printf("BEGIN TESTING\n");
+
+  if( !startStandIn() ){
+    printf("Failed to start the Socks5 stand-in\n");
+    return 1;
+  }
+
+  printf("BEGIN torCon.h TESTING\n\n");
+  testPassedSockBlocks();
+  testPassedSockHandshake();
+  testBatchCon();
+  printf("END torCon.h TESTING\n\n");
+
+  printf("BEGIN dnsCache.h TESTING\n\n");
+  testCachedConIsolation();
+  printf("END dnsCache.h TESTING\n\n");
+
+  printf("DONE TESTING\n\n");
+
+  printf("%i failed, %i passed\n", gFailCount, gPassCount);
+
+  return gFailCount != 0;
+}
+
+
+/* requestTorCon stands in for that of isolNet.c in the passFd mode, it 
+ * connects to the stand-in with a non-blocking connect and passes the socket
+ * over a Unix Domain Socket, exactly as the redirector does.
+ *
+ * Returns the socket the connection is received on, -1 on error.
+ */
+int requestTorCon(void)
+{
+  struct pollfd connected;
+  int           pair[2];
+  int           torSock;
+
+  if( socketpair(AF_UNIX, SOCK_STREAM, 0, pair) ){
+    return -1;
+  }
+
+  torSock = socket(AF_INET, SOCK_STREAM, 0);
+  if( torSock == -1 || !setNonBlocking(torSock) ){
+    return -1;
+  }
+
+  if( connect(torSock, (struct sockaddr *)&sStandInAddr, sizeof(sStandInAddr))
+      && errno != EINPROGRESS ){
+    return -1;
+  }
+
+  connected.fd     = torSock;
+  connected.events = POLLOUT;
+  if( poll(&connected, 1, -1) != 1 ){
+    return -1;
+  }
+
+  if( !passSock(pair[0], torSock) ){
+    return -1;
+  }
+
+  close(torSock);
+  close(pair[0]);
+
+  return pair[1];
+}
+
+/* receiveTorCon stands in for that of isolNet.c in the passFd mode.
+ *
+ * Returns the received socket on success, -1 on error.
+ */
+int receiveTorCon(int unixSock)
+{
+  int torSock;
+
+  if( unixSock == -1 ){
+    return -1;
+  }
+
+  torSock = recvFd(unixSock);
+  close(unixSock);
+
+  return torSock;
+}
+
+/* getTorCon stands in for that of isolNet.c in the passFd mode */
+int getTorCon(void)
+{
+  return receiveTorCon(requestTorCon());
+}
+
+
+/*
+ * torCon.h tests
+ */
+
+
+/* A socket passed by the redirector is blocking, as its connect was not */
+static void testPassedSockBlocks(void)
+{
+  int torSock;
+  int flags;
+
+  printf("BEGIN TESTING passSock\n");
+
+  torSock = getTorCon();
+  check(torSock != -1, "passSock passed a connected socket");
+
+  flags = fcntl(torSock, F_GETFL);
+  check(flags != -1 && !(flags & O_NONBLOCK), "passSock passed a blocking socket");
+
+  close(torSock);
+
+  printf("END TESTING passSock\n\n");
+}
+
+/* The blocking Socks5 client completes its handshake over a passed socket,
+ * pipelined as well as in lockstep, although every reply is late
+ */
+static void testPassedSockHandshake(void)
+{
+  int torSock;
+  int pipeline;
+
+  printf("BEGIN TESTING torUrlCon over a passed socket\n");
+
+  for( pipeline = 0 ; pipeline <= 1 ; pipeline++ ){
+    setSocksPipeline(pipeline);
+
+    torSock = getTorCon();
+    check( torSock != -1 && torUrlCon(torSock, "example.com", 11, 80),
+           pipeline ? "torUrlCon connected pipelined over a passed socket"
+                    : "torUrlCon connected in lockstep over a passed socket" );
+    close(torSock);
+  }
+
+  setSocksPipeline(SOCKS_PIPELINE);
+
+  printf("END TESTING torUrlCon over a passed socket\n\n");
+}
+
+
+/* torBatchCon connects to every target over the connections it requested */
+static void testBatchCon(void)
+{
+  struct torTarget targets[3];
+  int              connected;
+  int              i;
+
+  printf("BEGIN TESTING torBatchCon\n");
+
+  for( i = 0 ; i < 3 ; i++ ){
+    targets[i].url  = "example.com";
+    targets[i].bc   = 11;
+    targets[i].port = 80 + i;
+  }
+
+  connected = torBatchCon(targets, 3, -1);
+  check(connected == 3, "torBatchCon connected to every target");
+
+  for( i = 0 ; i < 3 ; i++ ){
+    if( targets[i].socket != -1 ) close(targets[i].socket);
+  }
+
+  printf("END TESTING torBatchCon\n\n");
+}
+
+
+/*
+ * dnsCache.h tests
+ */
+
+
+/* A URL resolved and then connected to by its cached address authenticates
+ * with the same credentials for the resolve and for each connect, with 
+ * ISOLATE_DEST
+ */
+static void testCachedConIsolation(void)
+{
+  struct socksAuth auths[3];
+  int              conns;
+  int              torSock;
+  int              i;
+
+  printf("BEGIN TESTING dnsCacheCon isolation\n");
+
+  setIsolationPolicy(ISOLATE_DEST, 1);
+
+  conns = settleStandIn();
+  if( conns == -1 || conns + 3 > STANDIN_CONNS ){
+    check(0, "The stand-in settled before dnsCacheCon");
+    return;
+  }
+
+  /* The resolve and the connect to its address, then a connect from cache */
+  for( i = 0 ; i < 2 ; i++ ){
+    torSock = getTorCon();
+    check( torSock != -1 && dnsCacheCon(torSock, "isolated.example", 16, 443),
+           "dnsCacheCon connected to a URL" );
+    close(torSock);
+  }
+
+  check(settleStandIn() == conns + 3, "dnsCacheCon made a resolve and two connects");
+
+  pthread_mutex_lock(&sStandInLock);
+  memcpy(auths, &sStandInAuths[conns], sizeof(auths));
+  pthread_mutex_unlock(&sStandInLock);
+
+  check( auths[0].userBc != 0, "The resolve authenticated with credentials" );
+
+  for( i = 1 ; i < 3 ; i++ ){
+    check( auths[i].userBc == auths[0].userBc && auths[i].passBc == auths[0].passBc
+           && !memcmp(auths[i].user, auths[0].user, auths[0].userBc)
+           && !memcmp(auths[i].pass, auths[0].pass, auths[0].passBc),
+           "A connect to the cached address authenticated as the resolve did" );
+  }
+
+  dnsCacheFlush();
+  setIsolationPolicy(ISOLATE_POLICY, ISOLATE_GROUP_STREAMS);
+
+  printf("END TESTING dnsCacheCon isolation\n\n");
+}
+
+
+/*
+ * The stand-in for the Tor SocksPort
+ */
+
+
+/* startStandIn starts the stand-in for the Tor SocksPort in a thread of its
+ * own, listening on an ephemeral port of the loopback interface.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int startStandIn(void)
+{
+  pthread_t thread;
+  socklen_t addrBc = sizeof(sStandInAddr);
+  int       listenSock;
+
+  listenSock = ipv4Listen("127.0.0.1", 0);
+  if( listenSock == -1 ){
+    return 0;
+  }
+
+  if( getsockname(listenSock, (struct sockaddr *)&sStandInAddr, &addrBc) ){
+    return 0;
+  }
+
+  if( pthread_create(&thread, NULL, &runStandIn, (void *)(intptr_t)listenSock) ){
+    return 0;
+  }
+
+  pthread_detach(thread);
+
+  return 1;
+}
+
+/* runStandIn answers the connections accepted on the listening socket arg, 
+ * each in a thread of its own such that a client may wait on one connection
+ * while it makes another (as dnsCacheCon does to resolve), ad infinitum
+ */
+static void *runStandIn(void *arg)
+{
+  pthread_t thread;
+  int       listenSock = (intptr_t)arg;
+  int       sock;
+
+  while(1){
+    sock = accept(listenSock, NULL, NULL);
+    if( sock == -1 ) continue;
+
+    pthread_mutex_lock(&sStandInLock);
+    sStandInBusy++;
+    pthread_mutex_unlock(&sStandInLock);
+
+    if( pthread_create(&thread, NULL, &serveStandIn, (void *)(intptr_t)sock) ){
+      pthread_mutex_lock(&sStandInLock);
+      sStandInBusy--;
+      pthread_mutex_unlock(&sStandInLock);
+      close(sock);
+      continue;
+    }
+
+    pthread_detach(thread);
+  }
+
+  return NULL;
+}
+
+/* serveStandIn answers the accepted connection arg and records the credentials
+ * it authenticated with
+ */
+static void *serveStandIn(void *arg)
+{
+  struct socksAuth auth;
+  int              sock = (intptr_t)arg;
+  int              answered;
+
+  answered = answerStandIn(sock, &auth);
+  close(sock);
+
+  pthread_mutex_lock(&sStandInLock);
+  if( answered && sStandInConns < STANDIN_CONNS ) sStandInAuths[sStandInConns++] = auth;
+  sStandInBusy--;
+  pthread_mutex_unlock(&sStandInLock);
+
+  return NULL;
+}
+
+/* answerStandIn answers the Socks5 handshake and request of the connection
+ * on sock as Tor does, succeeding any request, with the credentials it
+ * authenticated with stored in auth. A RESOLVE is answered with 10.0.0.1.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int answerStandIn(int sock, struct socksAuth *auth)
+{
+  unsigned char in[2 + 255];
+  unsigned char reply[4 + 4 + 2] = { 5, 0, 0, SOCKS_ATYP_IPV4, 0, 0, 0, 0, 0, 0 };
+  unsigned char method           = 0;
+  unsigned char cmd;
+  int           addrBc;
+  int           i;
+
+  auth->userBc = 0;
+  auth->passBc = 0;
+
+  /* The handshake, picking username and password authentication if offered */
+  if( !recvAll(sock, in, 2) || !recvAll(sock, in + 2, in[1]) ){
+    return 0;
+  }
+
+  for( i = 0 ; i < in[1] ; i++ ){
+    if( in[2 + i] == 2 ) method = 2;
+  }
+
+  usleep(STANDIN_DELAY_US);
+  in[0] = 5;
+  in[1] = method;
+  if( send(sock, in, 2, MSG_NOSIGNAL) != 2 ){
+    return 0;
+  }
+
+  if( method == 2 ){
+    if( !recvAll(sock, in, 2) || !recvAll(sock, auth->user, in[1]) ){
+      return 0;
+    }
+    auth->userBc = in[1];
+
+    if( !recvAll(sock, in, 1) || !recvAll(sock, auth->pass, in[0]) ){
+      return 0;
+    }
+    auth->passBc = in[0];
+
+    usleep(STANDIN_DELAY_US);
+    in[0] = 1;
+    in[1] = 0;
+    if( send(sock, in, 2, MSG_NOSIGNAL) != 2 ){
+      return 0;
+    }
+  }
+
+  /* The request, of which the address and port are skipped */
+  if( !recvAll(sock, in, 4) ){
+    return 0;
+  }
+
+  cmd    = in[1];
+  addrBc = 4;
+  if( in[3] == SOCKS_ATYP_IPV6 ) addrBc = 16;
+  if( in[3] == SOCKS_ATYP_DOMAIN ){
+    if( !recvAll(sock, in, 1) ) return 0;
+    addrBc = in[0];
+  }
+
+  if( !recvAll(sock, in, addrBc + 2) ){
+    return 0;
+  }
+
+  if( cmd == SOCKS_CMD_RESOLVE ){
+    reply[4] = 10;
+    reply[7] = 1;
+  }
+
+  usleep(STANDIN_DELAY_US);
+
+  return send(sock, reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply);
+}
+
+/* settleStandIn waits for up to a second for the stand-in to have answered
+ * every connection it accepted, as it records each only after its reply.
+ *
+ * Returns the connections the stand-in recorded, -1 if it is still busy.
+ */
+static int settleStandIn(void)
+{
+  int conns = -1;
+  int i;
+
+  for( i = 0 ; i < 100 && conns == -1 ; i++ ){
+    pthread_mutex_lock(&sStandInLock);
+    if( sStandInBusy == 0 ) conns = sStandInConns;
+    pthread_mutex_unlock(&sStandInLock);
+
+    if( conns == -1 ) usleep(10000);
+  }
+
+  return conns;
+}
+
+/* recvAll receives exactly bc bytes from sock into buff.
+ *
+ * Returns 1 on success, 0 on error.
+ */
+static int recvAll(int sock, void *buff, size_t bc)
+{
+  size_t  at = 0;
+  ssize_t got;
+
+  while( at < bc ){
+    got = recv(sock, (char *)buff + at, bc - at, 0);
+    if( got <= 0 ) return 0;
+    at += got;
+  }
+
+  return 1;
+}
+
+/* check counts a test passed or failed and prints its outcome */
+static void check(int passed, const char *what)
+{
+  if( passed ){
+    printf("TEST PASS: %s\n", what);
+    gPassCount++;
+  }
+  else{
+    printf("TEST FAIL: %s\n", what);
+    gFailCount++;
+  }
+}